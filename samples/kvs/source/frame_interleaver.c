@@ -0,0 +1,468 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_interleaver.h"
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define INTERLEAVER_MAX_TRACKS (2)
+
+#define H264_NALU_TYPE_IDR (5)
+#define H264_NALU_TYPE_SPS (7)
+
+typedef struct
+{
+    uint8_t *pData;
+    size_t uDataLen;
+    size_t uDataSize;
+    uint64_t uTimestamp;
+    TrackType_t xTrackType;
+    uint64_t uSeq;
+    uint64_t uArrivalMs;
+} HeldFrame_t;
+
+typedef struct ReleasedFrame
+{
+    struct ReleasedFrame *pNext;
+    HeldFrame_t xFrame;
+} ReleasedFrame_t;
+
+typedef struct
+{
+    bool bSeen;
+    uint64_t uLastTimestamp;
+    uint64_t uLastArrivalMs;
+} TrackState_t;
+
+struct FrameInterleaver
+{
+    FrameInterleaverConfig_t xConfig;
+    pthread_mutex_t xLock;
+
+    /* Min-heap of held frames ordered by timestamp, then by arrival. */
+    HeldFrame_t *pxHeap;
+    size_t uCount;
+    uint64_t uSeq;
+
+    TrackState_t xTracks[INTERLEAVER_MAX_TRACKS];
+    size_t uTracksSeen;
+    uint64_t uFirstArrivalMs;
+    /* Nothing is released until every configured track has delivered a frame, or the startup timeout has passed. */
+    bool bStarted;
+    bool bReleased;
+    uint64_t uLastReleasedTimestamp;
+    /* Set once a late video frame is dropped, the video frames referencing it are dropped up to the next key frame. */
+    bool bVideoResync;
+
+    /* Frames released in order, they are passed to the callback after the lock is released. */
+    ReleasedFrame_t *pxReleasedHead;
+    ReleasedFrame_t *pxReleasedTail;
+    /* Only one thread at a time passes released frames to the callback, so they stay in order. */
+    bool bDelivering;
+
+    FrameInterleaverStats_t xStats;
+};
+
+typedef struct FrameInterleaver FrameInterleaver_t;
+
+static uint64_t getMonotonicTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+static bool isKeyFrame(const uint8_t *pData, size_t uLen)
+{
+    size_t i = 0;
+    uint8_t uNaluType = 0;
+
+    for (i = 0; i + 3 < uLen; i++)
+    {
+        if (pData[i] == 0x00 && pData[i + 1] == 0x00 && pData[i + 2] == 0x01)
+        {
+            uNaluType = pData[i + 3] & 0x1F;
+            if (uNaluType == H264_NALU_TYPE_IDR || uNaluType == H264_NALU_TYPE_SPS)
+            {
+                return true;
+            }
+            i += 2;
+        }
+    }
+
+    return false;
+}
+
+static bool isEarlier(const HeldFrame_t *pxA, const HeldFrame_t *pxB)
+{
+    return (pxA->uTimestamp < pxB->uTimestamp) || (pxA->uTimestamp == pxB->uTimestamp && pxA->uSeq < pxB->uSeq);
+}
+
+static void heapPush(FrameInterleaver_t *pxInterleaver, const HeldFrame_t *pxFrame)
+{
+    HeldFrame_t *pxHeap = pxInterleaver->pxHeap;
+    size_t i = pxInterleaver->uCount++;
+    size_t uParent = 0;
+
+    pxHeap[i] = *pxFrame;
+    while (i > 0)
+    {
+        uParent = (i - 1) / 2;
+        if (!isEarlier(&pxHeap[i], &pxHeap[uParent]))
+        {
+            break;
+        }
+        HeldFrame_t xTmp = pxHeap[i];
+        pxHeap[i] = pxHeap[uParent];
+        pxHeap[uParent] = xTmp;
+        i = uParent;
+    }
+}
+
+static void heapPop(FrameInterleaver_t *pxInterleaver, HeldFrame_t *pxFrame)
+{
+    HeldFrame_t *pxHeap = pxInterleaver->pxHeap;
+    size_t i = 0;
+    size_t uChild = 0;
+
+    *pxFrame = pxHeap[0];
+    pxHeap[0] = pxHeap[--pxInterleaver->uCount];
+    while ((uChild = 2 * i + 1) < pxInterleaver->uCount)
+    {
+        if (uChild + 1 < pxInterleaver->uCount && isEarlier(&pxHeap[uChild + 1], &pxHeap[uChild]))
+        {
+            uChild++;
+        }
+        if (!isEarlier(&pxHeap[uChild], &pxHeap[i]))
+        {
+            break;
+        }
+        HeldFrame_t xTmp = pxHeap[i];
+        pxHeap[i] = pxHeap[uChild];
+        pxHeap[uChild] = xTmp;
+        i = uChild;
+    }
+}
+
+static void releaseFrame(FrameInterleaver_t *pxInterleaver, const HeldFrame_t *pxFrame)
+{
+    ReleasedFrame_t *pxReleased = NULL;
+
+    if ((pxReleased = (ReleasedFrame_t *)malloc(sizeof(ReleasedFrame_t))) == NULL)
+    {
+        printf("OOM: pxReleased\n");
+        free(pxFrame->pData);
+        return;
+    }
+
+    pxReleased->pNext = NULL;
+    pxReleased->xFrame = *pxFrame;
+    if (pxInterleaver->pxReleasedTail == NULL)
+    {
+        pxInterleaver->pxReleasedHead = pxReleased;
+    }
+    else
+    {
+        pxInterleaver->pxReleasedTail->pNext = pxReleased;
+    }
+    pxInterleaver->pxReleasedTail = pxReleased;
+    pxInterleaver->xStats.uFramesOut++;
+}
+
+static void releaseEarliest(FrameInterleaver_t *pxInterleaver)
+{
+    HeldFrame_t xFrame;
+
+    heapPop(pxInterleaver, &xFrame);
+    pxInterleaver->bReleased = true;
+    pxInterleaver->uLastReleasedTimestamp = xFrame.uTimestamp;
+    releaseFrame(pxInterleaver, &xFrame);
+}
+
+/**
+ * @brief Pass the released frames to the callback. It's called with the lock held, which is released around the
+ * callback. If another thread is already passing frames on, it also takes the ones released here.
+ */
+static void deliverReleasedFrames(FrameInterleaver_t *pxInterleaver)
+{
+    ReleasedFrame_t *pxReleased = NULL;
+    ReleasedFrame_t *pxNext = NULL;
+
+    if (pxInterleaver->bDelivering)
+    {
+        return;
+    }
+
+    pxInterleaver->bDelivering = true;
+    while ((pxReleased = pxInterleaver->pxReleasedHead) != NULL)
+    {
+        pxInterleaver->pxReleasedHead = NULL;
+        pxInterleaver->pxReleasedTail = NULL;
+        pthread_mutex_unlock(&pxInterleaver->xLock);
+
+        for (; pxReleased != NULL; pxReleased = pxNext)
+        {
+            pxNext = pxReleased->pNext;
+            pxInterleaver->xConfig.onFrame(pxReleased->xFrame.pData, pxReleased->xFrame.uDataLen, pxReleased->xFrame.uDataSize,
+                                           pxReleased->xFrame.uTimestamp, pxReleased->xFrame.xTrackType, pxInterleaver->xConfig.pAppData);
+            free(pxReleased);
+        }
+
+        pthread_mutex_lock(&pxInterleaver->xLock);
+    }
+    pxInterleaver->bDelivering = false;
+}
+
+/**
+ * @brief The earliest frame is ready if it has waited for the whole window, or if every active track has already
+ * delivered a frame at or after its timestamp. Nothing is ready before the interleaver has started.
+ */
+static bool isEarliestReady(FrameInterleaver_t *pxInterleaver, uint64_t uNowMs)
+{
+    HeldFrame_t *pxEarliest = &pxInterleaver->pxHeap[0];
+    TrackState_t *pxTrack = NULL;
+    int i = 0;
+
+    if (!pxInterleaver->bStarted)
+    {
+        if (pxInterleaver->uTracksSeen < pxInterleaver->xConfig.uTrackCount &&
+            uNowMs < pxInterleaver->uFirstArrivalMs + pxInterleaver->xConfig.uStartupTimeoutMs)
+        {
+            return false;
+        }
+        pxInterleaver->bStarted = true;
+    }
+
+    if (uNowMs >= pxEarliest->uArrivalMs + pxInterleaver->xConfig.uWindowMs)
+    {
+        return true;
+    }
+
+    for (i = 0; i < INTERLEAVER_MAX_TRACKS; i++)
+    {
+        pxTrack = &pxInterleaver->xTracks[i];
+        /* Tracks which stopped delivering frames are not waited for. */
+        if (pxTrack->bSeen && uNowMs < pxTrack->uLastArrivalMs + pxInterleaver->xConfig.uWindowMs &&
+            pxTrack->uLastTimestamp < pxEarliest->uTimestamp)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void releaseReadyFrames(FrameInterleaver_t *pxInterleaver, uint64_t uNowMs)
+{
+    while (pxInterleaver->uCount > 0 && isEarliestReady(pxInterleaver, uNowMs))
+    {
+        releaseEarliest(pxInterleaver);
+    }
+}
+
+FrameInterleaverHandle FrameInterleaver_create(const FrameInterleaverConfig_t *pxConfig)
+{
+    FrameInterleaver_t *pxInterleaver = NULL;
+
+    if (pxConfig == NULL || pxConfig->onFrame == NULL || pxConfig->uMaxFrames == 0 || pxConfig->uTrackCount == 0 ||
+        pxConfig->uTrackCount > INTERLEAVER_MAX_TRACKS)
+    {
+        printf("Invalid interleaver configuration\n");
+    }
+    else if ((pxInterleaver = (FrameInterleaver_t *)calloc(1, sizeof(FrameInterleaver_t))) == NULL)
+    {
+        printf("OOM: pxInterleaver\n");
+    }
+    else if ((pxInterleaver->pxHeap = (HeldFrame_t *)calloc(pxConfig->uMaxFrames, sizeof(HeldFrame_t))) == NULL)
+    {
+        printf("OOM: pxHeap\n");
+        free(pxInterleaver);
+        pxInterleaver = NULL;
+    }
+    else
+    {
+        pxInterleaver->xConfig = *pxConfig;
+        pthread_mutex_init(&pxInterleaver->xLock, NULL);
+    }
+
+    return pxInterleaver;
+}
+
+void FrameInterleaver_terminate(FrameInterleaverHandle xInterleaverHandle)
+{
+    FrameInterleaver_t *pxInterleaver = xInterleaverHandle;
+    ReleasedFrame_t *pxReleased = NULL;
+    size_t i = 0;
+
+    if (pxInterleaver != NULL)
+    {
+        for (i = 0; i < pxInterleaver->uCount; i++)
+        {
+            free(pxInterleaver->pxHeap[i].pData);
+        }
+        while ((pxReleased = pxInterleaver->pxReleasedHead) != NULL)
+        {
+            pxInterleaver->pxReleasedHead = pxReleased->pNext;
+            free(pxReleased->xFrame.pData);
+            free(pxReleased);
+        }
+        pthread_mutex_destroy(&pxInterleaver->xLock);
+        free(pxInterleaver->pxHeap);
+        free(pxInterleaver);
+    }
+}
+
+int FrameInterleaver_addFrame(FrameInterleaverHandle xInterleaverHandle, uint8_t *pData, size_t uDataLen, size_t uDataSize, uint64_t uTimestamp,
+                              TrackType_t xTrackType)
+{
+    int res = ERRNO_NONE;
+    FrameInterleaver_t *pxInterleaver = xInterleaverHandle;
+    HeldFrame_t xFrame = {0};
+    TrackState_t *pxTrack = NULL;
+    uint64_t uNowMs = getMonotonicTimestampInMs();
+    size_t uDepth = 0;
+    size_t i = 0;
+
+    if (pxInterleaver == NULL || pData == NULL || (int)xTrackType < 0 || (int)xTrackType >= INTERLEAVER_MAX_TRACKS)
+    {
+        free(pData);
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxInterleaver->xLock);
+
+    pxInterleaver->xStats.uFramesIn++;
+    pxTrack = &pxInterleaver->xTracks[xTrackType];
+    if (!pxTrack->bSeen)
+    {
+        if (pxInterleaver->uTracksSeen++ == 0)
+        {
+            pxInterleaver->uFirstArrivalMs = uNowMs;
+        }
+        pxTrack->bSeen = true;
+    }
+    pxTrack->uLastArrivalMs = uNowMs;
+    if (uTimestamp > pxTrack->uLastTimestamp)
+    {
+        pxTrack->uLastTimestamp = uTimestamp;
+    }
+
+    xFrame.pData = pData;
+    xFrame.uDataLen = uDataLen;
+    xFrame.uDataSize = uDataSize;
+    xFrame.uTimestamp = uTimestamp;
+    xFrame.xTrackType = xTrackType;
+    xFrame.uSeq = pxInterleaver->uSeq++;
+    xFrame.uArrivalMs = uNowMs;
+
+    if (pxInterleaver->bReleased && uTimestamp < pxInterleaver->uLastReleasedTimestamp)
+    {
+        /* KvsApp rejects a timestamp going backwards, even on a key frame. */
+        pxInterleaver->xStats.uLateFrames++;
+        if (xTrackType == TRACK_VIDEO)
+        {
+            pxInterleaver->bVideoResync = true;
+        }
+        free(pData);
+        res = ERRNO_FAIL;
+    }
+    else if (xTrackType == TRACK_VIDEO && pxInterleaver->bVideoResync && !isKeyFrame(pData, uDataLen))
+    {
+        pxInterleaver->xStats.uResyncFrames++;
+        free(pData);
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        if (xTrackType == TRACK_VIDEO)
+        {
+            pxInterleaver->bVideoResync = false;
+        }
+
+        for (i = 0; i < pxInterleaver->uCount; i++)
+        {
+            if (pxInterleaver->pxHeap[i].uTimestamp > uTimestamp)
+            {
+                uDepth++;
+            }
+        }
+        if (uDepth > 0)
+        {
+            pxInterleaver->xStats.uReorderedFrames++;
+            if (uDepth > pxInterleaver->xStats.uMaxReorderDepth)
+            {
+                pxInterleaver->xStats.uMaxReorderDepth = uDepth;
+            }
+        }
+
+        if (pxInterleaver->uCount == pxInterleaver->xConfig.uMaxFrames)
+        {
+            releaseEarliest(pxInterleaver);
+        }
+
+        heapPush(pxInterleaver, &xFrame);
+
+        if (pxInterleaver->uCount > pxInterleaver->xStats.uMaxQueueDepth)
+        {
+            pxInterleaver->xStats.uMaxQueueDepth = pxInterleaver->uCount;
+        }
+    }
+
+    releaseReadyFrames(pxInterleaver, uNowMs);
+    deliverReleasedFrames(pxInterleaver);
+
+    pthread_mutex_unlock(&pxInterleaver->xLock);
+
+    return res;
+}
+
+void FrameInterleaver_poll(FrameInterleaverHandle xInterleaverHandle)
+{
+    FrameInterleaver_t *pxInterleaver = xInterleaverHandle;
+
+    if (pxInterleaver != NULL)
+    {
+        pthread_mutex_lock(&pxInterleaver->xLock);
+        releaseReadyFrames(pxInterleaver, getMonotonicTimestampInMs());
+        deliverReleasedFrames(pxInterleaver);
+        pthread_mutex_unlock(&pxInterleaver->xLock);
+    }
+}
+
+int FrameInterleaver_getStats(FrameInterleaverHandle xInterleaverHandle, FrameInterleaverStats_t *pxStats)
+{
+    FrameInterleaver_t *pxInterleaver = xInterleaverHandle;
+
+    if (pxInterleaver == NULL || pxStats == NULL)
+    {
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxInterleaver->xLock);
+    *pxStats = pxInterleaver->xStats;
+    pthread_mutex_unlock(&pxInterleaver->xLock);
+
+    return ERRNO_NONE;
+}
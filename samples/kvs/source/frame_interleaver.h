@@ -0,0 +1,114 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef FRAME_INTERLEAVER_H
+#define FRAME_INTERLEAVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs/kvsapp.h"
+
+typedef struct FrameInterleaver *FrameInterleaverHandle;
+
+/**
+ * Callback of frames released in timestamp order. It takes the ownership of pData, like KvsApp_addFrame. It's
+ * called without the interleaver lock held, from the thread of FrameInterleaver_addFrame or FrameInterleaver_poll.
+ */
+typedef int (*OnInterleavedFrame_t)(uint8_t *pData, size_t uDataLen, size_t uDataSize, uint64_t uTimestamp, TrackType_t xTrackType, void *pAppData);
+
+typedef struct
+{
+    /* A frame is held at most this long waiting for frames of other tracks with earlier timestamps. */
+    uint32_t uWindowMs;
+
+    /* Maximum number of frames held, the earliest one is released when it's full. */
+    size_t uMaxFrames;
+
+    /* Number of tracks fed to the interleaver. Frames are held until each track has delivered one, or until
+     * uStartupTimeoutMs has passed since the first frame, so the first frames of a slower track aren't late. */
+    size_t uTrackCount;
+    uint32_t uStartupTimeoutMs;
+
+    OnInterleavedFrame_t onFrame;
+    void *pAppData;
+} FrameInterleaverConfig_t;
+
+typedef struct
+{
+    uint64_t uFramesIn;
+    uint64_t uFramesOut;
+
+    /* Frames arriving with a timestamp earlier than a frame already released. They are dropped, key frames too. */
+    uint64_t uLateFrames;
+
+    /* Video frames dropped after a late video frame, up to the next key frame which isn't late. */
+    uint64_t uResyncFrames;
+
+    /* Frames which were released ahead of at least one frame that arrived before them. */
+    uint64_t uReorderedFrames;
+
+    /* Maximum number of held frames that a single frame has overtaken. */
+    size_t uMaxReorderDepth;
+
+    size_t uMaxQueueDepth;
+} FrameInterleaverStats_t;
+
+/**
+ * @brief Create a frame interleaver.
+ *
+ * @param[in] pxConfig Interleaver configuration
+ * @return Interleaver handle on success, NULL otherwise
+ */
+FrameInterleaverHandle FrameInterleaver_create(const FrameInterleaverConfig_t *pxConfig);
+
+/**
+ * @brief Free the interleaver and the frames which are still held.
+ *
+ * @param[in] xInterleaverHandle Interleaver handle
+ */
+void FrameInterleaver_terminate(FrameInterleaverHandle xInterleaverHandle);
+
+/**
+ * @brief Add a frame. It's released to the callback once no earlier frame is expected from other tracks.
+ *
+ * @param[in] xInterleaverHandle Interleaver handle
+ * @param[in] pData Frame data, its ownership is taken by the interleaver
+ * @param[in] uDataLen Length of frame data
+ * @param[in] uDataSize Size of pData
+ * @param[in] uTimestamp Frame timestamp in milliseconds
+ * @param[in] xTrackType Track type
+ * @return 0 on success, non-zero value if the frame is dropped
+ */
+int FrameInterleaver_addFrame(FrameInterleaverHandle xInterleaverHandle, uint8_t *pData, size_t uDataLen, size_t uDataSize, uint64_t uTimestamp,
+                              TrackType_t xTrackType);
+
+/**
+ * @brief Release frames which have been held longer than the window, in case a track stops delivering frames.
+ *
+ * @param[in] xInterleaverHandle Interleaver handle
+ */
+void FrameInterleaver_poll(FrameInterleaverHandle xInterleaverHandle);
+
+/**
+ * @brief Get interleaver statistics.
+ *
+ * @param[in] xInterleaverHandle Interleaver handle
+ * @param[out] pxStats Statistics
+ * @return 0 on success, non-zero value otherwise
+ */
+int FrameInterleaver_getStats(FrameInterleaverHandle xInterleaverHandle, FrameInterleaverStats_t *pxStats);
+
+#endif /* FRAME_INTERLEAVER_H */
@@ -29,6 +29,21 @@
 
 #include "sample_config.h"
 #include "option_configuration.h"
+#if ENABLE_MKV_RECORDER
+#include "mkv_recorder.h"
+#endif /* ENABLE_MKV_RECORDER */
+#if ENABLE_DISK_SPILLOVER
+#include "spill_buffer.h"
+#endif /* ENABLE_DISK_SPILLOVER */
+#if ENABLE_AV_INTERLEAVER
+#include "frame_interleaver.h"
+#endif /* ENABLE_AV_INTERLEAVER */
+#if ENABLE_METRICS_EXPORT
+#include "producer_metrics.h"
+#define METRICS_ADD(xId, uDelta) ProducerMetrics_add(xId, uDelta)
+#else
+#define METRICS_ADD(xId, uDelta)
+#endif /* ENABLE_METRICS_EXPORT */
 
 #include "com/amazonaws/kinesis/video/capturer/AudioCapturer.h"
 #include "com/amazonaws/kinesis/video/capturer/VideoCapturer.h"
@@ -68,9 +83,22 @@ static AudioTrackInfo_t audioTrackInfo = {
 /* A global variable to exit program if it's set to true. It can be set to true if signal.h is available and user press Ctrl+c. It can also be set to true via debugger. */
 static bool gStopRunning = false;
 
+#if ENABLE_METRICS_EXPORT
+/* Set by SIGUSR1 to write a metrics snapshot file. */
+static bool gDumpMetrics = false;
+#endif /* ENABLE_METRICS_EXPORT */
+
 #ifdef HAVE_SIGNAL_H
 static void signalHandler(int signum)
 {
+#if ENABLE_METRICS_EXPORT
+    if (signum == SIGUSR1)
+    {
+        gDumpMetrics = true;
+        return;
+    }
+#endif /* ENABLE_METRICS_EXPORT */
+
     if (!gStopRunning)
     {
         printf("Received interrupt signal\n");
@@ -84,35 +112,80 @@ static void signalHandler(int signum)
 }
 #endif /* HAVE_SIGNAL_H */
 
-#if DEBUG_STORE_MEDIA_TO_FILE
-static FILE *fpDbgMedia = NULL;
+#if ENABLE_MKV_RECORDER
+static MkvRecorderHandle xMkvRecorderHandle = NULL;
 static int onMkvSent(uint8_t *pData, size_t uDataLen, void *pAppData)
 {
-    int res = ERRNO_NONE;
-    char pFilename[sizeof(MEDIA_FILENAME_FORMAT) + 21]; /* 20 digits for uint64_t, 1 digit for EOS */
+    /* The recorder only copies data into its queue, disk I/O is done by its own thread. */
+    MkvRecorder_write((MkvRecorderHandle)pAppData, pData, uDataLen);
 
-    if (fpDbgMedia == NULL)
+    return ERRNO_NONE;
+}
+#endif /* ENABLE_MKV_RECORDER */
+
+#if ENABLE_DISK_SPILLOVER
+static SpillBufferHandle xSpillBufferHandle = NULL;
+#endif /* ENABLE_DISK_SPILLOVER */
+
+#if ENABLE_AV_INTERLEAVER
+static FrameInterleaverHandle xInterleaverHandle = NULL;
+#endif /* ENABLE_AV_INTERLEAVER */
+
+static int submitFrame(KvsAppHandle kvsAppHandle, void *pFrameBuffer, size_t frameSize, size_t bufferSize, uint64_t timestamp, TrackType_t trackType)
+{
+#if ENABLE_DISK_SPILLOVER
+    if (xSpillBufferHandle != NULL)
     {
-        snprintf(pFilename, sizeof(pFilename) - 1, MEDIA_FILENAME_FORMAT, getEpochTimestampInMs());
-        fpDbgMedia = fopen(pFilename, "wb");
-        if (fpDbgMedia == NULL)
-        {
-            printf("Failed to open debug file: %s\n", pFilename);
-        }
-        else
-        {
-            printf("Opened debug file %s\n", pFilename);
-        }
+        return SpillBuffer_addFrame(xSpillBufferHandle, kvsAppHandle, pFrameBuffer, frameSize, bufferSize, timestamp, trackType);
     }
+#endif /* ENABLE_DISK_SPILLOVER */
+
+    // KvsApp will help to free pFrameBuffer
+    return KvsApp_addFrame(kvsAppHandle, pFrameBuffer, frameSize, bufferSize, timestamp, trackType);
+}
 
-    if (fpDbgMedia != NULL)
+#if ENABLE_AV_INTERLEAVER
+static int onInterleavedFrame(uint8_t *pData, size_t uDataLen, size_t uDataSize, uint64_t uTimestamp, TrackType_t xTrackType, void *pAppData)
+{
+    return submitFrame((KvsAppHandle)pAppData, pData, uDataLen, uDataSize, uTimestamp, xTrackType);
+}
+#endif /* ENABLE_AV_INTERLEAVER */
+
+static int addFrame(KvsAppHandle kvsAppHandle, void *pFrameBuffer, size_t frameSize, size_t bufferSize, uint64_t timestamp, TrackType_t trackType)
+{
+    METRICS_ADD((trackType == TRACK_VIDEO) ? METRIC_VIDEO_FRAMES : METRIC_AUDIO_FRAMES, 1);
+
+#if ENABLE_AV_INTERLEAVER
+    /* Video and audio threads deliver frames independently, the interleaver passes them on in timestamp order. */
+    if (xInterleaverHandle != NULL)
     {
-        fwrite(pData, 1, uDataLen, fpDbgMedia);
+        return FrameInterleaver_addFrame(xInterleaverHandle, pFrameBuffer, frameSize, bufferSize, timestamp, trackType);
     }
+#endif /* ENABLE_AV_INTERLEAVER */
 
-    return res;
+    return submitFrame(kvsAppHandle, pFrameBuffer, frameSize, bufferSize, timestamp, trackType);
+}
+
+static void countFragmentAck(ePutMediaFragmentAckEventType eAckEventType)
+{
+    switch (eAckEventType)
+    {
+        case eBuffering:
+            METRICS_ADD(METRIC_ACK_BUFFERING, 1);
+            break;
+        case eReceived:
+            METRICS_ADD(METRIC_ACK_RECEIVED, 1);
+            break;
+        case ePersisted:
+            METRICS_ADD(METRIC_ACK_PERSISTED, 1);
+            break;
+        case eError:
+            METRICS_ADD(METRIC_ACK_ERROR, 1);
+            break;
+        default:
+            break;
+    }
 }
-#endif
 
 static void *videoThread(void *arg)
 {
@@ -146,18 +219,22 @@ static void *videoThread(void *arg)
             if (!pFrameBuffer)
             {
                 printf("OOM\n");
+                METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
                 continue;
             }
 
             if (videoCapturerGetFrame(videoCapturerHandle, pFrameBuffer, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize))
             {
                 printf("videoCapturerGetFrame failed\n");
+                METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
                 free(pFrameBuffer);
             }
             else
             {
-                // KvsApp will help to free pFrameBuffer
-                KvsApp_addFrame(kvsAppHandle, pFrameBuffer, frameSize, VIDEO_FRAME_BUFFER_SIZE_BYTES, timestamp / MICROSECONDS_IN_A_MILLISECOND, TRACK_VIDEO);
+                if (addFrame(kvsAppHandle, pFrameBuffer, frameSize, VIDEO_FRAME_BUFFER_SIZE_BYTES, timestamp / MICROSECONDS_IN_A_MILLISECOND, TRACK_VIDEO) != 0)
+                {
+                    METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
+                }
             }
 
             pFrameBuffer = NULL;
@@ -202,18 +279,22 @@ static void *audioThread(void *arg)
             if (!pFrameBuffer)
             {
                 printf("OOM\n");
+                METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
                 continue;
             }
 
             if (audioCapturerGetFrame(audioCapturerHandle, pFrameBuffer, AUDIO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize))
             {
                 printf("audioCapturerGetFrame failed\n");
+                METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
                 free(pFrameBuffer);
             }
             else
             {
-                // KvsApp will help to free pFrameBuffer
-                KvsApp_addFrame(kvsAppHandle, pFrameBuffer, frameSize, AUDIO_FRAME_BUFFER_SIZE_BYTES, timestamp / MICROSECONDS_IN_A_MILLISECOND, TRACK_AUDIO);
+                if (addFrame(kvsAppHandle, pFrameBuffer, frameSize, AUDIO_FRAME_BUFFER_SIZE_BYTES, timestamp / MICROSECONDS_IN_A_MILLISECOND, TRACK_AUDIO) != 0)
+                {
+                    METRICS_ADD(METRIC_FRAMES_DROPPED, 1);
+                }
             }
 
             pFrameBuffer = NULL;
@@ -295,16 +376,73 @@ static int setKvsAppOptions(KvsAppHandle kvsAppHandle)
     }
 #endif /* ENABLE_RING_BUFFER_MEM_LIMIT */
 
-#if DEBUG_STORE_MEDIA_TO_FILE
-    if (KvsApp_setOnMkvSentCallback(kvsAppHandle, onMkvSent, NULL) != 0)
+#if ENABLE_MKV_RECORDER
+    if (xMkvRecorderHandle != NULL && KvsApp_setOnMkvSentCallback(kvsAppHandle, onMkvSent, xMkvRecorderHandle) != 0)
     {
         printf("Failed to set onMkvSentCallback\n");
     }
-#endif /* DEBUG_STORE_MEDIA_TO_FILE */
+#endif /* ENABLE_MKV_RECORDER */
 
     return res;
 }
 
+static void updateStats(KvsAppHandle kvsAppHandle)
+{
+#ifdef KVS_USE_POOL_ALLOCATOR
+    PoolStats_t stats = {0};
+#endif
+#if ENABLE_DISK_SPILLOVER
+    SpillBufferStats_t xSpillBufferStats = {0};
+#endif /* ENABLE_DISK_SPILLOVER */
+#if ENABLE_AV_INTERLEAVER
+    FrameInterleaverStats_t xInterleaverStats = {0};
+#endif /* ENABLE_AV_INTERLEAVER */
+
+#if ENABLE_METRICS_EXPORT
+    /* Only update the metrics here, they're exported on demand via METRICS_SOCKET_PATH or SIGUSR1. */
+    ProducerMetrics_set(METRIC_STREAM_MEM_TOTAL, KvsApp_getStreamMemStatTotal(kvsAppHandle));
+#ifdef KVS_USE_POOL_ALLOCATOR
+    poolAllocatorGetStats(&stats);
+    ProducerMetrics_set(METRIC_POOL_USED_MEMORY, stats.uSumOfUsedMemory);
+    ProducerMetrics_set(METRIC_POOL_FREE_MEMORY, stats.uSumOfFreeMemory);
+    ProducerMetrics_set(METRIC_POOL_LARGEST_USED_BLOCK, stats.uSizeOfLargestUsedBlock);
+    ProducerMetrics_set(METRIC_POOL_LARGEST_FREE_BLOCK, stats.uSizeOfLargestFreeBlock);
+    ProducerMetrics_set(METRIC_POOL_USED_BLOCKS, stats.uNumberOfUsedBlocks);
+    ProducerMetrics_set(METRIC_POOL_FREE_BLOCKS, stats.uNumberOfFreeBlocks);
+#endif
+#if ENABLE_DISK_SPILLOVER
+    if (SpillBuffer_getStats(xSpillBufferHandle, &xSpillBufferStats) == 0)
+    {
+        ProducerMetrics_set(METRIC_SPILL_DISK_USAGE, xSpillBufferStats.uDiskUsage);
+    }
+#endif /* ENABLE_DISK_SPILLOVER */
+#if ENABLE_AV_INTERLEAVER
+    if (FrameInterleaver_getStats(xInterleaverHandle, &xInterleaverStats) == 0)
+    {
+        ProducerMetrics_set(METRIC_FRAMES_LATE, xInterleaverStats.uLateFrames);
+    }
+#endif /* ENABLE_AV_INTERLEAVER */
+#else
+    printf("Buffer memory used: %zu\n", KvsApp_getStreamMemStatTotal(kvsAppHandle));
+#ifdef KVS_USE_POOL_ALLOCATOR
+    poolAllocatorGetStats(&stats);
+    printf("Sum of used/free memory:%zu/%zu, size of largest used/free block:%zu/%zu, number of used/free blocks:%zu/%zu\n", stats.uSumOfUsedMemory, stats.uSumOfFreeMemory, stats.uSizeOfLargestUsedBlock, stats.uSizeOfLargestFreeBlock, stats.uNumberOfUsedBlocks, stats.uNumberOfFreeBlocks);
+#endif
+#if ENABLE_DISK_SPILLOVER
+    if (SpillBuffer_getStats(xSpillBufferHandle, &xSpillBufferStats) == 0 && xSpillBufferStats.uDiskUsage > 0)
+    {
+        printf("Spilled frames on disk: %" PRIu64 " bytes, spilled/drained/dropped frames:%" PRIu64 "/%" PRIu64 "/%" PRIu64 "\n", xSpillBufferStats.uDiskUsage, xSpillBufferStats.uFramesSpilled, xSpillBufferStats.uFramesDrained, xSpillBufferStats.uFramesDropped);
+    }
+#endif /* ENABLE_DISK_SPILLOVER */
+#if ENABLE_AV_INTERLEAVER
+    if (FrameInterleaver_getStats(xInterleaverHandle, &xInterleaverStats) == 0)
+    {
+        printf("Interleaved frames in/out:%" PRIu64 "/%" PRIu64 ", late:%" PRIu64 ", resync:%" PRIu64 ", reordered:%" PRIu64 ", max reorder/queue depth:%zu/%zu\n", xInterleaverStats.uFramesIn, xInterleaverStats.uFramesOut, xInterleaverStats.uLateFrames, xInterleaverStats.uResyncFrames, xInterleaverStats.uReorderedFrames, xInterleaverStats.uMaxReorderDepth, xInterleaverStats.uMaxQueueDepth);
+    }
+#endif /* ENABLE_AV_INTERLEAVER */
+#endif /* ENABLE_METRICS_EXPORT */
+}
+
 int main(int argc, char *argv[])
 {
     int res = 0;
@@ -315,6 +453,39 @@ int main(int argc, char *argv[])
     unsigned int uErrorId = 0;
     const char *pKvsStreamName = NULL;
     DoWorkExParamter_t xDoWorkExParamter = {0};
+#if ENABLE_DISK_SPILLOVER
+    unsigned int uReconnectDelaySec = 1;
+    unsigned int i = 0;
+    SpillBufferConfig_t xSpillBufferConfig = {
+        .pDirectory = SPILLOVER_DIR,
+        .uMemThreshold = SPILLOVER_MEM_THRESHOLD,
+        .uMemQueueSize = SPILLOVER_MEM_QUEUE_SIZE,
+        .uFileSize = SPILLOVER_FILE_SIZE,
+        .uMaxDiskSize = SPILLOVER_MAX_DISK_SIZE,
+        .uCatchUpRate = SPILLOVER_CATCH_UP_RATE,
+        .uWriteQueueSize = SPILLOVER_WRITE_QUEUE_SIZE,
+    };
+#endif /* ENABLE_DISK_SPILLOVER */
+#if ENABLE_AV_INTERLEAVER
+    FrameInterleaverConfig_t xInterleaverConfig = {
+        .uWindowMs = INTERLEAVER_WINDOW_MS,
+        .uMaxFrames = INTERLEAVER_MAX_FRAMES,
+        .uTrackCount = 2, /* video and audio */
+        .uStartupTimeoutMs = INTERLEAVER_STARTUP_TIMEOUT_MS,
+        .onFrame = onInterleavedFrame,
+    };
+#endif /* ENABLE_AV_INTERLEAVER */
+#if ENABLE_MKV_RECORDER
+    MkvRecorderConfig_t xMkvRecorderConfig = {
+        .pDirectory = MKV_RECORDER_DIR,
+        .uSegmentDurationSec = MKV_RECORDER_SEGMENT_DURATION_SEC,
+        .uSegmentGopCount = MKV_RECORDER_SEGMENT_GOPS,
+        .uPreallocateSize = MKV_RECORDER_PREALLOCATE_SIZE,
+        .uQueueSize = MKV_RECORDER_QUEUE_SIZE,
+        .uWriteBatchSize = MKV_RECORDER_WRITE_BATCH_SIZE,
+        .uSyncIntervalMs = MKV_RECORDER_SYNC_INTERVAL_MS,
+    };
+#endif /* ENABLE_MKV_RECORDER */
 
 #ifdef KVS_USE_POOL_ALLOCATOR
     poolAllocatorInit((void *)pMemPool, sizeof(pMemPool));
@@ -323,6 +494,9 @@ int main(int argc, char *argv[])
 #ifdef HAVE_SIGNAL_H
     /* Register interrupt signal handler so user can press Ctrl+C to exit this program gracefully. */
     signal(SIGINT, signalHandler);
+#if ENABLE_METRICS_EXPORT
+    signal(SIGUSR1, signalHandler);
+#endif /* ENABLE_METRICS_EXPORT */
 #endif /* HAVE_SIGNAL_H */
 
     /* Resolve KVS stream name */
@@ -334,6 +508,35 @@ int main(int argc, char *argv[])
         return ERRNO_FAIL;
     }
 
+#if ENABLE_MKV_RECORDER
+    if ((xMkvRecorderHandle = MkvRecorder_create(&xMkvRecorderConfig)) == NULL)
+    {
+        printf("Failed to create MKV recorder\n");
+    }
+#endif /* ENABLE_MKV_RECORDER */
+
+#if ENABLE_METRICS_EXPORT
+    if (ProducerMetrics_startServer(METRICS_SOCKET_PATH) != 0)
+    {
+        printf("Failed to start metrics server\n");
+    }
+#endif /* ENABLE_METRICS_EXPORT */
+
+#if ENABLE_DISK_SPILLOVER
+    if ((xSpillBufferHandle = SpillBuffer_create(&xSpillBufferConfig)) == NULL)
+    {
+        printf("Failed to create spill buffer\n");
+    }
+#endif /* ENABLE_DISK_SPILLOVER */
+
+#if ENABLE_AV_INTERLEAVER
+    xInterleaverConfig.pAppData = kvsAppHandle;
+    if ((xInterleaverHandle = FrameInterleaver_create(&xInterleaverConfig)) == NULL)
+    {
+        printf("Failed to create frame interleaver\n");
+    }
+#endif /* ENABLE_AV_INTERLEAVER */
+
 #if ENABLE_AUDIO_TRACK
 #if USE_AUDIO_G711
     AudioFormat audioFormat = AUD_FMT_G711A;
@@ -395,8 +598,31 @@ int main(int argc, char *argv[])
             if ((res = KvsApp_open(kvsAppHandle)) != 0)
             {
                 printf("Failed to open KVS app, err:-%X\n", -res);
+#if ENABLE_DISK_SPILLOVER
+                /* Keep retrying with a backoff until interrupted, frames are spilled to disk while the network is down. */
+                printf("Retry in %u seconds\n", uReconnectDelaySec);
+                for (i = 0; i < uReconnectDelaySec && !gStopRunning; i++)
+                {
+                    sleep(1);
+                }
+                if (uReconnectDelaySec * 2 <= SPILLOVER_RECONNECT_MAX_DELAY_SEC)
+                {
+                    uReconnectDelaySec *= 2;
+                }
+                else
+                {
+                    uReconnectDelaySec = SPILLOVER_RECONNECT_MAX_DELAY_SEC;
+                }
+                continue;
+#else
                 break;
+#endif /* ENABLE_DISK_SPILLOVER */
             }
+            METRICS_ADD(METRIC_CONNECTIONS, 1);
+#if ENABLE_DISK_SPILLOVER
+            uReconnectDelaySec = 1;
+            SpillBuffer_resume(xSpillBufferHandle);
+#endif /* ENABLE_DISK_SPILLOVER */
 
             while (true)
             {
@@ -413,22 +639,32 @@ int main(int argc, char *argv[])
 
                 while (KvsApp_readFragmentAck(kvsAppHandle, &eAckEventType, &uFragmentTimecode, &uErrorId) == 0)
                 {
+                    countFragmentAck(eAckEventType);
                     if (eAckEventType == ePersisted)
                     {
                         // printf("key-frame with timecode %" PRIu64 " is persisted\n", uFragmentTimecode);
                     }
                 }
 
+#if ENABLE_AV_INTERLEAVER
+                FrameInterleaver_poll(xInterleaverHandle);
+#endif /* ENABLE_AV_INTERLEAVER */
+#if ENABLE_DISK_SPILLOVER
+                SpillBuffer_drain(xSpillBufferHandle, kvsAppHandle);
+#endif /* ENABLE_DISK_SPILLOVER */
+
                 if (getEpochTimestampInMs() > uLastPrintMemStatTimestamp + 1000)
                 {
-                    printf("Buffer memory used: %zu\n", KvsApp_getStreamMemStatTotal(kvsAppHandle));
+                    updateStats(kvsAppHandle);
                     uLastPrintMemStatTimestamp = getEpochTimestampInMs();
-#ifdef KVS_USE_POOL_ALLOCATOR
-                    PoolStats_t stats = {0};
-                    poolAllocatorGetStats(&stats);
-                    printf("Sum of used/free memory:%zu/%zu, size of largest used/free block:%zu/%zu, number of used/free blocks:%zu/%zu\n", stats.uSumOfUsedMemory, stats.uSumOfFreeMemory, stats.uSizeOfLargestUsedBlock, stats.uSizeOfLargestFreeBlock, stats.uNumberOfUsedBlocks, stats.uNumberOfFreeBlocks);
-#endif
                 }
+#if ENABLE_METRICS_EXPORT
+                if (gDumpMetrics)
+                {
+                    gDumpMetrics = false;
+                    ProducerMetrics_writeFile(METRICS_SNAPSHOT_PATH);
+                }
+#endif /* ENABLE_METRICS_EXPORT */
             }
 
             xDoWorkExParamter.eType = DO_WORK_SEND_END_OF_FRAMES;
@@ -436,6 +672,7 @@ int main(int argc, char *argv[])
 
             while (KvsApp_readFragmentAck(kvsAppHandle, &eAckEventType, &uFragmentTimecode, &uErrorId) == 0)
             {
+                countFragmentAck(eAckEventType);
                 if (eAckEventType == eError)
                 {
                     /* Please refer to the following link to get more information on the error ID.
@@ -452,14 +689,6 @@ int main(int argc, char *argv[])
             else
             {
                 printf("KvsApp closed\n");
-#if DEBUG_STORE_MEDIA_TO_FILE
-                if (fpDbgMedia != NULL)
-                {
-                    fclose(fpDbgMedia);
-                    fpDbgMedia = NULL;
-                    printf("Closed debug file\n");
-                }
-#endif
             }
         }
     }
@@ -481,6 +710,25 @@ int main(int argc, char *argv[])
 
     KvsApp_terminate(kvsAppHandle);
 
+#if ENABLE_METRICS_EXPORT
+    ProducerMetrics_stopServer();
+#endif /* ENABLE_METRICS_EXPORT */
+
+#if ENABLE_AV_INTERLEAVER
+    FrameInterleaver_terminate(xInterleaverHandle);
+    xInterleaverHandle = NULL;
+#endif /* ENABLE_AV_INTERLEAVER */
+
+#if ENABLE_DISK_SPILLOVER
+    SpillBuffer_terminate(xSpillBufferHandle);
+    xSpillBufferHandle = NULL;
+#endif /* ENABLE_DISK_SPILLOVER */
+
+#if ENABLE_MKV_RECORDER
+    MkvRecorder_terminate(xMkvRecorderHandle);
+    xMkvRecorderHandle = NULL;
+#endif /* ENABLE_MKV_RECORDER */
+
 #ifdef KVS_USE_POOL_ALLOCATOR
     poolAllocatorDeinit();
 #endif
@@ -0,0 +1,452 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/**
+ * Upload throughput benchmark for the KVS producer path.
+ *
+ * It streams the board's video track (the FILE board when run offline) through KvsApp for a fixed duration, usually
+ * against putmedia-stub on localhost, and reports sustained upload throughput, fragment ACK latency and memory use.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Headers for KVS */
+#include "kvs/kvsapp.h"
+#include "kvs/port.h"
+
+#include "sample_config.h"
+#include "option_configuration.h"
+
+#include "com/amazonaws/kinesis/video/capturer/VideoCapturer.h"
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define VIDEO_FRAME_BUFFER_SIZE_BYTES (160 * 1024UL)
+#define MICROSECONDS_IN_A_MILLISECOND (1000LL)
+
+#define BENCH_DEFAULT_DURATION_SEC    (60)
+#define BENCH_KEYFRAME_HISTORY        (256)
+#define BENCH_LATENCY_SAMPLES_MAX     (4096)
+
+#define H264_NALU_TYPE_IDR            (5)
+#define H264_NALU_TYPE_SPS            (7)
+
+#ifdef KVS_USE_POOL_ALLOCATOR
+#include "kvs/pool_allocator.h"
+static char pMemPool[POOL_ALLOCATOR_SIZE];
+#endif
+
+typedef struct
+{
+    uint64_t uTimecodeMs;
+    uint64_t uAddedMs;
+} KeyframeRecord_t;
+
+typedef struct
+{
+    uint64_t puSamples[BENCH_LATENCY_SAMPLES_MAX];
+    size_t uCount;
+} LatencySamples_t;
+
+static VideoCapturerHandle videoCapturerHandle = NULL;
+static pthread_t videoThreadTid;
+
+static volatile sig_atomic_t gStopRunning = 0;
+
+static pthread_mutex_t gKeyframeLock = PTHREAD_MUTEX_INITIALIZER;
+static KeyframeRecord_t gKeyframes[BENCH_KEYFRAME_HISTORY];
+static size_t gKeyframeIndex = 0;
+
+static uint64_t gMkvBytesSent = 0;
+static uint64_t gFramesAdded = 0;
+static uint64_t gFramesFailed = 0;
+static size_t gStreamMemPeak = 0;
+
+static LatencySamples_t gBufferingLatency;
+static LatencySamples_t gReceivedLatency;
+static LatencySamples_t gPersistedLatency;
+static uint64_t gErrorAcks = 0;
+
+#ifdef HAVE_SIGNAL_H
+static void signalHandler(int signum)
+{
+    (void)signum;
+    gStopRunning = 1;
+}
+#endif /* HAVE_SIGNAL_H */
+
+static uint64_t getMonotonicTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+static bool isKeyFrame(const uint8_t *pData, size_t uLen)
+{
+    size_t i = 0;
+    uint8_t uNaluType = 0;
+
+    for (i = 0; i + 3 < uLen; i++)
+    {
+        if (pData[i] == 0x00 && pData[i + 1] == 0x00 && pData[i + 2] == 0x01)
+        {
+            uNaluType = pData[i + 3] & 0x1F;
+            if (uNaluType == H264_NALU_TYPE_IDR || uNaluType == H264_NALU_TYPE_SPS)
+            {
+                return true;
+            }
+            i += 2;
+        }
+    }
+
+    return false;
+}
+
+static void recordKeyframe(uint64_t uTimecodeMs)
+{
+    pthread_mutex_lock(&gKeyframeLock);
+    gKeyframes[gKeyframeIndex % BENCH_KEYFRAME_HISTORY].uTimecodeMs = uTimecodeMs;
+    gKeyframes[gKeyframeIndex % BENCH_KEYFRAME_HISTORY].uAddedMs = getMonotonicTimestampInMs();
+    gKeyframeIndex++;
+    pthread_mutex_unlock(&gKeyframeLock);
+}
+
+static bool lookupKeyframe(uint64_t uTimecodeMs, uint64_t *puAddedMs)
+{
+    bool bFound = false;
+    size_t i = 0;
+
+    pthread_mutex_lock(&gKeyframeLock);
+    for (i = 0; i < BENCH_KEYFRAME_HISTORY; i++)
+    {
+        if (gKeyframes[i].uTimecodeMs == uTimecodeMs && gKeyframes[i].uAddedMs != 0)
+        {
+            *puAddedMs = gKeyframes[i].uAddedMs;
+            bFound = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gKeyframeLock);
+
+    return bFound;
+}
+
+static void addLatencySample(LatencySamples_t *pxSamples, uint64_t uLatencyMs)
+{
+    if (pxSamples->uCount < BENCH_LATENCY_SAMPLES_MAX)
+    {
+        pxSamples->puSamples[pxSamples->uCount++] = uLatencyMs;
+    }
+}
+
+static int compareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void printLatency(const char *pName, LatencySamples_t *pxSamples)
+{
+    size_t n = pxSamples->uCount;
+
+    if (n == 0)
+    {
+        printf("  %-10s no samples\n", pName);
+        return;
+    }
+
+    qsort(pxSamples->puSamples, n, sizeof(uint64_t), compareU64);
+    printf("  %-10s n=%zu p50=%" PRIu64 "ms p90=%" PRIu64 "ms p99=%" PRIu64 "ms max=%" PRIu64 "ms\n", pName, n, pxSamples->puSamples[n / 2],
+           pxSamples->puSamples[(n * 90) / 100], pxSamples->puSamples[(n * 99) / 100], pxSamples->puSamples[n - 1]);
+}
+
+static void printProcessMemory(void)
+{
+    FILE *fp = NULL;
+    char pLine[128];
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+    {
+        return;
+    }
+
+    while (fgets(pLine, sizeof(pLine), fp) != NULL)
+    {
+        if (strncmp(pLine, "VmRSS:", 6) == 0 || strncmp(pLine, "VmHWM:", 6) == 0)
+        {
+            printf("  %s", pLine);
+        }
+    }
+
+    fclose(fp);
+}
+
+static int onMkvSent(uint8_t *pData, size_t uDataLen, void *pAppData)
+{
+    (void)pData;
+    (void)pAppData;
+
+    gMkvBytesSent += uDataLen;
+
+    return ERRNO_NONE;
+}
+
+static void *videoThread(void *arg)
+{
+    int res = ERRNO_NONE;
+    void *pFrameBuffer = NULL;
+    uint64_t timestamp = 0;
+    size_t frameSize = 0;
+    KvsAppHandle kvsAppHandle = (KvsAppHandle)(arg);
+
+    if (videoCapturerAcquireStream(videoCapturerHandle))
+    {
+        printf("%s(): Failed to acquire video stream\n", __FUNCTION__);
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        while (!gStopRunning)
+        {
+            if ((pFrameBuffer = malloc(VIDEO_FRAME_BUFFER_SIZE_BYTES)) == NULL)
+            {
+                printf("OOM\n");
+                continue;
+            }
+
+            if (videoCapturerGetFrame(videoCapturerHandle, pFrameBuffer, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize))
+            {
+                free(pFrameBuffer);
+            }
+            else
+            {
+                if (isKeyFrame((const uint8_t *)pFrameBuffer, frameSize))
+                {
+                    recordKeyframe(timestamp / MICROSECONDS_IN_A_MILLISECOND);
+                }
+
+                // KvsApp will help to free pFrameBuffer
+                if (KvsApp_addFrame(kvsAppHandle, pFrameBuffer, frameSize, VIDEO_FRAME_BUFFER_SIZE_BYTES, timestamp / MICROSECONDS_IN_A_MILLISECOND,
+                                    TRACK_VIDEO) == 0)
+                {
+                    gFramesAdded++;
+                }
+                else
+                {
+                    gFramesFailed++;
+                }
+            }
+
+            pFrameBuffer = NULL;
+        }
+    }
+
+    videoCapturerReleaseStream(videoCapturerHandle);
+    printf("video thread leaving, err:%d\n", res);
+
+    return NULL;
+}
+
+static void handleFragmentAck(ePutMediaFragmentAckEventType eAckEventType, uint64_t uFragmentTimecode)
+{
+    uint64_t uAddedMs = 0;
+    uint64_t uLatencyMs = 0;
+
+    if (eAckEventType == eError)
+    {
+        gErrorAcks++;
+        return;
+    }
+
+    if (!lookupKeyframe(uFragmentTimecode, &uAddedMs))
+    {
+        return;
+    }
+    uLatencyMs = getMonotonicTimestampInMs() - uAddedMs;
+
+    switch (eAckEventType)
+    {
+        case eBuffering:
+            addLatencySample(&gBufferingLatency, uLatencyMs);
+            break;
+        case eReceived:
+            addLatencySample(&gReceivedLatency, uLatencyMs);
+            break;
+        case ePersisted:
+            addLatencySample(&gPersistedLatency, uLatencyMs);
+            break;
+        default:
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int res = ERRNO_NONE;
+    KvsAppHandle kvsAppHandle = NULL;
+    ePutMediaFragmentAckEventType eAckEventType = eUnknown;
+    uint64_t uFragmentTimecode = 0;
+    unsigned int uErrorId = 0;
+    const char *pKvsStreamName = NULL;
+    uint64_t uDurationSec = BENCH_DEFAULT_DURATION_SEC;
+    uint64_t uStartMs = 0;
+    uint64_t uElapsedMs = 0;
+    size_t uMemStat = 0;
+    DoWorkExParamter_t xDoWorkExParamter = {0};
+
+#ifdef KVS_USE_POOL_ALLOCATOR
+    poolAllocatorInit((void *)pMemPool, sizeof(pMemPool));
+#endif
+
+#ifdef HAVE_SIGNAL_H
+    signal(SIGINT, signalHandler);
+#endif /* HAVE_SIGNAL_H */
+
+    pKvsStreamName = (argc >= 2) ? argv[1] : KVS_STREAM_NAME;
+    if (argc >= 3)
+    {
+        uDurationSec = strtoull(argv[2], NULL, 10);
+    }
+
+    if ((kvsAppHandle = KvsApp_create(OptCfg_getHostKinesisVideo(), OptCfg_getRegion(), OptCfg_getServiceKinesisVideo(), pKvsStreamName)) == NULL)
+    {
+        printf("Failed to initialize KVS\n");
+        return ERRNO_FAIL;
+    }
+
+    if (KvsApp_setoption(kvsAppHandle, OPTION_AWS_ACCESS_KEY_ID, OptCfg_getAwsAccessKey()) != 0 ||
+        KvsApp_setoption(kvsAppHandle, OPTION_AWS_SECRET_ACCESS_KEY, OptCfg_getAwsSecretAccessKey()) != 0 ||
+        KvsApp_setOnMkvSentCallback(kvsAppHandle, onMkvSent, NULL) != 0)
+    {
+        printf("Failed to set options\n");
+        res = ERRNO_FAIL;
+    }
+#if ENABLE_RING_BUFFER_MEM_LIMIT
+    else
+    {
+        KvsApp_streamPolicy_t xPolicy = STREAM_POLICY_RING_BUFFER;
+        size_t uRingBufferMemLimit = RING_BUFFER_MEM_LIMIT;
+        if (KvsApp_setoption(kvsAppHandle, OPTION_STREAM_POLICY, (const char *)&xPolicy) != 0 ||
+            KvsApp_setoption(kvsAppHandle, OPTION_STREAM_POLICY_RING_BUFFER_MEM_LIMIT, (const char *)&uRingBufferMemLimit) != 0)
+        {
+            printf("Failed to set ring buffer policy\n");
+            res = ERRNO_FAIL;
+        }
+    }
+#endif /* ENABLE_RING_BUFFER_MEM_LIMIT */
+
+    if (res != ERRNO_NONE)
+    {
+        /* Options are already reported. */
+    }
+    else if ((videoCapturerHandle = videoCapturerCreate()) == NULL)
+    {
+        printf("Failed to create video capturer\n");
+        res = ERRNO_FAIL;
+    }
+    else if (videoCapturerSetFormat(videoCapturerHandle, VID_FMT_H264, VID_RES_1080P))
+    {
+        printf("Failed to set video format\n");
+        res = ERRNO_FAIL;
+    }
+    else if ((res = KvsApp_open(kvsAppHandle)) != 0)
+    {
+        printf("Failed to open KVS app, err:-%X\n", -res);
+    }
+    else if (pthread_create(&videoThreadTid, NULL, videoThread, kvsAppHandle))
+    {
+        printf("Failed to create video thread\n");
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        printf("Benchmarking %s for %" PRIu64 " seconds\n", OptCfg_getHostKinesisVideo(), uDurationSec);
+        uStartMs = getMonotonicTimestampInMs();
+
+        while (!gStopRunning && getMonotonicTimestampInMs() < uStartMs + uDurationSec * 1000ULL)
+        {
+            if ((res = KvsApp_doWork(kvsAppHandle)) != 0)
+            {
+                printf("do work err:-%X\n", -res);
+                break;
+            }
+
+            while (KvsApp_readFragmentAck(kvsAppHandle, &eAckEventType, &uFragmentTimecode, &uErrorId) == 0)
+            {
+                handleFragmentAck(eAckEventType, uFragmentTimecode);
+            }
+
+            if ((uMemStat = KvsApp_getStreamMemStatTotal(kvsAppHandle)) > gStreamMemPeak)
+            {
+                gStreamMemPeak = uMemStat;
+            }
+        }
+
+        uElapsedMs = getMonotonicTimestampInMs() - uStartMs;
+        gStopRunning = 1;
+        pthread_join(videoThreadTid, NULL);
+
+        xDoWorkExParamter.eType = DO_WORK_SEND_END_OF_FRAMES;
+        KvsApp_doWorkEx(kvsAppHandle, &xDoWorkExParamter);
+        while (KvsApp_readFragmentAck(kvsAppHandle, &eAckEventType, &uFragmentTimecode, &uErrorId) == 0)
+        {
+            handleFragmentAck(eAckEventType, uFragmentTimecode);
+        }
+
+        printf("=== KVS producer benchmark ===\n");
+        printf("  duration   %" PRIu64 " ms\n", uElapsedMs);
+        printf("  frames     added:%" PRIu64 " failed:%" PRIu64 "\n", gFramesAdded, gFramesFailed);
+        printf("  uploaded   %" PRIu64 " bytes, %.1f kbps sustained\n", gMkvBytesSent,
+               uElapsedMs ? (double)gMkvBytesSent * 8.0 / (double)uElapsedMs : 0.0);
+        printf("  ack latency from keyframe capture (RECEIVED/PERSISTED include the fragment duration):\n");
+        printLatency("BUFFERING", &gBufferingLatency);
+        printLatency("RECEIVED", &gReceivedLatency);
+        printLatency("PERSISTED", &gPersistedLatency);
+        printf("  error acks %" PRIu64 "\n", gErrorAcks);
+        printf("  stream buffer peak %zu bytes\n", gStreamMemPeak);
+#ifdef KVS_USE_POOL_ALLOCATOR
+        PoolStats_t stats = {0};
+        poolAllocatorGetStats(&stats);
+        printf("  pool used/free %zu/%zu, largest free block %zu\n", stats.uSumOfUsedMemory, stats.uSumOfFreeMemory, stats.uSizeOfLargestFreeBlock);
+#endif
+        printProcessMemory();
+    }
+
+    KvsApp_close(kvsAppHandle);
+
+    videoCapturerDestory(videoCapturerHandle);
+    videoCapturerHandle = NULL;
+
+    KvsApp_terminate(kvsAppHandle);
+
+#ifdef KVS_USE_POOL_ALLOCATOR
+    poolAllocatorDeinit();
+#endif
+
+    return (res == ERRNO_NONE) ? 0 : ERRNO_FAIL;
+}
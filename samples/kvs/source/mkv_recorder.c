@@ -0,0 +1,797 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* fallocate() */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mkv_recorder.h"
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define RECORDER_PATH_MAX               (256)
+#define RECORDER_HEADER_MAX             (8 * 1024)
+#define RECORDER_PENDING_MAX            (64)
+#define RECORDER_INDEX_INITIAL_CAPACITY (64)
+
+#define MKV_ELEMENT_ID_EBML             (0x1A45DFA3)
+#define MKV_ELEMENT_ID_SEGMENT          (0x18538067)
+#define MKV_ELEMENT_ID_CLUSTER          (0x1F43B675)
+#define MKV_ELEMENT_ID_CLUSTER_TIMECODE (0xE7)
+
+typedef enum
+{
+    EBML_STATE_ID = 0,
+    EBML_STATE_SIZE,
+    EBML_STATE_VALUE,
+    EBML_STATE_SKIP,
+    EBML_STATE_RESYNC,
+} EbmlState_t;
+
+typedef struct
+{
+    uint64_t uTimecode;
+    uint64_t uOffset;
+} KeyframeIndexEntry_t;
+
+struct MkvRecorder
+{
+    MkvRecorderConfig_t xConfig;
+
+    pthread_mutex_t xLock;
+    pthread_cond_t xCond;
+    pthread_t writerTid;
+    bool bWriterStarted;
+    bool bStop;
+
+    /* Ring buffer between the upload thread and the writer thread, guarded by xLock. */
+    uint8_t *pQueue;
+    size_t uQueueHead;
+    size_t uQueueLen;
+    uint64_t uProduced;
+    uint64_t uConsumed;
+    bool bGap;
+    uint64_t uGapAt;
+    MkvRecorderStats_t xStats;
+
+    /* Everything below is owned by the writer thread. */
+    EbmlState_t eState;
+    uint32_t uId;
+    int iIdRemaining;
+    uint64_t uSize;
+    int iSizeRemaining;
+    uint64_t uValue;
+    uint64_t uRemaining;
+    uint32_t uSyncWord;
+
+    uint8_t pHeader[RECORDER_HEADER_MAX];
+    size_t uHeaderLen;
+    bool bCapturingHeader;
+    bool bHeaderValid;
+
+    uint8_t pPending[RECORDER_PENDING_MAX];
+    size_t uPendingLen;
+    bool bHoldingCluster;
+
+    int xSegmentFd;
+    char pSegmentPath[RECORDER_PATH_MAX];
+    uint64_t uSegmentSize;
+    uint64_t uSegmentStartTimecode;
+    uint32_t uSegmentGops;
+    uint8_t *pBatch;
+    size_t uBatchLen;
+    KeyframeIndexEntry_t *pxIndex;
+    size_t uIndexCount;
+    size_t uIndexCapacity;
+    uint64_t uLastSyncMs;
+};
+
+typedef struct MkvRecorder MkvRecorder_t;
+
+static uint64_t getMonotonicTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+static int writeAll(int xFd, const uint8_t *pData, size_t uLen)
+{
+    ssize_t n = 0;
+
+    while (uLen > 0)
+    {
+        if ((n = write(xFd, pData, uLen)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ERRNO_FAIL;
+        }
+        pData += n;
+        uLen -= (size_t)n;
+    }
+
+    return ERRNO_NONE;
+}
+
+static void segmentFlushBatch(MkvRecorder_t *pxRecorder)
+{
+    if (pxRecorder->xSegmentFd >= 0 && pxRecorder->uBatchLen > 0)
+    {
+        if (writeAll(pxRecorder->xSegmentFd, pxRecorder->pBatch, pxRecorder->uBatchLen) != ERRNO_NONE)
+        {
+            printf("Failed to write segment %s, errno:%d\n", pxRecorder->pSegmentPath, errno);
+        }
+        else
+        {
+            pthread_mutex_lock(&pxRecorder->xLock);
+            pxRecorder->xStats.uBytesWritten += pxRecorder->uBatchLen;
+            pthread_mutex_unlock(&pxRecorder->xLock);
+        }
+    }
+    pxRecorder->uBatchLen = 0;
+}
+
+static void segmentWrite(MkvRecorder_t *pxRecorder, const uint8_t *pData, size_t uLen)
+{
+    size_t uCopy = 0;
+
+    while (uLen > 0)
+    {
+        uCopy = pxRecorder->xConfig.uWriteBatchSize - pxRecorder->uBatchLen;
+        if (uCopy > uLen)
+        {
+            uCopy = uLen;
+        }
+        memcpy(pxRecorder->pBatch + pxRecorder->uBatchLen, pData, uCopy);
+        pxRecorder->uBatchLen += uCopy;
+        pxRecorder->uSegmentSize += uCopy;
+        pData += uCopy;
+        uLen -= uCopy;
+
+        if (pxRecorder->uBatchLen == pxRecorder->xConfig.uWriteBatchSize)
+        {
+            segmentFlushBatch(pxRecorder);
+        }
+    }
+}
+
+static void segmentSync(MkvRecorder_t *pxRecorder)
+{
+    if (pxRecorder->xSegmentFd >= 0)
+    {
+        segmentFlushBatch(pxRecorder);
+        fdatasync(pxRecorder->xSegmentFd);
+
+        pthread_mutex_lock(&pxRecorder->xLock);
+        pxRecorder->xStats.uSyncCount++;
+        pthread_mutex_unlock(&pxRecorder->xLock);
+    }
+    pxRecorder->uLastSyncMs = getMonotonicTimestampInMs();
+}
+
+static void writeKeyframeIndex(MkvRecorder_t *pxRecorder)
+{
+    char pIndexPath[RECORDER_PATH_MAX + 4];
+    FILE *fp = NULL;
+    size_t i = 0;
+
+    snprintf(pIndexPath, sizeof(pIndexPath), "%s.idx", pxRecorder->pSegmentPath);
+    if ((fp = fopen(pIndexPath, "w")) == NULL)
+    {
+        printf("Failed to open keyframe index %s\n", pIndexPath);
+        return;
+    }
+
+    /* One line per cluster: "<cluster timecode in ms> <byte offset in segment>" */
+    for (i = 0; i < pxRecorder->uIndexCount; i++)
+    {
+        fprintf(fp, "%" PRIu64 " %" PRIu64 "\n", pxRecorder->pxIndex[i].uTimecode, pxRecorder->pxIndex[i].uOffset);
+    }
+
+    fflush(fp);
+    fdatasync(fileno(fp));
+    fclose(fp);
+}
+
+static void segmentClose(MkvRecorder_t *pxRecorder)
+{
+    if (pxRecorder->xSegmentFd < 0)
+    {
+        return;
+    }
+
+    segmentFlushBatch(pxRecorder);
+
+    /* Give back the preallocated blocks that were not used. */
+    if (ftruncate(pxRecorder->xSegmentFd, (off_t)pxRecorder->uSegmentSize) != 0)
+    {
+        printf("Failed to truncate segment %s, errno:%d\n", pxRecorder->pSegmentPath, errno);
+    }
+    fdatasync(pxRecorder->xSegmentFd);
+    close(pxRecorder->xSegmentFd);
+    pxRecorder->xSegmentFd = -1;
+
+    writeKeyframeIndex(pxRecorder);
+    printf("Closed segment %s, %" PRIu64 " bytes, %u GOPs\n", pxRecorder->pSegmentPath, pxRecorder->uSegmentSize, pxRecorder->uSegmentGops);
+
+    pthread_mutex_lock(&pxRecorder->xLock);
+    pxRecorder->xStats.uSegmentsClosed++;
+    pthread_mutex_unlock(&pxRecorder->xLock);
+}
+
+static int segmentOpen(MkvRecorder_t *pxRecorder, uint64_t uTimecode)
+{
+    snprintf(pxRecorder->pSegmentPath, sizeof(pxRecorder->pSegmentPath), "%s/segment_%020" PRIu64 ".mkv", pxRecorder->xConfig.pDirectory, uTimecode);
+
+    if ((pxRecorder->xSegmentFd = open(pxRecorder->pSegmentPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        printf("Failed to open segment %s, errno:%d\n", pxRecorder->pSegmentPath, errno);
+        return ERRNO_FAIL;
+    }
+
+#if defined(__linux__)
+    /* Reserve contiguous blocks up front, the file size is kept so readers only see written data. */
+    if (pxRecorder->xConfig.uPreallocateSize > 0 &&
+        fallocate(pxRecorder->xSegmentFd, FALLOC_FL_KEEP_SIZE, 0, (off_t)pxRecorder->xConfig.uPreallocateSize) != 0)
+    {
+        printf("fallocate is not available for %s, errno:%d\n", pxRecorder->pSegmentPath, errno);
+    }
+#endif /* __linux__ */
+
+    pxRecorder->uSegmentSize = 0;
+    pxRecorder->uSegmentStartTimecode = uTimecode;
+    pxRecorder->uSegmentGops = 0;
+    pxRecorder->uIndexCount = 0;
+    pxRecorder->uLastSyncMs = getMonotonicTimestampInMs();
+
+    /* Every segment starts with the EBML header, Segment, Info and Tracks so it can be played on its own. */
+    segmentWrite(pxRecorder, pxRecorder->pHeader, pxRecorder->uHeaderLen);
+
+    return ERRNO_NONE;
+}
+
+static void indexAdd(MkvRecorder_t *pxRecorder, uint64_t uTimecode, uint64_t uOffset)
+{
+    KeyframeIndexEntry_t *pxNewIndex = NULL;
+    size_t uNewCapacity = 0;
+
+    if (pxRecorder->uIndexCount == pxRecorder->uIndexCapacity)
+    {
+        uNewCapacity = pxRecorder->uIndexCapacity ? pxRecorder->uIndexCapacity * 2 : RECORDER_INDEX_INITIAL_CAPACITY;
+        if ((pxNewIndex = (KeyframeIndexEntry_t *)realloc(pxRecorder->pxIndex, uNewCapacity * sizeof(KeyframeIndexEntry_t))) == NULL)
+        {
+            return;
+        }
+        pxRecorder->pxIndex = pxNewIndex;
+        pxRecorder->uIndexCapacity = uNewCapacity;
+    }
+
+    pxRecorder->pxIndex[pxRecorder->uIndexCount].uTimecode = uTimecode;
+    pxRecorder->pxIndex[pxRecorder->uIndexCount].uOffset = uOffset;
+    pxRecorder->uIndexCount++;
+}
+
+static void emit(MkvRecorder_t *pxRecorder, const uint8_t *pData, size_t uLen)
+{
+    if (pxRecorder->bCapturingHeader)
+    {
+        if (pxRecorder->uHeaderLen + uLen > RECORDER_HEADER_MAX)
+        {
+            printf("MKV header exceeds %d bytes, recording disabled until next header\n", RECORDER_HEADER_MAX);
+            pxRecorder->bCapturingHeader = false;
+            pxRecorder->bHeaderValid = false;
+            pxRecorder->uHeaderLen = 0;
+            return;
+        }
+        memcpy(pxRecorder->pHeader + pxRecorder->uHeaderLen, pData, uLen);
+        pxRecorder->uHeaderLen += uLen;
+    }
+    else if (pxRecorder->xSegmentFd >= 0)
+    {
+        segmentWrite(pxRecorder, pData, uLen);
+    }
+}
+
+static void flushPending(MkvRecorder_t *pxRecorder)
+{
+    emit(pxRecorder, pxRecorder->pPending, pxRecorder->uPendingLen);
+    pxRecorder->uPendingLen = 0;
+}
+
+/**
+ * @brief A cluster (one GOP in KVS) starts here, decide which segment it belongs to.
+ */
+static void resolveCluster(MkvRecorder_t *pxRecorder, bool bTimecodeKnown, uint64_t uTimecode)
+{
+    bool bRotate = false;
+    MkvRecorderConfig_t *pxConfig = &pxRecorder->xConfig;
+
+    pxRecorder->bHoldingCluster = false;
+
+    if (pxRecorder->bCapturingHeader)
+    {
+        pxRecorder->bCapturingHeader = false;
+        pxRecorder->bHeaderValid = true;
+    }
+
+    if (!pxRecorder->bHeaderValid)
+    {
+        pxRecorder->uPendingLen = 0;
+        return;
+    }
+
+    if (pxRecorder->xSegmentFd < 0)
+    {
+        bRotate = true;
+    }
+    else if (pxConfig->uSegmentDurationSec > 0 && bTimecodeKnown &&
+             uTimecode >= pxRecorder->uSegmentStartTimecode + (uint64_t)pxConfig->uSegmentDurationSec * 1000ULL)
+    {
+        bRotate = true;
+    }
+    else if (pxConfig->uSegmentGopCount > 0 && pxRecorder->uSegmentGops >= pxConfig->uSegmentGopCount)
+    {
+        bRotate = true;
+    }
+
+    if (bRotate)
+    {
+        segmentClose(pxRecorder);
+        if (segmentOpen(pxRecorder, bTimecodeKnown ? uTimecode : pxRecorder->uSegmentStartTimecode + 1) != ERRNO_NONE)
+        {
+            pxRecorder->uPendingLen = 0;
+            return;
+        }
+    }
+
+    pxRecorder->uSegmentGops++;
+    indexAdd(pxRecorder, uTimecode, pxRecorder->uSegmentSize);
+    flushPending(pxRecorder);
+}
+
+static void pendingAppend(MkvRecorder_t *pxRecorder, const uint8_t *pData, size_t uLen)
+{
+    if (pxRecorder->uPendingLen + uLen > RECORDER_PENDING_MAX)
+    {
+        /* The cluster timecode did not show up in the cluster header, rotate on GOP count only. */
+        resolveCluster(pxRecorder, false, 0);
+        emit(pxRecorder, pData, uLen);
+        return;
+    }
+    memcpy(pxRecorder->pPending + pxRecorder->uPendingLen, pData, uLen);
+    pxRecorder->uPendingLen += uLen;
+}
+
+static void onElementId(MkvRecorder_t *pxRecorder)
+{
+    if (pxRecorder->bHoldingCluster)
+    {
+        return;
+    }
+
+    if (pxRecorder->uId == MKV_ELEMENT_ID_EBML)
+    {
+        /* A new MKV stream begins, e.g. after KvsApp is re-opened. */
+        segmentClose(pxRecorder);
+        pxRecorder->uHeaderLen = 0;
+        pxRecorder->bCapturingHeader = true;
+        pxRecorder->bHeaderValid = false;
+        flushPending(pxRecorder);
+    }
+    else if (pxRecorder->uId == MKV_ELEMENT_ID_CLUSTER)
+    {
+        pxRecorder->bHoldingCluster = true;
+    }
+    else
+    {
+        flushPending(pxRecorder);
+    }
+}
+
+static void route(MkvRecorder_t *pxRecorder, const uint8_t *pData, size_t uLen)
+{
+    if (pxRecorder->bHoldingCluster)
+    {
+        pendingAppend(pxRecorder, pData, uLen);
+    }
+    else
+    {
+        emit(pxRecorder, pData, uLen);
+    }
+}
+
+static void consume(MkvRecorder_t *pxRecorder, const uint8_t *pData, size_t uLen)
+{
+    size_t i = 0;
+    size_t uTake = 0;
+    uint8_t b = 0;
+    int iLen = 0;
+
+    while (i < uLen)
+    {
+        b = pData[i];
+
+        switch (pxRecorder->eState)
+        {
+            case EBML_STATE_RESYNC:
+                /* Look for the next cluster after data was dropped. */
+                pxRecorder->uSyncWord = (pxRecorder->uSyncWord << 8) | b;
+                i++;
+                if (pxRecorder->uSyncWord == MKV_ELEMENT_ID_CLUSTER)
+                {
+                    pxRecorder->pPending[0] = 0x1F;
+                    pxRecorder->pPending[1] = 0x43;
+                    pxRecorder->pPending[2] = 0xB6;
+                    pxRecorder->pPending[3] = 0x75;
+                    pxRecorder->uPendingLen = 4;
+                    pxRecorder->uId = MKV_ELEMENT_ID_CLUSTER;
+                    pxRecorder->bHoldingCluster = true;
+                    pxRecorder->iSizeRemaining = -1;
+                    pxRecorder->eState = EBML_STATE_SIZE;
+                }
+                else if (pxRecorder->uSyncWord == MKV_ELEMENT_ID_EBML)
+                {
+                    pxRecorder->pPending[0] = 0x1A;
+                    pxRecorder->pPending[1] = 0x45;
+                    pxRecorder->pPending[2] = 0xDF;
+                    pxRecorder->pPending[3] = 0xA3;
+                    pxRecorder->uPendingLen = 4;
+                    pxRecorder->uId = MKV_ELEMENT_ID_EBML;
+                    onElementId(pxRecorder);
+                    pxRecorder->iSizeRemaining = -1;
+                    pxRecorder->eState = EBML_STATE_SIZE;
+                }
+                break;
+
+            case EBML_STATE_ID:
+                if (pxRecorder->iIdRemaining == 0)
+                {
+                    for (iLen = 1; iLen <= 4 && !(b & (0x80 >> (iLen - 1))); iLen++)
+                        ;
+                    pxRecorder->uId = b;
+                    pxRecorder->iIdRemaining = iLen - 1;
+                }
+                else
+                {
+                    pxRecorder->uId = (pxRecorder->uId << 8) | b;
+                    pxRecorder->iIdRemaining--;
+                }
+                i++;
+                /* ID bytes are held back until it's known whether a cluster starts here. */
+                if (pxRecorder->bHoldingCluster)
+                {
+                    pendingAppend(pxRecorder, &b, 1);
+                }
+                else if (pxRecorder->uPendingLen < RECORDER_PENDING_MAX)
+                {
+                    pxRecorder->pPending[pxRecorder->uPendingLen++] = b;
+                }
+                if (pxRecorder->iIdRemaining == 0)
+                {
+                    onElementId(pxRecorder);
+                    pxRecorder->iSizeRemaining = -1;
+                    pxRecorder->eState = EBML_STATE_SIZE;
+                }
+                break;
+
+            case EBML_STATE_SIZE:
+                if (pxRecorder->iSizeRemaining < 0)
+                {
+                    for (iLen = 1; iLen <= 8 && !(b & (0x80 >> (iLen - 1))); iLen++)
+                        ;
+                    pxRecorder->iSizeRemaining = iLen - 1;
+                    pxRecorder->uSize = (iLen < 8) ? (b & (0xFF >> iLen)) : 0;
+                }
+                else
+                {
+                    pxRecorder->uSize = (pxRecorder->uSize << 8) | b;
+                    pxRecorder->iSizeRemaining--;
+                }
+                i++;
+                route(pxRecorder, &b, 1);
+                if (pxRecorder->iSizeRemaining == 0)
+                {
+                    if (pxRecorder->uId == MKV_ELEMENT_ID_SEGMENT || pxRecorder->uId == MKV_ELEMENT_ID_CLUSTER)
+                    {
+                        pxRecorder->eState = EBML_STATE_ID;
+                    }
+                    else if (pxRecorder->uId == MKV_ELEMENT_ID_CLUSTER_TIMECODE && pxRecorder->bHoldingCluster && pxRecorder->uSize > 0 &&
+                             pxRecorder->uSize <= 8)
+                    {
+                        pxRecorder->uValue = 0;
+                        pxRecorder->uRemaining = pxRecorder->uSize;
+                        pxRecorder->eState = EBML_STATE_VALUE;
+                    }
+                    else
+                    {
+                        pxRecorder->uRemaining = pxRecorder->uSize;
+                        pxRecorder->eState = (pxRecorder->uRemaining > 0) ? EBML_STATE_SKIP : EBML_STATE_ID;
+                    }
+                }
+                break;
+
+            case EBML_STATE_VALUE:
+                pxRecorder->uValue = (pxRecorder->uValue << 8) | b;
+                i++;
+                route(pxRecorder, &b, 1);
+                if (--pxRecorder->uRemaining == 0)
+                {
+                    if (pxRecorder->bHoldingCluster)
+                    {
+                        resolveCluster(pxRecorder, true, pxRecorder->uValue);
+                    }
+                    pxRecorder->eState = EBML_STATE_ID;
+                }
+                break;
+
+            case EBML_STATE_SKIP:
+                uTake = uLen - i;
+                if ((uint64_t)uTake > pxRecorder->uRemaining)
+                {
+                    uTake = (size_t)pxRecorder->uRemaining;
+                }
+                route(pxRecorder, pData + i, uTake);
+                i += uTake;
+                pxRecorder->uRemaining -= uTake;
+                if (pxRecorder->uRemaining == 0)
+                {
+                    pxRecorder->eState = EBML_STATE_ID;
+                }
+                break;
+        }
+    }
+}
+
+static void handleGap(MkvRecorder_t *pxRecorder)
+{
+    printf("MKV recorder queue overflowed, resuming at next cluster\n");
+
+    /* The current segment ends at the last complete cluster boundary we know of. */
+    segmentClose(pxRecorder);
+    pxRecorder->uPendingLen = 0;
+    pxRecorder->bHoldingCluster = false;
+    pxRecorder->bCapturingHeader = false;
+    pxRecorder->iIdRemaining = 0;
+    pxRecorder->uSyncWord = 0;
+    pxRecorder->eState = EBML_STATE_RESYNC;
+}
+
+static void *writerThread(void *arg)
+{
+    MkvRecorder_t *pxRecorder = (MkvRecorder_t *)arg;
+    size_t uSlice = 0;
+    bool bGapReached = false;
+    struct timespec xDeadline;
+    uint64_t uNowMs = 0;
+
+    pthread_mutex_lock(&pxRecorder->xLock);
+    while (true)
+    {
+        while (pxRecorder->uQueueLen == 0 && !pxRecorder->bStop)
+        {
+            clock_gettime(CLOCK_REALTIME, &xDeadline);
+            xDeadline.tv_sec += pxRecorder->xConfig.uSyncIntervalMs / 1000;
+            xDeadline.tv_nsec += (long)(pxRecorder->xConfig.uSyncIntervalMs % 1000) * 1000000L;
+            if (xDeadline.tv_nsec >= 1000000000L)
+            {
+                xDeadline.tv_sec++;
+                xDeadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&pxRecorder->xCond, &pxRecorder->xLock, &xDeadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+
+        if (pxRecorder->uQueueLen == 0 && pxRecorder->bStop)
+        {
+            break;
+        }
+
+        /* Take one contiguous slice, and never consume across a gap. */
+        uSlice = pxRecorder->uQueueLen;
+        if (pxRecorder->uQueueHead + uSlice > pxRecorder->xConfig.uQueueSize)
+        {
+            uSlice = pxRecorder->xConfig.uQueueSize - pxRecorder->uQueueHead;
+        }
+        if (pxRecorder->bGap && pxRecorder->uConsumed + uSlice > pxRecorder->uGapAt)
+        {
+            uSlice = (size_t)(pxRecorder->uGapAt - pxRecorder->uConsumed);
+        }
+        pthread_mutex_unlock(&pxRecorder->xLock);
+
+        consume(pxRecorder, pxRecorder->pQueue + pxRecorder->uQueueHead, uSlice);
+
+        uNowMs = getMonotonicTimestampInMs();
+        if (uNowMs >= pxRecorder->uLastSyncMs + pxRecorder->xConfig.uSyncIntervalMs)
+        {
+            segmentSync(pxRecorder);
+        }
+
+        pthread_mutex_lock(&pxRecorder->xLock);
+        pxRecorder->uQueueHead = (pxRecorder->uQueueHead + uSlice) % pxRecorder->xConfig.uQueueSize;
+        pxRecorder->uQueueLen -= uSlice;
+        pxRecorder->uConsumed += uSlice;
+        bGapReached = pxRecorder->bGap && pxRecorder->uConsumed == pxRecorder->uGapAt;
+        if (bGapReached)
+        {
+            pxRecorder->bGap = false;
+        }
+
+        if (bGapReached)
+        {
+            pthread_mutex_unlock(&pxRecorder->xLock);
+            handleGap(pxRecorder);
+            pthread_mutex_lock(&pxRecorder->xLock);
+        }
+    }
+    pthread_mutex_unlock(&pxRecorder->xLock);
+
+    segmentClose(pxRecorder);
+
+    return NULL;
+}
+
+MkvRecorderHandle MkvRecorder_create(const MkvRecorderConfig_t *pxConfig)
+{
+    int res = ERRNO_NONE;
+    MkvRecorder_t *pxRecorder = NULL;
+
+    if (pxConfig == NULL || pxConfig->pDirectory == NULL || pxConfig->uQueueSize == 0 || pxConfig->uWriteBatchSize == 0)
+    {
+        printf("Invalid recorder configuration\n");
+        res = ERRNO_FAIL;
+    }
+    else if ((pxRecorder = (MkvRecorder_t *)calloc(1, sizeof(MkvRecorder_t))) == NULL)
+    {
+        printf("OOM: pxRecorder\n");
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        pxRecorder->xConfig = *pxConfig;
+        pxRecorder->xSegmentFd = -1;
+        pxRecorder->eState = EBML_STATE_ID;
+        pthread_mutex_init(&pxRecorder->xLock, NULL);
+        pthread_cond_init(&pxRecorder->xCond, NULL);
+
+        if ((pxRecorder->pQueue = (uint8_t *)malloc(pxConfig->uQueueSize)) == NULL ||
+            (pxRecorder->pBatch = (uint8_t *)malloc(pxConfig->uWriteBatchSize)) == NULL)
+        {
+            printf("OOM: recorder buffers\n");
+            res = ERRNO_FAIL;
+        }
+        else if (pthread_create(&pxRecorder->writerTid, NULL, writerThread, pxRecorder) != 0)
+        {
+            printf("Failed to create recorder thread\n");
+            res = ERRNO_FAIL;
+        }
+        else
+        {
+            pxRecorder->bWriterStarted = true;
+        }
+    }
+
+    if (res != ERRNO_NONE)
+    {
+        MkvRecorder_terminate(pxRecorder);
+        pxRecorder = NULL;
+    }
+
+    return pxRecorder;
+}
+
+void MkvRecorder_terminate(MkvRecorderHandle xRecorderHandle)
+{
+    MkvRecorder_t *pxRecorder = xRecorderHandle;
+
+    if (pxRecorder != NULL)
+    {
+        if (pxRecorder->bWriterStarted)
+        {
+            pthread_mutex_lock(&pxRecorder->xLock);
+            pxRecorder->bStop = true;
+            pthread_cond_signal(&pxRecorder->xCond);
+            pthread_mutex_unlock(&pxRecorder->xLock);
+            pthread_join(pxRecorder->writerTid, NULL);
+        }
+
+        pthread_cond_destroy(&pxRecorder->xCond);
+        pthread_mutex_destroy(&pxRecorder->xLock);
+        free(pxRecorder->pxIndex);
+        free(pxRecorder->pBatch);
+        free(pxRecorder->pQueue);
+        free(pxRecorder);
+    }
+}
+
+int MkvRecorder_write(MkvRecorderHandle xRecorderHandle, const uint8_t *pData, size_t uDataLen)
+{
+    int res = ERRNO_NONE;
+    MkvRecorder_t *pxRecorder = xRecorderHandle;
+    size_t uTail = 0;
+    size_t uFirst = 0;
+
+    if (pxRecorder == NULL || pData == NULL)
+    {
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxRecorder->xLock);
+
+    if (pxRecorder->bGap || pxRecorder->uQueueLen + uDataLen > pxRecorder->xConfig.uQueueSize)
+    {
+        /* Drop until the writer catches up with the gap, it will resync on the next cluster. */
+        if (!pxRecorder->bGap)
+        {
+            pxRecorder->bGap = true;
+            pxRecorder->uGapAt = pxRecorder->uProduced;
+        }
+        pxRecorder->xStats.uBytesDropped += uDataLen;
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        uTail = (pxRecorder->uQueueHead + pxRecorder->uQueueLen) % pxRecorder->xConfig.uQueueSize;
+        uFirst = pxRecorder->xConfig.uQueueSize - uTail;
+        if (uFirst > uDataLen)
+        {
+            uFirst = uDataLen;
+        }
+        memcpy(pxRecorder->pQueue + uTail, pData, uFirst);
+        memcpy(pxRecorder->pQueue, pData + uFirst, uDataLen - uFirst);
+        pxRecorder->uQueueLen += uDataLen;
+        pxRecorder->uProduced += uDataLen;
+        pxRecorder->xStats.uBytesQueued += uDataLen;
+        pthread_cond_signal(&pxRecorder->xCond);
+    }
+
+    pthread_mutex_unlock(&pxRecorder->xLock);
+
+    return res;
+}
+
+int MkvRecorder_getStats(MkvRecorderHandle xRecorderHandle, MkvRecorderStats_t *pxStats)
+{
+    MkvRecorder_t *pxRecorder = xRecorderHandle;
+
+    if (pxRecorder == NULL || pxStats == NULL)
+    {
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxRecorder->xLock);
+    *pxStats = pxRecorder->xStats;
+    pthread_mutex_unlock(&pxRecorder->xLock);
+
+    return ERRNO_NONE;
+}
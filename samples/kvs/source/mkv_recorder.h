@@ -0,0 +1,93 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef MKV_RECORDER_H
+#define MKV_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct MkvRecorder *MkvRecorderHandle;
+
+typedef struct
+{
+    /* Directory where segment files and their keyframe index files are stored. */
+    const char *pDirectory;
+
+    /* Rotate to a new segment once it spans this many seconds, 0 to disable. */
+    uint32_t uSegmentDurationSec;
+
+    /* Rotate to a new segment once it holds this many GOPs, 0 to disable. */
+    uint32_t uSegmentGopCount;
+
+    /* Size reserved on disk for every new segment to avoid fragmentation while it grows. */
+    size_t uPreallocateSize;
+
+    /* Size of the in-memory queue between the upload thread and the writer thread. */
+    size_t uQueueSize;
+
+    /* Data is written to disk in batches of this size. */
+    size_t uWriteBatchSize;
+
+    /* Interval of fdatasync on the current segment. */
+    uint32_t uSyncIntervalMs;
+} MkvRecorderConfig_t;
+
+typedef struct
+{
+    uint64_t uBytesQueued;
+    uint64_t uBytesDropped;
+    uint64_t uBytesWritten;
+    uint64_t uSegmentsClosed;
+    uint64_t uSyncCount;
+} MkvRecorderStats_t;
+
+/**
+ * @brief Create a recorder and start its writer thread.
+ *
+ * @param[in] pxConfig Recorder configuration
+ * @return Recorder handle on success, NULL otherwise
+ */
+MkvRecorderHandle MkvRecorder_create(const MkvRecorderConfig_t *pxConfig);
+
+/**
+ * @brief Flush pending data, close the current segment and free the recorder.
+ *
+ * @param[in] xRecorderHandle Recorder handle
+ */
+void MkvRecorder_terminate(MkvRecorderHandle xRecorderHandle);
+
+/**
+ * @brief Queue a chunk of the MKV stream. It never blocks on disk I/O and drops data if the queue is full.
+ *
+ * It's designed to be called from the KvsApp onMkvSent callback.
+ *
+ * @param[in] xRecorderHandle Recorder handle
+ * @param[in] pData MKV data
+ * @param[in] uDataLen Length of MKV data
+ * @return 0 on success, non-zero value if data was dropped
+ */
+int MkvRecorder_write(MkvRecorderHandle xRecorderHandle, const uint8_t *pData, size_t uDataLen);
+
+/**
+ * @brief Get recorder statistics.
+ *
+ * @param[in] xRecorderHandle Recorder handle
+ * @param[out] pxStats Statistics
+ * @return 0 on success, non-zero value otherwise
+ */
+int MkvRecorder_getStats(MkvRecorderHandle xRecorderHandle, MkvRecorderStats_t *pxStats);
+
+#endif /* MKV_RECORDER_H */
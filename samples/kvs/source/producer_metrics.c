@@ -0,0 +1,270 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "producer_metrics.h"
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define METRICS_SNAPSHOT_MAX_SIZE (2048)
+
+static const char *pMetricNames[METRIC_COUNT] = {
+    [METRIC_STREAM_MEM_TOTAL] = "stream_mem_total",
+    [METRIC_POOL_USED_MEMORY] = "pool_used_memory",
+    [METRIC_POOL_FREE_MEMORY] = "pool_free_memory",
+    [METRIC_POOL_LARGEST_USED_BLOCK] = "pool_largest_used_block",
+    [METRIC_POOL_LARGEST_FREE_BLOCK] = "pool_largest_free_block",
+    [METRIC_POOL_USED_BLOCKS] = "pool_used_blocks",
+    [METRIC_POOL_FREE_BLOCKS] = "pool_free_blocks",
+    [METRIC_SPILL_DISK_USAGE] = "spill_disk_usage",
+    [METRIC_VIDEO_FRAMES] = "video_frames",
+    [METRIC_AUDIO_FRAMES] = "audio_frames",
+    [METRIC_FRAMES_DROPPED] = "frames_dropped",
+    [METRIC_FRAMES_LATE] = "frames_late",
+    [METRIC_ACK_BUFFERING] = "ack_buffering",
+    [METRIC_ACK_RECEIVED] = "ack_received",
+    [METRIC_ACK_PERSISTED] = "ack_persisted",
+    [METRIC_ACK_ERROR] = "ack_error",
+    [METRIC_CONNECTIONS] = "connections",
+};
+
+/* 64-bit atomics need libatomic on 32-bit targets like MIPS32, so a mutex guards the metrics instead. It's only held
+ * to update or copy the array. */
+static pthread_mutex_t gMetricsLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t gMetrics[METRIC_COUNT];
+
+static int gServerFd = -1;
+static pthread_t gServerTid;
+static char gSocketPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static uint64_t getEpochTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_REALTIME, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+void ProducerMetrics_add(ProducerMetricId_t xId, uint64_t uDelta)
+{
+    if ((unsigned int)xId < METRIC_COUNT)
+    {
+        pthread_mutex_lock(&gMetricsLock);
+        gMetrics[xId] += uDelta;
+        pthread_mutex_unlock(&gMetricsLock);
+    }
+}
+
+void ProducerMetrics_set(ProducerMetricId_t xId, uint64_t uValue)
+{
+    if ((unsigned int)xId < METRIC_COUNT)
+    {
+        pthread_mutex_lock(&gMetricsLock);
+        gMetrics[xId] = uValue;
+        pthread_mutex_unlock(&gMetricsLock);
+    }
+}
+
+size_t ProducerMetrics_serialize(uint8_t *pBuf, size_t uBufSize, bool bBinary)
+{
+    ProducerMetricsSnapshotHeader_t xHeader = {0};
+    uint64_t pMetrics[METRIC_COUNT];
+    size_t uLen = 0;
+    int n = 0;
+    int i = 0;
+
+    if (pBuf == NULL)
+    {
+        return 0;
+    }
+
+    xHeader.uMagic = PRODUCER_METRICS_MAGIC;
+    xHeader.uVersion = PRODUCER_METRICS_VERSION;
+    xHeader.uCount = METRIC_COUNT;
+    xHeader.uTimestampMs = getEpochTimestampInMs();
+
+    pthread_mutex_lock(&gMetricsLock);
+    memcpy(pMetrics, gMetrics, sizeof(pMetrics));
+    pthread_mutex_unlock(&gMetricsLock);
+
+    if (bBinary)
+    {
+        uLen = sizeof(ProducerMetricsSnapshotHeader_t) + METRIC_COUNT * sizeof(uint64_t);
+        if (uLen > uBufSize)
+        {
+            return 0;
+        }
+        memcpy(pBuf, &xHeader, sizeof(ProducerMetricsSnapshotHeader_t));
+        memcpy(pBuf + sizeof(ProducerMetricsSnapshotHeader_t), pMetrics, sizeof(pMetrics));
+    }
+    else
+    {
+        n = snprintf((char *)pBuf, uBufSize, "timestamp_ms %" PRIu64 "\n", xHeader.uTimestampMs);
+        if (n < 0 || (size_t)n >= uBufSize)
+        {
+            return 0;
+        }
+        uLen = (size_t)n;
+        for (i = 0; i < METRIC_COUNT; i++)
+        {
+            n = snprintf((char *)pBuf + uLen, uBufSize - uLen, "%s %" PRIu64 "\n", pMetricNames[i], pMetrics[i]);
+            if (n < 0 || (size_t)n >= uBufSize - uLen)
+            {
+                return 0;
+            }
+            uLen += (size_t)n;
+        }
+    }
+
+    return uLen;
+}
+
+int ProducerMetrics_writeFile(const char *pPath)
+{
+    int res = ERRNO_NONE;
+    uint8_t pBuf[METRICS_SNAPSHOT_MAX_SIZE];
+    char pTmpPath[256];
+    size_t uLen = 0;
+    FILE *fp = NULL;
+
+    snprintf(pTmpPath, sizeof(pTmpPath), "%s.tmp", pPath);
+
+    if ((uLen = ProducerMetrics_serialize(pBuf, sizeof(pBuf), false)) == 0)
+    {
+        res = ERRNO_FAIL;
+    }
+    else if ((fp = fopen(pTmpPath, "w")) == NULL)
+    {
+        printf("Failed to open %s\n", pTmpPath);
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        if (fwrite(pBuf, 1, uLen, fp) != uLen)
+        {
+            res = ERRNO_FAIL;
+        }
+        fclose(fp);
+
+        if (res == ERRNO_NONE && rename(pTmpPath, pPath) != 0)
+        {
+            printf("Failed to rename %s\n", pTmpPath);
+            res = ERRNO_FAIL;
+        }
+    }
+
+    return res;
+}
+
+static void *serverThread(void *arg)
+{
+    int xClientFd = -1;
+    uint8_t pBuf[METRICS_SNAPSHOT_MAX_SIZE];
+    char cRequest = 0;
+    size_t uLen = 0;
+    struct timeval xTimeout = {.tv_sec = 1, .tv_usec = 0};
+
+    (void)arg;
+
+    while ((xClientFd = accept(gServerFd, NULL, NULL)) >= 0 || errno == EINTR)
+    {
+        if (xClientFd < 0)
+        {
+            continue;
+        }
+
+        /* Wait briefly for a request byte, clients that only read get a text snapshot. */
+        setsockopt(xClientFd, SOL_SOCKET, SO_RCVTIMEO, &xTimeout, sizeof(xTimeout));
+        if (recv(xClientFd, &cRequest, 1, 0) != 1)
+        {
+            cRequest = 0;
+        }
+
+        if ((uLen = ProducerMetrics_serialize(pBuf, sizeof(pBuf), cRequest == PRODUCER_METRICS_REQUEST_BINARY)) > 0)
+        {
+            send(xClientFd, pBuf, uLen, MSG_NOSIGNAL);
+        }
+        close(xClientFd);
+    }
+
+    return NULL;
+}
+
+int ProducerMetrics_startServer(const char *pSocketPath)
+{
+    int res = ERRNO_NONE;
+    struct sockaddr_un xAddr = {0};
+
+    if (pSocketPath == NULL || strlen(pSocketPath) >= sizeof(xAddr.sun_path) || gServerFd >= 0)
+    {
+        return ERRNO_FAIL;
+    }
+
+    xAddr.sun_family = AF_UNIX;
+    strcpy(xAddr.sun_path, pSocketPath);
+    unlink(pSocketPath);
+
+    if ((gServerFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        printf("Failed to create metrics socket\n");
+        res = ERRNO_FAIL;
+    }
+    else if (bind(gServerFd, (struct sockaddr *)&xAddr, sizeof(xAddr)) != 0 || listen(gServerFd, 4) != 0)
+    {
+        printf("Failed to listen on %s, errno:%d\n", pSocketPath, errno);
+        res = ERRNO_FAIL;
+    }
+    else if (pthread_create(&gServerTid, NULL, serverThread, NULL) != 0)
+    {
+        printf("Failed to create metrics thread\n");
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        strcpy(gSocketPath, pSocketPath);
+    }
+
+    if (res != ERRNO_NONE && gServerFd >= 0)
+    {
+        close(gServerFd);
+        gServerFd = -1;
+    }
+
+    return res;
+}
+
+void ProducerMetrics_stopServer(void)
+{
+    if (gServerFd >= 0)
+    {
+        /* Wake up accept() so the thread can leave. */
+        shutdown(gServerFd, SHUT_RDWR);
+        pthread_join(gServerTid, NULL);
+        close(gServerFd);
+        gServerFd = -1;
+        unlink(gSocketPath);
+    }
+}
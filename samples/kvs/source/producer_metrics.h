@@ -0,0 +1,111 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef PRODUCER_METRICS_H
+#define PRODUCER_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary snapshot: ProducerMetricsSnapshotHeader_t followed by uCount uint64_t values in host byte order ordered by ProducerMetricId_t. */
+#define PRODUCER_METRICS_MAGIC   (0x4D53564B) /* "KVSM" */
+#define PRODUCER_METRICS_VERSION (1)
+
+/* Request sent by a client of the metrics socket. Any other request is answered with a text snapshot. */
+#define PRODUCER_METRICS_REQUEST_BINARY 'b'
+
+typedef enum
+{
+    /* Gauges */
+    METRIC_STREAM_MEM_TOTAL = 0,
+    METRIC_POOL_USED_MEMORY,
+    METRIC_POOL_FREE_MEMORY,
+    METRIC_POOL_LARGEST_USED_BLOCK,
+    METRIC_POOL_LARGEST_FREE_BLOCK,
+    METRIC_POOL_USED_BLOCKS,
+    METRIC_POOL_FREE_BLOCKS,
+    METRIC_SPILL_DISK_USAGE,
+
+    /* Counters */
+    METRIC_VIDEO_FRAMES,
+    METRIC_AUDIO_FRAMES,
+    METRIC_FRAMES_DROPPED,
+    METRIC_FRAMES_LATE,
+    METRIC_ACK_BUFFERING,
+    METRIC_ACK_RECEIVED,
+    METRIC_ACK_PERSISTED,
+    METRIC_ACK_ERROR,
+    METRIC_CONNECTIONS,
+
+    METRIC_COUNT
+} ProducerMetricId_t;
+
+typedef struct
+{
+    uint32_t uMagic;
+    uint16_t uVersion;
+    uint16_t uCount;
+    uint64_t uTimestampMs;
+} ProducerMetricsSnapshotHeader_t;
+
+/**
+ * @brief Add to a counter. It's safe to call from any thread and only holds a lock for the update.
+ *
+ * @param[in] xId Metric ID
+ * @param[in] uDelta Value to add
+ */
+void ProducerMetrics_add(ProducerMetricId_t xId, uint64_t uDelta);
+
+/**
+ * @brief Set a gauge. It's safe to call from any thread and only holds a lock for the update.
+ *
+ * @param[in] xId Metric ID
+ * @param[in] uValue New value
+ */
+void ProducerMetrics_set(ProducerMetricId_t xId, uint64_t uValue);
+
+/**
+ * @brief Serialize a consistent snapshot of all metrics.
+ *
+ * @param[out] pBuf Buffer for the snapshot
+ * @param[in] uBufSize Size of pBuf
+ * @param[in] bBinary true for the binary format, false for "name value" text lines
+ * @return Length of the snapshot, 0 if pBuf is too small
+ */
+size_t ProducerMetrics_serialize(uint8_t *pBuf, size_t uBufSize, bool bBinary);
+
+/**
+ * @brief Write a text snapshot to a file. The file is replaced atomically.
+ *
+ * @param[in] pPath File path
+ * @return 0 on success, non-zero value otherwise
+ */
+int ProducerMetrics_writeFile(const char *pPath);
+
+/**
+ * @brief Start a thread serving snapshots on a Unix domain socket. Every client gets one snapshot per connection.
+ *
+ * @param[in] pSocketPath Socket path
+ * @return 0 on success, non-zero value otherwise
+ */
+int ProducerMetrics_startServer(const char *pSocketPath);
+
+/**
+ * @brief Stop the snapshot server and remove its socket.
+ */
+void ProducerMetrics_stopServer(void);
+
+#endif /* PRODUCER_METRICS_H */
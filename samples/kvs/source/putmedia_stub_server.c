@@ -0,0 +1,930 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/**
+ * A local stand-in for the KVS control plane and PutMedia data plane.
+ *
+ * It answers DescribeStream/CreateStream/GetDataEndpoint with canned responses that point back to itself, consumes
+ * the chunked MKV body of PutMedia, and replies with BUFFERING/RECEIVED/PERSISTED fragment ACK events derived from
+ * the cluster timecodes found in the stream. Uplink bandwidth, ACK latency and packet loss can be shaped so the
+ * producer path can be performance tested without AWS.
+ *
+ * It only binds to the loopback interface.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif /* HAVE_SIGNAL_H */
+
+#if ENABLE_STUB_TLS
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#endif /* ENABLE_STUB_TLS */
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define STUB_DEFAULT_PORT                 (8443)
+#define STUB_RECV_BUFFER_SIZE             (16 * 1024)
+#define STUB_HEADER_BUFFER_SIZE           (4 * 1024)
+#define STUB_POLL_INTERVAL_MS             (10)
+#define STUB_DEFAULT_LOSS_STALL_MS        (200)
+#define STUB_PENDING_ACK_MAX              (64)
+#define STUB_PERSIST_DELAY_MS             (100)
+#define STUB_STREAM_ARN                   "arn:aws:kinesisvideo:us-east-1:000000000000:stream/stub/0"
+
+#define MKV_ELEMENT_ID_SEGMENT            (0x18538067)
+#define MKV_ELEMENT_ID_CLUSTER            (0x1F43B675)
+#define MKV_ELEMENT_ID_CLUSTER_TIMECODE   (0xE7)
+
+typedef struct
+{
+    uint16_t uPort;
+    uint32_t uBandwidthKbps;
+    uint32_t uLatencyMs;
+    uint32_t uLossPermyriad;
+    uint32_t uLossStallMs;
+    const char *pCertPath;
+    const char *pKeyPath;
+} StubConfig_t;
+
+typedef enum
+{
+    ACK_EVENT_BUFFERING = 0,
+    ACK_EVENT_RECEIVED,
+    ACK_EVENT_PERSISTED,
+} AckEvent_t;
+
+typedef struct
+{
+    uint64_t uDueMs;
+    uint64_t uFragmentTimecode;
+    uint64_t uFragmentNumber;
+    AckEvent_t eEvent;
+} PendingAck_t;
+
+typedef enum
+{
+    EBML_STATE_ID = 0,
+    EBML_STATE_SIZE,
+    EBML_STATE_VALUE,
+    EBML_STATE_SKIP,
+} EbmlState_t;
+
+/* A byte-at-a-time EBML walker that only descends into Segment and Cluster and reports cluster timecodes. */
+typedef struct
+{
+    EbmlState_t eState;
+    uint32_t uId;
+    int iIdRemaining;
+    uint64_t uSize;
+    int iSizeLen;
+    int iSizeRemaining;
+    uint64_t uValue;
+    uint64_t uRemaining;
+} EbmlWalker_t;
+
+typedef struct
+{
+    int xSockFd;
+#if ENABLE_STUB_TLS
+    mbedtls_net_context xNet;
+    mbedtls_ssl_context xSsl;
+#endif /* ENABLE_STUB_TLS */
+    bool bTls;
+
+    /* Shaping */
+    uint64_t uShapeStartMs;
+    uint64_t uShapedBytes;
+
+    /* Fragment state */
+    EbmlWalker_t xWalker;
+    bool bHasFragment;
+    uint64_t uCurrentFragmentTimecode;
+    uint64_t uFragmentNumber;
+    PendingAck_t pxPendingAcks[STUB_PENDING_ACK_MAX];
+    size_t uPendingAckCount;
+
+    /* Statistics */
+    uint64_t uBodyBytes;
+    uint64_t uFragments;
+} StubConnection_t;
+
+static StubConfig_t gStubConfig = {
+    .uPort = STUB_DEFAULT_PORT,
+    .uLossStallMs = STUB_DEFAULT_LOSS_STALL_MS,
+};
+
+static volatile bool gStopRunning = false;
+
+#if ENABLE_STUB_TLS
+static mbedtls_ssl_config gSslConf;
+static mbedtls_x509_crt gSrvCert;
+static mbedtls_pk_context gSrvKey;
+static mbedtls_entropy_context gEntropy;
+static mbedtls_ctr_drbg_context gCtrDrbg;
+#endif /* ENABLE_STUB_TLS */
+
+#ifdef HAVE_SIGNAL_H
+static void signalHandler(int signum)
+{
+    (void)signum;
+    gStopRunning = true;
+}
+#endif /* HAVE_SIGNAL_H */
+
+static uint64_t getMonotonicTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+static void sleepMs(uint32_t uMs)
+{
+    struct timespec xTs = {.tv_sec = uMs / 1000, .tv_nsec = (long)(uMs % 1000) * 1000000L};
+
+    nanosleep(&xTs, NULL);
+}
+
+static int connRecv(StubConnection_t *pxConn, uint8_t *pBuf, size_t uLen)
+{
+    int n = 0;
+    struct pollfd xPfd = {.fd = pxConn->xSockFd, .events = POLLIN};
+
+#if ENABLE_STUB_TLS
+    if (pxConn->bTls)
+    {
+        if (mbedtls_ssl_get_bytes_avail(&pxConn->xSsl) == 0 && poll(&xPfd, 1, STUB_POLL_INTERVAL_MS) == 0)
+        {
+            return 0;
+        }
+        n = mbedtls_ssl_read(&pxConn->xSsl, pBuf, uLen);
+        if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            return 0;
+        }
+        return (n == 0) ? -1 : n;
+    }
+#endif /* ENABLE_STUB_TLS */
+
+    if (poll(&xPfd, 1, STUB_POLL_INTERVAL_MS) == 0)
+    {
+        return 0;
+    }
+    n = recv(pxConn->xSockFd, pBuf, uLen, 0);
+
+    return (n <= 0) ? -1 : n;
+}
+
+static int connSendAll(StubConnection_t *pxConn, const char *pBuf, size_t uLen)
+{
+    int n = 0;
+    size_t uSent = 0;
+
+    while (uSent < uLen)
+    {
+#if ENABLE_STUB_TLS
+        if (pxConn->bTls)
+        {
+            n = mbedtls_ssl_write(&pxConn->xSsl, (const unsigned char *)pBuf + uSent, uLen - uSent);
+            if (n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                continue;
+            }
+        }
+        else
+#endif /* ENABLE_STUB_TLS */
+        {
+            n = send(pxConn->xSockFd, pBuf + uSent, uLen - uSent, MSG_NOSIGNAL);
+        }
+
+        if (n <= 0)
+        {
+            return ERRNO_FAIL;
+        }
+        uSent += n;
+    }
+
+    return ERRNO_NONE;
+}
+
+static int sendJsonResponse(StubConnection_t *pxConn, const char *pJson)
+{
+    char pHeader[256];
+    int iHeaderLen = snprintf(pHeader, sizeof(pHeader),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              strlen(pJson));
+
+    if (connSendAll(pxConn, pHeader, iHeaderLen) != ERRNO_NONE || connSendAll(pxConn, pJson, strlen(pJson)) != ERRNO_NONE)
+    {
+        return ERRNO_FAIL;
+    }
+
+    return ERRNO_NONE;
+}
+
+static int sendAckChunk(StubConnection_t *pxConn, const PendingAck_t *pxAck)
+{
+    static const char *pcEventNames[] = {"BUFFERING", "RECEIVED", "PERSISTED"};
+    char pEvent[256];
+    char pChunk[300];
+    int iEventLen = 0;
+    int iChunkLen = 0;
+
+    iEventLen = snprintf(pEvent, sizeof(pEvent), "{\"EventType\":\"%s\",\"FragmentTimecode\":%" PRIu64 ",\"FragmentNumber\":\"%020" PRIu64 "\"}",
+                         pcEventNames[pxAck->eEvent], pxAck->uFragmentTimecode, pxAck->uFragmentNumber);
+    iChunkLen = snprintf(pChunk, sizeof(pChunk), "%x\r\n%s\r\n", iEventLen, pEvent);
+
+    return connSendAll(pxConn, pChunk, iChunkLen);
+}
+
+static void queueAck(StubConnection_t *pxConn, uint64_t uFragmentTimecode, uint64_t uFragmentNumber, AckEvent_t eEvent, uint32_t uDelayMs)
+{
+    PendingAck_t *pxAck = NULL;
+
+    if (pxConn->uPendingAckCount >= STUB_PENDING_ACK_MAX)
+    {
+        printf("ACK queue full, dropping event for fragment %" PRIu64 "\n", uFragmentTimecode);
+        return;
+    }
+
+    pxAck = &pxConn->pxPendingAcks[pxConn->uPendingAckCount++];
+    pxAck->uDueMs = getMonotonicTimestampInMs() + uDelayMs;
+    pxAck->uFragmentTimecode = uFragmentTimecode;
+    pxAck->uFragmentNumber = uFragmentNumber;
+    pxAck->eEvent = eEvent;
+}
+
+static int flushDueAcks(StubConnection_t *pxConn)
+{
+    uint64_t uNow = getMonotonicTimestampInMs();
+    size_t i = 0;
+    size_t uKept = 0;
+
+    for (i = 0; i < pxConn->uPendingAckCount; i++)
+    {
+        if (pxConn->pxPendingAcks[i].uDueMs <= uNow)
+        {
+            if (sendAckChunk(pxConn, &pxConn->pxPendingAcks[i]) != ERRNO_NONE)
+            {
+                return ERRNO_FAIL;
+            }
+        }
+        else
+        {
+            pxConn->pxPendingAcks[uKept++] = pxConn->pxPendingAcks[i];
+        }
+    }
+    pxConn->uPendingAckCount = uKept;
+
+    return ERRNO_NONE;
+}
+
+static void onFragmentStart(StubConnection_t *pxConn, uint64_t uFragmentTimecode)
+{
+    if (pxConn->bHasFragment)
+    {
+        queueAck(pxConn, pxConn->uCurrentFragmentTimecode, pxConn->uFragmentNumber, ACK_EVENT_RECEIVED, gStubConfig.uLatencyMs);
+        queueAck(pxConn, pxConn->uCurrentFragmentTimecode, pxConn->uFragmentNumber, ACK_EVENT_PERSISTED,
+                 gStubConfig.uLatencyMs + STUB_PERSIST_DELAY_MS);
+    }
+
+    pxConn->uFragmentNumber++;
+    queueAck(pxConn, uFragmentTimecode, pxConn->uFragmentNumber, ACK_EVENT_BUFFERING, gStubConfig.uLatencyMs);
+
+    pxConn->bHasFragment = true;
+    pxConn->uCurrentFragmentTimecode = uFragmentTimecode;
+    pxConn->uFragments++;
+}
+
+static void ebmlWalkerFeed(StubConnection_t *pxConn, const uint8_t *pData, size_t uLen)
+{
+    EbmlWalker_t *pxWalker = &pxConn->xWalker;
+    size_t i = 0;
+    uint8_t b = 0;
+    int iLen = 0;
+
+    while (i < uLen)
+    {
+        b = pData[i];
+
+        switch (pxWalker->eState)
+        {
+            case EBML_STATE_ID:
+                if (pxWalker->iIdRemaining == 0)
+                {
+                    for (iLen = 1; iLen <= 4 && !(b & (0x80 >> (iLen - 1))); iLen++)
+                        ;
+                    pxWalker->uId = b;
+                    pxWalker->iIdRemaining = iLen - 1;
+                }
+                else
+                {
+                    pxWalker->uId = (pxWalker->uId << 8) | b;
+                    pxWalker->iIdRemaining--;
+                }
+                if (pxWalker->iIdRemaining == 0)
+                {
+                    pxWalker->eState = EBML_STATE_SIZE;
+                    pxWalker->iSizeLen = 0;
+                }
+                i++;
+                break;
+
+            case EBML_STATE_SIZE:
+                if (pxWalker->iSizeLen == 0)
+                {
+                    for (iLen = 1; iLen <= 8 && !(b & (0x80 >> (iLen - 1))); iLen++)
+                        ;
+                    pxWalker->iSizeLen = iLen;
+                    pxWalker->iSizeRemaining = iLen - 1;
+                    pxWalker->uSize = (iLen < 8) ? (b & (0xFF >> iLen)) : 0;
+                }
+                else
+                {
+                    pxWalker->uSize = (pxWalker->uSize << 8) | b;
+                    pxWalker->iSizeRemaining--;
+                }
+                i++;
+                if (pxWalker->iSizeRemaining == 0)
+                {
+                    if (pxWalker->uId == MKV_ELEMENT_ID_SEGMENT || pxWalker->uId == MKV_ELEMENT_ID_CLUSTER)
+                    {
+                        /* Master elements (possibly of unknown size) are entered instead of skipped. */
+                        pxWalker->eState = EBML_STATE_ID;
+                    }
+                    else if (pxWalker->uId == MKV_ELEMENT_ID_CLUSTER_TIMECODE && pxWalker->uSize > 0 && pxWalker->uSize <= 8)
+                    {
+                        pxWalker->uValue = 0;
+                        pxWalker->uRemaining = pxWalker->uSize;
+                        pxWalker->eState = EBML_STATE_VALUE;
+                    }
+                    else
+                    {
+                        pxWalker->uRemaining = pxWalker->uSize;
+                        pxWalker->eState = (pxWalker->uRemaining > 0) ? EBML_STATE_SKIP : EBML_STATE_ID;
+                    }
+                }
+                break;
+
+            case EBML_STATE_VALUE:
+                pxWalker->uValue = (pxWalker->uValue << 8) | b;
+                i++;
+                if (--pxWalker->uRemaining == 0)
+                {
+                    onFragmentStart(pxConn, pxWalker->uValue);
+                    pxWalker->eState = EBML_STATE_ID;
+                }
+                break;
+
+            case EBML_STATE_SKIP:
+                if ((uint64_t)(uLen - i) >= pxWalker->uRemaining)
+                {
+                    i += (size_t)pxWalker->uRemaining;
+                    pxWalker->uRemaining = 0;
+                    pxWalker->eState = EBML_STATE_ID;
+                }
+                else
+                {
+                    pxWalker->uRemaining -= (uLen - i);
+                    i = uLen;
+                }
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Apply uplink shaping to a batch of received bytes.
+ *
+ * The bandwidth limit is a token bucket refilled at the configured rate, and loss is modelled as a retransmission
+ * stall on the received batch. ACKs keep flowing while the reader is stalled.
+ */
+static int shapeReceived(StubConnection_t *pxConn, size_t uLen)
+{
+    uint64_t uReadyMs = 0;
+
+    pxConn->uShapedBytes += uLen;
+
+    if (gStubConfig.uLossPermyriad > 0 && (uint32_t)(rand() % 10000) < gStubConfig.uLossPermyriad)
+    {
+        uReadyMs = getMonotonicTimestampInMs() + gStubConfig.uLossStallMs;
+        while (getMonotonicTimestampInMs() < uReadyMs)
+        {
+            if (flushDueAcks(pxConn) != ERRNO_NONE)
+            {
+                return ERRNO_FAIL;
+            }
+            sleepMs(STUB_POLL_INTERVAL_MS);
+        }
+    }
+
+    if (gStubConfig.uBandwidthKbps > 0)
+    {
+        uReadyMs = pxConn->uShapeStartMs + (pxConn->uShapedBytes * 8ULL) / gStubConfig.uBandwidthKbps;
+        while (getMonotonicTimestampInMs() < uReadyMs)
+        {
+            if (flushDueAcks(pxConn) != ERRNO_NONE)
+            {
+                return ERRNO_FAIL;
+            }
+            sleepMs(STUB_POLL_INTERVAL_MS);
+        }
+    }
+
+    return ERRNO_NONE;
+}
+
+/**
+ * @brief Consume a chunked PutMedia body, feeding the de-chunked payload into the EBML walker.
+ *
+ * @param[in] pxConn Connection
+ * @param[in] pPrefix Body bytes that were already read together with the request header
+ * @param[in] uPrefixLen Length of pPrefix
+ * @return 0 on success, non-zero value otherwise
+ */
+static int handlePutMedia(StubConnection_t *pxConn, const uint8_t *pPrefix, size_t uPrefixLen)
+{
+    int res = ERRNO_NONE;
+    uint8_t *pBuf = NULL;
+    size_t uBufLen = 0;
+    size_t uOffset = 0;
+    uint64_t uChunkRemaining = 0;
+    bool bInChunkData = false;
+    bool bEndOfBody = false;
+    char *pEnd = NULL;
+    int n = 0;
+    static const char pcResponseHeader[] = "HTTP/1.1 200 OK\r\n"
+                                           "Content-Type: application/json\r\n"
+                                           "Transfer-Encoding: chunked\r\n\r\n";
+
+    if ((pBuf = (uint8_t *)malloc(STUB_RECV_BUFFER_SIZE)) == NULL)
+    {
+        printf("OOM: PutMedia buffer\n");
+        return ERRNO_FAIL;
+    }
+
+    if (uPrefixLen > STUB_RECV_BUFFER_SIZE)
+    {
+        uPrefixLen = STUB_RECV_BUFFER_SIZE;
+    }
+    memcpy(pBuf, pPrefix, uPrefixLen);
+    uBufLen = uPrefixLen;
+    pxConn->uShapeStartMs = getMonotonicTimestampInMs();
+
+    if (connSendAll(pxConn, pcResponseHeader, sizeof(pcResponseHeader) - 1) != ERRNO_NONE)
+    {
+        res = ERRNO_FAIL;
+    }
+
+    while (res == ERRNO_NONE && !bEndOfBody && !gStopRunning)
+    {
+        /* Parse whatever is buffered. */
+        while (uOffset < uBufLen)
+        {
+            if (bInChunkData)
+            {
+                size_t uTake = uBufLen - uOffset;
+                if ((uint64_t)uTake > uChunkRemaining)
+                {
+                    uTake = (size_t)uChunkRemaining;
+                }
+                ebmlWalkerFeed(pxConn, pBuf + uOffset, uTake);
+                pxConn->uBodyBytes += uTake;
+                uOffset += uTake;
+                uChunkRemaining -= uTake;
+                if (uChunkRemaining == 0)
+                {
+                    bInChunkData = false;
+                }
+            }
+            else
+            {
+                /* Chunk header: "<hex>[;ext]\r\n", or the CRLF closing the previous chunk. */
+                pEnd = memchr(pBuf + uOffset, '\n', uBufLen - uOffset);
+                if (pEnd == NULL)
+                {
+                    break;
+                }
+                if ((uint8_t *)pEnd - (pBuf + uOffset) <= 1)
+                {
+                    uOffset = (uint8_t *)pEnd - pBuf + 1;
+                    continue;
+                }
+                uChunkRemaining = strtoull((const char *)pBuf + uOffset, NULL, 16);
+                uOffset = (uint8_t *)pEnd - pBuf + 1;
+                if (uChunkRemaining == 0)
+                {
+                    bEndOfBody = true;
+                    break;
+                }
+                bInChunkData = true;
+            }
+        }
+
+        if (bEndOfBody)
+        {
+            break;
+        }
+
+        /* Compact the buffer and read more. */
+        memmove(pBuf, pBuf + uOffset, uBufLen - uOffset);
+        uBufLen -= uOffset;
+        uOffset = 0;
+
+        if ((n = connRecv(pxConn, pBuf + uBufLen, STUB_RECV_BUFFER_SIZE - uBufLen)) < 0)
+        {
+            break;
+        }
+        else if (n > 0)
+        {
+            uBufLen += n;
+            res = shapeReceived(pxConn, n);
+        }
+
+        if (res == ERRNO_NONE)
+        {
+            res = flushDueAcks(pxConn);
+        }
+    }
+
+    /* The last fragment is complete once the body ends. */
+    if (res == ERRNO_NONE && pxConn->bHasFragment)
+    {
+        queueAck(pxConn, pxConn->uCurrentFragmentTimecode, pxConn->uFragmentNumber, ACK_EVENT_RECEIVED, gStubConfig.uLatencyMs);
+        queueAck(pxConn, pxConn->uCurrentFragmentTimecode, pxConn->uFragmentNumber, ACK_EVENT_PERSISTED,
+                 gStubConfig.uLatencyMs + STUB_PERSIST_DELAY_MS);
+        while (res == ERRNO_NONE && pxConn->uPendingAckCount > 0 && !gStopRunning)
+        {
+            sleepMs(STUB_POLL_INTERVAL_MS);
+            res = flushDueAcks(pxConn);
+        }
+        if (res == ERRNO_NONE)
+        {
+            res = connSendAll(pxConn, "0\r\n\r\n", 5);
+        }
+    }
+
+    printf("PutMedia closed, body:%" PRIu64 " bytes, fragments:%" PRIu64 "\n", pxConn->uBodyBytes, pxConn->uFragments);
+
+    free(pBuf);
+
+    return res;
+}
+
+static void *connectionThread(void *arg)
+{
+    StubConnection_t *pxConn = (StubConnection_t *)arg;
+    char pHeader[STUB_HEADER_BUFFER_SIZE + 1];
+    size_t uHeaderLen = 0;
+    char *pHeaderEnd = NULL;
+    char pJson[512];
+    int n = 0;
+    static const char pcNotFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+#if ENABLE_STUB_TLS
+    if (pxConn->bTls)
+    {
+        while ((n = mbedtls_ssl_handshake(&pxConn->xSsl)) != 0)
+        {
+            if (n != MBEDTLS_ERR_SSL_WANT_READ && n != MBEDTLS_ERR_SSL_WANT_WRITE)
+            {
+                printf("TLS handshake failed, err:-%X\n", -n);
+                goto cleanup;
+            }
+        }
+    }
+#endif /* ENABLE_STUB_TLS */
+
+    /* Read the request header. Anything after it belongs to the body. */
+    while (pHeaderEnd == NULL && uHeaderLen < STUB_HEADER_BUFFER_SIZE && !gStopRunning)
+    {
+        if ((n = connRecv(pxConn, (uint8_t *)pHeader + uHeaderLen, STUB_HEADER_BUFFER_SIZE - uHeaderLen)) < 0)
+        {
+            goto cleanup;
+        }
+        uHeaderLen += n;
+        pHeader[uHeaderLen] = '\0';
+        pHeaderEnd = strstr(pHeader, "\r\n\r\n");
+    }
+
+    if (pHeaderEnd == NULL)
+    {
+        printf("Malformed request header\n");
+        goto cleanup;
+    }
+    pHeaderEnd += 4;
+
+    if (strncmp(pHeader, "POST /putMedia", 14) == 0)
+    {
+        handlePutMedia(pxConn, (const uint8_t *)pHeaderEnd, uHeaderLen - (pHeaderEnd - pHeader));
+    }
+    else if (strncmp(pHeader, "POST /describeStream", 20) == 0)
+    {
+        snprintf(pJson, sizeof(pJson),
+                 "{\"StreamInfo\":{\"CreationTime\":0,\"DataRetentionInHours\":2,\"DeviceName\":null,\"KmsKeyId\":null,"
+                 "\"MediaType\":\"video/h264\",\"Status\":\"ACTIVE\",\"StreamARN\":\"%s\",\"StreamName\":\"stub\",\"Version\":\"0\"}}",
+                 STUB_STREAM_ARN);
+        sendJsonResponse(pxConn, pJson);
+    }
+    else if (strncmp(pHeader, "POST /createStream", 18) == 0)
+    {
+        snprintf(pJson, sizeof(pJson), "{\"StreamARN\":\"%s\"}", STUB_STREAM_ARN);
+        sendJsonResponse(pxConn, pJson);
+    }
+    else if (strncmp(pHeader, "POST /getDataEndpoint", 21) == 0)
+    {
+        /* Point PutMedia back to the port the stub listens on, so it doesn't have to take 443 */
+        snprintf(pJson, sizeof(pJson), "{\"DataEndpoint\":\"https://127.0.0.1:%u\"}", gStubConfig.uPort);
+        sendJsonResponse(pxConn, pJson);
+    }
+    else
+    {
+        connSendAll(pxConn, pcNotFound, sizeof(pcNotFound) - 1);
+    }
+
+cleanup:
+#if ENABLE_STUB_TLS
+    if (pxConn->bTls)
+    {
+        mbedtls_ssl_close_notify(&pxConn->xSsl);
+        mbedtls_ssl_free(&pxConn->xSsl);
+    }
+#endif /* ENABLE_STUB_TLS */
+    close(pxConn->xSockFd);
+    free(pxConn);
+
+    return NULL;
+}
+
+#if ENABLE_STUB_TLS
+static int initTls(void)
+{
+    int res = ERRNO_NONE;
+    int ret = 0;
+
+    mbedtls_ssl_config_init(&gSslConf);
+    mbedtls_x509_crt_init(&gSrvCert);
+    mbedtls_pk_init(&gSrvKey);
+    mbedtls_entropy_init(&gEntropy);
+    mbedtls_ctr_drbg_init(&gCtrDrbg);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&gCtrDrbg, mbedtls_entropy_func, &gEntropy, NULL, 0)) != 0)
+    {
+        printf("Failed to seed DRBG, err:-%X\n", -ret);
+        res = ERRNO_FAIL;
+    }
+    else if ((ret = mbedtls_x509_crt_parse_file(&gSrvCert, gStubConfig.pCertPath)) != 0)
+    {
+        printf("Failed to load certificate %s, err:-%X\n", gStubConfig.pCertPath, -ret);
+        res = ERRNO_FAIL;
+    }
+    else if ((ret = mbedtls_pk_parse_keyfile(&gSrvKey, gStubConfig.pKeyPath, NULL)) != 0)
+    {
+        printf("Failed to load private key %s, err:-%X\n", gStubConfig.pKeyPath, -ret);
+        res = ERRNO_FAIL;
+    }
+    else if ((ret = mbedtls_ssl_config_defaults(&gSslConf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+    {
+        printf("Failed to set TLS defaults, err:-%X\n", -ret);
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        mbedtls_ssl_conf_rng(&gSslConf, mbedtls_ctr_drbg_random, &gCtrDrbg);
+        if ((ret = mbedtls_ssl_conf_own_cert(&gSslConf, &gSrvCert, &gSrvKey)) != 0)
+        {
+            printf("Failed to set own certificate, err:-%X\n", -ret);
+            res = ERRNO_FAIL;
+        }
+    }
+
+    return res;
+}
+
+static void deinitTls(void)
+{
+    mbedtls_x509_crt_free(&gSrvCert);
+    mbedtls_pk_free(&gSrvKey);
+    mbedtls_ssl_config_free(&gSslConf);
+    mbedtls_ctr_drbg_free(&gCtrDrbg);
+    mbedtls_entropy_free(&gEntropy);
+}
+#endif /* ENABLE_STUB_TLS */
+
+static void printUsage(const char *pProgram)
+{
+    printf("Usage: %s [-p port] [-b bandwidth_kbps] [-d ack_latency_ms] [-l loss_percent] [-s loss_stall_ms] [-c cert.pem -k key.pem]\n", pProgram);
+}
+
+static int parseArgs(int argc, char *argv[])
+{
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "p:b:d:l:s:c:k:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                gStubConfig.uPort = (uint16_t)atoi(optarg);
+                break;
+            case 'b':
+                gStubConfig.uBandwidthKbps = (uint32_t)atoi(optarg);
+                break;
+            case 'd':
+                gStubConfig.uLatencyMs = (uint32_t)atoi(optarg);
+                break;
+            case 'l':
+                gStubConfig.uLossPermyriad = (uint32_t)(atof(optarg) * 100);
+                break;
+            case 's':
+                gStubConfig.uLossStallMs = (uint32_t)atoi(optarg);
+                break;
+            case 'c':
+                gStubConfig.pCertPath = optarg;
+                break;
+            case 'k':
+                gStubConfig.pKeyPath = optarg;
+                break;
+            default:
+                printUsage(argv[0]);
+                return ERRNO_FAIL;
+        }
+    }
+
+    if ((gStubConfig.pCertPath == NULL) != (gStubConfig.pKeyPath == NULL))
+    {
+        printf("Both -c and -k are required for TLS\n");
+        return ERRNO_FAIL;
+    }
+
+#if !ENABLE_STUB_TLS
+    if (gStubConfig.pCertPath != NULL)
+    {
+        printf("TLS is not enabled in this build\n");
+        return ERRNO_FAIL;
+    }
+#endif /* !ENABLE_STUB_TLS */
+
+    return ERRNO_NONE;
+}
+
+int main(int argc, char *argv[])
+{
+    int res = ERRNO_NONE;
+    int xListenFd = -1;
+    int xClientFd = -1;
+    int iReuse = 1;
+    struct sockaddr_in xAddr = {0};
+    pthread_t tid;
+    StubConnection_t *pxConn = NULL;
+#ifdef HAVE_SIGNAL_H
+    struct sigaction xSigAction = {0};
+#endif /* HAVE_SIGNAL_H */
+
+    if (parseArgs(argc, argv) != ERRNO_NONE)
+    {
+        return ERRNO_FAIL;
+    }
+
+#ifdef HAVE_SIGNAL_H
+    /* Without SA_RESTART, accept() returns EINTR and the loop sees the stop flag right away */
+    xSigAction.sa_handler = signalHandler;
+    sigemptyset(&xSigAction.sa_mask);
+    xSigAction.sa_flags = 0;
+    sigaction(SIGINT, &xSigAction, NULL);
+    signal(SIGPIPE, SIG_IGN);
+#endif /* HAVE_SIGNAL_H */
+
+#if ENABLE_STUB_TLS
+    if (gStubConfig.pCertPath != NULL && initTls() != ERRNO_NONE)
+    {
+        deinitTls();
+        return ERRNO_FAIL;
+    }
+#endif /* ENABLE_STUB_TLS */
+
+    xAddr.sin_family = AF_INET;
+    xAddr.sin_port = htons(gStubConfig.uPort);
+    xAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((xListenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        printf("Failed to create socket, errno:%d\n", errno);
+        res = ERRNO_FAIL;
+    }
+    else if (setsockopt(xListenFd, SOL_SOCKET, SO_REUSEADDR, &iReuse, sizeof(iReuse)) != 0 ||
+             bind(xListenFd, (struct sockaddr *)&xAddr, sizeof(xAddr)) != 0 || listen(xListenFd, 8) != 0)
+    {
+        printf("Failed to listen on 127.0.0.1:%u, errno:%d\n", gStubConfig.uPort, errno);
+        res = ERRNO_FAIL;
+    }
+    else
+    {
+        printf("PutMedia stub listening on 127.0.0.1:%u (%s), bandwidth:%u kbps, latency:%u ms, loss:%u.%02u%%\n", gStubConfig.uPort,
+               gStubConfig.pCertPath ? "https" : "http", gStubConfig.uBandwidthKbps, gStubConfig.uLatencyMs, gStubConfig.uLossPermyriad / 100,
+               gStubConfig.uLossPermyriad % 100);
+
+        while (!gStopRunning)
+        {
+            if ((xClientFd = accept(xListenFd, NULL, NULL)) < 0)
+            {
+                continue;
+            }
+
+            if ((pxConn = (StubConnection_t *)calloc(1, sizeof(StubConnection_t))) == NULL)
+            {
+                printf("OOM: connection\n");
+                close(xClientFd);
+                continue;
+            }
+            pxConn->xSockFd = xClientFd;
+
+#if ENABLE_STUB_TLS
+            if (gStubConfig.pCertPath != NULL)
+            {
+                pxConn->bTls = true;
+                pxConn->xNet.fd = xClientFd;
+                mbedtls_ssl_init(&pxConn->xSsl);
+                if (mbedtls_ssl_setup(&pxConn->xSsl, &gSslConf) != 0)
+                {
+                    printf("Failed to setup TLS session\n");
+                    mbedtls_ssl_free(&pxConn->xSsl);
+                    close(xClientFd);
+                    free(pxConn);
+                    continue;
+                }
+                mbedtls_ssl_set_bio(&pxConn->xSsl, &pxConn->xNet, mbedtls_net_send, mbedtls_net_recv, NULL);
+            }
+#endif /* ENABLE_STUB_TLS */
+
+            if (pthread_create(&tid, NULL, connectionThread, pxConn) != 0)
+            {
+                printf("Failed to create connection thread\n");
+#if ENABLE_STUB_TLS
+                if (pxConn->bTls)
+                {
+                    mbedtls_ssl_free(&pxConn->xSsl);
+                }
+#endif /* ENABLE_STUB_TLS */
+                close(xClientFd);
+                free(pxConn);
+            }
+            else
+            {
+                pthread_detach(tid);
+            }
+        }
+    }
+
+    if (xListenFd >= 0)
+    {
+        close(xListenFd);
+    }
+
+#if ENABLE_STUB_TLS
+    if (gStubConfig.pCertPath != NULL)
+    {
+        deinitTls();
+    }
+#endif /* ENABLE_STUB_TLS */
+
+    return res;
+}
@@ -35,7 +35,9 @@
 #define ENABLE_AUDIO_TRACK              1
 #define ENABLE_IOT_CREDENTIAL           0
 #define ENABLE_RING_BUFFER_MEM_LIMIT    1
-#define DEBUG_STORE_MEDIA_TO_FILE       0
+#define ENABLE_MKV_RECORDER             0
+#define ENABLE_DISK_SPILLOVER           0
+#define ENABLE_METRICS_EXPORT           0
 /* Video configuration */
 #define VIDEO_TRACK_NAME                "kvs video track"
 
@@ -61,6 +63,15 @@
 #define AUDIO_TRACK_NAME                "kvs audio track"
 #define AUDIO_FREQUENCY                 8000
 #define AUDIO_CHANNEL_NUMBER            1
+
+/* Interleave video and audio frames by timestamp before they're added to KvsApp. It's only defined with
+ * ENABLE_AUDIO_TRACK, there is nothing to interleave with the video alone. */
+#define ENABLE_AV_INTERLEAVER           0
+#if ENABLE_AV_INTERLEAVER
+#define INTERLEAVER_WINDOW_MS           200
+#define INTERLEAVER_MAX_FRAMES          64
+#define INTERLEAVER_STARTUP_TIMEOUT_MS  2000
+#endif /* ENABLE_AV_INTERLEAVER */
 #endif /* ENABLE_AUDIO_TRACK */
 
 /* IoT credential configuration */
@@ -90,6 +101,33 @@
 #define RING_BUFFER_MEM_LIMIT           (2 * 1024 * 1024)
 #endif /* ENABLE_RING_BUFFER_MEM_LIMIT */
 
+#if ENABLE_DISK_SPILLOVER
+/* Frames are spilled to disk once the stream buffer reaches this size, so it has to be less than the ring buffer limit. */
+#if ENABLE_RING_BUFFER_MEM_LIMIT
+#define SPILLOVER_MEM_THRESHOLD         (RING_BUFFER_MEM_LIMIT * 3 / 4)
+#else
+#define SPILLOVER_MEM_THRESHOLD         (1536 * 1024)
+#endif
+/* Live frames kept in memory while spilling, the oldest fragments beyond it go to disk. */
+#define SPILLOVER_MEM_QUEUE_SIZE        (512 * 1024)
+#define SPILLOVER_DIR                   "."
+#define SPILLOVER_FILE_SIZE             (16 * 1024 * 1024)
+#define SPILLOVER_MAX_DISK_SIZE         (1024ULL * 1024 * 1024)
+/* Maximum rate of spilled frames sent after reconnection. It must be higher than the bitrate of live frames to catch up. */
+#define SPILLOVER_CATCH_UP_RATE         (512 * 1024)
+/* Spilled frames are written by a background thread, this is how much of them can wait for the disk. */
+#define SPILLOVER_WRITE_QUEUE_SIZE      (1024 * 1024)
+/* KvsApp is reopened with an exponential backoff up to this delay while the network is down. */
+#define SPILLOVER_RECONNECT_MAX_DELAY_SEC   (60)
+#endif /* ENABLE_DISK_SPILLOVER */
+
+#if ENABLE_METRICS_EXPORT
+/* Connect to the socket to get a snapshot of the metrics, send 'b' first to get it in binary format. */
+#define METRICS_SOCKET_PATH             "/tmp/kvsproducer-metrics.sock"
+/* A text snapshot is written to this file on SIGUSR1. */
+#define METRICS_SNAPSHOT_PATH           "kvsproducer-metrics.txt"
+#endif /* ENABLE_METRICS_EXPORT */
+
 #ifdef KVS_USE_POOL_ALLOCATOR
 
 /**
@@ -118,10 +156,15 @@
 
 #endif /* KVS_USE_POOL_ALLOCATOR */
 
-/* Debug configuration */
-#if DEBUG_STORE_MEDIA_TO_FILE
-/* Store MKV content in a file with timestamp in its filename. */
-#define MEDIA_FILENAME_FORMAT                  "video_%" PRIu64 ".mkv"
-#endif /* DEBUG_STORE_MEDIA_TO_FILE */
+#if ENABLE_MKV_RECORDER
+/* Store the uploaded MKV stream locally as segments named by the timecode of their first cluster. */
+#define MKV_RECORDER_DIR                    "."
+#define MKV_RECORDER_SEGMENT_DURATION_SEC   (5 * 60)    /* Rotate every 5 minutes, 0 to disable */
+#define MKV_RECORDER_SEGMENT_GOPS           0           /* Rotate every N GOPs, 0 to disable */
+#define MKV_RECORDER_PREALLOCATE_SIZE       (64 * 1024 * 1024)
+#define MKV_RECORDER_QUEUE_SIZE             (512 * 1024)
+#define MKV_RECORDER_WRITE_BATCH_SIZE       (64 * 1024)
+#define MKV_RECORDER_SYNC_INTERVAL_MS       5000
+#endif /* ENABLE_MKV_RECORDER */
 
 #endif /* SAMPLE_CONFIG_H */
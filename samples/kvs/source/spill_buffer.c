@@ -0,0 +1,827 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spill_buffer.h"
+
+#define ERRNO_NONE 0
+#define ERRNO_FAIL __LINE__
+
+#define SPILL_PATH_MAX        (256)
+#define SPILL_FILENAME_FORMAT "spill_%010u.log"
+#define SPILL_RECORD_MAGIC    (0x4B565346) /* "KVSF" */
+
+#define H264_NALU_TYPE_IDR (5)
+#define H264_NALU_TYPE_SPS (7)
+
+/* Every frame in the log is stored as a record header followed by the frame data. */
+typedef struct
+{
+    uint32_t uMagic;
+    uint32_t uDataLen;
+    uint64_t uTimestamp;
+    uint32_t uTrackType;
+    uint32_t uReserved;
+} SpillRecordHeader_t;
+
+/* A spilled frame waiting in memory or for the writer thread. */
+typedef struct SpillQueueEntry
+{
+    struct SpillQueueEntry *pNext;
+    uint8_t *pData;
+    size_t uDataLen;
+    uint64_t uTimestamp;
+    TrackType_t xTrackType;
+    bool bKeyFrame;
+} SpillQueueEntry_t;
+
+struct SpillBuffer
+{
+    SpillBufferConfig_t xConfig;
+
+    /* Guards the spilling state and the write queue. The capture threads only hold it to enqueue a frame. */
+    pthread_mutex_t xLock;
+    pthread_cond_t xCond;
+    pthread_t writerTid;
+    bool bWriterStarted;
+    bool bStop;
+
+    /* Once spilling starts, every frame goes through the memory queue until the log and the memory queue are drained. */
+    bool bSpilling;
+
+    /* Live frames are kept here while spilling, the oldest fragments go to the log once it's over uMemQueueSize. */
+    SpillQueueEntry_t *pMemHead;
+    SpillQueueEntry_t *pMemTail;
+    size_t uMemSize;
+
+    SpillQueueEntry_t *pQueueHead;
+    SpillQueueEntry_t *pQueueTail;
+    size_t uQueueSize;
+    /* The frame taken by the writer thread is neither in the queue nor readable from the log yet. */
+    bool bWriting;
+    /* Video frames are dropped up to the next key frame once one was dropped because the queue was full. */
+    bool bDropUntilKeyFrame;
+    uint64_t uQueueDropped;
+
+    /* Guards the log files and the statistics. It's taken before xLock when both are needed. */
+    pthread_mutex_t xFileLock;
+
+    /* Log files in [uReadSeq, uWriteSeq] are pending. */
+    unsigned int uReadSeq;
+    unsigned int uWriteSeq;
+    FILE *fpWrite;
+    size_t uWriteFileSize;
+    FILE *fpRead;
+    bool bHasHeader;
+    SpillRecordHeader_t xHeader;
+
+    int64_t iTokens;
+    uint64_t uLastRefillMs;
+    /* Set when KvsApp refused a drained frame, the frame is kept until SpillBuffer_resume is called. */
+    bool bDrainBlocked;
+
+    SpillBufferStats_t xStats;
+};
+
+typedef struct SpillBuffer SpillBuffer_t;
+
+static uint64_t getMonotonicTimestampInMs(void)
+{
+    struct timespec xTs;
+
+    clock_gettime(CLOCK_MONOTONIC, &xTs);
+
+    return (uint64_t)xTs.tv_sec * 1000ULL + (uint64_t)xTs.tv_nsec / 1000000ULL;
+}
+
+static bool isKeyFrame(const uint8_t *pData, size_t uLen)
+{
+    size_t i = 0;
+    uint8_t uNaluType = 0;
+
+    for (i = 0; i + 3 < uLen; i++)
+    {
+        if (pData[i] == 0x00 && pData[i + 1] == 0x00 && pData[i + 2] == 0x01)
+        {
+            uNaluType = pData[i + 3] & 0x1F;
+            if (uNaluType == H264_NALU_TYPE_IDR || uNaluType == H264_NALU_TYPE_SPS)
+            {
+                return true;
+            }
+            i += 2;
+        }
+    }
+
+    return false;
+}
+
+static void getLogPath(SpillBuffer_t *pxSpill, unsigned int uSeq, char *pPath, size_t uPathSize)
+{
+    snprintf(pPath, uPathSize, "%s/" SPILL_FILENAME_FORMAT, pxSpill->xConfig.pDirectory, uSeq);
+}
+
+static void removeLogFile(SpillBuffer_t *pxSpill, unsigned int uSeq)
+{
+    char pPath[SPILL_PATH_MAX];
+    struct stat xStat;
+
+    getLogPath(pxSpill, uSeq, pPath, sizeof(pPath));
+    if (stat(pPath, &xStat) == 0)
+    {
+        pxSpill->xStats.uDiskUsage -= ((uint64_t)xStat.st_size < pxSpill->xStats.uDiskUsage) ? (uint64_t)xStat.st_size : pxSpill->xStats.uDiskUsage;
+        unlink(pPath);
+    }
+}
+
+static void recoverLogFiles(SpillBuffer_t *pxSpill)
+{
+    DIR *pDir = NULL;
+    struct dirent *pEntry = NULL;
+    struct stat xStat;
+    char pPath[SPILL_PATH_MAX];
+    unsigned int uSeq = 0;
+    bool bFound = false;
+
+    if ((pDir = opendir(pxSpill->xConfig.pDirectory)) == NULL)
+    {
+        printf("Failed to open spill directory %s\n", pxSpill->xConfig.pDirectory);
+        return;
+    }
+
+    while ((pEntry = readdir(pDir)) != NULL)
+    {
+        if (sscanf(pEntry->d_name, SPILL_FILENAME_FORMAT, &uSeq) != 1)
+        {
+            continue;
+        }
+        getLogPath(pxSpill, uSeq, pPath, sizeof(pPath));
+        if (stat(pPath, &xStat) != 0)
+        {
+            continue;
+        }
+        if (!bFound || uSeq < pxSpill->uReadSeq)
+        {
+            pxSpill->uReadSeq = uSeq;
+        }
+        if (!bFound || uSeq >= pxSpill->uWriteSeq)
+        {
+            pxSpill->uWriteSeq = uSeq + 1;
+        }
+        pxSpill->xStats.uDiskUsage += (uint64_t)xStat.st_size;
+        bFound = true;
+    }
+    closedir(pDir);
+
+    if (bFound)
+    {
+        pxSpill->bSpilling = true;
+        printf("Recovered %" PRIu64 " bytes of spilled frames in %s\n", pxSpill->xStats.uDiskUsage, pxSpill->xConfig.pDirectory);
+    }
+}
+
+/**
+ * @brief Discard the oldest log file to make room for new frames. Log files start with key frames, so complete
+ * fragments are discarded.
+ */
+static int discardOldestLogFile(SpillBuffer_t *pxSpill)
+{
+    if (pxSpill->uReadSeq >= pxSpill->uWriteSeq)
+    {
+        return ERRNO_FAIL;
+    }
+
+    if (pxSpill->fpRead != NULL)
+    {
+        fclose(pxSpill->fpRead);
+        pxSpill->fpRead = NULL;
+    }
+    pxSpill->bHasHeader = false;
+    removeLogFile(pxSpill, pxSpill->uReadSeq);
+    pxSpill->uReadSeq++;
+    pxSpill->xStats.uFilesDiscarded++;
+
+    return ERRNO_NONE;
+}
+
+static int appendFrame(SpillBuffer_t *pxSpill, const uint8_t *pData, size_t uDataLen, uint64_t uTimestamp, TrackType_t xTrackType)
+{
+    char pPath[SPILL_PATH_MAX];
+    SpillRecordHeader_t xHeader = {0};
+    size_t uRecordLen = sizeof(SpillRecordHeader_t) + uDataLen;
+
+    if (pxSpill->fpWrite != NULL && pxSpill->uWriteFileSize >= pxSpill->xConfig.uFileSize && xTrackType == TRACK_VIDEO &&
+        isKeyFrame(pData, uDataLen))
+    {
+        fclose(pxSpill->fpWrite);
+        pxSpill->fpWrite = NULL;
+        pxSpill->uWriteSeq++;
+    }
+
+    while (pxSpill->xStats.uDiskUsage + uRecordLen > pxSpill->xConfig.uMaxDiskSize)
+    {
+        if (discardOldestLogFile(pxSpill) != ERRNO_NONE)
+        {
+            pxSpill->xStats.uFramesDropped++;
+            return ERRNO_FAIL;
+        }
+    }
+
+    if (pxSpill->fpWrite == NULL)
+    {
+        getLogPath(pxSpill, pxSpill->uWriteSeq, pPath, sizeof(pPath));
+        if ((pxSpill->fpWrite = fopen(pPath, "ab")) == NULL)
+        {
+            printf("Failed to open spill file %s\n", pPath);
+            pxSpill->xStats.uFramesDropped++;
+            return ERRNO_FAIL;
+        }
+        pxSpill->uWriteFileSize = 0;
+    }
+
+    xHeader.uMagic = SPILL_RECORD_MAGIC;
+    xHeader.uDataLen = (uint32_t)uDataLen;
+    xHeader.uTimestamp = uTimestamp;
+    xHeader.uTrackType = (uint32_t)xTrackType;
+
+    if (fwrite(&xHeader, sizeof(SpillRecordHeader_t), 1, pxSpill->fpWrite) != 1 || fwrite(pData, 1, uDataLen, pxSpill->fpWrite) != uDataLen)
+    {
+        printf("Failed to write spill file\n");
+        pxSpill->xStats.uFramesDropped++;
+        return ERRNO_FAIL;
+    }
+
+    pxSpill->uWriteFileSize += uRecordLen;
+    pxSpill->xStats.uDiskUsage += uRecordLen;
+    pxSpill->xStats.uFramesSpilled++;
+
+    return ERRNO_NONE;
+}
+
+static void *writerThread(void *arg)
+{
+    SpillBuffer_t *pxSpill = (SpillBuffer_t *)arg;
+    SpillQueueEntry_t *pxEntry = NULL;
+
+    pthread_mutex_lock(&pxSpill->xLock);
+    while (true)
+    {
+        while (pxSpill->pQueueHead == NULL && !pxSpill->bStop)
+        {
+            pthread_cond_wait(&pxSpill->xCond, &pxSpill->xLock);
+        }
+
+        /* The frames still queued when stopping are written, so they are sent by the next run. */
+        if ((pxEntry = pxSpill->pQueueHead) == NULL)
+        {
+            break;
+        }
+        if ((pxSpill->pQueueHead = pxEntry->pNext) == NULL)
+        {
+            pxSpill->pQueueTail = NULL;
+        }
+        pxSpill->uQueueSize -= pxEntry->uDataLen;
+        pxSpill->bWriting = true;
+        pthread_mutex_unlock(&pxSpill->xLock);
+
+        pthread_mutex_lock(&pxSpill->xFileLock);
+        appendFrame(pxSpill, pxEntry->pData, pxEntry->uDataLen, pxEntry->uTimestamp, pxEntry->xTrackType);
+        pthread_mutex_unlock(&pxSpill->xFileLock);
+        free(pxEntry->pData);
+        free(pxEntry);
+
+        pthread_mutex_lock(&pxSpill->xLock);
+        pxSpill->bWriting = false;
+    }
+    pthread_mutex_unlock(&pxSpill->xLock);
+
+    return NULL;
+}
+
+/**
+ * @brief Hand a frame over to the writer thread, it's called with xLock held and takes the ownership of pData.
+ */
+static int enqueueFrame(SpillBuffer_t *pxSpill, uint8_t *pData, size_t uDataLen, uint64_t uTimestamp, TrackType_t xTrackType)
+{
+    SpillQueueEntry_t *pxEntry = NULL;
+
+    if (xTrackType == TRACK_VIDEO && pxSpill->bDropUntilKeyFrame)
+    {
+        if (!isKeyFrame(pData, uDataLen))
+        {
+            pxSpill->uQueueDropped++;
+            free(pData);
+            return ERRNO_FAIL;
+        }
+        pxSpill->bDropUntilKeyFrame = false;
+    }
+
+    if (pxSpill->uQueueSize + uDataLen > pxSpill->xConfig.uWriteQueueSize ||
+        (pxEntry = (SpillQueueEntry_t *)malloc(sizeof(SpillQueueEntry_t))) == NULL)
+    {
+        /* The disk can't keep up, the frames referencing this one are useless */
+        if (xTrackType == TRACK_VIDEO)
+        {
+            pxSpill->bDropUntilKeyFrame = true;
+        }
+        pxSpill->uQueueDropped++;
+        free(pData);
+        return ERRNO_FAIL;
+    }
+
+    pxEntry->pNext = NULL;
+    pxEntry->pData = pData;
+    pxEntry->uDataLen = uDataLen;
+    pxEntry->uTimestamp = uTimestamp;
+    pxEntry->xTrackType = xTrackType;
+    pxEntry->bKeyFrame = false;
+    if (pxSpill->pQueueTail == NULL)
+    {
+        pxSpill->pQueueHead = pxEntry;
+    }
+    else
+    {
+        pxSpill->pQueueTail->pNext = pxEntry;
+    }
+    pxSpill->pQueueTail = pxEntry;
+    pxSpill->uQueueSize += uDataLen;
+    pthread_cond_signal(&pxSpill->xCond);
+
+    return ERRNO_NONE;
+}
+
+static SpillQueueEntry_t *popMemFrame(SpillBuffer_t *pxSpill)
+{
+    SpillQueueEntry_t *pxEntry = pxSpill->pMemHead;
+
+    if (pxEntry != NULL)
+    {
+        if ((pxSpill->pMemHead = pxEntry->pNext) == NULL)
+        {
+            pxSpill->pMemTail = NULL;
+        }
+        pxSpill->uMemSize -= pxEntry->uDataLen;
+    }
+
+    return pxEntry;
+}
+
+/**
+ * @brief Move the oldest fragment of the memory queue, i.e. the frames up to the next key frame, to the writer thread.
+ * It's called with xLock held. If there is no other key frame in the queue, only the oldest frame is moved.
+ */
+static void spillOldestFragment(SpillBuffer_t *pxSpill)
+{
+    SpillQueueEntry_t *pxEntry = NULL;
+    SpillQueueEntry_t *pxNextKeyFrame = NULL;
+
+    for (pxEntry = pxSpill->pMemHead != NULL ? pxSpill->pMemHead->pNext : NULL; pxEntry != NULL; pxEntry = pxEntry->pNext)
+    {
+        if (pxEntry->bKeyFrame)
+        {
+            pxNextKeyFrame = pxEntry;
+            break;
+        }
+    }
+
+    do
+    {
+        if ((pxEntry = popMemFrame(pxSpill)) == NULL)
+        {
+            break;
+        }
+        // The writer thread will help to free pData
+        enqueueFrame(pxSpill, pxEntry->pData, pxEntry->uDataLen, pxEntry->uTimestamp, pxEntry->xTrackType);
+        free(pxEntry);
+    } while (pxNextKeyFrame != NULL && pxSpill->pMemHead != pxNextKeyFrame);
+}
+
+/**
+ * @brief Append a live frame to the memory queue, it's called with xLock held and takes the ownership of pData.
+ */
+static int addMemFrame(SpillBuffer_t *pxSpill, uint8_t *pData, size_t uDataLen, uint64_t uTimestamp, TrackType_t xTrackType)
+{
+    SpillQueueEntry_t *pxEntry = NULL;
+
+    if ((pxEntry = (SpillQueueEntry_t *)malloc(sizeof(SpillQueueEntry_t))) == NULL)
+    {
+        printf("OOM: pxEntry\n");
+        pxSpill->uQueueDropped++;
+        free(pData);
+        return ERRNO_FAIL;
+    }
+
+    pxEntry->pNext = NULL;
+    pxEntry->pData = pData;
+    pxEntry->uDataLen = uDataLen;
+    pxEntry->uTimestamp = uTimestamp;
+    pxEntry->xTrackType = xTrackType;
+    pxEntry->bKeyFrame = (xTrackType == TRACK_VIDEO && isKeyFrame(pData, uDataLen));
+    if (pxSpill->pMemTail == NULL)
+    {
+        pxSpill->pMemHead = pxEntry;
+    }
+    else
+    {
+        pxSpill->pMemTail->pNext = pxEntry;
+    }
+    pxSpill->pMemTail = pxEntry;
+    pxSpill->uMemSize += uDataLen;
+
+    while (pxSpill->uMemSize > pxSpill->xConfig.uMemQueueSize)
+    {
+        spillOldestFragment(pxSpill);
+    }
+
+    return ERRNO_NONE;
+}
+
+/**
+ * @brief Read the header of the next record in the log.
+ *
+ * @return true if a record is available, false if the log is empty
+ */
+static bool peekRecord(SpillBuffer_t *pxSpill)
+{
+    char pPath[SPILL_PATH_MAX];
+    long lOffset = 0;
+
+    while (!pxSpill->bHasHeader)
+    {
+        if (pxSpill->fpRead == NULL)
+        {
+            getLogPath(pxSpill, pxSpill->uReadSeq, pPath, sizeof(pPath));
+            if ((pxSpill->fpRead = fopen(pPath, "rb")) == NULL)
+            {
+                if (pxSpill->uReadSeq < pxSpill->uWriteSeq)
+                {
+                    pxSpill->uReadSeq++;
+                    continue;
+                }
+                return false;
+            }
+        }
+
+        if (pxSpill->uReadSeq == pxSpill->uWriteSeq && pxSpill->fpWrite != NULL)
+        {
+            fflush(pxSpill->fpWrite);
+        }
+
+        lOffset = ftell(pxSpill->fpRead);
+        if (fread(&pxSpill->xHeader, sizeof(SpillRecordHeader_t), 1, pxSpill->fpRead) == 1 && pxSpill->xHeader.uMagic == SPILL_RECORD_MAGIC)
+        {
+            pxSpill->bHasHeader = true;
+        }
+        else if (pxSpill->uReadSeq == pxSpill->uWriteSeq)
+        {
+            /* Caught up with the writer. */
+            clearerr(pxSpill->fpRead);
+            fseek(pxSpill->fpRead, lOffset, SEEK_SET);
+            return false;
+        }
+        else
+        {
+            /* End of a completed log file, or a record truncated by a crash. */
+            fclose(pxSpill->fpRead);
+            pxSpill->fpRead = NULL;
+            removeLogFile(pxSpill, pxSpill->uReadSeq);
+            pxSpill->uReadSeq++;
+        }
+    }
+
+    return true;
+}
+
+static void finishSpilling(SpillBuffer_t *pxSpill)
+{
+    if (pxSpill->fpRead != NULL)
+    {
+        fclose(pxSpill->fpRead);
+        pxSpill->fpRead = NULL;
+    }
+    if (pxSpill->fpWrite != NULL)
+    {
+        fclose(pxSpill->fpWrite);
+        pxSpill->fpWrite = NULL;
+    }
+    removeLogFile(pxSpill, pxSpill->uWriteSeq);
+    pxSpill->uWriteSeq++;
+    pxSpill->uReadSeq = pxSpill->uWriteSeq;
+    pxSpill->xStats.uDiskUsage = 0;
+    pxSpill->bSpilling = false;
+
+    printf("Spilled frames are drained\n");
+}
+
+SpillBufferHandle SpillBuffer_create(const SpillBufferConfig_t *pxConfig)
+{
+    SpillBuffer_t *pxSpill = NULL;
+
+    if (pxConfig == NULL || pxConfig->pDirectory == NULL || pxConfig->uCatchUpRate == 0 || pxConfig->uWriteQueueSize == 0)
+    {
+        printf("Invalid spill buffer configuration\n");
+    }
+    else if ((pxSpill = (SpillBuffer_t *)calloc(1, sizeof(SpillBuffer_t))) == NULL)
+    {
+        printf("OOM: pxSpill\n");
+    }
+    else
+    {
+        pxSpill->xConfig = *pxConfig;
+        pxSpill->iTokens = (int64_t)pxConfig->uCatchUpRate;
+        pxSpill->uLastRefillMs = getMonotonicTimestampInMs();
+        pthread_mutex_init(&pxSpill->xLock, NULL);
+        pthread_mutex_init(&pxSpill->xFileLock, NULL);
+        pthread_cond_init(&pxSpill->xCond, NULL);
+        recoverLogFiles(pxSpill);
+
+        if (pthread_create(&pxSpill->writerTid, NULL, writerThread, pxSpill) != 0)
+        {
+            printf("Failed to create spill writer thread\n");
+            SpillBuffer_terminate(pxSpill);
+            pxSpill = NULL;
+        }
+        else
+        {
+            pxSpill->bWriterStarted = true;
+        }
+    }
+
+    return pxSpill;
+}
+
+void SpillBuffer_terminate(SpillBufferHandle xSpillBufferHandle)
+{
+    SpillBuffer_t *pxSpill = xSpillBufferHandle;
+    SpillQueueEntry_t *pxEntry = NULL;
+
+    if (pxSpill != NULL)
+    {
+        if (pxSpill->bWriterStarted)
+        {
+            pthread_mutex_lock(&pxSpill->xLock);
+            pxSpill->bStop = true;
+            pthread_cond_signal(&pxSpill->xCond);
+            pthread_mutex_unlock(&pxSpill->xLock);
+            pthread_join(pxSpill->writerTid, NULL);
+        }
+
+        /* The frames still in memory go after the ones written by the writer thread, so they are sent by the next run. */
+        while ((pxEntry = popMemFrame(pxSpill)) != NULL)
+        {
+            appendFrame(pxSpill, pxEntry->pData, pxEntry->uDataLen, pxEntry->uTimestamp, pxEntry->xTrackType);
+            free(pxEntry->pData);
+            free(pxEntry);
+        }
+
+        if (pxSpill->fpRead != NULL)
+        {
+            fclose(pxSpill->fpRead);
+        }
+        if (pxSpill->fpWrite != NULL)
+        {
+            fclose(pxSpill->fpWrite);
+        }
+        pthread_cond_destroy(&pxSpill->xCond);
+        pthread_mutex_destroy(&pxSpill->xFileLock);
+        pthread_mutex_destroy(&pxSpill->xLock);
+        free(pxSpill);
+    }
+}
+
+int SpillBuffer_addFrame(SpillBufferHandle xSpillBufferHandle, KvsAppHandle kvsAppHandle, uint8_t *pData, size_t uDataLen, size_t uDataSize,
+                         uint64_t uTimestamp, TrackType_t xTrackType)
+{
+    int res = ERRNO_NONE;
+    SpillBuffer_t *pxSpill = xSpillBufferHandle;
+
+    if (pxSpill == NULL || pData == NULL)
+    {
+        free(pData);
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxSpill->xLock);
+
+    if (!pxSpill->bSpilling && KvsApp_getStreamMemStatTotal(kvsAppHandle) + uDataLen > pxSpill->xConfig.uMemThreshold)
+    {
+        printf("Stream buffer is full, spilling frames to %s\n", pxSpill->xConfig.pDirectory);
+        pxSpill->bSpilling = true;
+    }
+
+    if (!pxSpill->bSpilling)
+    {
+        // KvsApp will help to free pData
+        res = KvsApp_addFrame(kvsAppHandle, pData, uDataLen, uDataSize, uTimestamp, xTrackType);
+    }
+    else
+    {
+        // The memory queue or the writer thread will help to free pData
+        res = addMemFrame(pxSpill, pData, uDataLen, uTimestamp, xTrackType);
+    }
+
+    pthread_mutex_unlock(&pxSpill->xLock);
+
+    return res;
+}
+
+/**
+ * @brief Send the oldest frame of the memory queue once the log is empty. It's called with xLock held, so the capture
+ * threads can't move the frame to the log meanwhile.
+ *
+ * @return 1 if a frame is sent, 0 if there is nothing to send yet, negative value if KvsApp refused the frame
+ */
+static int drainMemFrame(SpillBuffer_t *pxSpill, KvsAppHandle kvsAppHandle)
+{
+    SpillQueueEntry_t *pxEntry = pxSpill->pMemHead;
+    uint8_t *pFrame = NULL;
+
+    if (pxEntry == NULL || pxSpill->iTokens <= 0 || KvsApp_getStreamMemStatTotal(kvsAppHandle) + pxEntry->uDataLen > pxSpill->xConfig.uMemThreshold)
+    {
+        return 0;
+    }
+
+    /* KvsApp frees the frame even if it's refused, so a copy is sent and the frame stays queued until it's accepted. */
+    if ((pFrame = (uint8_t *)malloc(pxEntry->uDataLen)) == NULL)
+    {
+        printf("OOM: pFrame\n");
+        return 0;
+    }
+    memcpy(pFrame, pxEntry->pData, pxEntry->uDataLen);
+
+    // KvsApp will help to free pFrame
+    if (KvsApp_addFrame(kvsAppHandle, pFrame, pxEntry->uDataLen, pxEntry->uDataLen, pxEntry->uTimestamp, pxEntry->xTrackType) != 0)
+    {
+        return -1;
+    }
+
+    popMemFrame(pxSpill);
+    pxSpill->iTokens -= (int64_t)pxEntry->uDataLen;
+    free(pxEntry->pData);
+    free(pxEntry);
+
+    return 1;
+}
+
+int SpillBuffer_drain(SpillBufferHandle xSpillBufferHandle, KvsAppHandle kvsAppHandle)
+{
+    int res = ERRNO_NONE;
+    SpillBuffer_t *pxSpill = xSpillBufferHandle;
+    uint64_t uNowMs = 0;
+    uint8_t *pFrame = NULL;
+    size_t uDataLen = 0;
+    long lOffset = 0;
+    bool bSpilling = false;
+    int iMemRes = 0;
+
+    if (pxSpill == NULL)
+    {
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxSpill->xFileLock);
+    pthread_mutex_lock(&pxSpill->xLock);
+    bSpilling = pxSpill->bSpilling;
+    pthread_mutex_unlock(&pxSpill->xLock);
+
+    if (pxSpill->bDrainBlocked)
+    {
+        res = ERRNO_FAIL;
+    }
+    else if (bSpilling)
+    {
+        uNowMs = getMonotonicTimestampInMs();
+        pxSpill->iTokens += (int64_t)((uNowMs - pxSpill->uLastRefillMs) * pxSpill->xConfig.uCatchUpRate / 1000);
+        if (pxSpill->iTokens > (int64_t)pxSpill->xConfig.uCatchUpRate)
+        {
+            pxSpill->iTokens = (int64_t)pxSpill->xConfig.uCatchUpRate;
+        }
+        pxSpill->uLastRefillMs = uNowMs;
+
+        while (true)
+        {
+            if (!peekRecord(pxSpill))
+            {
+                /* The memory queue is only sent once the frames queued for the log are written and sent too. */
+                pthread_mutex_lock(&pxSpill->xLock);
+                iMemRes = 0;
+                if (pxSpill->pQueueHead == NULL && !pxSpill->bWriting)
+                {
+                    if (pxSpill->pMemHead == NULL)
+                    {
+                        finishSpilling(pxSpill);
+                    }
+                    else if ((iMemRes = drainMemFrame(pxSpill, kvsAppHandle)) > 0)
+                    {
+                        pxSpill->xStats.uFramesDrained++;
+                    }
+                }
+                pthread_mutex_unlock(&pxSpill->xLock);
+
+                if (iMemRes > 0)
+                {
+                    continue;
+                }
+                else if (iMemRes < 0)
+                {
+                    printf("Failed to drain spilled frame, it's kept until the next connection\n");
+                    pxSpill->bDrainBlocked = true;
+                    res = ERRNO_FAIL;
+                }
+                break;
+            }
+
+            uDataLen = pxSpill->xHeader.uDataLen;
+            if (pxSpill->iTokens <= 0 || KvsApp_getStreamMemStatTotal(kvsAppHandle) + uDataLen > pxSpill->xConfig.uMemThreshold)
+            {
+                break;
+            }
+
+            if ((pFrame = (uint8_t *)malloc(uDataLen)) == NULL)
+            {
+                printf("OOM: pFrame\n");
+                res = ERRNO_FAIL;
+                break;
+            }
+
+            pxSpill->bHasHeader = false;
+            lOffset = ftell(pxSpill->fpRead);
+            if (fread(pFrame, 1, uDataLen, pxSpill->fpRead) != uDataLen)
+            {
+                /* Truncated record, the rest of this file is skipped by the next peek. */
+                free(pFrame);
+                continue;
+            }
+
+            // KvsApp will help to free pFrame
+            if (KvsApp_addFrame(kvsAppHandle, pFrame, uDataLen, uDataLen, pxSpill->xHeader.uTimestamp, (TrackType_t)pxSpill->xHeader.uTrackType) != 0)
+            {
+                /* Rewind to the data of this record, so it's sent again once KvsApp is reconnected. */
+                printf("Failed to drain spilled frame, it's kept until the next connection\n");
+                fseek(pxSpill->fpRead, lOffset, SEEK_SET);
+                pxSpill->bHasHeader = true;
+                pxSpill->bDrainBlocked = true;
+                res = ERRNO_FAIL;
+                break;
+            }
+            pxSpill->iTokens -= (int64_t)uDataLen;
+            pxSpill->xStats.uFramesDrained++;
+        }
+    }
+
+    pthread_mutex_unlock(&pxSpill->xFileLock);
+
+    return res;
+}
+
+void SpillBuffer_resume(SpillBufferHandle xSpillBufferHandle)
+{
+    SpillBuffer_t *pxSpill = xSpillBufferHandle;
+
+    if (pxSpill != NULL)
+    {
+        pthread_mutex_lock(&pxSpill->xFileLock);
+        pxSpill->bDrainBlocked = false;
+        pthread_mutex_unlock(&pxSpill->xFileLock);
+    }
+}
+
+int SpillBuffer_getStats(SpillBufferHandle xSpillBufferHandle, SpillBufferStats_t *pxStats)
+{
+    SpillBuffer_t *pxSpill = xSpillBufferHandle;
+
+    if (pxSpill == NULL || pxStats == NULL)
+    {
+        return ERRNO_FAIL;
+    }
+
+    pthread_mutex_lock(&pxSpill->xFileLock);
+    *pxStats = pxSpill->xStats;
+    pthread_mutex_lock(&pxSpill->xLock);
+    pxStats->uFramesDropped += pxSpill->uQueueDropped;
+    pthread_mutex_unlock(&pxSpill->xLock);
+    pthread_mutex_unlock(&pxSpill->xFileLock);
+
+    return ERRNO_NONE;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#ifndef SPILL_BUFFER_H
+#define SPILL_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kvs/kvsapp.h"
+
+typedef struct SpillBuffer *SpillBufferHandle;
+
+typedef struct
+{
+    /* Directory of the append-only log files. Logs left by a previous run are drained first. */
+    const char *pDirectory;
+
+    /* Spilling starts once the KvsApp stream buffer would grow beyond this size. */
+    size_t uMemThreshold;
+
+    /* Live frames kept in memory while spilling. Beyond this size the oldest whole fragments go to disk. */
+    size_t uMemQueueSize;
+
+    /* A new log file is started on the next key frame once the current one reaches this size. */
+    size_t uFileSize;
+
+    /* Oldest log files are discarded once the log grows beyond this size. */
+    uint64_t uMaxDiskSize;
+
+    /* Maximum rate in bytes per second of frames moved from disk back into KvsApp. */
+    size_t uCatchUpRate;
+
+    /* Frames waiting for the writer thread beyond this size are dropped, video up to the next key frame. */
+    size_t uWriteQueueSize;
+} SpillBufferConfig_t;
+
+typedef struct
+{
+    uint64_t uFramesSpilled;
+    uint64_t uFramesDrained;
+    uint64_t uFramesDropped;
+    uint64_t uFilesDiscarded;
+    uint64_t uDiskUsage;
+} SpillBufferStats_t;
+
+/**
+ * @brief Create a spill buffer. It recovers the logs left in the directory by a previous run.
+ *
+ * @param[in] pxConfig Spill buffer configuration
+ * @return Spill buffer handle on success, NULL otherwise
+ */
+SpillBufferHandle SpillBuffer_create(const SpillBufferConfig_t *pxConfig);
+
+/**
+ * @brief Close the log files and free the spill buffer. Logs which are not drained yet are kept on disk.
+ *
+ * @param[in] xSpillBufferHandle Spill buffer handle
+ */
+void SpillBuffer_terminate(SpillBufferHandle xSpillBufferHandle);
+
+/**
+ * @brief Add a frame in place of KvsApp_addFrame.
+ *
+ * The frame is passed to KvsApp directly unless the stream buffer is full or there are spilled frames waiting to be
+ * drained, in which case it's appended to a memory queue. Once the memory queue is full, its oldest fragment, i.e. the
+ * frames from a key frame to the next one, is handed over to the writer thread which appends it to the log. So the
+ * live frames stay in memory, frames are always sent in order and the caller never waits for the disk. Either way,
+ * pData is freed by the spill buffer.
+ *
+ * @param[in] xSpillBufferHandle Spill buffer handle
+ * @param[in] kvsAppHandle KvsApp handle
+ * @param[in] pData Frame data
+ * @param[in] uDataLen Length of frame data
+ * @param[in] uDataSize Size of pData
+ * @param[in] uTimestamp Frame timestamp in milliseconds
+ * @param[in] xTrackType Track type
+ * @return 0 on success, non-zero value otherwise
+ */
+int SpillBuffer_addFrame(SpillBufferHandle xSpillBufferHandle, KvsAppHandle kvsAppHandle, uint8_t *pData, size_t uDataLen, size_t uDataSize,
+                         uint64_t uTimestamp, TrackType_t xTrackType);
+
+/**
+ * @brief Move frames from the log, then from the memory queue, back into KvsApp at the configured catch-up rate.
+ *
+ * It should be called periodically while KvsApp is open, e.g. after every KvsApp_doWork. If KvsApp refuses a frame, the
+ * frame is kept and draining stops until SpillBuffer_resume is called.
+ *
+ * @param[in] xSpillBufferHandle Spill buffer handle
+ * @param[in] kvsAppHandle KvsApp handle
+ * @return 0 on success, non-zero value otherwise
+ */
+int SpillBuffer_drain(SpillBufferHandle xSpillBufferHandle, KvsAppHandle kvsAppHandle);
+
+/**
+ * @brief Resume draining after KvsApp refused a frame. It should be called once KvsApp is opened again.
+ *
+ * @param[in] xSpillBufferHandle Spill buffer handle
+ */
+void SpillBuffer_resume(SpillBufferHandle xSpillBufferHandle);
+
+/**
+ * @brief Get spill buffer statistics.
+ *
+ * @param[in] xSpillBufferHandle Spill buffer handle
+ * @param[out] pxStats Statistics
+ * @return 0 on success, non-zero value otherwise
+ */
+int SpillBuffer_getStats(SpillBufferHandle xSpillBufferHandle, SpillBufferStats_t *pxStats);
+
+#endif /* SPILL_BUFFER_H */
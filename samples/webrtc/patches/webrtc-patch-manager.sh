@@ -6,7 +6,14 @@ PATCHFILES=$(ls ${BASEDIR}/*.patch)
 
 if [ "$(git rev-parse --is-inside-work-tree 2>/dev/null)" ]; then
     git reset --hard
+    # Files added by the patches on a previous run would keep them from applying again
+    git clean -fdq -- src
     for PATCH in ${PATCHFILES}; do
-        git apply "${PATCH}"
+        # A patch which doesn't fit the SDK version is left out rather than breaking the build
+        if git apply --check "${PATCH}"; then
+            git apply "${PATCH}"
+        else
+            echo "WARNING: $(basename ${PATCH}) doesn't apply to this SDK version and is skipped"
+        fi
     done
 fi
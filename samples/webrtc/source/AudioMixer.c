@@ -0,0 +1,347 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#define LOG_CLASS "AudioMixer"
+#include "Samples.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Upper ends of the 13-bit A-law segments, from the G.711 reference implementation
+static const INT32 alawSegmentEnd[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
+
+static INT16 alawToLinear(BYTE alaw)
+{
+    INT32 value, segment;
+
+    alaw ^= 0x55;
+    value = (alaw & 0x0F) << 4;
+    segment = (alaw & 0x70) >> 4;
+    switch (segment) {
+        case 0:
+            value += 8;
+            break;
+        case 1:
+            value += 0x108;
+            break;
+        default:
+            value += 0x108;
+            value <<= segment - 1;
+            break;
+    }
+
+    return (INT16) ((alaw & 0x80) ? value : -value);
+}
+
+static BYTE linearToAlaw(INT16 pcm)
+{
+    INT32 value = pcm >> 3, segment;
+    BYTE mask, alaw;
+
+    if (value >= 0) {
+        mask = 0xD5;
+    } else {
+        mask = 0x55;
+        value = -value - 1;
+    }
+
+    for (segment = 0; segment < 8 && value > alawSegmentEnd[segment]; segment++) {
+    }
+    if (segment >= 8) {
+        return (BYTE) (0x7F ^ mask);
+    }
+
+    alaw = (BYTE) (segment << 4);
+    alaw |= (BYTE) ((segment < 2 ? value >> 1 : value >> segment) & 0x0F);
+
+    return (BYTE) (alaw ^ mask);
+}
+
+// pDst[i] += pSrc[i], clamped to the INT16 range
+static VOID mixSaturating(PINT16 pDst, PINT16 pSrc, UINT32 count)
+{
+    UINT32 i = 0;
+    INT32 sum;
+
+#if defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(pDst + i, vqaddq_s16(vld1q_s16(pDst + i), vld1q_s16(pSrc + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i*) (pDst + i), _mm_adds_epi16(_mm_loadu_si128((__m128i*) (pDst + i)), _mm_loadu_si128((__m128i*) (pSrc + i))));
+    }
+#endif
+
+    for (; i < count; i++) {
+        sum = (INT32) pDst[i] + pSrc[i];
+        pDst[i] = (INT16) (sum > MAX_INT16 ? MAX_INT16 : (sum < MIN_INT16 ? MIN_INT16 : sum));
+    }
+}
+
+// Called under the mixer lock
+static PJitterBuffer getJitterBuffer(PAudioMixer pAudioMixer, UINT64 streamId, BOOL create)
+{
+    PJitterBuffer pJitterBuffer = NULL;
+    UINT32 i;
+
+    for (i = 0; i < ARRAY_SIZE(pAudioMixer->streams); i++) {
+        if (pAudioMixer->streams[i].active && pAudioMixer->streams[i].streamId == streamId) {
+            return &pAudioMixer->streams[i];
+        } else if (pJitterBuffer == NULL && !pAudioMixer->streams[i].active) {
+            pJitterBuffer = &pAudioMixer->streams[i];
+        }
+    }
+
+    if (!create || pJitterBuffer == NULL) {
+        return NULL;
+    }
+
+    MEMSET(pJitterBuffer, 0x00, SIZEOF(JitterBuffer));
+    pJitterBuffer->streamId = streamId;
+    pJitterBuffer->active = TRUE;
+    pJitterBuffer->buffering = TRUE;
+    pJitterBuffer->targetDepth = SAMPLE_JITTER_BUFFER_MIN_DEPTH_SAMPLES;
+
+    return pJitterBuffer;
+}
+
+static VOID getJitterBufferStats(PJitterBuffer pJitterBuffer, PJitterBufferStats pStats)
+{
+    *pStats = pJitterBuffer->stats;
+    pStats->targetLatency = pJitterBuffer->targetDepth * 1000 / SAMPLE_AUDIO_MIXER_SAMPLE_RATE;
+    pStats->averageLatency = pJitterBuffer->latencyCount == 0 ? 0 : (UINT32) (pJitterBuffer->latencySum / pJitterBuffer->latencyCount);
+}
+
+// Called under the mixer lock, returns the number of samples played out, the rest of the period is silence
+static UINT32 pullJitterBuffer(PJitterBuffer pJitterBuffer, PINT16 pSamples, UINT64 now)
+{
+    UINT32 i, count, latency;
+
+    if (pJitterBuffer->buffering) {
+        if (pJitterBuffer->count < pJitterBuffer->targetDepth) {
+            return 0;
+        }
+        pJitterBuffer->buffering = FALSE;
+    }
+
+    latency = pJitterBuffer->count * 1000 / SAMPLE_AUDIO_MIXER_SAMPLE_RATE;
+    pJitterBuffer->latencySum += latency;
+    pJitterBuffer->latencyCount++;
+    pJitterBuffer->stats.maxLatency = MAX(pJitterBuffer->stats.maxLatency, latency);
+
+    count = MIN(pJitterBuffer->count, SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES);
+    for (i = 0; i < count; i++) {
+        pSamples[i] = pJitterBuffer->samples[(pJitterBuffer->head + i) % SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES];
+    }
+    MEMSET(pSamples + count, 0x00, (SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES - count) * SIZEOF(INT16));
+    pJitterBuffer->head = (pJitterBuffer->head + count) % SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES;
+    pJitterBuffer->count -= count;
+
+    if (count < SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES) {
+        // Running dry while the viewer is still talking is an underrun, after the last frame it is just the end of a talk spurt
+        if ((now - pJitterBuffer->lastArrivalTime) * SAMPLE_AUDIO_MIXER_SAMPLE_RATE / HUNDREDS_OF_NANOS_IN_A_SECOND <
+            pJitterBuffer->targetDepth + SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES) {
+            pJitterBuffer->stats.underruns++;
+        }
+        pJitterBuffer->buffering = TRUE;
+    }
+
+    return count;
+}
+
+static PVOID audioMixerPlaybackRoutine(PVOID args)
+{
+    PAudioMixer pAudioMixer = (PAudioMixer) args;
+    INT16 mixedSamples[SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES], samples[SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES];
+    BYTE alawSamples[SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES];
+    UINT64 nextPeriod = GETTIME(), now;
+    UINT32 i;
+    BOOL mixed;
+
+    while (!ATOMIC_LOAD_BOOL(&pAudioMixer->terminateFlag)) {
+        nextPeriod += SAMPLE_AUDIO_MIXER_PERIOD;
+        now = GETTIME();
+        if (nextPeriod > now) {
+            THREAD_SLEEP(nextPeriod - now);
+            now = nextPeriod;
+        } else if (now - nextPeriod > SAMPLE_AUDIO_MIXER_PERIOD) {
+            // The player blocked for longer than a period, don't try to catch up with a burst
+            nextPeriod = now;
+        }
+
+        MEMSET(mixedSamples, 0x00, SIZEOF(mixedSamples));
+        mixed = FALSE;
+
+        MUTEX_LOCK(pAudioMixer->lock);
+        for (i = 0; i < ARRAY_SIZE(pAudioMixer->streams); i++) {
+            if (pAudioMixer->streams[i].active && pullJitterBuffer(&pAudioMixer->streams[i], samples, now) > 0) {
+                mixSaturating(mixedSamples, samples, SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES);
+                mixed = TRUE;
+            }
+        }
+        MUTEX_UNLOCK(pAudioMixer->lock);
+
+        // One write per period no matter how many viewers are talking
+        if (mixed) {
+            for (i = 0; i < SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES; i++) {
+                alawSamples[i] = linearToAlaw(mixedSamples[i]);
+            }
+            pAudioMixer->outputFn(pAudioMixer->customData, alawSamples, SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES);
+        }
+    }
+
+    return NULL;
+}
+
+STATUS createAudioMixer(AudioMixerOutputFunc outputFn, UINT64 customData, PAudioMixer* ppAudioMixer)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PAudioMixer pAudioMixer = NULL;
+
+    CHK(outputFn != NULL && ppAudioMixer != NULL, STATUS_NULL_ARG);
+
+    CHK(NULL != (pAudioMixer = (PAudioMixer) MEMCALLOC(1, SIZEOF(AudioMixer))), STATUS_NOT_ENOUGH_MEMORY);
+    pAudioMixer->outputFn = outputFn;
+    pAudioMixer->customData = customData;
+    pAudioMixer->playbackTid = INVALID_TID_VALUE;
+    pAudioMixer->lock = MUTEX_CREATE(FALSE);
+    CHK(IS_VALID_MUTEX_VALUE(pAudioMixer->lock), STATUS_INVALID_OPERATION);
+    ATOMIC_STORE_BOOL(&pAudioMixer->terminateFlag, FALSE);
+    CHK_STATUS(THREAD_CREATE(&pAudioMixer->playbackTid, audioMixerPlaybackRoutine, (PVOID) pAudioMixer));
+
+CleanUp:
+
+    if (STATUS_FAILED(retStatus)) {
+        freeAudioMixer(&pAudioMixer);
+    }
+
+    if (ppAudioMixer != NULL) {
+        *ppAudioMixer = pAudioMixer;
+    }
+
+    return retStatus;
+}
+
+STATUS freeAudioMixer(PAudioMixer* ppAudioMixer)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PAudioMixer pAudioMixer;
+
+    CHK(ppAudioMixer != NULL, STATUS_NULL_ARG);
+    pAudioMixer = *ppAudioMixer;
+    CHK(pAudioMixer != NULL, retStatus);
+
+    ATOMIC_STORE_BOOL(&pAudioMixer->terminateFlag, TRUE);
+    if (IS_VALID_TID_VALUE(pAudioMixer->playbackTid)) {
+        THREAD_JOIN(pAudioMixer->playbackTid, NULL);
+    }
+
+    if (IS_VALID_MUTEX_VALUE(pAudioMixer->lock)) {
+        MUTEX_FREE(pAudioMixer->lock);
+    }
+
+    SAFE_MEMFREE(*ppAudioMixer);
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS audioMixerPushFrame(PAudioMixer pAudioMixer, UINT64 streamId, PBYTE pData, UINT32 size)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PJitterBuffer pJitterBuffer;
+    UINT64 now = GETTIME();
+    DOUBLE transit;
+    UINT32 i, excess;
+    BOOL locked = FALSE;
+
+    CHK(pAudioMixer != NULL && pData != NULL, STATUS_NULL_ARG);
+
+    MUTEX_LOCK(pAudioMixer->lock);
+    locked = TRUE;
+
+    CHK_ERR(NULL != (pJitterBuffer = getJitterBuffer(pAudioMixer, streamId, TRUE)), STATUS_INVALID_OPERATION, "No free jitter buffer");
+
+    // Deviation of the arrival time from the duration of the previous frame, the depth covers a few times the smoothed value
+    if (pJitterBuffer->lastArrivalTime != 0) {
+        transit = (DOUBLE) (now - pJitterBuffer->lastArrivalTime) * SAMPLE_AUDIO_MIXER_SAMPLE_RATE / HUNDREDS_OF_NANOS_IN_A_SECOND -
+            pJitterBuffer->lastFrameSamples;
+        pJitterBuffer->jitter += ((transit < 0 ? -transit : transit) - pJitterBuffer->jitter) / 16;
+        pJitterBuffer->targetDepth = (UINT32) (SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES + 4 * pJitterBuffer->jitter);
+        pJitterBuffer->targetDepth =
+            MIN(MAX(pJitterBuffer->targetDepth, SAMPLE_JITTER_BUFFER_MIN_DEPTH_SAMPLES), SAMPLE_JITTER_BUFFER_MAX_DEPTH_SAMPLES);
+    }
+    pJitterBuffer->lastArrivalTime = now;
+    pJitterBuffer->lastFrameSamples = size;
+
+    // G.711 has one byte per sample, the oldest samples are overwritten when the buffer is full
+    for (i = 0; i < size; i++) {
+        if (pJitterBuffer->count == SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES) {
+            pJitterBuffer->head = (pJitterBuffer->head + 1) % SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES;
+            pJitterBuffer->count--;
+            pJitterBuffer->stats.discardedSamples++;
+        }
+        pJitterBuffer->samples[(pJitterBuffer->head + pJitterBuffer->count) % SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES] = alawToLinear(pData[i]);
+        pJitterBuffer->count++;
+    }
+    pJitterBuffer->stats.frames++;
+
+    // A burst after a stall would otherwise keep the latency up for the rest of the call
+    if (!pJitterBuffer->buffering && pJitterBuffer->count > pJitterBuffer->targetDepth + 2 * SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES) {
+        excess = pJitterBuffer->count - pJitterBuffer->targetDepth;
+        pJitterBuffer->head = (pJitterBuffer->head + excess) % SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES;
+        pJitterBuffer->count -= excess;
+        pJitterBuffer->stats.discardedSamples += excess;
+    }
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pAudioMixer->lock);
+    }
+
+    return retStatus;
+}
+
+STATUS audioMixerRemoveStream(PAudioMixer pAudioMixer, UINT64 streamId, PJitterBufferStats pStats)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PJitterBuffer pJitterBuffer;
+    BOOL locked = FALSE;
+
+    CHK(pAudioMixer != NULL, STATUS_NULL_ARG);
+
+    MUTEX_LOCK(pAudioMixer->lock);
+    locked = TRUE;
+
+    CHK(NULL != (pJitterBuffer = getJitterBuffer(pAudioMixer, streamId, FALSE)), STATUS_INVALID_ARG);
+    if (pStats != NULL) {
+        getJitterBufferStats(pJitterBuffer, pStats);
+    }
+    pJitterBuffer->active = FALSE;
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pAudioMixer->lock);
+    }
+
+    return retStatus;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#define LOG_CLASS "BenchmarkCommon"
+#include "BenchmarkCommon.h"
+
+VideoCapturerHandle gVideoCapturerHandle = NULL;
+AudioCapturerHandle gAudioCapturerHandle = NULL;
+
+// The master's video source, the capturer is gated like in kvsWebRTCClientMaster.c
+PVOID sendBoardVideoPackets(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    PBYTE pFrameBuffer = NULL;
+    UINT64 timestamp = 0;
+    SIZE_T frameSize = 0;
+    BOOL streamAcquired = FALSE;
+
+    if (NULL == (pFrameBuffer = (PBYTE) MEMALLOC(VIDEO_FRAME_BUFFER_SIZE_BYTES))) {
+        printf("[Benchmark] OOM\n");
+        return NULL;
+    }
+
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        if (pSampleConfiguration->idleCaptureMode == SAMPLE_IDLE_CAPTURE_MODE_RELEASE && !hasStreamingSession(pSampleConfiguration)) {
+            if (streamAcquired) {
+                videoCapturerReleaseStream(gVideoCapturerHandle);
+                streamAcquired = FALSE;
+                videoCaptureReleased(pSampleConfiguration);
+            }
+            waitForStreamingSession(pSampleConfiguration);
+            continue;
+        }
+
+        if (!streamAcquired) {
+            if (videoCapturerAcquireStream(gVideoCapturerHandle) != 0) {
+                printf("[Benchmark] Unable to acquire video stream\n");
+                break;
+            }
+            streamAcquired = TRUE;
+        }
+
+        if (videoCapturerGetFrame(gVideoCapturerHandle, pFrameBuffer, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize) == 0) {
+            writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer, (UINT32) frameSize,
+                                    SAMPLE_VIDEO_TRACK_ID);
+        }
+    }
+
+    if (streamAcquired) {
+        videoCapturerReleaseStream(gVideoCapturerHandle);
+    }
+    MEMFREE(pFrameBuffer);
+
+    return NULL;
+}
+
+// The master's audio source, the capturer is gated like in kvsWebRTCClientMaster.c
+PVOID sendBoardAudioPackets(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    PBYTE pFrameBuffer = NULL;
+    UINT64 timestamp = 0;
+    SIZE_T frameSize = 0;
+    BOOL streamAcquired = FALSE;
+
+    if (NULL == (pFrameBuffer = (PBYTE) MEMALLOC(AUDIO_FRAME_BUFFER_SIZE_BYTES))) {
+        printf("[Benchmark] OOM\n");
+        return NULL;
+    }
+
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        if (pSampleConfiguration->idleCaptureMode != SAMPLE_IDLE_CAPTURE_MODE_OFF && !hasStreamingSession(pSampleConfiguration)) {
+            if (streamAcquired) {
+                audioCapturerReleaseStream(gAudioCapturerHandle);
+                streamAcquired = FALSE;
+            }
+            waitForStreamingSession(pSampleConfiguration);
+            continue;
+        }
+
+        if (!streamAcquired) {
+            if (audioCapturerAcquireStream(gAudioCapturerHandle) != 0) {
+                printf("[Benchmark] Unable to acquire audio stream\n");
+                break;
+            }
+            streamAcquired = TRUE;
+        }
+
+        if (audioCapturerGetFrame(gAudioCapturerHandle, pFrameBuffer, AUDIO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize) == 0) {
+            writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer, (UINT32) frameSize,
+                                    SAMPLE_AUDIO_TRACK_ID);
+        }
+    }
+
+    if (streamAcquired) {
+        audioCapturerReleaseStream(gAudioCapturerHandle);
+    }
+    MEMFREE(pFrameBuffer);
+
+    return NULL;
+}
+
+STATUS getProcessUsage(PProcessUsage pProcessUsage)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    FILE* pFile = NULL;
+    unsigned long userTicks, systemTicks, residentPages;
+    INT32 ticksPerSecond = (INT32) sysconf(_SC_CLK_TCK);
+
+    CHK(pProcessUsage != NULL, STATUS_NULL_ARG);
+    pProcessUsage->time = GETTIME();
+
+    // utime and stime are the 14th and 15th fields, the command name in the 2nd can contain spaces but not ')'
+    CHK(NULL != (pFile = fopen("/proc/self/stat", "r")), STATUS_INVALID_OPERATION);
+    CHK(fscanf(pFile, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &userTicks, &systemTicks) == 2,
+        STATUS_INVALID_OPERATION);
+    fclose(pFile);
+    pFile = NULL;
+    pProcessUsage->cpuTime = (UINT64) (userTicks + systemTicks) * HUNDREDS_OF_NANOS_IN_A_SECOND / ticksPerSecond;
+
+    CHK(NULL != (pFile = fopen("/proc/self/statm", "r")), STATUS_INVALID_OPERATION);
+    CHK(fscanf(pFile, "%*u %lu", &residentPages) == 1, STATUS_INVALID_OPERATION);
+    pProcessUsage->rss = (SIZE_T) residentPages * (SIZE_T) sysconf(_SC_PAGESIZE);
+
+CleanUp:
+
+    if (pFile != NULL) {
+        fclose(pFile);
+    }
+
+    return retStatus;
+}
+
+DOUBLE getCpuUsagePercent(PProcessUsage pBefore, PProcessUsage pAfter)
+{
+    if (pAfter->time <= pBefore->time) {
+        return 0;
+    }
+
+    return 100.0 * (pAfter->cpuTime - pBefore->cpuTime) / (pAfter->time - pBefore->time);
+}
+
+INT32 compareUint64(const VOID* pA, const VOID* pB)
+{
+    UINT64 a = *(const UINT64*) pA, b = *(const UINT64*) pB;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+UINT64 percentile(PUINT64 pSorted, UINT32 count, UINT32 pct)
+{
+    return count == 0 ? 0 : pSorted[(count - 1) * pct / 100];
+}
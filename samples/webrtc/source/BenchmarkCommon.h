@@ -0,0 +1,57 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Helpers shared by the WebRTC benchmarks: the board's video and audio sources, the process usage and the sample statistics.
+ */
+#ifndef __KINESIS_VIDEO_SAMPLE_BENCHMARK_COMMON_INCLUDE__
+#define __KINESIS_VIDEO_SAMPLE_BENCHMARK_COMMON_INCLUDE__
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "LoopbackSignaling.h"
+
+#include "com/amazonaws/kinesis/video/capturer/AudioCapturer.h"
+#include "com/amazonaws/kinesis/video/capturer/VideoCapturer.h"
+
+#define VIDEO_FRAME_BUFFER_SIZE_BYTES      (160 * 1024UL)
+#define AUDIO_FRAME_BUFFER_SIZE_BYTES      (1024UL)
+#define HUNDREDS_OF_NANOS_IN_A_MICROSECOND 10LL
+
+typedef struct {
+    UINT64 time;    // When the usage was sampled
+    UINT64 cpuTime; // User and system time of the process
+    SIZE_T rss;     // Resident set size in bytes
+} ProcessUsage, *PProcessUsage;
+
+// Created by the benchmark before the master's media thread can start
+extern VideoCapturerHandle gVideoCapturerHandle;
+extern AudioCapturerHandle gAudioCapturerHandle;
+
+PVOID sendBoardVideoPackets(PVOID);
+PVOID sendBoardAudioPackets(PVOID);
+STATUS getProcessUsage(PProcessUsage);
+DOUBLE getCpuUsagePercent(PProcessUsage, PProcessUsage);
+INT32 compareUint64(const VOID*, const VOID*);
+UINT64 percentile(PUINT64, UINT32, UINT32);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __KINESIS_VIDEO_SAMPLE_BENCHMARK_COMMON_INCLUDE__ */
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+#define LOG_CLASS "CertificatePool"
+#include "Samples.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include <mbedtls/pk.h>
+#include <mbedtls/x509_crt.h>
+
+/*
+ * The SDK is built with mbedTLS, the certificate and the private key of an RtcCertificate are an mbedtls_x509_crt and
+ * an mbedtls_pk_context. They are saved in DER and parsed back into a LoadedCertificate, which the SDK copies from
+ * like from the certificates it creates itself.
+ */
+
+typedef struct {
+    UINT32 version;
+    UINT32 certificateCount;
+} CertificatePoolFileHeader;
+
+// Followed by the certificate and the private key
+typedef struct {
+    UINT64 createTime;
+    UINT32 certificateSize;
+    UINT32 privateKeySize;
+} CertificatePoolFileEntry, *PCertificatePoolFileEntry;
+
+typedef struct {
+    PooledCertificate pooledCertificate;
+    RtcCertificate rtcCertificate;
+    mbedtls_x509_crt certificate;
+    mbedtls_pk_context privateKey;
+} LoadedCertificate, *PLoadedCertificate;
+
+#define CERTIFICATE_POOL_ENTRY_MAX_SIZE (SIZEOF(CertificatePoolFileEntry) + 2 * SAMPLE_CERTIFICATE_POOL_MAX_DER_SIZE)
+#define CERTIFICATE_POOL_FILE_MAX_SIZE  (SIZEOF(CertificatePoolFileHeader) + MAX_RTCCONFIGURATION_CERTIFICATES * CERTIFICATE_POOL_ENTRY_MAX_SIZE)
+
+static STATUS createPooledCertificate(PPooledCertificate* ppPooledCertificate)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PPooledCertificate pPooledCertificate = NULL;
+
+    CHK(NULL != (pPooledCertificate = (PPooledCertificate) MEMCALLOC(1, SIZEOF(PooledCertificate))), STATUS_NOT_ENOUGH_MEMORY);
+    pPooledCertificate->createTime = GETTIME();
+    CHK_STATUS(createRtcCertificate(&pPooledCertificate->pRtcCertificate));
+
+    *ppPooledCertificate = pPooledCertificate;
+    pPooledCertificate = NULL;
+
+CleanUp:
+
+    freePooledCertificate(pPooledCertificate);
+
+    return retStatus;
+}
+
+static STATUS parsePooledCertificate(PCertificatePoolFileEntry pEntry, PBYTE pData, PPooledCertificate* ppPooledCertificate)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PLoadedCertificate pLoadedCertificate = NULL;
+
+    CHK(NULL != (pLoadedCertificate = (PLoadedCertificate) MEMCALLOC(1, SIZEOF(LoadedCertificate))), STATUS_NOT_ENOUGH_MEMORY);
+    pLoadedCertificate->pooledCertificate.createTime = pEntry->createTime;
+    pLoadedCertificate->pooledCertificate.loaded = TRUE;
+    pLoadedCertificate->pooledCertificate.pRtcCertificate = &pLoadedCertificate->rtcCertificate;
+    mbedtls_x509_crt_init(&pLoadedCertificate->certificate);
+    mbedtls_pk_init(&pLoadedCertificate->privateKey);
+
+    CHK(mbedtls_x509_crt_parse_der(&pLoadedCertificate->certificate, pData, pEntry->certificateSize) == 0, STATUS_INVALID_ARG);
+    CHK(mbedtls_pk_parse_key(&pLoadedCertificate->privateKey, pData + pEntry->certificateSize, pEntry->privateKeySize, NULL, 0) == 0,
+        STATUS_INVALID_ARG);
+
+    pLoadedCertificate->rtcCertificate.pCertificate = (PBYTE) &pLoadedCertificate->certificate;
+    pLoadedCertificate->rtcCertificate.certificateSize = SIZEOF(mbedtls_x509_crt);
+    pLoadedCertificate->rtcCertificate.pPrivateKey = (PBYTE) &pLoadedCertificate->privateKey;
+    pLoadedCertificate->rtcCertificate.privateKeySize = SIZEOF(mbedtls_pk_context);
+
+    *ppPooledCertificate = &pLoadedCertificate->pooledCertificate;
+    pLoadedCertificate = NULL;
+
+CleanUp:
+
+    if (pLoadedCertificate != NULL) {
+        freePooledCertificate(&pLoadedCertificate->pooledCertificate);
+    }
+
+    return retStatus;
+}
+
+VOID freePooledCertificate(PPooledCertificate pPooledCertificate)
+{
+    PLoadedCertificate pLoadedCertificate;
+
+    if (pPooledCertificate == NULL) {
+        return;
+    }
+
+    if (pPooledCertificate->loaded) {
+        // Both zero the memory they free
+        pLoadedCertificate = (PLoadedCertificate) pPooledCertificate;
+        mbedtls_x509_crt_free(&pLoadedCertificate->certificate);
+        mbedtls_pk_free(&pLoadedCertificate->privateKey);
+    } else {
+        freeRtcCertificate(pPooledCertificate->pRtcCertificate);
+    }
+
+    MEMFREE(pPooledCertificate);
+}
+
+STATUS loadPregeneratedCertificates(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PBYTE pBuffer = NULL, pCurrent, pEnd;
+    UINT64 fileSize = 0, now;
+    UINT32 i, loadedCount = 0;
+    CertificatePoolFileHeader header;
+    CertificatePoolFileEntry entry;
+    PPooledCertificate pPooledCertificate = NULL;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    // Without a pool file the pool just starts empty
+    CHK(pSampleConfiguration->certificatePoolFile, retStatus);
+    CHK(STATUS_SUCCEEDED(readFile(SAMPLE_CERTIFICATE_POOL_FILE_PATH, TRUE, NULL, &fileSize)) && fileSize >= SIZEOF(header) &&
+            fileSize <= CERTIFICATE_POOL_FILE_MAX_SIZE,
+        retStatus);
+    CHK(NULL != (pBuffer = (PBYTE) MEMALLOC(fileSize)), STATUS_NOT_ENOUGH_MEMORY);
+    CHK_STATUS(readFile(SAMPLE_CERTIFICATE_POOL_FILE_PATH, TRUE, pBuffer, &fileSize));
+    MEMCPY(&header, pBuffer, SIZEOF(header));
+    CHK_WARN(header.version == SAMPLE_CERTIFICATE_POOL_VERSION, retStatus, "Ignoring the certificate pool file version %u", header.version);
+
+    now = GETTIME();
+    pCurrent = pBuffer + SIZEOF(header);
+    pEnd = pBuffer + fileSize;
+    for (i = 0; i < MIN(header.certificateCount, MAX_RTCCONFIGURATION_CERTIFICATES); i++) {
+        CHK((SIZE_T) (pEnd - pCurrent) >= SIZEOF(entry), STATUS_INVALID_ARG);
+        MEMCPY(&entry, pCurrent, SIZEOF(entry));
+        pCurrent += SIZEOF(entry);
+        CHK((UINT64) entry.certificateSize + entry.privateKeySize <= (UINT64) (pEnd - pCurrent), STATUS_INVALID_ARG);
+
+        // The same key pair isn't used for too long, the expired ones are replaced by new ones
+        if (entry.createTime <= now && now < entry.createTime + SAMPLE_CERTIFICATE_POOL_MAX_AGE) {
+            CHK_STATUS(parsePooledCertificate(&entry, pCurrent, &pPooledCertificate));
+            CHK_STATUS(stackQueueEnqueue(pSampleConfiguration->pregeneratedCertificates, (UINT64) pPooledCertificate));
+            pPooledCertificate = NULL;
+            loadedCount++;
+        }
+
+        pCurrent += entry.certificateSize + entry.privateKeySize;
+    }
+
+    DLOGI("Loaded %u of the %u saved pre-generated certificates", loadedCount, header.certificateCount);
+
+CleanUp:
+
+    if (pSampleConfiguration != NULL) {
+        // Rewritten right away, a certificate used after this isn't loaded again if the process doesn't exit cleanly
+        pSampleConfiguration->pregeneratedCertificatesChanged = TRUE;
+    }
+
+    freePooledCertificate(pPooledCertificate);
+
+    if (pBuffer != NULL) {
+        MEMSET(pBuffer, 0x00, fileSize);
+        MEMFREE(pBuffer);
+    }
+
+    return retStatus;
+}
+
+STATUS savePregeneratedCertificates(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PBYTE pBuffer = NULL, pCurrent;
+    BYTE privateKey[SAMPLE_CERTIFICATE_POOL_MAX_DER_SIZE];
+    CHAR tempFilePath[MAX_PATH_LEN + 1];
+    INT32 privateKeySize, fd = -1;
+    UINT32 certificateCount = 0;
+    UINT64 data;
+    SIZE_T fileSize;
+    BOOL locked = FALSE;
+    StackQueueIterator iterator;
+    PPooledCertificate pPooledCertificate;
+    mbedtls_x509_crt* pCertificate;
+    CertificatePoolFileHeader header;
+    CertificatePoolFileEntry entry;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+    CHK(pSampleConfiguration->certificatePoolFile, retStatus);
+
+    CHK(NULL != (pBuffer = (PBYTE) MEMALLOC(CERTIFICATE_POOL_FILE_MAX_SIZE)), STATUS_NOT_ENOUGH_MEMORY);
+    pCurrent = pBuffer + SIZEOF(header);
+
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = TRUE;
+
+    // Cleared first, a certificate taken while the file is written marks the pool changed again
+    pSampleConfiguration->pregeneratedCertificatesChanged = FALSE;
+
+    CHK_STATUS(stackQueueGetIterator(pSampleConfiguration->pregeneratedCertificates, &iterator));
+    while (IS_VALID_ITERATOR(iterator) && certificateCount < MAX_RTCCONFIGURATION_CERTIFICATES) {
+        CHK_STATUS(stackQueueIteratorGetItem(iterator, &data));
+        CHK_STATUS(stackQueueIteratorNext(&iterator));
+        pPooledCertificate = (PPooledCertificate) data;
+        pCertificate = (mbedtls_x509_crt*) pPooledCertificate->pRtcCertificate->pCertificate;
+
+        // mbedtls_pk_write_key_der writes at the end of the buffer
+        privateKeySize = mbedtls_pk_write_key_der((mbedtls_pk_context*) pPooledCertificate->pRtcCertificate->pPrivateKey, privateKey,
+                                                  SIZEOF(privateKey));
+        if (privateKeySize <= 0 || pCertificate->raw.len > SAMPLE_CERTIFICATE_POOL_MAX_DER_SIZE) {
+            DLOGW("Unable to save a pre-generated certificate");
+            continue;
+        }
+
+        entry.createTime = pPooledCertificate->createTime;
+        entry.certificateSize = (UINT32) pCertificate->raw.len;
+        entry.privateKeySize = (UINT32) privateKeySize;
+        MEMCPY(pCurrent, &entry, SIZEOF(entry));
+        pCurrent += SIZEOF(entry);
+        MEMCPY(pCurrent, pCertificate->raw.p, entry.certificateSize);
+        pCurrent += entry.certificateSize;
+        MEMCPY(pCurrent, privateKey + SIZEOF(privateKey) - privateKeySize, entry.privateKeySize);
+        pCurrent += entry.privateKeySize;
+        certificateCount++;
+    }
+
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = FALSE;
+
+    header.version = SAMPLE_CERTIFICATE_POOL_VERSION;
+    header.certificateCount = certificateCount;
+    MEMCPY(pBuffer, &header, SIZEOF(header));
+    fileSize = (SIZE_T) (pCurrent - pBuffer);
+
+    // Created for the owner only and renamed over the pool file, so the keys are never readable by others or half written
+    SNPRINTF(tempFilePath, SIZEOF(tempFilePath), "%s.tmp", SAMPLE_CERTIFICATE_POOL_FILE_PATH);
+    unlink(tempFilePath);
+    CHK_ERR((fd = open(tempFilePath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) >= 0, STATUS_OPEN_FILE_FAILED, "Unable to create %s",
+            tempFilePath);
+    CHK(write(fd, pBuffer, fileSize) == (ssize_t) fileSize && fsync(fd) == 0, STATUS_WRITE_TO_FILE_FAILED);
+    CHK(close(fd) == 0, STATUS_WRITE_TO_FILE_FAILED);
+    fd = -1;
+    CHK(rename(tempFilePath, SAMPLE_CERTIFICATE_POOL_FILE_PATH) == 0, STATUS_WRITE_TO_FILE_FAILED);
+
+    DLOGD("Saved %u pre-generated certificates", certificateCount);
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        unlink(tempFilePath);
+    }
+
+    // The private keys don't stay behind in freed memory
+    MEMSET(privateKey, 0x00, SIZEOF(privateKey));
+    if (pBuffer != NULL) {
+        MEMSET(pBuffer, 0x00, CERTIFICATE_POOL_FILE_MAX_SIZE);
+        MEMFREE(pBuffer);
+    }
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+PVOID pregenerateCertRoutine(PVOID customData)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
+    PPooledCertificate pPooledCertificate = NULL;
+    UINT32 certCount;
+    BOOL changed;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    // A key takes seconds to generate on slow cores, the media and the sessions being set up go first.
+    // On Linux the nice value set for PRIO_PROCESS 0 is the one of the calling thread.
+    if (setpriority(PRIO_PROCESS, 0, SAMPLE_PRE_GENERATE_CERT_NICE) != 0) {
+        DLOGW("Unable to lower the priority of the certificate pre-generation, errno %d", errno);
+    }
+
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->pregenerateCertTerminate)) {
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        retStatus = stackQueueGetCount(pSampleConfiguration->pregeneratedCertificates, &certCount);
+        changed = pSampleConfiguration->pregeneratedCertificatesChanged;
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        CHK_STATUS(retStatus);
+
+        // Saved at most once per period, which also drops the certificates used since from the file
+        if (changed) {
+            savePregeneratedCertificates(pSampleConfiguration);
+        }
+
+        // Generated without the lock held, so the offers are answered in the meantime
+        if (certCount < MAX_RTCCONFIGURATION_CERTIFICATES && STATUS_SUCCEEDED(retStatus = createPooledCertificate(&pPooledCertificate))) {
+            MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+            if (STATUS_SUCCEEDED(retStatus = stackQueueEnqueue(pSampleConfiguration->pregeneratedCertificates, (UINT64) pPooledCertificate))) {
+                pPooledCertificate = NULL;
+                pSampleConfiguration->pregeneratedCertificatesChanged = TRUE;
+                DLOGV("New certificate has been pre-generated and added to the queue");
+            }
+            MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        }
+        CHK_LOG_ERR(retStatus);
+        freePooledCertificate(pPooledCertificate);
+        pPooledCertificate = NULL;
+
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        if (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->pregenerateCertTerminate)) {
+            CVAR_WAIT(pSampleConfiguration->cvar, pSampleConfiguration->sampleConfigurationObjLock, SAMPLE_PRE_GENERATE_CERT_PERIOD);
+        }
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+
+    return (PVOID) (ULONG_PTR) retStatus;
+}
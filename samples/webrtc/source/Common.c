@@ -16,15 +16,66 @@
 #define LOG_CLASS "WebRtcSamples"
 #include "Samples.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 PSampleConfiguration gSampleConfiguration = NULL;
 
+// Only async-signal-safe calls here, the waiting threads are woken up by signalWatcherRoutine
+static VOID wakeSignalWatcher(PSampleConfiguration pSampleConfiguration)
+{
+    INT32 savedErrno = errno, fd = pSampleConfiguration->signalPipe[1];
+    CHAR signalByte = 0;
+    ssize_t result;
+
+    // The write end is non-blocking, a full pipe already has a wakeup pending
+    if (fd >= 0) {
+        result = write(fd, &signalByte, 1);
+        UNUSED_PARAM(result);
+    }
+    errno = savedErrno;
+}
+
 VOID sigintHandler(INT32 sigNum)
 {
     UNUSED_PARAM(sigNum);
     if (gSampleConfiguration != NULL) {
         ATOMIC_STORE_BOOL(&gSampleConfiguration->interrupted, TRUE);
-        CVAR_BROADCAST(gSampleConfiguration->cvar);
+        wakeSignalWatcher(gSampleConfiguration);
+    }
+}
+
+VOID setupHistogramSignalHandler(INT32 sigNum)
+{
+    UNUSED_PARAM(sigNum);
+    if (gSampleConfiguration != NULL) {
+        // Printed by sessionCleanupWait, which checks the flag before every wait
+        ATOMIC_STORE_BOOL(&gSampleConfiguration->setupHistogramDumpRequested, TRUE);
+        wakeSignalWatcher(gSampleConfiguration);
+    }
+}
+
+// Does the locking a signal handler can't, it returns once freeSampleConfiguration closes the write end of the pipe
+static PVOID signalWatcherRoutine(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    CHAR signalBytes[16];
+    ssize_t result;
+
+    while ((result = read(pSampleConfiguration->signalPipe[0], signalBytes, SIZEOF(signalBytes))) != 0) {
+        if (result < 0 && errno != EINTR) {
+            DLOGE("Failed to read the signal pipe with errno %d", errno);
+            break;
+        }
+
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        raiseCleanupEvent(pSampleConfiguration);
     }
+
+    return NULL;
 }
 
 STATUS signalingCallFailed(STATUS status)
@@ -67,8 +118,20 @@ VOID onConnectionStateChange(UINT64 customData, RTC_PEER_CONNECTION_STATE newSta
     PSampleConfiguration pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
     DLOGI("New connection state %u", newState);
 
+    if (newState == RTC_PEER_CONNECTION_STATE_CONNECTING) {
+        recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_ICE_CHECKING);
+    }
+
     switch (newState) {
         case RTC_PEER_CONNECTION_STATE_CONNECTED:
+            recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_CONNECTED);
+            recordIceConnected(pSampleStreamingSession);
+            ATOMIC_STORE_BOOL(&pSampleStreamingSession->iceConnected, TRUE);
+            if (ATOMIC_EXCHANGE_BOOL(&pSampleStreamingSession->iceRestarting, FALSE)) {
+                ATOMIC_STORE_BOOL(&pSampleStreamingSession->videoRestartRequested, TRUE);
+                DLOGI("ICE restart of %s connected in %" PRIu64 " ms", pSampleStreamingSession->peerId,
+                      (GETTIME() - pSampleStreamingSession->iceRestartTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+            }
             ATOMIC_STORE_BOOL(&pSampleConfiguration->connected, TRUE);
             CVAR_BROADCAST(pSampleConfiguration->cvar);
             if (STATUS_FAILED(retStatus = logSelectedIceCandidatesInformation(pSampleStreamingSession))) {
@@ -76,12 +139,20 @@ VOID onConnectionStateChange(UINT64 customData, RTC_PEER_CONNECTION_STATE newSta
             }
             break;
         case RTC_PEER_CONNECTION_STATE_FAILED:
+            // The cached ICE servers may be the cause, the next session looks them up again
+            invalidateIceServerCache(pSampleConfiguration);
             // explicit fallthrough
         case RTC_PEER_CONNECTION_STATE_CLOSED:
             // explicit fallthrough
         case RTC_PEER_CONNECTION_STATE_DISCONNECTED:
-            ATOMIC_STORE_BOOL(&pSampleStreamingSession->terminateFlag, TRUE);
-            CVAR_BROADCAST(pSampleConfiguration->cvar);
+            // The old candidate pair goes away during an ICE restart, the session only fails if the new one can't be found in time
+            if (newState == RTC_PEER_CONNECTION_STATE_DISCONNECTED && ATOMIC_LOAD_BOOL(&pSampleStreamingSession->iceRestarting)) {
+                DLOGI("Disconnected from %s while restarting ICE", pSampleStreamingSession->peerId);
+            } else {
+                ATOMIC_STORE_BOOL(&pSampleStreamingSession->terminateFlag, TRUE);
+                CVAR_BROADCAST(pSampleConfiguration->cvar);
+                raiseCleanupEvent(pSampleConfiguration);
+            }
             // explicit fallthrough
         default:
             ATOMIC_STORE_BOOL(&pSampleConfiguration->connected, FALSE);
@@ -96,14 +167,19 @@ CleanUp:
 
 STATUS signalingClientStateChanged(UINT64 customData, SIGNALING_CLIENT_STATE state)
 {
-    UNUSED_PARAM(customData);
     STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
     PCHAR pStateStr;
 
     signalingClientGetStateString(state, &pStateStr);
 
     DLOGV("Signaling client state changed to %d - '%s'", state, pStateStr);
 
+    // sessionCleanupWait connects the client once it's ready
+    if (state == SIGNALING_CLIENT_STATE_READY && pSampleConfiguration != NULL) {
+        raiseCleanupEvent(pSampleConfiguration);
+    }
+
     // Return success to continue
     return retStatus;
 }
@@ -118,6 +194,7 @@ STATUS signalingClientError(UINT64 customData, STATUS status, PCHAR msg, UINT32
     if (status == STATUS_SIGNALING_ICE_CONFIG_REFRESH_FAILED || status == STATUS_SIGNALING_RECONNECT_FAILED) {
         ATOMIC_STORE_BOOL(&pSampleConfiguration->recreateSignalingClient, TRUE);
         CVAR_BROADCAST(pSampleConfiguration->cvar);
+        raiseCleanupEvent(pSampleConfiguration);
     }
 
     return STATUS_SUCCESS;
@@ -154,13 +231,15 @@ CleanUp:
 
 STATUS handleAnswer(PSampleConfiguration pSampleConfiguration, PSampleStreamingSession pSampleStreamingSession, PSignalingMessage pSignalingMessage)
 {
-    UNUSED_PARAM(pSampleConfiguration);
     STATUS retStatus = STATUS_SUCCESS;
     RtcSessionDescriptionInit answerSessionDescriptionInit;
 
     MEMSET(&answerSessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
 
     CHK_STATUS(deserializeSessionDescriptionInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &answerSessionDescriptionInit));
+    recordIceCandidatesFiltered(pSampleConfiguration,
+                                filterSessionDescriptionCandidates(&pSampleConfiguration->iceFilterPolicy, answerSessionDescriptionInit.sdp,
+                                                                   pSampleStreamingSession->remoteCandidateCounts));
     CHK_STATUS(setRemoteDescription(pSampleStreamingSession->pPeerConnection, &answerSessionDescriptionInit));
 
 CleanUp:
@@ -176,6 +255,11 @@ PVOID mediaSenderRoutine(PVOID customData)
     PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
     TID videoSenderTid = INVALID_TID_VALUE, audioSenderTid = INVALID_TID_VALUE;
 
+    // The video keeps the GOP cache filled before anyone connects, audio still waits for the first viewer
+    if (pSampleConfiguration->warmCapture && pSampleConfiguration->videoSource != NULL) {
+        THREAD_CREATE(&videoSenderTid, pSampleConfiguration->videoSource, (PVOID) pSampleConfiguration);
+    }
+
     MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
     while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->connected) && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
         CVAR_WAIT(pSampleConfiguration->cvar, pSampleConfiguration->sampleConfigurationObjLock, 5 * HUNDREDS_OF_NANOS_IN_A_SECOND);
@@ -184,7 +268,7 @@ PVOID mediaSenderRoutine(PVOID customData)
 
     CHK(!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag), retStatus);
 
-    if (pSampleConfiguration->videoSource != NULL) {
+    if (pSampleConfiguration->videoSource != NULL && videoSenderTid == INVALID_TID_VALUE) {
         THREAD_CREATE(&videoSenderTid, pSampleConfiguration->videoSource, (PVOID) pSampleConfiguration);
     }
 
@@ -192,6 +276,8 @@ PVOID mediaSenderRoutine(PVOID customData)
         THREAD_CREATE(&audioSenderTid, pSampleConfiguration->audioSource, (PVOID) pSampleConfiguration);
     }
 
+CleanUp:
+
     if (videoSenderTid != INVALID_TID_VALUE) {
         THREAD_JOIN(videoSenderTid, NULL);
     }
@@ -200,7 +286,6 @@ PVOID mediaSenderRoutine(PVOID customData)
         THREAD_JOIN(audioSenderTid, NULL);
     }
 
-CleanUp:
     // clean the flag of the media thread.
     ATOMIC_STORE_BOOL(&pSampleConfiguration->mediaThreadStarted, FALSE);
     CHK_LOG_ERR(retStatus);
@@ -217,21 +302,28 @@ STATUS handleOffer(PSampleConfiguration pSampleConfiguration, PSampleStreamingSe
     CHK(pSampleConfiguration != NULL && pSignalingMessage != NULL, STATUS_NULL_ARG);
 
     MEMSET(&offerSessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
-    MEMSET(&pSampleStreamingSession->answerSessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
+    // The SDP buffer is tens of KB per viewer, it isn't kept for the lifetime of the session
+    pSampleStreamingSession->pAnswerSessionDescriptionInit = (PRtcSessionDescriptionInit) MEMCALLOC(1, SIZEOF(RtcSessionDescriptionInit));
+    CHK(pSampleStreamingSession->pAnswerSessionDescriptionInit != NULL, STATUS_NOT_ENOUGH_MEMORY);
 
     CHK_STATUS(deserializeSessionDescriptionInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &offerSessionDescriptionInit));
+    // The candidates of a viewer which can't trickle come with its offer
+    recordIceCandidatesFiltered(pSampleConfiguration,
+                                filterSessionDescriptionCandidates(&pSampleConfiguration->iceFilterPolicy, offerSessionDescriptionInit.sdp,
+                                                                   pSampleStreamingSession->remoteCandidateCounts));
     CHK_STATUS(setRemoteDescription(pSampleStreamingSession->pPeerConnection, &offerSessionDescriptionInit));
     canTrickle = canTrickleIceCandidates(pSampleStreamingSession->pPeerConnection);
     /* cannot be null after setRemoteDescription */
     CHECK(!NULLABLE_CHECK_EMPTY(canTrickle));
     pSampleStreamingSession->remoteCanTrickleIce = canTrickle.value;
-    CHK_STATUS(setLocalDescription(pSampleStreamingSession->pPeerConnection, &pSampleStreamingSession->answerSessionDescriptionInit));
+    pSampleStreamingSession->iceGatheringStartTime = GETTIME();
+    CHK_STATUS(setLocalDescription(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pAnswerSessionDescriptionInit));
 
     /*
      * If remote support trickle ice, send answer now. Otherwise answer will be sent once ice candidate gathering is complete.
      */
     if (pSampleStreamingSession->remoteCanTrickleIce) {
-        CHK_STATUS(createAnswer(pSampleStreamingSession->pPeerConnection, &pSampleStreamingSession->answerSessionDescriptionInit));
+        CHK_STATUS(createAnswer(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pAnswerSessionDescriptionInit));
         CHK_STATUS(respondWithAnswer(pSampleStreamingSession));
         DLOGD("time taken to send answer %" PRIu64 " ms",
               (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
@@ -261,6 +353,11 @@ STATUS sendSignalingMessage(PSampleStreamingSession pSampleStreamingSession, PSi
 
     // Validate the input params
     CHK(pSampleStreamingSession != NULL && pSampleStreamingSession->pSampleConfiguration != NULL && pMessage != NULL, STATUS_NULL_ARG);
+    if (pSampleStreamingSession->pSampleConfiguration->signalingMessageSendFn != NULL) {
+        CHK_STATUS(pSampleStreamingSession->pSampleConfiguration->signalingMessageSendFn(
+            pSampleStreamingSession->pSampleConfiguration->signalingMessageSendCustomData, pMessage));
+        CHK(FALSE, retStatus);
+    }
     CHK(IS_VALID_MUTEX_VALUE(pSampleStreamingSession->pSampleConfiguration->signalingSendMessageLock) &&
             IS_VALID_SIGNALING_CLIENT_HANDLE(pSampleStreamingSession->pSampleConfiguration->signalingClientHandle),
         STATUS_INVALID_OPERATION);
@@ -285,7 +382,11 @@ STATUS respondWithAnswer(PSampleStreamingSession pSampleStreamingSession)
     SignalingMessage message;
     UINT32 buffLen = MAX_SIGNALING_MESSAGE_LEN;
 
-    CHK_STATUS(serializeSessionDescriptionInit(&pSampleStreamingSession->answerSessionDescriptionInit, message.payload, &buffLen));
+    CHK(pSampleStreamingSession->pAnswerSessionDescriptionInit != NULL, STATUS_INVALID_OPERATION);
+    // The local candidates left out were already counted when they were gathered
+    filterSessionDescriptionCandidates(&pSampleStreamingSession->pSampleConfiguration->iceFilterPolicy,
+                                       pSampleStreamingSession->pAnswerSessionDescriptionInit->sdp, NULL);
+    CHK_STATUS(serializeSessionDescriptionInit(pSampleStreamingSession->pAnswerSessionDescriptionInit, message.payload, &buffLen));
 
     message.version = SIGNALING_MESSAGE_CURRENT_VERSION;
     message.messageType = SIGNALING_MESSAGE_TYPE_ANSWER;
@@ -294,6 +395,10 @@ STATUS respondWithAnswer(PSampleStreamingSession pSampleStreamingSession)
     message.correlationId[0] = '\0';
 
     CHK_STATUS(sendSignalingMessage(pSampleStreamingSession, &message));
+    recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_ANSWER_SENT);
+
+    // The answer is sent once
+    SAFE_MEMFREE(pSampleStreamingSession->pAnswerSessionDescriptionInit);
 
 CleanUp:
 
@@ -301,15 +406,117 @@ CleanUp:
     return retStatus;
 }
 
-BOOL sampleFilterNetworkInterfaces(UINT64 customData, PCHAR networkInt)
+static STATUS sendOffer(PSampleStreamingSession pSampleStreamingSession, PRtcSessionDescriptionInit pOfferSessionDescriptionInit)
 {
-    UNUSED_PARAM(customData);
-    BOOL useInterface = FALSE;
-    if (STRNCMP(networkInt, (PCHAR) "eth0", ARRAY_SIZE("eth0")) == 0) {
-        useInterface = TRUE;
+    STATUS retStatus = STATUS_SUCCESS;
+    SignalingMessage message;
+    UINT32 buffLen = MAX_SIGNALING_MESSAGE_LEN;
+
+    filterSessionDescriptionCandidates(&pSampleStreamingSession->pSampleConfiguration->iceFilterPolicy, pOfferSessionDescriptionInit->sdp, NULL);
+    CHK_STATUS(serializeSessionDescriptionInit(pOfferSessionDescriptionInit, message.payload, &buffLen));
+
+    message.version = SIGNALING_MESSAGE_CURRENT_VERSION;
+    message.messageType = SIGNALING_MESSAGE_TYPE_OFFER;
+    STRNCPY(message.peerClientId, pSampleStreamingSession->peerId, MAX_SIGNALING_CLIENT_ID_LEN);
+    message.payloadLen = (UINT32) STRLEN(message.payload);
+    message.correlationId[0] = '\0';
+
+    CHK_STATUS(sendSignalingMessage(pSampleStreamingSession, &message));
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+// For a viewer which can't trickle, the offer of the ICE restart is sent with all the candidates once they're gathered
+static STATUS sendIceRestartOffer(PSampleStreamingSession pSampleStreamingSession)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PRtcSessionDescriptionInit pOfferSessionDescriptionInit = NULL;
+
+    CHK(NULL != (pOfferSessionDescriptionInit = (PRtcSessionDescriptionInit) MEMCALLOC(1, SIZEOF(RtcSessionDescriptionInit))),
+        STATUS_NOT_ENOUGH_MEMORY);
+    CHK_STATUS(createOffer(pSampleStreamingSession->pPeerConnection, pOfferSessionDescriptionInit));
+    CHK_STATUS(sendOffer(pSampleStreamingSession, pOfferSessionDescriptionInit));
+
+CleanUp:
+
+    SAFE_MEMFREE(pOfferSessionDescriptionInit);
+
+    return retStatus;
+}
+
+/*
+ * Starts the ICE of a connected session over with new credentials, the DTLS association and the media state are kept.
+ * The offer goes out before the gathering is started, so the viewer never gets a new candidate before the credentials
+ * it belongs to. A viewer which can't trickle gets the offer with all the candidates once the gathering is done.
+ */
+STATUS restartSessionIce(PSampleStreamingSession pSampleStreamingSession)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    RtcSessionDescriptionInit sessionDescriptionInit;
+    BOOL restarted = FALSE;
+    UINT32 i;
+
+    CHK(pSampleStreamingSession != NULL, STATUS_NULL_ARG);
+    CHK(pSampleStreamingSession->pSampleConfiguration->channelInfo.channelRoleType == SIGNALING_CHANNEL_ROLE_TYPE_MASTER, STATUS_INVALID_OPERATION);
+
+    MEMSET(&sessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
+    // Another change during a restart starts it over, the timeout still counts from the first one
+    if (!ATOMIC_LOAD_BOOL(&pSampleStreamingSession->iceRestarting)) {
+        pSampleStreamingSession->iceRestartTime = GETTIME();
+        ATOMIC_STORE_BOOL(&pSampleStreamingSession->iceRestarting, TRUE);
+        // sessionCleanupWait watches the timeout
+        raiseCleanupEvent(pSampleStreamingSession->pSampleConfiguration);
+    }
+    ATOMIC_STORE_BOOL(&pSampleStreamingSession->candidateGatheringDone, FALSE);
+    for (i = 0; i < SAMPLE_ICE_FAMILY_COUNT; i++) {
+        ATOMIC_STORE(&pSampleStreamingSession->localCandidateCounts[i], 0);
+        ATOMIC_STORE(&pSampleStreamingSession->remoteCandidateCounts[i], 0);
+    }
+    restarted = TRUE;
+    CHK_STATUS(restartIce(pSampleStreamingSession->pPeerConnection));
+
+    CHK_STATUS(createOffer(pSampleStreamingSession->pPeerConnection, &sessionDescriptionInit));
+    if (pSampleStreamingSession->remoteCanTrickleIce) {
+        CHK_STATUS(sendOffer(pSampleStreamingSession, &sessionDescriptionInit));
+    }
+    pSampleStreamingSession->iceGatheringStartTime = GETTIME();
+    CHK_STATUS(setLocalDescription(pSampleStreamingSession->pPeerConnection, &sessionDescriptionInit));
+
+CleanUp:
+
+    // The viewer has to set up a new session
+    if (STATUS_FAILED(retStatus) && restarted) {
+        ATOMIC_STORE_BOOL(&pSampleStreamingSession->terminateFlag, TRUE);
+        raiseCleanupEvent(pSampleStreamingSession->pSampleConfiguration);
+    }
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+VOID sampleNetworkChangeHandler(UINT64 customData)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
+    PStreamingSessionSnapshot pSnapshot;
+    UINT32 i;
+
+    // The sessions of the snapshot aren't freed before it's released
+    if (NULL == (pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration))) {
+        return;
+    }
+
+    // A session still setting up has no candidate pair to lose, the change is seen by its gathering or its checks
+    for (i = 0; i < pSnapshot->sessionCount; i++) {
+        if (!ATOMIC_LOAD_BOOL(&pSnapshot->sessionList[i]->terminateFlag) && ATOMIC_LOAD_BOOL(&pSnapshot->sessionList[i]->iceConnected)) {
+            DLOGI("Restarting the ICE of %s", pSnapshot->sessionList[i]->peerId);
+            UNUSED_PARAM(restartSessionIce(pSnapshot->sessionList[i]));
+        }
     }
-    DLOGD("%s %s", networkInt, (useInterface) ? ("allowed. Candidates to be gathered") : ("blocked. Candidates will not be gathered"));
-    return useInterface;
+
+    releaseStreamingSessionSnapshot(pSnapshot);
 }
 
 VOID onIceCandidateHandler(UINT64 customData, PCHAR candidateJson)
@@ -317,17 +524,35 @@ VOID onIceCandidateHandler(UINT64 customData, PCHAR candidateJson)
     STATUS retStatus = STATUS_SUCCESS;
     PSampleStreamingSession pSampleStreamingSession = (PSampleStreamingSession) customData;
     SignalingMessage message;
+    SampleIceFamily family;
 
     CHK(pSampleStreamingSession != NULL, STATUS_NULL_ARG);
 
+    if (candidateJson != NULL) {
+        recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_FIRST_LOCAL_CANDIDATE);
+        // The interface filter only sees names, an address the policy leaves out can still come from an allowed interface
+        if (!sampleFilterIceCandidate(&pSampleStreamingSession->pSampleConfiguration->iceFilterPolicy, candidateJson, &family)) {
+            recordIceCandidatesFiltered(pSampleStreamingSession->pSampleConfiguration, 1);
+            CHK(FALSE, retStatus);
+        }
+        if (family < SAMPLE_ICE_FAMILY_COUNT) {
+            ATOMIC_INCREMENT(&pSampleStreamingSession->localCandidateCounts[family]);
+        }
+    }
+
     if (candidateJson == NULL) {
         DLOGD("ice candidate gathering finished");
         ATOMIC_STORE_BOOL(&pSampleStreamingSession->candidateGatheringDone, TRUE);
+        recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_ICE_GATHERING_DONE);
+        recordIceGatheringDone(pSampleStreamingSession);
 
-        // if application is master and non-trickle ice, send answer now.
+        // if application is master and non-trickle ice, send answer now, or the offer of an ICE restart with its candidates.
         if (pSampleStreamingSession->pSampleConfiguration->channelInfo.channelRoleType == SIGNALING_CHANNEL_ROLE_TYPE_MASTER &&
-            !pSampleStreamingSession->remoteCanTrickleIce) {
-            CHK_STATUS(createAnswer(pSampleStreamingSession->pPeerConnection, &pSampleStreamingSession->answerSessionDescriptionInit));
+            !pSampleStreamingSession->remoteCanTrickleIce && ATOMIC_LOAD_BOOL(&pSampleStreamingSession->iceRestarting)) {
+            CHK_STATUS(sendIceRestartOffer(pSampleStreamingSession));
+        } else if (pSampleStreamingSession->pSampleConfiguration->channelInfo.channelRoleType == SIGNALING_CHANNEL_ROLE_TYPE_MASTER &&
+                   !pSampleStreamingSession->remoteCanTrickleIce) {
+            CHK_STATUS(createAnswer(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pAnswerSessionDescriptionInit));
             CHK_STATUS(respondWithAnswer(pSampleStreamingSession));
             DLOGD("time taken to send answer %" PRIu64 " ms",
                   (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
@@ -356,17 +581,19 @@ STATUS initializePeerConnection(PSampleConfiguration pSampleConfiguration, PRtcP
     ENTERS();
     STATUS retStatus = STATUS_SUCCESS;
     RtcConfiguration configuration;
-    UINT32 i, j, iceConfigCount, uriCount = 0, maxTurnServer = 1;
+    UINT32 i, j, iceConfigCount, uriCount = 0, maxTurnServer = SAMPLE_ICE_SERVER_CACHE_MAX_TURN_SERVERS;
     PIceConfigInfo pIceConfigInfo;
     UINT64 data, curTime;
-    PRtcCertificate pRtcCertificate = NULL;
+    PPooledCertificate pPooledCertificate = NULL;
+    BOOL locked = FALSE;
 
     CHK(pSampleConfiguration != NULL && ppRtcPeerConnection != NULL, STATUS_NULL_ARG);
 
     MEMSET(&configuration, 0x00, SIZEOF(RtcConfiguration));
 
-    // Set this to custom callback to enable filtering of interfaces
-    configuration.kvsRtcConfiguration.iceSetInterfaceFilterFunc = NULL;
+    // Leaves the interfaces out of ICE as configured by the SAMPLE_ICE_*_ENV_VAR env vars
+    configuration.kvsRtcConfiguration.iceSetInterfaceFilterFunc = sampleFilterNetworkInterfaces;
+    configuration.kvsRtcConfiguration.filterCustomData = (UINT64) &pSampleConfiguration->iceFilterPolicy;
 
     // Disable TWCC to save RAM
     configuration.kvsRtcConfiguration.disableSenderSideBandwidthEstimation = FALSE;
@@ -377,7 +604,14 @@ STATUS initializePeerConnection(PSampleConfiguration pSampleConfiguration, PRtcP
     // Set the  STUN server
     SNPRINTF(configuration.iceServers[0].urls, MAX_ICE_CONFIG_URI_LEN, KINESIS_VIDEO_STUN_URL, pSampleConfiguration->channelInfo.pRegion);
 
-    if (pSampleConfiguration->useTurn) {
+    // Skip the DNS lookup of the STUN server and the TURN server request when they are cached
+    CHK_STATUS(setCachedIceServers(pSampleConfiguration, &configuration, maxTurnServer, &uriCount));
+
+    // Session setup workers get here in parallel, the signaling client and the certificate pool are shared
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = TRUE;
+
+    if (pSampleConfiguration->useTurn && uriCount == 0) {
         // Set the URIs from the configuration
         CHK_STATUS(signalingClientGetIceConfigInfoCount(pSampleConfiguration->signalingClientHandle, &iceConfigCount));
 
@@ -409,7 +643,6 @@ STATUS initializePeerConnection(PSampleConfiguration pSampleConfiguration, PRtcP
     pSampleConfiguration->iceUriCount = uriCount + 1;
 
     // Check if we have any pregenerated certs and use them
-    // NOTE: We are running under the config lock
     retStatus = stackQueueDequeue(pSampleConfiguration->pregeneratedCertificates, &data);
     CHK(retStatus == STATUS_SUCCESS || retStatus == STATUS_NOT_FOUND, retStatus);
 
@@ -417,20 +650,30 @@ STATUS initializePeerConnection(PSampleConfiguration pSampleConfiguration, PRtcP
         retStatus = STATUS_SUCCESS;
     } else {
         // Use the pre-generated cert and get rid of it to not reuse again
-        pRtcCertificate = (PRtcCertificate) data;
-        configuration.certificates[0] = *pRtcCertificate;
+        pPooledCertificate = (PPooledCertificate) data;
+        configuration.certificates[0] = *pPooledCertificate->pRtcCertificate;
+        pSampleConfiguration->pregeneratedCertificatesChanged = TRUE;
     }
 
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = FALSE;
+
+    // Without a pre-generated certificate, this includes generating one
     curTime = GETTIME();
     CHK_STATUS(createPeerConnection(&configuration, ppRtcPeerConnection));
-    DLOGD("time taken to create peer connection %" PRIu64 " ms", (GETTIME() - curTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+    DLOGI("time taken to create peer connection %" PRIu64 " ms with a %s certificate", (GETTIME() - curTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND,
+          pPooledCertificate == NULL ? "new" : (pPooledCertificate->loaded ? "persisted" : "pre-generated"));
 
 CleanUp:
 
+    if (locked) {
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
     CHK_LOG_ERR(retStatus);
 
     // Free the certificate which can be NULL as we no longer need it and won't reuse
-    freeRtcCertificate(pRtcCertificate);
+    freePooledCertificate(pPooledCertificate);
 
     LEAVES();
     return retStatus;
@@ -492,6 +735,14 @@ STATUS createSampleStreamingSession(PSampleConfiguration pSampleConfiguration, P
 
     ATOMIC_STORE_BOOL(&pSampleStreamingSession->terminateFlag, FALSE);
     ATOMIC_STORE_BOOL(&pSampleStreamingSession->candidateGatheringDone, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleStreamingSession->iceConnected, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleStreamingSession->iceRestarting, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleStreamingSession->videoRestartRequested, FALSE);
+
+    pSampleStreamingSession->sendQueueLock = MUTEX_CREATE(FALSE);
+    CHK(IS_VALID_MUTEX_VALUE(pSampleStreamingSession->sendQueueLock), STATUS_INVALID_OPERATION);
+    pSampleStreamingSession->sendQueueCvar = CVAR_CREATE();
+    CHK(IS_VALID_CVAR_VALUE(pSampleStreamingSession->sendQueueCvar), STATUS_INVALID_OPERATION);
 
     CHK_STATUS(initializePeerConnection(pSampleConfiguration, &pSampleStreamingSession->pPeerConnection));
     CHK_STATUS(peerConnectionOnIceCandidate(pSampleStreamingSession->pPeerConnection, (UINT64) pSampleStreamingSession, onIceCandidateHandler));
@@ -534,6 +785,8 @@ STATUS createSampleStreamingSession(PSampleConfiguration pSampleConfiguration, P
                                                          sampleSenderBandwidthEstimationHandler));
     pSampleStreamingSession->firstFrame = TRUE;
     pSampleStreamingSession->startUpLatency = 0;
+
+    CHK_STATUS(THREAD_CREATE(&pSampleStreamingSession->frameSenderTid, sessionFrameSenderRoutine, (PVOID) pSampleStreamingSession));
 CleanUp:
 
     if (STATUS_FAILED(retStatus) && pSampleStreamingSession != NULL) {
@@ -553,6 +806,7 @@ STATUS freeSampleStreamingSession(PSampleStreamingSession* ppSampleStreamingSess
     STATUS retStatus = STATUS_SUCCESS;
     PSampleStreamingSession pSampleStreamingSession = NULL;
     PSampleConfiguration pSampleConfiguration;
+    SampleSendQueueStats sendQueueStats;
 
     CHK(ppSampleStreamingSession != NULL, STATUS_NULL_ARG);
     pSampleStreamingSession = *ppSampleStreamingSession;
@@ -571,11 +825,33 @@ STATUS freeSampleStreamingSession(PSampleStreamingSession* ppSampleStreamingSess
         THREAD_JOIN(pSampleStreamingSession->receiveAudioVideoSenderTid, NULL);
     }
 
+    if (IS_VALID_TID_VALUE(pSampleStreamingSession->frameSenderTid)) {
+        MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+        CVAR_BROADCAST(pSampleStreamingSession->sendQueueCvar);
+        MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+        THREAD_JOIN(pSampleStreamingSession->frameSenderTid, NULL);
+    }
+
+    if (STATUS_SUCCEEDED(getSessionSendQueueStats(pSampleStreamingSession, &sendQueueStats))) {
+        DLOGI("Send queue of %s: max depth %u, dropped frames %" PRIu64 ", fell behind %" PRIu64 " times for %" PRIu64 " ms, paced for %" PRIu64
+              " ms",
+              pSampleStreamingSession->peerId, sendQueueStats.maxQueueDepth, sendQueueStats.droppedFrames, sendQueueStats.keyFrameWaitCount,
+              sendQueueStats.timeBehind / HUNDREDS_OF_NANOS_IN_A_MILLISECOND, sendQueueStats.pacedTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+    }
+
+    // Release the frames which were never sent
+    while (pSampleStreamingSession->sendQueueCount > 0) {
+        releaseSharedFrame(pSampleStreamingSession->sendQueue[pSampleStreamingSession->sendQueueHead]);
+        pSampleStreamingSession->sendQueueHead = (pSampleStreamingSession->sendQueueHead + 1) % SAMPLE_SESSION_SEND_QUEUE_LENGTH;
+        pSampleStreamingSession->sendQueueCount--;
+    }
+
     // De-initialize the session stats timer if there are no active sessions
     // NOTE: we need to perform this under the lock which might be acquired by
     // the running thread but it's OK as it's re-entrant
     MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
-    if (pSampleConfiguration->iceCandidatePairStatsTimerId != MAX_UINT32 && pSampleConfiguration->streamingSessionCount == 0 &&
+    if (pSampleConfiguration->iceCandidatePairStatsTimerId != MAX_UINT32 &&
+        pSampleConfiguration->iceCandidatePairStatsTimerId != SAMPLE_STATS_TIMER_ID_PENDING && pSampleConfiguration->streamingSessionCount == 0 &&
         IS_VALID_TIMER_QUEUE_HANDLE(pSampleConfiguration->timerQueueHandle)) {
         CHK_LOG_ERR(timerQueueCancelTimer(pSampleConfiguration->timerQueueHandle, pSampleConfiguration->iceCandidatePairStatsTimerId,
                                           (UINT64) pSampleConfiguration));
@@ -585,6 +861,16 @@ STATUS freeSampleStreamingSession(PSampleStreamingSession* ppSampleStreamingSess
 
     CHK_LOG_ERR(closePeerConnection(pSampleStreamingSession->pPeerConnection));
     CHK_LOG_ERR(freePeerConnection(&pSampleStreamingSession->pPeerConnection));
+
+    if (IS_VALID_MUTEX_VALUE(pSampleStreamingSession->sendQueueLock)) {
+        MUTEX_FREE(pSampleStreamingSession->sendQueueLock);
+    }
+
+    if (IS_VALID_CVAR_VALUE(pSampleStreamingSession->sendQueueCvar)) {
+        CVAR_FREE(pSampleStreamingSession->sendQueueCvar);
+    }
+
+    SAFE_MEMFREE(pSampleStreamingSession->pAnswerSessionDescriptionInit);
     SAFE_MEMFREE(pSampleStreamingSession);
 
 CleanUp:
@@ -610,161 +896,922 @@ CleanUp:
     return retStatus;
 }
 
-VOID sampleFrameHandler(UINT64 customData, PFrame pFrame)
+// Collects the NAL unit types of an Annex-B H.264 frame up to its first slice
+static UINT32 getH264NalTypes(PBYTE pData, UINT32 size)
 {
-    UNUSED_PARAM(customData);
-    DLOGV("Frame received. TrackId: %" PRIu64 ", Size: %u, Flags %u", pFrame->trackId, pFrame->size, pFrame->flags);
-    PSampleStreamingSession pSampleStreamingSession = (PSampleStreamingSession) customData;
-    if (pSampleStreamingSession->firstFrame) {
-        pSampleStreamingSession->firstFrame = FALSE;
-        pSampleStreamingSession->startUpLatency = (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
-        printf("Start up latency from offer to first frame: %" PRIu64 "ms\n", pSampleStreamingSession->startUpLatency);
-    }
-}
+    UINT32 i, nalTypes = 0;
+    BYTE nalType;
 
-VOID sampleBandwidthEstimationHandler(UINT64 customData, DOUBLE maximumBitrate)
-{
-    UNUSED_PARAM(customData);
-    DLOGV("received bitrate suggestion: %f", maximumBitrate);
-}
+    for (i = 0; i + 3 < size; i++) {
+        if (pData[i] != 0x00 || pData[i + 1] != 0x00 || pData[i + 2] != 0x01) {
+            continue;
+        }
 
-VOID sampleSenderBandwidthEstimationHandler(UINT64 customData, UINT32 txBytes, UINT32 rxBytes, UINT32 txPacketsCnt, UINT32 rxPacketsCnt,
-                                            UINT64 duration)
-{
-    UNUSED_PARAM(customData);
-    UNUSED_PARAM(duration);
-    UNUSED_PARAM(rxBytes);
-    UNUSED_PARAM(txBytes);
-    UINT32 lostPacketsCnt = txPacketsCnt - rxPacketsCnt;
-    UINT32 percentLost = lostPacketsCnt * 100 / txPacketsCnt;
-    UINT32 bitrate = 1024;
-    if (percentLost < 2) {
-        // increase encoder bitrate by 2 percent
-        bitrate *= 1.02f;
-    } else if (percentLost > 5) {
-        // decrease encoder bitrate by packet loss percent
-        bitrate *= (1.0f - percentLost / 100.0f);
+        nalType = pData[i + 3] & 0x1F;
+        nalTypes |= 1 << nalType;
+        if (nalType == SAMPLE_H264_NAL_TYPE_SLICE || nalType == SAMPLE_H264_NAL_TYPE_IDR_SLICE) {
+            break;
+        }
+        i += 3;
     }
-    // otherwise keep bitrate the same
 
-    DLOGS("received sender bitrate estimation: suggested bitrate %u sent: %u bytes %u packets received: %u bytes %u packets in %lu msec, ", bitrate,
-          txBytes, txPacketsCnt, rxBytes, rxPacketsCnt, duration / 10000ULL);
+    return nalTypes;
 }
 
-STATUS handleRemoteCandidate(PSampleStreamingSession pSampleStreamingSession, PSignalingMessage pSignalingMessage)
+STATUS createSharedFrame(UINT64 presentationTs, PBYTE pData, UINT32 size, BOOL isVideo, PSampleSharedFrame* ppSharedFrame)
 {
     STATUS retStatus = STATUS_SUCCESS;
-    RtcIceCandidateInit iceCandidate;
-    CHK(pSampleStreamingSession != NULL && pSignalingMessage != NULL, STATUS_NULL_ARG);
-
-    CHK_STATUS(deserializeRtcIceCandidateInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &iceCandidate));
-    CHK_STATUS(addIceCandidate(pSampleStreamingSession->pPeerConnection, iceCandidate.candidate));
+    PSampleSharedFrame pSharedFrame = NULL;
+
+    CHK(pData != NULL && ppSharedFrame != NULL, STATUS_NULL_ARG);
+
+    // Single allocation for the header and the frame data
+    CHK(NULL != (pSharedFrame = (PSampleSharedFrame) MEMALLOC(SIZEOF(SampleSharedFrame) + size)), STATUS_NOT_ENOUGH_MEMORY);
+    MEMSET(pSharedFrame, 0x00, SIZEOF(SampleSharedFrame));
+    pSharedFrame->refCount = 1;
+    pSharedFrame->isVideo = isVideo;
+    pSharedFrame->createTime = GETTIME();
+    if (isVideo) {
+        pSharedFrame->h264NalTypes = getH264NalTypes(pData, size);
+        // A frame starting with the parameter sets is treated as a key frame, the IDR follows it
+        if ((pSharedFrame->h264NalTypes & ((1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE) | (1 << SAMPLE_H264_NAL_TYPE_SPS))) != 0) {
+            pSharedFrame->frame.flags = FRAME_FLAG_KEY_FRAME;
+        }
+    }
+    pSharedFrame->frame.presentationTs = presentationTs;
+    pSharedFrame->frame.size = size;
+    pSharedFrame->frame.frameData = (PBYTE) (pSharedFrame + 1);
+    MEMCPY(pSharedFrame->frame.frameData, pData, size);
 
 CleanUp:
 
-    CHK_LOG_ERR(retStatus);
+    if (ppSharedFrame != NULL) {
+        *ppSharedFrame = pSharedFrame;
+    }
+
     return retStatus;
 }
 
-STATUS traverseDirectoryPEMFileScan(UINT64 customData, DIR_ENTRY_TYPES entryType, PCHAR fullPath, PCHAR fileName)
+VOID releaseSharedFrame(PSampleSharedFrame pSharedFrame)
 {
-    UNUSED_PARAM(entryType);
-    UNUSED_PARAM(fullPath);
+    // ATOMIC_DECREMENT returns the value before decrementing
+    if (pSharedFrame != NULL && ATOMIC_DECREMENT(&pSharedFrame->refCount) == 1) {
+        MEMFREE(pSharedFrame);
+    }
+}
 
-    PCHAR certName = (PCHAR) customData;
-    UINT32 fileNameLen = STRLEN(fileName);
+// Called under gopCacheLock
+static VOID releaseGopCacheFrames(PSampleConfiguration pSampleConfiguration)
+{
+    UINT32 i;
 
-    if (fileNameLen > ARRAY_SIZE(CA_CERT_PEM_FILE_EXTENSION) + 1 &&
-        (STRCMPI(CA_CERT_PEM_FILE_EXTENSION, &fileName[fileNameLen - ARRAY_SIZE(CA_CERT_PEM_FILE_EXTENSION) + 1]) == 0)) {
-        certName[0] = FPATHSEPARATOR;
-        certName++;
-        STRCPY(certName, fileName);
+    for (i = 0; i < pSampleConfiguration->gopCacheCount; i++) {
+        releaseSharedFrame(pSampleConfiguration->gopCache[i]);
+        pSampleConfiguration->gopCache[i] = NULL;
     }
-
-    return STATUS_SUCCESS;
+    pSampleConfiguration->gopCacheCount = 0;
 }
 
-STATUS lookForSslCert(PSampleConfiguration* ppSampleConfiguration)
+VOID updateGopCache(PSampleConfiguration pSampleConfiguration, PSampleSharedFrame pSharedFrame)
 {
-    STATUS retStatus = STATUS_SUCCESS;
-    struct stat pathStat;
-    CHAR certName[MAX_PATH_LEN];
-    PSampleConfiguration pSampleConfiguration = *ppSampleConfiguration;
+    UINT32 nalTypes;
 
-    MEMSET(certName, 0x0, ARRAY_SIZE(certName));
-    pSampleConfiguration->pCaCertPath = getenv(CACERT_PATH_ENV_VAR);
+    if (pSampleConfiguration == NULL || pSharedFrame == NULL || !pSharedFrame->isVideo) {
+        return;
+    }
 
-    // if ca cert path is not set from the environment, try to use the one that cmake detected
-    if (pSampleConfiguration->pCaCertPath == NULL) {
-        CHK_ERR(STRNLEN(DEFAULT_KVS_CACERT_PATH, MAX_PATH_LEN) > 0, STATUS_INVALID_OPERATION, "No ca cert path given (error:%s)", strerror(errno));
-        pSampleConfiguration->pCaCertPath = DEFAULT_KVS_CACERT_PATH;
-    } else {
-        // Check if the environment variable is a path
-        CHK(0 == FSTAT(pSampleConfiguration->pCaCertPath, &pathStat), STATUS_DIRECTORY_ENTRY_STAT_ERROR);
+    nalTypes = pSharedFrame->h264NalTypes;
 
-        if (S_ISDIR(pathStat.st_mode)) {
-            CHK_STATUS(traverseDirectory(pSampleConfiguration->pCaCertPath, (UINT64) &certName, /* iterate */ FALSE, traverseDirectoryPEMFileScan));
+    MUTEX_LOCK(pSampleConfiguration->gopCacheLock);
 
-            if (certName[0] != 0x0) {
-                STRCAT(pSampleConfiguration->pCaCertPath, certName);
-            } else {
-                DLOGW("Cert not found in path set...checking if CMake detected a path\n");
-                CHK_ERR(STRNLEN(DEFAULT_KVS_CACERT_PATH, MAX_PATH_LEN) > 0, STATUS_INVALID_OPERATION, "No ca cert path given (error:%s)",
-                        strerror(errno));
-                DLOGI("CMake detected cert path\n");
-                pSampleConfiguration->pCaCertPath = DEFAULT_KVS_CACERT_PATH;
-            }
-        }
+    // The index is assigned under the lock so the cache and the send queues agree on the order of the frames
+    pSharedFrame->videoFrameIndex = ++pSampleConfiguration->videoFrameIndex;
+
+    if ((nalTypes & (1 << SAMPLE_H264_NAL_TYPE_SPS)) != 0) {
+        releaseSharedFrame(pSampleConfiguration->pParameterSetFrame);
+        ATOMIC_INCREMENT(&pSharedFrame->refCount);
+        pSampleConfiguration->pParameterSetFrame = pSharedFrame;
     }
 
-CleanUp:
+    if ((nalTypes & (1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE)) != 0) {
+        releaseGopCacheFrames(pSampleConfiguration);
+        pSampleConfiguration->gopCacheKeyFramesOnly = FALSE;
+    }
 
-    CHK_LOG_ERR(retStatus);
-    return retStatus;
+    if ((nalTypes & ((1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE) | (1 << SAMPLE_H264_NAL_TYPE_SLICE))) == 0) {
+        // Parameter sets without a picture are only kept in pParameterSetFrame
+    } else if (pSampleConfiguration->gopCacheCount == SAMPLE_GOP_CACHE_MAX_FRAMES) {
+        // The GOP is too long to be cached, new sessions wait for the next IDR instead
+        releaseGopCacheFrames(pSampleConfiguration);
+    } else if (pSampleConfiguration->gopCacheCount > 0 || (nalTypes & (1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE)) != 0) {
+        ATOMIC_INCREMENT(&pSharedFrame->refCount);
+        pSampleConfiguration->gopCache[pSampleConfiguration->gopCacheCount++] = pSharedFrame;
+    }
+
+    MUTEX_UNLOCK(pSampleConfiguration->gopCacheLock);
 }
 
-STATUS createSampleConfiguration(PCHAR channelName, SIGNALING_CHANNEL_ROLE_TYPE roleType, BOOL trickleIce, BOOL useTurn,
-                                 PSampleConfiguration* ppSampleConfiguration)
+// Called when a P-frame is skipped while idle, the cached frames after the IDR can't be followed by the live ones anymore
+static VOID trimGopCacheToKeyFrame(PSampleConfiguration pSampleConfiguration)
 {
-    STATUS retStatus = STATUS_SUCCESS;
-    PCHAR pAccessKey, pSecretKey, pSessionToken, pLogLevel;
-    PSampleConfiguration pSampleConfiguration = NULL;
-    UINT32 logLevel = LOG_LEVEL_DEBUG;
-
-    CHK(ppSampleConfiguration != NULL, STATUS_NULL_ARG);
+    UINT32 i;
 
-    CHK(NULL != (pSampleConfiguration = (PSampleConfiguration) MEMCALLOC(1, SIZEOF(SampleConfiguration))), STATUS_NOT_ENOUGH_MEMORY);
+    MUTEX_LOCK(pSampleConfiguration->gopCacheLock);
+    if (!pSampleConfiguration->gopCacheKeyFramesOnly) {
+        for (i = 1; i < pSampleConfiguration->gopCacheCount; i++) {
+            releaseSharedFrame(pSampleConfiguration->gopCache[i]);
+            pSampleConfiguration->gopCache[i] = NULL;
+        }
+        pSampleConfiguration->gopCacheCount = MIN(pSampleConfiguration->gopCacheCount, 1);
+        pSampleConfiguration->gopCacheKeyFramesOnly = TRUE;
+    }
+    MUTEX_UNLOCK(pSampleConfiguration->gopCacheLock);
+}
 
-#ifdef IOT_CORE_ENABLE_CREDENTIALS
-    PCHAR pIotCoreCredentialEndPoint, pIotCoreCert, pIotCorePrivateKey, pIotCoreRoleAlias, pIotCoreThingName;
-    CHK_ERR((pIotCoreCredentialEndPoint = getenv(IOT_CORE_CREDENTIAL_ENDPOINT)) != NULL, STATUS_INVALID_OPERATION,
-            "AWS_IOT_CORE_CREDENTIAL_ENDPOINT must be set");
-    CHK_ERR((pIotCoreCert = getenv(IOT_CORE_CERT)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_CERT must be set");
-    CHK_ERR((pIotCorePrivateKey = getenv(IOT_CORE_PRIVATE_KEY)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_PRIVATE_KEY must be set");
-    CHK_ERR((pIotCoreRoleAlias = getenv(IOT_CORE_ROLE_ALIAS)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_ROLE_ALIAS must be set");
-#else
-    CHK_ERR((pAccessKey = getenv(ACCESS_KEY_ENV_VAR)) != NULL, STATUS_INVALID_OPERATION, "AWS_ACCESS_KEY_ID must be set");
-    CHK_ERR((pSecretKey = getenv(SECRET_KEY_ENV_VAR)) != NULL, STATUS_INVALID_OPERATION, "AWS_SECRET_ACCESS_KEY must be set");
-#endif
+UINT32 acquireGopCache(PSampleConfiguration pSampleConfiguration, PSampleSharedFrame* pFrames, PBOOL pKeyFramesOnly)
+{
+    UINT32 i, count = 0;
 
-    pSessionToken = getenv(SESSION_TOKEN_ENV_VAR);
-    pSampleConfiguration->enableFileLogging = FALSE;
-    if (NULL != getenv(ENABLE_FILE_LOGGING)) {
-        pSampleConfiguration->enableFileLogging = TRUE;
-    }
-    if ((pSampleConfiguration->channelInfo.pRegion = getenv(DEFAULT_REGION_ENV_VAR)) == NULL) {
-        pSampleConfiguration->channelInfo.pRegion = DEFAULT_AWS_REGION;
+    if (pSampleConfiguration == NULL || pFrames == NULL || pKeyFramesOnly == NULL) {
+        return 0;
     }
 
-    CHK_STATUS(lookForSslCert(&pSampleConfiguration));
+    MUTEX_LOCK(pSampleConfiguration->gopCacheLock);
+    *pKeyFramesOnly = pSampleConfiguration->gopCacheKeyFramesOnly;
+    if (pSampleConfiguration->gopCacheCount > 0) {
+        // The IDR can't be decoded without the parameter sets when the encoder sent them in a frame of their own
+        if (pSampleConfiguration->pParameterSetFrame != NULL && pSampleConfiguration->pParameterSetFrame != pSampleConfiguration->gopCache[0]) {
+            ATOMIC_INCREMENT(&pSampleConfiguration->pParameterSetFrame->refCount);
+            pFrames[count++] = pSampleConfiguration->pParameterSetFrame;
+        }
 
-    // Set the logger log level
-    if (NULL == (pLogLevel = getenv(DEBUG_LOG_LEVEL_ENV_VAR)) || STATUS_SUCCESS != STRTOUI32(pLogLevel, NULL, 10, &logLevel) ||
-        logLevel < LOG_LEVEL_VERBOSE || logLevel > LOG_LEVEL_SILENT) {
-        logLevel = LOG_LEVEL_WARN;
+        for (i = 0; i < pSampleConfiguration->gopCacheCount; i++) {
+            ATOMIC_INCREMENT(&pSampleConfiguration->gopCache[i]->refCount);
+            pFrames[count++] = pSampleConfiguration->gopCache[i];
+        }
     }
+    MUTEX_UNLOCK(pSampleConfiguration->gopCacheLock);
 
-    SET_LOGGER_LOG_LEVEL(logLevel);
+    return count;
+}
+
+VOID clearGopCache(PSampleConfiguration pSampleConfiguration)
+{
+    if (pSampleConfiguration == NULL || !IS_VALID_MUTEX_VALUE(pSampleConfiguration->gopCacheLock)) {
+        return;
+    }
+
+    MUTEX_LOCK(pSampleConfiguration->gopCacheLock);
+    releaseGopCacheFrames(pSampleConfiguration);
+    releaseSharedFrame(pSampleConfiguration->pParameterSetFrame);
+    pSampleConfiguration->pParameterSetFrame = NULL;
+    MUTEX_UNLOCK(pSampleConfiguration->gopCacheLock);
+}
+
+// Called under sendQueueLock, keeps the audio frames in order and releases the video frames
+static VOID dropQueuedVideoFrames(PSampleStreamingSession pSampleStreamingSession)
+{
+    UINT32 i, index, count = 0;
+    PSampleSharedFrame pSharedFrame;
+
+    for (i = 0; i < pSampleStreamingSession->sendQueueCount; i++) {
+        index = (pSampleStreamingSession->sendQueueHead + i) % SAMPLE_SESSION_SEND_QUEUE_LENGTH;
+        pSharedFrame = pSampleStreamingSession->sendQueue[index];
+        if (pSharedFrame->isVideo) {
+            releaseSharedFrame(pSharedFrame);
+            pSampleStreamingSession->sendQueueStats.droppedFrames++;
+        } else {
+            pSampleStreamingSession->sendQueue[(pSampleStreamingSession->sendQueueHead + count) % SAMPLE_SESSION_SEND_QUEUE_LENGTH] = pSharedFrame;
+            count++;
+        }
+    }
+
+    pSampleStreamingSession->sendQueueCount = count;
+}
+
+STATUS enqueueSessionFrame(PSampleStreamingSession pSampleStreamingSession, PSampleSharedFrame pSharedFrame)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    BOOL locked = FALSE, isKeyFrame;
+    UINT64 now;
+
+    CHK(pSampleStreamingSession != NULL && pSharedFrame != NULL, STATUS_NULL_ARG);
+
+    isKeyFrame = pSharedFrame->isVideo && (pSharedFrame->frame.flags & FRAME_FLAG_KEY_FRAME) != 0;
+    now = GETTIME();
+
+    MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+    locked = TRUE;
+
+    if (pSharedFrame->isVideo) {
+        // Decimation starts right away but only ends on a key frame, the P-frames before it reference skipped frames
+        if (isKeyFrame || pSampleStreamingSession->videoDecimationRequested) {
+            pSampleStreamingSession->videoDecimated = pSampleStreamingSession->videoDecimationRequested;
+        }
+        if (pSampleStreamingSession->videoDecimated && !isKeyFrame) {
+            pSampleStreamingSession->sendQueueStats.decimatedFrames++;
+            CHK(FALSE, retStatus);
+        }
+    }
+
+    // The capture thread never waits for a peer. The session has fallen behind when its queue is full, the queued video
+    // is stale by then and a decoder can't use what comes after it until the next key frame, so all of it is dropped.
+    if (pSampleStreamingSession->sendQueueCount == SAMPLE_SESSION_SEND_QUEUE_LENGTH) {
+        dropQueuedVideoFrames(pSampleStreamingSession);
+        // Unless a key frame is coming in and there is room for it now, video resumes at the next key frame
+        if (!(isKeyFrame && pSampleStreamingSession->sendQueueCount < SAMPLE_SESSION_SEND_QUEUE_LENGTH) &&
+            !pSampleStreamingSession->sendQueueWaitForKeyFrame) {
+            pSampleStreamingSession->sendQueueWaitForKeyFrame = TRUE;
+            pSampleStreamingSession->sendQueueBehindStartTime = now;
+            pSampleStreamingSession->sendQueueStats.keyFrameWaitCount++;
+        }
+    }
+
+    if (pSampleStreamingSession->sendQueueWaitForKeyFrame && pSharedFrame->isVideo) {
+        if (!isKeyFrame) {
+            pSampleStreamingSession->sendQueueStats.droppedFrames++;
+            CHK(FALSE, retStatus);
+        }
+
+        pSampleStreamingSession->sendQueueWaitForKeyFrame = FALSE;
+        pSampleStreamingSession->sendQueueStats.timeBehind += now - pSampleStreamingSession->sendQueueBehindStartTime;
+    }
+
+    // Only audio is left in the queue
+    if (pSampleStreamingSession->sendQueueCount == SAMPLE_SESSION_SEND_QUEUE_LENGTH) {
+        pSampleStreamingSession->sendQueueStats.droppedFrames++;
+        CHK(FALSE, retStatus);
+    }
+
+    ATOMIC_INCREMENT(&pSharedFrame->refCount);
+    pSampleStreamingSession->sendQueue[(pSampleStreamingSession->sendQueueHead + pSampleStreamingSession->sendQueueCount) %
+                                       SAMPLE_SESSION_SEND_QUEUE_LENGTH] = pSharedFrame;
+    pSampleStreamingSession->sendQueueCount++;
+    pSampleStreamingSession->sendQueueStats.maxQueueDepth =
+        MAX(pSampleStreamingSession->sendQueueStats.maxQueueDepth, pSampleStreamingSession->sendQueueCount);
+    CVAR_SIGNAL(pSampleStreamingSession->sendQueueCvar);
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+    }
+
+    return retStatus;
+}
+
+STATUS getSessionSendQueueStats(PSampleStreamingSession pSampleStreamingSession, PSampleSendQueueStats pStats)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+
+    CHK(pSampleStreamingSession != NULL && pStats != NULL, STATUS_NULL_ARG);
+
+    MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+    *pStats = pSampleStreamingSession->sendQueueStats;
+    pStats->queueDepth = pSampleStreamingSession->sendQueueCount;
+    pStats->estimatedBitrate = (UINT64) pSampleStreamingSession->estimatedBitrate;
+    if (pSampleStreamingSession->sendQueueWaitForKeyFrame) {
+        pStats->timeBehind += GETTIME() - pSampleStreamingSession->sendQueueBehindStartTime;
+    }
+    MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+
+CleanUp:
+
+    return retStatus;
+}
+
+VOID updateSessionBitrateEstimate(PSampleStreamingSession pSampleStreamingSession, DOUBLE bitrate)
+{
+    PSampleConfiguration pSampleConfiguration;
+    DOUBLE sourceBitrate;
+    UINT64 now = GETTIME();
+
+    if (pSampleStreamingSession == NULL || bitrate <= 0 || ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag)) {
+        return;
+    }
+
+    pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
+    sourceBitrate = (DOUBLE) ATOMIC_LOAD(&pSampleConfiguration->videoSourceBitrate);
+
+    MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+    if (pSampleStreamingSession->estimatedBitrate == 0) {
+        pSampleStreamingSession->estimatedBitrate = bitrate;
+    } else {
+        pSampleStreamingSession->estimatedBitrate += SAMPLE_BITRATE_SMOOTHING_FACTOR * (bitrate - pSampleStreamingSession->estimatedBitrate);
+    }
+
+    // Sending the whole stream over a link which can't carry it only builds up RTP backlog and jitter
+    if (sourceBitrate > 0) {
+        if (!pSampleStreamingSession->videoDecimationRequested &&
+            pSampleStreamingSession->estimatedBitrate < sourceBitrate * (1.0 - SAMPLE_BITRATE_HYSTERESIS)) {
+            pSampleStreamingSession->videoDecimationRequested = TRUE;
+            pSampleStreamingSession->estimateAboveSince = 0;
+            DLOGI("Sending key frames only to %s, estimated %.0f bps for %.0f bps of video", pSampleStreamingSession->peerId,
+                  pSampleStreamingSession->estimatedBitrate, sourceBitrate);
+        } else if (pSampleStreamingSession->videoDecimationRequested &&
+                   pSampleStreamingSession->estimatedBitrate > sourceBitrate * (1.0 + SAMPLE_BITRATE_HYSTERESIS)) {
+            if (pSampleStreamingSession->estimateAboveSince == 0) {
+                pSampleStreamingSession->estimateAboveSince = now;
+            } else if (now - pSampleStreamingSession->estimateAboveSince >= SAMPLE_BITRATE_UPGRADE_HOLD_PERIOD) {
+                pSampleStreamingSession->videoDecimationRequested = FALSE;
+                DLOGI("Sending the whole video to %s again, estimated %.0f bps", pSampleStreamingSession->peerId,
+                      pSampleStreamingSession->estimatedBitrate);
+            }
+        } else {
+            pSampleStreamingSession->estimateAboveSince = 0;
+        }
+    }
+    MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+
+    updateVideoBitrateTarget(pSampleConfiguration);
+}
+
+VOID updateVideoBitrateTarget(PSampleConfiguration pSampleConfiguration)
+{
+    PStreamingSessionSnapshot pSnapshot = NULL;
+    PSampleStreamingSession pSampleStreamingSession;
+    UINT64 estimates[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION], estimate, target, now = GETTIME();
+    UINT32 i, j, count = 0;
+
+    if (pSampleConfiguration == NULL || (pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration)) == NULL) {
+        return;
+    }
+
+    // Sorted ascending, sessions without an estimate yet don't count
+    for (i = 0; i < pSnapshot->sessionCount; i++) {
+        pSampleStreamingSession = pSnapshot->sessionList[i];
+        MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+        estimate = (UINT64) pSampleStreamingSession->estimatedBitrate;
+        MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+        if (estimate == 0) {
+            continue;
+        }
+        for (j = count; j > 0 && estimates[j - 1] > estimate; j--) {
+            estimates[j] = estimates[j - 1];
+        }
+        estimates[j] = estimate;
+        count++;
+    }
+
+    releaseStreamingSessionSnapshot(pSnapshot);
+
+    if (count == 0) {
+        return;
+    }
+
+    target = SAMPLE_BITRATE_POLICY == SAMPLE_BITRATE_POLICY_MEDIAN ? estimates[(count - 1) / 2] : estimates[0];
+
+    MUTEX_LOCK(pSampleConfiguration->bitrateControllerLock);
+    // Go down right away, go up only once the viewers have kept up for the hold period
+    if (pSampleConfiguration->videoBitrateTarget == 0 || target < pSampleConfiguration->videoBitrateTarget * (1.0 - SAMPLE_BITRATE_HYSTERESIS) ||
+        (target > pSampleConfiguration->videoBitrateTarget * (1.0 + SAMPLE_BITRATE_HYSTERESIS) &&
+         pSampleConfiguration->videoBitrateTargetAboveSince != 0 &&
+         now - pSampleConfiguration->videoBitrateTargetAboveSince >= SAMPLE_BITRATE_UPGRADE_HOLD_PERIOD)) {
+        pSampleConfiguration->videoBitrateTarget = target;
+        pSampleConfiguration->videoBitrateTargetAboveSince = 0;
+        DLOGI("Video bitrate target %" PRIu64 " bps from %u sessions", target, count);
+        if (pSampleConfiguration->videoBitrateTargetCallback != NULL) {
+            pSampleConfiguration->videoBitrateTargetCallback((UINT64) pSampleConfiguration, target);
+        }
+    } else if (target > pSampleConfiguration->videoBitrateTarget * (1.0 + SAMPLE_BITRATE_HYSTERESIS)) {
+        if (pSampleConfiguration->videoBitrateTargetAboveSince == 0) {
+            pSampleConfiguration->videoBitrateTargetAboveSince = now;
+        }
+    } else {
+        pSampleConfiguration->videoBitrateTargetAboveSince = 0;
+    }
+    MUTEX_UNLOCK(pSampleConfiguration->bitrateControllerLock);
+}
+
+// Called by the video capture thread only
+static VOID measureVideoSourceBitrate(PSampleConfiguration pSampleConfiguration, UINT32 size)
+{
+    UINT64 now = GETTIME(), elapsed;
+
+    if (pSampleConfiguration->videoMeasurePeriodStart == 0) {
+        pSampleConfiguration->videoMeasurePeriodStart = now;
+        pSampleConfiguration->videoBytesInMeasurePeriod = 0;
+    }
+
+    pSampleConfiguration->videoBytesInMeasurePeriod += size;
+    elapsed = now - pSampleConfiguration->videoMeasurePeriodStart;
+    if (elapsed >= SAMPLE_BITRATE_MEASURE_PERIOD) {
+        ATOMIC_STORE(&pSampleConfiguration->videoSourceBitrate,
+                     (SIZE_T) (pSampleConfiguration->videoBytesInMeasurePeriod * 8 * HUNDREDS_OF_NANOS_IN_A_SECOND / elapsed));
+        pSampleConfiguration->videoBytesInMeasurePeriod = 0;
+        pSampleConfiguration->videoMeasurePeriodStart = now;
+    }
+}
+
+// Called by the frame sender thread only. Drains the bucket of the session at its pacing rate and waits until the frame
+// fits under the burst size, a frame bigger than the burst waits for an empty bucket. Audio is only counted.
+static VOID paceSessionFrame(PSampleStreamingSession pSampleStreamingSession, UINT32 size, BOOL isVideo)
+{
+    PSampleConfiguration pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
+    UINT32 burstSize = pSampleConfiguration->pacerBurstSize;
+    UINT64 now, waitStartTime = 0;
+    DOUBLE bitrate, threshold = burstSize > size ? (DOUBLE) (burstSize - size) : 0;
+
+    if (burstSize == 0) {
+        return;
+    }
+
+    MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+    while (TRUE) {
+        now = GETTIME();
+        if ((bitrate = pSampleStreamingSession->estimatedBitrate) == 0 &&
+            (bitrate = (DOUBLE) ATOMIC_LOAD(&pSampleConfiguration->videoSourceBitrate)) == 0) {
+            bitrate = SAMPLE_PACER_INITIAL_BITRATE;
+        }
+        // In bytes per 100 ns
+        bitrate *= SAMPLE_PACER_RATE_FACTOR / 8 / HUNDREDS_OF_NANOS_IN_A_SECOND;
+
+        pSampleStreamingSession->pacerLevel -= bitrate * (now - pSampleStreamingSession->pacerUpdateTime);
+        pSampleStreamingSession->pacerLevel = MAX(0, pSampleStreamingSession->pacerLevel);
+        pSampleStreamingSession->pacerUpdateTime = now;
+        if (!isVideo || pSampleStreamingSession->pacerLevel <= threshold || ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag)) {
+            break;
+        }
+
+        if (waitStartTime == 0) {
+            waitStartTime = now;
+        }
+        // New frames in the queue wake us up early, the level is worked out again
+        CVAR_WAIT(pSampleStreamingSession->sendQueueCvar, pSampleStreamingSession->sendQueueLock,
+                  (UINT64) ((pSampleStreamingSession->pacerLevel - threshold) / bitrate) + 1);
+    }
+
+    pSampleStreamingSession->pacerLevel += size;
+    if (waitStartTime != 0) {
+        pSampleStreamingSession->sendQueueStats.pacedTime += now - waitStartTime;
+    }
+    MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+}
+
+// Starts the video of a session with the parameter sets and the current GOP so the viewer can decode its first frame
+// right away instead of waiting for the next IDR. The live frames which were already sent from the cache are skipped.
+static STATUS writeSessionFirstVideoFrames(PSampleStreamingSession pSampleStreamingSession, PSampleSharedFrame pSharedFrame)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleSharedFrame cachedFrames[SAMPLE_GOP_CACHE_MAX_FRAMES + 1];
+    UINT32 i, count;
+    BOOL keyFramesOnly = FALSE;
+
+    count = acquireGopCache(pSampleStreamingSession->pSampleConfiguration, cachedFrames, &keyFramesOnly);
+    if (count == 0) {
+        paceSessionFrame(pSampleStreamingSession, pSharedFrame->frame.size, TRUE);
+        CHK_STATUS(writeFrame(pSampleStreamingSession->pVideoRtcRtpTransceiver, &pSharedFrame->frame));
+        pSampleStreamingSession->lastSentVideoFrameIndex = pSharedFrame->videoFrameIndex;
+    } else {
+        // Nothing is sent before SRTP is ready, the next live frame tries again. The replay is paced like the live
+        // video, sent back to back it is the largest burst a new viewer gets.
+        paceSessionFrame(pSampleStreamingSession, cachedFrames[0]->frame.size, TRUE);
+        CHK_STATUS(writeFrame(pSampleStreamingSession->pVideoRtcRtpTransceiver, &cachedFrames[0]->frame));
+        for (i = 1; i < count && !ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag); i++) {
+            paceSessionFrame(pSampleStreamingSession, cachedFrames[i]->frame.size, TRUE);
+            UNUSED_PARAM(writeFrame(pSampleStreamingSession->pVideoRtcRtpTransceiver, &cachedFrames[i]->frame));
+        }
+        pSampleStreamingSession->lastSentVideoFrameIndex = cachedFrames[count - 1]->videoFrameIndex;
+        // The viewer shows the cached IDR right away but the live P-frames reference frames it never got
+        pSampleStreamingSession->skipVideoUntilKeyFrame = keyFramesOnly;
+        DLOGI("Started the video of %s with %u cached frames", pSampleStreamingSession->peerId, count);
+    }
+
+    pSampleStreamingSession->videoStarted = TRUE;
+    recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_FIRST_RTP_SENT);
+    DLOGI("Time from offer to the first video frame of %s: %" PRIu64 " ms", pSampleStreamingSession->peerId,
+          (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+
+CleanUp:
+
+    for (i = 0; i < count; i++) {
+        releaseSharedFrame(cachedFrames[i]);
+    }
+
+    return retStatus;
+}
+
+PVOID sessionFrameSenderRoutine(PVOID args)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleStreamingSession pSampleStreamingSession = (PSampleStreamingSession) args;
+    PSampleSharedFrame pSharedFrame = NULL;
+
+    CHK(pSampleStreamingSession != NULL, STATUS_NULL_ARG);
+
+    while (TRUE) {
+        MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+        while (pSampleStreamingSession->sendQueueCount == 0 && !ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag)) {
+            CVAR_WAIT(pSampleStreamingSession->sendQueueCvar, pSampleStreamingSession->sendQueueLock, INFINITE_TIME_VALUE);
+        }
+
+        if (ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag)) {
+            MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+            break;
+        }
+
+        pSharedFrame = pSampleStreamingSession->sendQueue[pSampleStreamingSession->sendQueueHead];
+        pSampleStreamingSession->sendQueueHead = (pSampleStreamingSession->sendQueueHead + 1) % SAMPLE_SESSION_SEND_QUEUE_LENGTH;
+        pSampleStreamingSession->sendQueueCount--;
+        pSampleStreamingSession->sendQueueStats.maxQueueDelay =
+            MAX(pSampleStreamingSession->sendQueueStats.maxQueueDelay, GETTIME() - pSharedFrame->createTime);
+        MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+
+        if (ATOMIC_EXCHANGE_BOOL(&pSampleStreamingSession->videoRestartRequested, FALSE)) {
+            pSampleStreamingSession->videoStarted = FALSE;
+        }
+
+        if (!pSharedFrame->isVideo) {
+            paceSessionFrame(pSampleStreamingSession, pSharedFrame->frame.size, FALSE);
+            retStatus = writeFrame(pSampleStreamingSession->pAudioRtcRtpTransceiver, &pSharedFrame->frame);
+        } else if (!pSampleStreamingSession->videoStarted) {
+            retStatus = writeSessionFirstVideoFrames(pSampleStreamingSession, pSharedFrame);
+        } else if (pSampleStreamingSession->skipVideoUntilKeyFrame && (pSharedFrame->frame.flags & FRAME_FLAG_KEY_FRAME) == 0) {
+            pSampleStreamingSession->lastSentVideoFrameIndex = pSharedFrame->videoFrameIndex;
+        } else if (pSharedFrame->videoFrameIndex > pSampleStreamingSession->lastSentVideoFrameIndex) {
+            pSampleStreamingSession->skipVideoUntilKeyFrame = FALSE;
+            paceSessionFrame(pSampleStreamingSession, pSharedFrame->frame.size, TRUE);
+            retStatus = writeFrame(pSampleStreamingSession->pVideoRtcRtpTransceiver, &pSharedFrame->frame);
+            pSampleStreamingSession->lastSentVideoFrameIndex = pSharedFrame->videoFrameIndex;
+        }
+        if (retStatus != STATUS_SRTP_NOT_READY_YET && retStatus != STATUS_SUCCESS) {
+#ifdef VERBOSE
+            printf("writeFrame() failed with 0x%08x\n", retStatus);
+#endif
+        }
+        retStatus = STATUS_SUCCESS;
+
+        releaseSharedFrame(pSharedFrame);
+        pSharedFrame = NULL;
+    }
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return (PVOID) (ULONG_PTR) retStatus;
+}
+
+STATUS publishStreamingSessionSnapshot(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PStreamingSessionSnapshot pOldSnapshot, pNewSnapshot;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    // NOTE: We are running under the config lock so the session list and the snapshots can't change underneath
+    pOldSnapshot = pSampleConfiguration->pStreamingSessionSnapshot;
+    pNewSnapshot = pOldSnapshot == &pSampleConfiguration->streamingSessionSnapshots[0] ? &pSampleConfiguration->streamingSessionSnapshots[1]
+                                                                                     : &pSampleConfiguration->streamingSessionSnapshots[0];
+
+    // The spare snapshot has no readers, they were all gone before it was retired by the previous publish
+    pNewSnapshot->sessionCount = pSampleConfiguration->streamingSessionCount;
+    MEMCPY(pNewSnapshot->sessionList, pSampleConfiguration->sampleStreamingSessionList,
+           pSampleConfiguration->streamingSessionCount * SIZEOF(PSampleStreamingSession));
+
+    MUTEX_LOCK(pSampleConfiguration->streamingSessionListReadLock);
+    pSampleConfiguration->pStreamingSessionSnapshot = pNewSnapshot;
+    MUTEX_UNLOCK(pSampleConfiguration->streamingSessionListReadLock);
+
+    // Wait for the capture threads which are still fanning out a frame to the old list
+    while (pOldSnapshot != NULL && ATOMIC_LOAD(&pOldSnapshot->refCount) != 0) {
+        THREAD_SLEEP(SAMPLE_SESSION_SNAPSHOT_RETIRE_POLL_PERIOD);
+    }
+
+CleanUp:
+
+    return retStatus;
+}
+
+PStreamingSessionSnapshot acquireStreamingSessionSnapshot(PSampleConfiguration pSampleConfiguration)
+{
+    PStreamingSessionSnapshot pSnapshot = NULL;
+
+    if (pSampleConfiguration != NULL) {
+        // The lock only covers taking the reference, publishing a new list doesn't hold it while waiting for readers
+        MUTEX_LOCK(pSampleConfiguration->streamingSessionListReadLock);
+        pSnapshot = pSampleConfiguration->pStreamingSessionSnapshot;
+        if (pSnapshot != NULL) {
+            ATOMIC_INCREMENT(&pSnapshot->refCount);
+        }
+        MUTEX_UNLOCK(pSampleConfiguration->streamingSessionListReadLock);
+    }
+
+    return pSnapshot;
+}
+
+VOID releaseStreamingSessionSnapshot(PStreamingSessionSnapshot pSnapshot)
+{
+    if (pSnapshot != NULL) {
+        ATOMIC_DECREMENT(&pSnapshot->refCount);
+    }
+}
+
+STATUS writeFrameToAllSessions(PSampleConfiguration pSampleConfiguration, UINT64 presentationTs, PBYTE pData, UINT32 size, PCHAR trackId)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PStreamingSessionSnapshot pSnapshot = NULL;
+    PSampleSharedFrame pSharedFrame = NULL;
+    BOOL isVideo = TRUE;
+    UINT32 i, nalTypes;
+
+    CHK(pSampleConfiguration != NULL && pData != NULL && trackId != NULL, STATUS_NULL_ARG);
+
+    if (!STRNCMP(trackId, SAMPLE_VIDEO_TRACK_ID, STRLEN(SAMPLE_VIDEO_TRACK_ID))) {
+        isVideo = TRUE;
+    } else if (!STRNCMP(trackId, SAMPLE_AUDIO_TRACK_ID, STRLEN(SAMPLE_AUDIO_TRACK_ID))) {
+        isVideo = FALSE;
+    } else {
+        CHK_ERR(FALSE, STATUS_INVALID_ARG, "unknown trackId: %s", trackId);
+    }
+
+    pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration);
+    // Video is cached even when nobody is watching so the first session can start with a decodable frame
+    CHK(pSnapshot != NULL && (isVideo || pSnapshot->sessionCount > 0), retStatus);
+
+    if (isVideo) {
+        measureVideoSourceBitrate(pSampleConfiguration, size);
+    }
+
+    // The encoder may not start with an IDR after the capturer was released, the sessions couldn't decode what comes before it
+    if (isVideo && ATOMIC_LOAD_BOOL(&pSampleConfiguration->videoWaitForKeyFrame)) {
+        nalTypes = getH264NalTypes(pData, size);
+        CHK((nalTypes & ((1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE) | (1 << SAMPLE_H264_NAL_TYPE_SPS))) != 0, retStatus);
+        if ((nalTypes & (1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE)) != 0) {
+            ATOMIC_STORE_BOOL(&pSampleConfiguration->videoWaitForKeyFrame, FALSE);
+        }
+    }
+
+    // Keep the idle capture thread cheap, the cached IDR is still enough for a viewer to show a picture right away
+    if (pSampleConfiguration->idleCaptureMode == SAMPLE_IDLE_CAPTURE_MODE_KEY_FRAMES && pSnapshot->sessionCount == 0 &&
+        (getH264NalTypes(pData, size) & ((1 << SAMPLE_H264_NAL_TYPE_IDR_SLICE) | (1 << SAMPLE_H264_NAL_TYPE_SPS))) == 0) {
+        trimGopCacheToKeyFrame(pSampleConfiguration);
+        CHK(FALSE, retStatus);
+    }
+
+    // Copy the frame once, every session keeps a reference until it has been sent
+    CHK_STATUS(createSharedFrame(presentationTs, pData, size, isVideo, &pSharedFrame));
+    if (isVideo) {
+        updateGopCache(pSampleConfiguration, pSharedFrame);
+    }
+    for (i = 0; i < pSnapshot->sessionCount; ++i) {
+        if (!ATOMIC_LOAD_BOOL(&pSnapshot->sessionList[i]->terminateFlag)) {
+            UNUSED_PARAM(enqueueSessionFrame(pSnapshot->sessionList[i], pSharedFrame));
+        }
+    }
+
+CleanUp:
+
+    releaseSharedFrame(pSharedFrame);
+    releaseStreamingSessionSnapshot(pSnapshot);
+
+    return retStatus;
+}
+
+BOOL hasStreamingSession(PSampleConfiguration pSampleConfiguration)
+{
+    PStreamingSessionSnapshot pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration);
+    BOOL hasSession = pSnapshot != NULL && pSnapshot->sessionCount > 0;
+
+    releaseStreamingSessionSnapshot(pSnapshot);
+
+    return hasSession;
+}
+
+// Blocks a capture thread which released its capturer until a session is added, returns FALSE once the app terminates
+BOOL waitForStreamingSession(PSampleConfiguration pSampleConfiguration)
+{
+    if (pSampleConfiguration == NULL) {
+        return FALSE;
+    }
+
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    while (pSampleConfiguration->streamingSessionCount == 0 && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        CVAR_WAIT(pSampleConfiguration->cvar, pSampleConfiguration->sampleConfigurationObjLock, SAMPLE_IDLE_CAPTURE_WAIT_PERIOD);
+    }
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+
+    return !ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag);
+}
+
+// The cached GOP came from the encoder which was just stopped, the next viewer starts at the first IDR of the new one
+VOID videoCaptureReleased(PSampleConfiguration pSampleConfiguration)
+{
+    if (pSampleConfiguration == NULL) {
+        return;
+    }
+
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->videoWaitForKeyFrame, TRUE);
+    clearGopCache(pSampleConfiguration);
+}
+
+VOID sampleFrameHandler(UINT64 customData, PFrame pFrame)
+{
+    UNUSED_PARAM(customData);
+    DLOGV("Frame received. TrackId: %" PRIu64 ", Size: %u, Flags %u", pFrame->trackId, pFrame->size, pFrame->flags);
+    PSampleStreamingSession pSampleStreamingSession = (PSampleStreamingSession) customData;
+    if (pSampleStreamingSession->firstFrame) {
+        pSampleStreamingSession->firstFrame = FALSE;
+        pSampleStreamingSession->startUpLatency = (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
+        printf("Start up latency from offer to first frame: %" PRIu64 "ms\n", pSampleStreamingSession->startUpLatency);
+        recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_FIRST_FRAME_RECEIVED);
+    }
+}
+
+VOID sampleBandwidthEstimationHandler(UINT64 customData, DOUBLE maximumBitrate)
+{
+    DLOGV("received bitrate suggestion: %f", maximumBitrate);
+    updateSessionBitrateEstimate((PSampleStreamingSession) customData, maximumBitrate);
+}
+
+VOID sampleSenderBandwidthEstimationHandler(UINT64 customData, UINT32 txBytes, UINT32 rxBytes, UINT32 txPacketsCnt, UINT32 rxPacketsCnt,
+                                            UINT64 duration)
+{
+    PSampleStreamingSession pSampleStreamingSession = (PSampleStreamingSession) customData;
+    UINT32 lostPacketsCnt, percentLost;
+    DOUBLE deliveredBitrate, estimatedBitrate, bitrate;
+
+    if (pSampleStreamingSession == NULL || txPacketsCnt == 0 || duration == 0) {
+        return;
+    }
+
+    lostPacketsCnt = txPacketsCnt > rxPacketsCnt ? txPacketsCnt - rxPacketsCnt : 0;
+    percentLost = lostPacketsCnt * 100 / txPacketsCnt;
+    deliveredBitrate = (DOUBLE) rxBytes * 8 * HUNDREDS_OF_NANOS_IN_A_SECOND / duration;
+
+    MUTEX_LOCK(pSampleStreamingSession->sendQueueLock);
+    estimatedBitrate = pSampleStreamingSession->estimatedBitrate;
+    MUTEX_UNLOCK(pSampleStreamingSession->sendQueueLock);
+
+    if (estimatedBitrate == 0) {
+        bitrate = deliveredBitrate;
+    } else if (percentLost < 2) {
+        // increase by 5 percent, the estimate of a decimated session has to be able to grow past what it receives now
+        bitrate = MAX(estimatedBitrate, deliveredBitrate) * 1.05;
+    } else if (percentLost > 5) {
+        // decrease what got through by packet loss percent
+        bitrate = deliveredBitrate * (1.0 - percentLost / 100.0);
+    } else {
+        // otherwise keep bitrate the same
+        bitrate = estimatedBitrate;
+    }
+
+    DLOGS("received sender bitrate estimation: suggested bitrate %.0f sent: %u bytes %u packets received: %u bytes %u packets in %lu msec, ", bitrate,
+          txBytes, txPacketsCnt, rxBytes, rxPacketsCnt, duration / 10000ULL);
+
+    updateSessionBitrateEstimate(pSampleStreamingSession, bitrate);
+}
+
+STATUS handleRemoteCandidate(PSampleStreamingSession pSampleStreamingSession, PSignalingMessage pSignalingMessage)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    RtcIceCandidateInit iceCandidate;
+    SampleIceFamily family;
+    CHK(pSampleStreamingSession != NULL && pSignalingMessage != NULL, STATUS_NULL_ARG);
+
+    CHK_STATUS(deserializeRtcIceCandidateInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &iceCandidate));
+    // Not given to the SDK, so it's never paired with the local candidates
+    if (!sampleFilterIceCandidate(&pSampleStreamingSession->pSampleConfiguration->iceFilterPolicy, iceCandidate.candidate, &family)) {
+        recordIceCandidatesFiltered(pSampleStreamingSession->pSampleConfiguration, 1);
+        CHK(FALSE, retStatus);
+    }
+    CHK_STATUS(addIceCandidate(pSampleStreamingSession->pPeerConnection, iceCandidate.candidate));
+    if (family < SAMPLE_ICE_FAMILY_COUNT) {
+        ATOMIC_INCREMENT(&pSampleStreamingSession->remoteCandidateCounts[family]);
+    }
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+STATUS traverseDirectoryPEMFileScan(UINT64 customData, DIR_ENTRY_TYPES entryType, PCHAR fullPath, PCHAR fileName)
+{
+    UNUSED_PARAM(entryType);
+    UNUSED_PARAM(fullPath);
+
+    PCHAR certName = (PCHAR) customData;
+    UINT32 fileNameLen = STRLEN(fileName);
+
+    if (fileNameLen > ARRAY_SIZE(CA_CERT_PEM_FILE_EXTENSION) + 1 &&
+        (STRCMPI(CA_CERT_PEM_FILE_EXTENSION, &fileName[fileNameLen - ARRAY_SIZE(CA_CERT_PEM_FILE_EXTENSION) + 1]) == 0)) {
+        certName[0] = FPATHSEPARATOR;
+        certName++;
+        STRCPY(certName, fileName);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+STATUS lookForSslCert(PSampleConfiguration* ppSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    struct stat pathStat;
+    CHAR certName[MAX_PATH_LEN];
+    PSampleConfiguration pSampleConfiguration = *ppSampleConfiguration;
+
+    MEMSET(certName, 0x0, ARRAY_SIZE(certName));
+    pSampleConfiguration->pCaCertPath = getenv(CACERT_PATH_ENV_VAR);
+
+    // if ca cert path is not set from the environment, try to use the one that cmake detected
+    if (pSampleConfiguration->pCaCertPath == NULL) {
+        CHK_ERR(STRNLEN(DEFAULT_KVS_CACERT_PATH, MAX_PATH_LEN) > 0, STATUS_INVALID_OPERATION, "No ca cert path given (error:%s)", strerror(errno));
+        pSampleConfiguration->pCaCertPath = DEFAULT_KVS_CACERT_PATH;
+    } else {
+        // Check if the environment variable is a path
+        CHK(0 == FSTAT(pSampleConfiguration->pCaCertPath, &pathStat), STATUS_DIRECTORY_ENTRY_STAT_ERROR);
+
+        if (S_ISDIR(pathStat.st_mode)) {
+            CHK_STATUS(traverseDirectory(pSampleConfiguration->pCaCertPath, (UINT64) &certName, /* iterate */ FALSE, traverseDirectoryPEMFileScan));
+
+            if (certName[0] != 0x0) {
+                STRCAT(pSampleConfiguration->pCaCertPath, certName);
+            } else {
+                DLOGW("Cert not found in path set...checking if CMake detected a path\n");
+                CHK_ERR(STRNLEN(DEFAULT_KVS_CACERT_PATH, MAX_PATH_LEN) > 0, STATUS_INVALID_OPERATION, "No ca cert path given (error:%s)",
+                        strerror(errno));
+                DLOGI("CMake detected cert path\n");
+                pSampleConfiguration->pCaCertPath = DEFAULT_KVS_CACERT_PATH;
+            }
+        }
+    }
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+STATUS createSampleConfiguration(PCHAR channelName, SIGNALING_CHANNEL_ROLE_TYPE roleType, BOOL trickleIce, BOOL useTurn,
+                                 PSampleConfiguration* ppSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PCHAR pAccessKey, pSecretKey, pSessionToken, pLogLevel, pPacerBurstSize, pStatsSocketPath, pIdleCapture, pIceRestart, pCertificatePoolFile;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    UINT32 logLevel = LOG_LEVEL_DEBUG, i;
+
+    CHK(ppSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    CHK(NULL != (pSampleConfiguration = (PSampleConfiguration) MEMCALLOC(1, SIZEOF(SampleConfiguration))), STATUS_NOT_ENOUGH_MEMORY);
+    pSampleConfiguration->signalPipe[0] = -1;
+    pSampleConfiguration->signalPipe[1] = -1;
+    pSampleConfiguration->signalWatcherTid = INVALID_TID_VALUE;
+
+#ifdef IOT_CORE_ENABLE_CREDENTIALS
+    PCHAR pIotCoreCredentialEndPoint, pIotCoreCert, pIotCorePrivateKey, pIotCoreRoleAlias, pIotCoreThingName;
+    CHK_ERR((pIotCoreCredentialEndPoint = getenv(IOT_CORE_CREDENTIAL_ENDPOINT)) != NULL, STATUS_INVALID_OPERATION,
+            "AWS_IOT_CORE_CREDENTIAL_ENDPOINT must be set");
+    CHK_ERR((pIotCoreCert = getenv(IOT_CORE_CERT)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_CERT must be set");
+    CHK_ERR((pIotCorePrivateKey = getenv(IOT_CORE_PRIVATE_KEY)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_PRIVATE_KEY must be set");
+    CHK_ERR((pIotCoreRoleAlias = getenv(IOT_CORE_ROLE_ALIAS)) != NULL, STATUS_INVALID_OPERATION, "AWS_IOT_CORE_ROLE_ALIAS must be set");
+#else
+    CHK_ERR((pAccessKey = getenv(ACCESS_KEY_ENV_VAR)) != NULL, STATUS_INVALID_OPERATION, "AWS_ACCESS_KEY_ID must be set");
+    CHK_ERR((pSecretKey = getenv(SECRET_KEY_ENV_VAR)) != NULL, STATUS_INVALID_OPERATION, "AWS_SECRET_ACCESS_KEY must be set");
+#endif
+
+    pSessionToken = getenv(SESSION_TOKEN_ENV_VAR);
+    pSampleConfiguration->enableFileLogging = FALSE;
+    if (NULL != getenv(ENABLE_FILE_LOGGING)) {
+        pSampleConfiguration->enableFileLogging = TRUE;
+    }
+    pSampleConfiguration->warmCapture = NULL != getenv(SAMPLE_WARM_CAPTURE_ENV_VAR);
+    pSampleConfiguration->idleCaptureMode = SAMPLE_IDLE_CAPTURE_MODE_KEY_FRAMES;
+    if (NULL != (pIdleCapture = getenv(SAMPLE_IDLE_CAPTURE_ENV_VAR))) {
+        if (0 == STRCMP(pIdleCapture, SAMPLE_IDLE_CAPTURE_RELEASE)) {
+            pSampleConfiguration->idleCaptureMode = SAMPLE_IDLE_CAPTURE_MODE_RELEASE;
+        } else if (0 == STRCMP(pIdleCapture, SAMPLE_IDLE_CAPTURE_OFF)) {
+            pSampleConfiguration->idleCaptureMode = SAMPLE_IDLE_CAPTURE_MODE_OFF;
+        } else if (0 != STRCMP(pIdleCapture, SAMPLE_IDLE_CAPTURE_KEY_FRAMES)) {
+            DLOGW("Unknown idle capture mode %s, keeping the key frames", pIdleCapture);
+        }
+    }
+    // Releasing the capturer before the first viewer would undo the warm capture
+    if (pSampleConfiguration->warmCapture && pSampleConfiguration->idleCaptureMode == SAMPLE_IDLE_CAPTURE_MODE_RELEASE) {
+        DLOGW("The video capturer is never released with warm capture, keeping the key frames while idle");
+        pSampleConfiguration->idleCaptureMode = SAMPLE_IDLE_CAPTURE_MODE_KEY_FRAMES;
+    }
+    if (NULL == (pPacerBurstSize = getenv(SAMPLE_PACER_BURST_SIZE_ENV_VAR)) ||
+        STATUS_SUCCESS != STRTOUI32(pPacerBurstSize, NULL, 10, &pSampleConfiguration->pacerBurstSize)) {
+        pSampleConfiguration->pacerBurstSize = SAMPLE_PACER_DEFAULT_BURST_SIZE;
+    }
+#ifdef KVS_WEBRTC_SHARED_RTP_PAYLOAD
+    PCHAR pSharedRtpPayload = getenv(SAMPLE_SHARED_RTP_PAYLOAD_ENV_VAR);
+    CHK_STATUS(setSharedRtpPayloadEnabled(pSharedRtpPayload == NULL || 0 != STRCMP(pSharedRtpPayload, "0")));
+#endif
+    loadIceFilterPolicy(&pSampleConfiguration->iceFilterPolicy);
+    if ((pSampleConfiguration->channelInfo.pRegion = getenv(DEFAULT_REGION_ENV_VAR)) == NULL) {
+        pSampleConfiguration->channelInfo.pRegion = DEFAULT_AWS_REGION;
+    }
+
+    CHK_STATUS(lookForSslCert(&pSampleConfiguration));
+
+    // Set the logger log level
+    if (NULL == (pLogLevel = getenv(DEBUG_LOG_LEVEL_ENV_VAR)) || STATUS_SUCCESS != STRTOUI32(pLogLevel, NULL, 10, &logLevel) ||
+        logLevel < LOG_LEVEL_VERBOSE || logLevel > LOG_LEVEL_SILENT) {
+        logLevel = LOG_LEVEL_WARN;
+    }
+
+    SET_LOGGER_LOG_LEVEL(logLevel);
 
 #ifdef IOT_CORE_ENABLE_CREDENTIALS
     CHK_STATUS(createLwsIotCredentialProvider(pIotCoreCredentialEndPoint, pIotCoreCert, pIotCorePrivateKey, pSampleConfiguration->pCaCertPath,
@@ -775,11 +1822,26 @@ STATUS createSampleConfiguration(PCHAR channelName, SIGNALING_CHANNEL_ROLE_TYPE
 #endif
 
     pSampleConfiguration->mediaSenderTid = INVALID_TID_VALUE;
+    pSampleConfiguration->pregenerateCertTid = INVALID_TID_VALUE;
+    for (i = 0; i < SAMPLE_SESSION_SETUP_WORKER_COUNT; i++) {
+        pSampleConfiguration->sessionSetupTids[i] = INVALID_TID_VALUE;
+    }
     pSampleConfiguration->signalingClientHandle = INVALID_SIGNALING_CLIENT_HANDLE_VALUE;
     pSampleConfiguration->sampleConfigurationObjLock = MUTEX_CREATE(TRUE);
     pSampleConfiguration->cvar = CVAR_CREATE();
+    pSampleConfiguration->cleanupEventLock = MUTEX_CREATE(FALSE);
+    pSampleConfiguration->cleanupEventCvar = CVAR_CREATE();
+    pSampleConfiguration->sessionSetupCvar = CVAR_CREATE();
     pSampleConfiguration->streamingSessionListReadLock = MUTEX_CREATE(FALSE);
+    pSampleConfiguration->pStreamingSessionSnapshot = &pSampleConfiguration->streamingSessionSnapshots[0];
+    pSampleConfiguration->gopCacheLock = MUTEX_CREATE(FALSE);
+    pSampleConfiguration->bitrateControllerLock = MUTEX_CREATE(FALSE);
+    pSampleConfiguration->setupHistogramLock = MUTEX_CREATE(FALSE);
     pSampleConfiguration->signalingSendMessageLock = MUTEX_CREATE(FALSE);
+    pSampleConfiguration->iceServerCacheLock = MUTEX_CREATE(FALSE);
+    CHK_ERR(pipe(pSampleConfiguration->signalPipe) == 0 && fcntl(pSampleConfiguration->signalPipe[1], F_SETFL, O_NONBLOCK) == 0,
+            STATUS_INVALID_OPERATION, "Failed to create the signal pipe");
+    CHK_STATUS(THREAD_CREATE(&pSampleConfiguration->signalWatcherTid, signalWatcherRoutine, (PVOID) pSampleConfiguration));
     /* This is ignored for master. Master can extract the info from offer. Viewer has to know if peer can trickle or
      * not ahead of time. */
     pSampleConfiguration->trickleIce = trickleIce;
@@ -807,34 +1869,68 @@ STATUS createSampleConfiguration(PCHAR channelName, SIGNALING_CHANNEL_ROLE_TYPE
 
     pSampleConfiguration->clientInfo.version = SIGNALING_CLIENT_INFO_CURRENT_VERSION;
     pSampleConfiguration->clientInfo.loggingLevel = logLevel;
-    pSampleConfiguration->clientInfo.cacheFilePath = NULL; // Use the default path
+    pSampleConfiguration->clientInfo.cacheFilePath = SAMPLE_SIGNALING_CACHE_FILE_PATH;
     pSampleConfiguration->clientInfo.signalingClientCreationMaxRetryAttempts = CREATE_SIGNALING_CLIENT_RETRY_ATTEMPTS_SENTINEL_VALUE;
     pSampleConfiguration->iceCandidatePairStatsTimerId = MAX_UINT32;
-    pSampleConfiguration->pregenerateCertTimerId = MAX_UINT32;
+    pSampleConfiguration->iceServerCacheTimerId = MAX_UINT32;
+    pSampleConfiguration->iceServerCacheRefreshTid = INVALID_TID_VALUE;
+    pSampleConfiguration->statsRingTimerId = MAX_UINT32;
 
     ATOMIC_STORE_BOOL(&pSampleConfiguration->interrupted, FALSE);
     ATOMIC_STORE_BOOL(&pSampleConfiguration->mediaThreadStarted, FALSE);
     ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, FALSE);
     ATOMIC_STORE_BOOL(&pSampleConfiguration->recreateSignalingClient, FALSE);
     ATOMIC_STORE_BOOL(&pSampleConfiguration->connected, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->pregenerateCertTerminate, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->sessionSetupTerminate, FALSE);
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->videoWaitForKeyFrame, FALSE);
 
     CHK_STATUS(timerQueueCreate(&pSampleConfiguration->timerQueueHandle));
 
     CHK_STATUS(stackQueueCreate(&pSampleConfiguration->pregeneratedCertificates));
 
-    // Start the cert pre-gen timer callback
+    // Start with the certificates saved by the previous run and generate the rest in the background
     if (SAMPLE_PRE_GENERATE_CERT) {
-        CHK_LOG_ERR(retStatus =
-                        timerQueueAddTimer(pSampleConfiguration->timerQueueHandle, 0, SAMPLE_PRE_GENERATE_CERT_PERIOD, pregenerateCertTimerCallback,
-                                           (UINT64) pSampleConfiguration, &pSampleConfiguration->pregenerateCertTimerId));
+        pSampleConfiguration->certificatePoolFile =
+            NULL == (pCertificatePoolFile = getenv(SAMPLE_CERTIFICATE_POOL_FILE_ENV_VAR)) || STRCMP(pCertificatePoolFile, "0") != 0;
+        CHK_LOG_ERR(loadPregeneratedCertificates(pSampleConfiguration));
+        CHK_STATUS(THREAD_CREATE(&pSampleConfiguration->pregenerateCertTid, pregenerateCertRoutine, (PVOID) pSampleConfiguration));
+    }
+
+    // The ICE servers saved by the previous run, refreshed once there is a signaling client to get the TURN servers from
+    CHK_LOG_ERR(loadIceServerCache(pSampleConfiguration));
+
+    // For dashboards, the sample runs without it when the socket can't be set up
+    if (NULL != (pStatsSocketPath = getenv(SAMPLE_STATS_RING_SOCKET_ENV_VAR))) {
+        CHK_LOG_ERR(retStatus = createStatsRing(pStatsSocketPath, &pSampleConfiguration->pStatsRing));
+        if (pSampleConfiguration->pStatsRing != NULL) {
+            CHK_LOG_ERR(retStatus = timerQueueAddTimer(pSampleConfiguration->timerQueueHandle, SAMPLE_STATS_RING_PERIOD, SAMPLE_STATS_RING_PERIOD,
+                                                       sampleStatsRingTimerCallback, (UINT64) pSampleConfiguration,
+                                                       &pSampleConfiguration->statsRingTimerId));
+        }
     }
 
     pSampleConfiguration->iceUriCount = 0;
 
-    CHK_STATUS(stackQueueCreate(&pSampleConfiguration->pPendingSignalingMessageForRemoteClient));
+    CHK_STATUS(createPendingMessageQueues(&pSampleConfiguration->pPendingSignalingMessageForRemoteClient));
     CHK_STATUS(hashTableCreateWithParams(SAMPLE_HASH_TABLE_BUCKET_COUNT, SAMPLE_HASH_TABLE_BUCKET_LENGTH,
                                          &pSampleConfiguration->pRtcPeerConnectionForRemoteClient));
 
+    // Only the master is sent offers
+    CHK_STATUS(stackQueueCreate(&pSampleConfiguration->pSessionSetupQueue));
+    CHK_STATUS(hashTableCreateWithParams(SAMPLE_HASH_TABLE_BUCKET_COUNT, SAMPLE_HASH_TABLE_BUCKET_LENGTH,
+                                         &pSampleConfiguration->pSessionSetupForRemoteClient));
+    if (roleType == SIGNALING_CHANNEL_ROLE_TYPE_MASTER) {
+        for (i = 0; i < SAMPLE_SESSION_SETUP_WORKER_COUNT; i++) {
+            CHK_STATUS(THREAD_CREATE(&pSampleConfiguration->sessionSetupTids[i], sessionSetupRoutine, (PVOID) pSampleConfiguration));
+        }
+
+        // Opt-in, the viewer has to take offers from the master. The sessions time out on a network change without it.
+        if (NULL != (pIceRestart = getenv(SAMPLE_ICE_RESTART_ENV_VAR)) && STRCMP(pIceRestart, "1") == 0) {
+            CHK_LOG_ERR(createNetworkMonitor(sampleNetworkChangeHandler, (UINT64) pSampleConfiguration, &pSampleConfiguration->pNetworkMonitor));
+        }
+    }
+
 CleanUp:
 
     if (STATUS_FAILED(retStatus)) {
@@ -871,6 +1967,156 @@ CleanUp:
     return retStatus;
 }
 
+VOID recordSessionSetupPhase(PSampleStreamingSession pSampleStreamingSession, SampleSetupPhase phase)
+{
+    PSampleConfiguration pSampleConfiguration;
+    PSampleSetupHistogram pHistogram;
+    UINT64 now = GETTIME(), time;
+    UINT32 bucket;
+
+    // Only the sessions answering an offer are timed
+    if (pSampleStreamingSession == NULL || pSampleStreamingSession->offerReceiveTime == 0 || phase >= SAMPLE_SETUP_PHASE_COUNT) {
+        return;
+    }
+
+    pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
+    time = (now - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
+    for (bucket = 0; bucket < SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT - 1 && time >= (1ULL << bucket); bucket++) {
+    }
+
+    MUTEX_LOCK(pSampleConfiguration->setupHistogramLock);
+    if (pSampleStreamingSession->setupPhaseTimes[phase] == 0) {
+        pSampleStreamingSession->setupPhaseTimes[phase] = now;
+        pHistogram = &pSampleConfiguration->setupHistograms[phase];
+        pHistogram->count++;
+        pHistogram->totalTime += time;
+        pHistogram->maxTime = MAX(pHistogram->maxTime, time);
+        pHistogram->buckets[bucket]++;
+    }
+    MUTEX_UNLOCK(pSampleConfiguration->setupHistogramLock);
+}
+
+VOID recordIceGatheringDone(PSampleStreamingSession pSampleStreamingSession)
+{
+    PSampleConfiguration pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
+    UINT64 time;
+
+    if (pSampleStreamingSession->iceGatheringStartTime == 0) {
+        return;
+    }
+
+    time = (GETTIME() - pSampleStreamingSession->iceGatheringStartTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
+    DLOGI("Candidate gathering of %s took %" PRIu64 " ms", pSampleStreamingSession->peerId, time);
+
+    MUTEX_LOCK(pSampleConfiguration->setupHistogramLock);
+    pSampleConfiguration->iceStats.gatheringCount++;
+    pSampleConfiguration->iceStats.totalGatheringTime += time;
+    pSampleConfiguration->iceStats.maxGatheringTime = MAX(pSampleConfiguration->iceStats.maxGatheringTime, time);
+    MUTEX_UNLOCK(pSampleConfiguration->setupHistogramLock);
+}
+
+// The SDK doesn't report its check list, every pair it forms is counted, the checks stop at the first one that works
+VOID recordIceConnected(PSampleStreamingSession pSampleStreamingSession)
+{
+    PSampleConfiguration pSampleConfiguration = pSampleStreamingSession->pSampleConfiguration;
+    UINT64 pairs = 0, localCount = 0, remoteCount = 0;
+    UINT32 i;
+
+    for (i = 0; i < SAMPLE_ICE_FAMILY_COUNT; i++) {
+        localCount += ATOMIC_LOAD(&pSampleStreamingSession->localCandidateCounts[i]);
+        remoteCount += ATOMIC_LOAD(&pSampleStreamingSession->remoteCandidateCounts[i]);
+        pairs += (UINT64) ATOMIC_LOAD(&pSampleStreamingSession->localCandidateCounts[i]) *
+            ATOMIC_LOAD(&pSampleStreamingSession->remoteCandidateCounts[i]);
+    }
+    DLOGI("%s connected with %" PRIu64 " candidate pairs from %" PRIu64 " local and %" PRIu64 " remote candidates", pSampleStreamingSession->peerId,
+          pairs, localCount, remoteCount);
+
+    MUTEX_LOCK(pSampleConfiguration->setupHistogramLock);
+    pSampleConfiguration->iceStats.connectionCount++;
+    pSampleConfiguration->iceStats.totalCandidatePairs += pairs;
+    pSampleConfiguration->iceStats.maxCandidatePairs = MAX(pSampleConfiguration->iceStats.maxCandidatePairs, pairs);
+    MUTEX_UNLOCK(pSampleConfiguration->setupHistogramLock);
+}
+
+VOID recordIceCandidatesFiltered(PSampleConfiguration pSampleConfiguration, UINT32 count)
+{
+    if (pSampleConfiguration == NULL || count == 0) {
+        return;
+    }
+
+    MUTEX_LOCK(pSampleConfiguration->setupHistogramLock);
+    pSampleConfiguration->iceStats.filteredCandidates += count;
+    MUTEX_UNLOCK(pSampleConfiguration->setupHistogramLock);
+}
+
+// Upper bound of the bucket the percentile falls in
+static UINT64 getSetupHistogramPercentile(PSampleSetupHistogram pHistogram, UINT32 percent)
+{
+    UINT64 rank = (pHistogram->count * percent + 99) / 100, total = 0;
+    UINT32 i;
+
+    for (i = 0; i < SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT - 1; i++) {
+        total += pHistogram->buckets[i];
+        if (total >= rank) {
+            return MIN(1ULL << i, pHistogram->maxTime);
+        }
+    }
+
+    return pHistogram->maxTime;
+}
+
+VOID dumpSetupPhaseHistograms(PSampleConfiguration pSampleConfiguration)
+{
+    static const PCHAR phaseNames[SAMPLE_SETUP_PHASE_COUNT] = {
+        (PCHAR) "peer connection", (PCHAR) "answer sent", (PCHAR) "first candidate", (PCHAR) "gathering done",
+        (PCHAR) "ice checking",    (PCHAR) "connected",   (PCHAR) "first rtp sent",  (PCHAR) "first frame recv",
+    };
+    SampleSetupHistogram histograms[SAMPLE_SETUP_PHASE_COUNT];
+    PSampleSetupHistogram pHistogram;
+    SampleIceStats iceStats;
+    UINT32 i, j;
+
+    if (pSampleConfiguration == NULL) {
+        return;
+    }
+
+    MUTEX_LOCK(pSampleConfiguration->setupHistogramLock);
+    MEMCPY(histograms, pSampleConfiguration->setupHistograms, SIZEOF(histograms));
+    iceStats = pSampleConfiguration->iceStats;
+    MUTEX_UNLOCK(pSampleConfiguration->setupHistogramLock);
+
+    printf("Session setup phases, ms from the offer\n");
+    printf("phase               count     mean      p50      p90      max\n");
+    for (i = 0; i < SAMPLE_SETUP_PHASE_COUNT; i++) {
+        pHistogram = &histograms[i];
+        printf("%-16s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", phaseNames[i], pHistogram->count,
+               pHistogram->count == 0 ? 0 : pHistogram->totalTime / pHistogram->count, getSetupHistogramPercentile(pHistogram, 50),
+               getSetupHistogramPercentile(pHistogram, 90), pHistogram->maxTime);
+        if (pHistogram->count == 0) {
+            continue;
+        }
+
+        printf("                ");
+        for (j = 0; j < SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT; j++) {
+            if (pHistogram->buckets[j] == 0) {
+                continue;
+            } else if (j == SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT - 1) {
+                printf(" >=%llu:%" PRIu64, 1ULL << (j - 1), pHistogram->buckets[j]);
+            } else {
+                printf(" <%llu:%" PRIu64, 1ULL << j, pHistogram->buckets[j]);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("ICE                 count     mean      max\n");
+    printf("%-16s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", "gathering ms", iceStats.gatheringCount,
+           iceStats.gatheringCount == 0 ? 0 : iceStats.totalGatheringTime / iceStats.gatheringCount, iceStats.maxGatheringTime);
+    printf("%-16s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", "candidate pairs", iceStats.connectionCount,
+           iceStats.connectionCount == 0 ? 0 : iceStats.totalCandidatePairs / iceStats.connectionCount, iceStats.maxCandidatePairs);
+    printf("%-16s %8" PRIu64 "\n", "filtered", iceStats.filteredCandidates);
+}
+
 STATUS getIceCandidatePairStatsCallback(UINT32 timerId, UINT64 currentTime, UINT64 customData)
 {
     UNUSED_PARAM(timerId);
@@ -884,6 +2130,7 @@ STATUS getIceCandidatePairStatsCallback(UINT32 timerId, UINT64 currentTime, UINT
     DOUBLE averageNumberOfPacketsReceivedPerSecond = 0.0;
     DOUBLE outgoingBitrate = 0.0;
     DOUBLE incomingBitrate = 0.0;
+    SampleSendQueueStats sendQueueStats;
     BOOL locked = FALSE;
 
     CHK_WARN(pSampleConfiguration != NULL, STATUS_NULL_ARG, "[KVS Master] getPeriodicStats(): Passed argument is NULL");
@@ -960,60 +2207,20 @@ STATUS getIceCandidatePairStatsCallback(UINT32 timerId, UINT64 currentTime, UINT
                     pSampleConfiguration->rtcIceCandidatePairMetrics.rtcStatsObject.iceCandidatePairStats.packetsDiscardedOnSend;
             }
         }
-    }
-
-CleanUp:
-
-    if (locked) {
-        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
-    }
 
-    return retStatus;
-}
-
-STATUS pregenerateCertTimerCallback(UINT32 timerId, UINT64 currentTime, UINT64 customData)
-{
-    UNUSED_PARAM(timerId);
-    UNUSED_PARAM(currentTime);
-    STATUS retStatus = STATUS_SUCCESS;
-    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
-    BOOL locked = FALSE;
-    UINT32 certCount;
-    PRtcCertificate pRtcCertificate = NULL;
-
-    CHK_WARN(pSampleConfiguration != NULL, STATUS_NULL_ARG, "[KVS Master] pregenerateCertTimerCallback(): Passed argument is NULL");
-
-    // Use MUTEX_TRYLOCK to avoid possible dead lock when canceling timerQueue
-    if (!MUTEX_TRYLOCK(pSampleConfiguration->sampleConfigurationObjLock)) {
-        return retStatus;
-    } else {
-        locked = TRUE;
+        if (STATUS_SUCCEEDED(getSessionSendQueueStats(pSampleConfiguration->sampleStreamingSessionList[i], &sendQueueStats))) {
+            DLOGD("Send queue of %s: depth %u (max %u), dropped frames %" PRIu64 ", fell behind %" PRIu64 " times for %" PRIu64
+                  " ms, max queue delay %" PRIu64 " ms, paced for %" PRIu64 " ms",
+                  pSampleConfiguration->sampleStreamingSessionList[i]->peerId, sendQueueStats.queueDepth, sendQueueStats.maxQueueDepth,
+                  sendQueueStats.droppedFrames, sendQueueStats.keyFrameWaitCount, sendQueueStats.timeBehind / HUNDREDS_OF_NANOS_IN_A_MILLISECOND,
+                  sendQueueStats.maxQueueDelay / HUNDREDS_OF_NANOS_IN_A_MILLISECOND, sendQueueStats.pacedTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+            DLOGD("Estimated bandwidth of %s: %" PRIu64 " bps, decimated frames %" PRIu64,
+                  pSampleConfiguration->sampleStreamingSessionList[i]->peerId, sendQueueStats.estimatedBitrate, sendQueueStats.decimatedFrames);
+        }
     }
 
-    // Quick check if there is anything that needs to be done.
-    CHK_STATUS(stackQueueGetCount(pSampleConfiguration->pregeneratedCertificates, &certCount));
-    CHK(certCount != MAX_RTCCONFIGURATION_CERTIFICATES, retStatus);
-
-    // Generate the certificate with the keypair
-    CHK_STATUS(createRtcCertificate(&pRtcCertificate));
-
-    // Add to the stack queue
-    CHK_STATUS(stackQueueEnqueue(pSampleConfiguration->pregeneratedCertificates, (UINT64) pRtcCertificate));
-
-    DLOGV("New certificate has been pre-generated and added to the queue");
-
-    // Reset it so it won't be freed on exit
-    pRtcCertificate = NULL;
-
-    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
-    locked = FALSE;
-
 CleanUp:
 
-    if (pRtcCertificate != NULL) {
-        freeRtcCertificate(pRtcCertificate);
-    }
-
     if (locked) {
         MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
     }
@@ -1030,11 +2237,68 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
     UINT64 data;
     StackQueueIterator iterator;
     BOOL locked = FALSE;
+    INT32 fd;
+
+    CHK(ppSampleConfiguration != NULL, STATUS_NULL_ARG);
+    pSampleConfiguration = *ppSampleConfiguration;
+
+    CHK(pSampleConfiguration != NULL, retStatus);
+
+    // The signal handlers see the closed write end as -1 and stop writing to it
+    if (pSampleConfiguration->signalPipe[1] >= 0) {
+        fd = pSampleConfiguration->signalPipe[1];
+        pSampleConfiguration->signalPipe[1] = -1;
+        close(fd);
+    }
+    if (IS_VALID_TID_VALUE(pSampleConfiguration->signalWatcherTid)) {
+        THREAD_JOIN(pSampleConfiguration->signalWatcherTid, NULL);
+        pSampleConfiguration->signalWatcherTid = INVALID_TID_VALUE;
+    }
+    if (pSampleConfiguration->signalPipe[0] >= 0) {
+        close(pSampleConfiguration->signalPipe[0]);
+        pSampleConfiguration->signalPipe[0] = -1;
+    }
+
+    // Nothing is restarted while the sessions are torn down
+    freeNetworkMonitor(&pSampleConfiguration->pNetworkMonitor);
+
+    // A certificate being generated is finished first
+    if (pSampleConfiguration->pregenerateCertTid != INVALID_TID_VALUE) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->pregenerateCertTerminate, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        THREAD_JOIN(pSampleConfiguration->pregenerateCertTid, NULL);
+        pSampleConfiguration->pregenerateCertTid = INVALID_TID_VALUE;
+
+        // Whatever wasn't used is there for the next run
+        CHK_LOG_ERR(savePregeneratedCertificates(pSampleConfiguration));
+    }
 
-    CHK(ppSampleConfiguration != NULL, STATUS_NULL_ARG);
-    pSampleConfiguration = *ppSampleConfiguration;
+    // The sessions being set up are finished and freed with the others, the offers still queued are dropped
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->sessionSetupTerminate, TRUE);
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->sampleConfigurationObjLock) && IS_VALID_CVAR_VALUE(pSampleConfiguration->sessionSetupCvar)) {
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        CVAR_BROADCAST(pSampleConfiguration->sessionSetupCvar);
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
 
-    CHK(pSampleConfiguration != NULL, retStatus);
+    for (i = 0; i < SAMPLE_SESSION_SETUP_WORKER_COUNT; i++) {
+        if (pSampleConfiguration->sessionSetupTids[i] != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->sessionSetupTids[i], NULL);
+            pSampleConfiguration->sessionSetupTids[i] = INVALID_TID_VALUE;
+        }
+    }
+
+    if (pSampleConfiguration->pSessionSetupQueue != NULL) {
+        CHK_LOG_ERR(stackQueueClear(pSampleConfiguration->pSessionSetupQueue, TRUE));
+        CHK_LOG_ERR(stackQueueFree(pSampleConfiguration->pSessionSetupQueue));
+        pSampleConfiguration->pSessionSetupQueue = NULL;
+    }
+
+    if (pSampleConfiguration->pSessionSetupForRemoteClient != NULL) {
+        hashTableClear(pSampleConfiguration->pSessionSetupForRemoteClient);
+        hashTableFree(pSampleConfiguration->pSessionSetupForRemoteClient);
+        pSampleConfiguration->pSessionSetupForRemoteClient = NULL;
+    }
 
     if (IS_VALID_TIMER_QUEUE_HANDLE(pSampleConfiguration->timerQueueHandle)) {
         if (pSampleConfiguration->iceCandidatePairStatsTimerId != MAX_UINT32) {
@@ -1046,32 +2310,37 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
             pSampleConfiguration->iceCandidatePairStatsTimerId = MAX_UINT32;
         }
 
-        if (pSampleConfiguration->pregenerateCertTimerId != MAX_UINT32) {
-            retStatus = timerQueueCancelTimer(pSampleConfiguration->timerQueueHandle, pSampleConfiguration->pregenerateCertTimerId,
+        if (pSampleConfiguration->iceServerCacheTimerId != MAX_UINT32) {
+            retStatus = timerQueueCancelTimer(pSampleConfiguration->timerQueueHandle, pSampleConfiguration->iceServerCacheTimerId,
                                               (UINT64) pSampleConfiguration);
             if (STATUS_FAILED(retStatus)) {
-                DLOGE("Failed to cancel certificate pre-generation timer with: 0x%08x", retStatus);
+                DLOGE("Failed to cancel ICE server cache refresh timer with: 0x%08x", retStatus);
             }
-            pSampleConfiguration->pregenerateCertTimerId = MAX_UINT32;
+            pSampleConfiguration->iceServerCacheTimerId = MAX_UINT32;
         }
 
-        timerQueueFree(&pSampleConfiguration->timerQueueHandle);
-    }
+        // No new refresh starts once the timer is gone, the last one may still be looking up the STUN server
+        if (pSampleConfiguration->iceServerCacheRefreshTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->iceServerCacheRefreshTid, NULL);
+            pSampleConfiguration->iceServerCacheRefreshTid = INVALID_TID_VALUE;
+        }
 
-    if (pSampleConfiguration->pPendingSignalingMessageForRemoteClient != NULL) {
-        // Iterate and free all the pending queues
-        stackQueueGetIterator(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, &iterator);
-        while (IS_VALID_ITERATOR(iterator)) {
-            stackQueueIteratorGetItem(iterator, &data);
-            stackQueueIteratorNext(&iterator);
-            freeMessageQueue((PPendingMessageQueue) data);
+        if (pSampleConfiguration->statsRingTimerId != MAX_UINT32) {
+            retStatus = timerQueueCancelTimer(pSampleConfiguration->timerQueueHandle, pSampleConfiguration->statsRingTimerId,
+                                              (UINT64) pSampleConfiguration);
+            if (STATUS_FAILED(retStatus)) {
+                DLOGE("Failed to cancel stats ring timer with: 0x%08x", retStatus);
+            }
+            pSampleConfiguration->statsRingTimerId = MAX_UINT32;
         }
 
-        stackQueueClear(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, FALSE);
-        stackQueueFree(pSampleConfiguration->pPendingSignalingMessageForRemoteClient);
-        pSampleConfiguration->pPendingSignalingMessageForRemoteClient = NULL;
+        timerQueueFree(&pSampleConfiguration->timerQueueHandle);
     }
 
+    freeStatsRing(&pSampleConfiguration->pStatsRing);
+
+    freePendingMessageQueues(&pSampleConfiguration->pPendingSignalingMessageForRemoteClient);
+
     hashTableClear(pSampleConfiguration->pRtcPeerConnectionForRemoteClient);
     hashTableFree(pSampleConfiguration->pRtcPeerConnectionForRemoteClient);
 
@@ -1080,6 +2349,19 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
         locked = TRUE;
     }
 
+    // Stop the capture threads from fanning out frames to the sessions which are about to be freed
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->streamingSessionListReadLock)) {
+        MUTEX_LOCK(pSampleConfiguration->streamingSessionListReadLock);
+        pSampleConfiguration->pStreamingSessionSnapshot = NULL;
+        MUTEX_UNLOCK(pSampleConfiguration->streamingSessionListReadLock);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(pSampleConfiguration->streamingSessionSnapshots); ++i) {
+        while (ATOMIC_LOAD(&pSampleConfiguration->streamingSessionSnapshots[i].refCount) != 0) {
+            THREAD_SLEEP(SAMPLE_SESSION_SNAPSHOT_RETIRE_POLL_PERIOD);
+        }
+    }
+
     for (i = 0; i < pSampleConfiguration->streamingSessionCount; ++i) {
         retStatus = gatherIceServerStats(pSampleConfiguration->sampleStreamingSessionList[i]);
         if (STATUS_FAILED(retStatus)) {
@@ -1090,8 +2372,14 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
     if (locked) {
         MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
     }
+#ifdef KVS_WEBRTC_SHARED_RTP_PAYLOAD
+    // Releases the payloads of the last frames, createSampleConfiguration turns them on again
+    setSharedRtpPayloadEnabled(FALSE);
+#endif
     deinitKvsWebRtc();
 
+    clearGopCache(pSampleConfiguration);
+
     SAFE_MEMFREE(pSampleConfiguration->pVideoFrameBuffer);
     SAFE_MEMFREE(pSampleConfiguration->pAudioFrameBuffer);
 
@@ -1109,14 +2397,42 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
         MUTEX_FREE(pSampleConfiguration->streamingSessionListReadLock);
     }
 
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->gopCacheLock)) {
+        MUTEX_FREE(pSampleConfiguration->gopCacheLock);
+    }
+
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->bitrateControllerLock)) {
+        MUTEX_FREE(pSampleConfiguration->bitrateControllerLock);
+    }
+
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->setupHistogramLock)) {
+        MUTEX_FREE(pSampleConfiguration->setupHistogramLock);
+    }
+
     if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->signalingSendMessageLock)) {
         MUTEX_FREE(pSampleConfiguration->signalingSendMessageLock);
     }
 
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->iceServerCacheLock)) {
+        MUTEX_FREE(pSampleConfiguration->iceServerCacheLock);
+    }
+
     if (IS_VALID_CVAR_VALUE(pSampleConfiguration->cvar)) {
         CVAR_FREE(pSampleConfiguration->cvar);
     }
 
+    if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->cleanupEventLock)) {
+        MUTEX_FREE(pSampleConfiguration->cleanupEventLock);
+    }
+
+    if (IS_VALID_CVAR_VALUE(pSampleConfiguration->cleanupEventCvar)) {
+        CVAR_FREE(pSampleConfiguration->cleanupEventCvar);
+    }
+
+    if (IS_VALID_CVAR_VALUE(pSampleConfiguration->sessionSetupCvar)) {
+        CVAR_FREE(pSampleConfiguration->sessionSetupCvar);
+    }
+
 #ifdef IOT_CORE_ENABLE_CREDENTIALS
     freeIotCredentialProvider(&pSampleConfiguration->pCredentialProvider);
 #else
@@ -1128,7 +2444,7 @@ STATUS freeSampleConfiguration(PSampleConfiguration* ppSampleConfiguration)
         while (IS_VALID_ITERATOR(iterator)) {
             stackQueueIteratorGetItem(iterator, &data);
             stackQueueIteratorNext(&iterator);
-            freeRtcCertificate((PRtcCertificate) data);
+            freePooledCertificate((PPooledCertificate) data);
         }
 
         CHK_LOG_ERR(stackQueueClear(pSampleConfiguration->pregeneratedCertificates, FALSE));
@@ -1150,23 +2466,43 @@ STATUS sessionCleanupWait(PSampleConfiguration pSampleConfiguration)
     STATUS retStatus = STATUS_SUCCESS;
     PSampleStreamingSession pSampleStreamingSession = NULL;
     UINT32 i, clientIdHash;
+    UINT64 nextWakeTime, pendingQueueExpiry, now;
     BOOL locked = FALSE, peerConnectionFound = FALSE;
     SIGNALING_CLIENT_STATE signalingClientState;
 
     CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
 
     while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted)) {
-        // Keep the main set of operations interlocked until cvar wait which would atomically unlock
+        if (ATOMIC_EXCHANGE_BOOL(&pSampleConfiguration->setupHistogramDumpRequested, FALSE)) {
+            dumpSetupPhaseHistograms(pSampleConfiguration);
+        }
+
         MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
         locked = TRUE;
+        nextWakeTime = INFINITE_TIME_VALUE;
+
+        // An ICE restart which hasn't connected in time falls back to a new session
+        now = GETTIME();
+        for (i = 0; i < pSampleConfiguration->streamingSessionCount; ++i) {
+            pSampleStreamingSession = pSampleConfiguration->sampleStreamingSessionList[i];
+            if (!ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag) && ATOMIC_LOAD_BOOL(&pSampleStreamingSession->iceRestarting)) {
+                if (now >= pSampleStreamingSession->iceRestartTime + SAMPLE_ICE_RESTART_TIMEOUT) {
+                    DLOGW("ICE restart of %s didn't connect within %" PRIu64 " ms, terminating the session", pSampleStreamingSession->peerId,
+                          (UINT64) SAMPLE_ICE_RESTART_TIMEOUT / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+                    ATOMIC_STORE_BOOL(&pSampleStreamingSession->terminateFlag, TRUE);
+                    CVAR_BROADCAST(pSampleConfiguration->cvar);
+                } else {
+                    nextWakeTime = MIN(nextWakeTime, pSampleStreamingSession->iceRestartTime + SAMPLE_ICE_RESTART_TIMEOUT);
+                }
+            }
+        }
+        pSampleStreamingSession = NULL;
 
         // scan and cleanup terminated streaming session
         for (i = 0; i < pSampleConfiguration->streamingSessionCount; ++i) {
             if (ATOMIC_LOAD_BOOL(&pSampleConfiguration->sampleStreamingSessionList[i]->terminateFlag)) {
                 pSampleStreamingSession = pSampleConfiguration->sampleStreamingSessionList[i];
 
-                MUTEX_LOCK(pSampleConfiguration->streamingSessionListReadLock);
-
                 // swap with last element and decrement count
                 pSampleConfiguration->streamingSessionCount--;
                 pSampleConfiguration->sampleStreamingSessionList[i] =
@@ -1179,7 +2515,8 @@ STATUS sessionCleanupWait(PSampleConfiguration pSampleConfiguration)
                     CHK_STATUS(hashTableRemove(pSampleConfiguration->pRtcPeerConnectionForRemoteClient, clientIdHash));
                 }
 
-                MUTEX_UNLOCK(pSampleConfiguration->streamingSessionListReadLock);
+                // Once published, no capture thread is referencing the session any longer
+                CHK_STATUS(publishStreamingSessionSnapshot(pSampleConfiguration));
 
                 CHK_STATUS(freeSampleStreamingSession(&pSampleStreamingSession));
             }
@@ -1193,28 +2530,40 @@ STATUS sessionCleanupWait(PSampleConfiguration pSampleConfiguration)
                 ATOMIC_STORE_BOOL(&pSampleConfiguration->recreateSignalingClient, FALSE);
             } else if (signalingCallFailed(retStatus)) {
                 printf("[KVS Common] recreating Signaling Client\n");
-                freeSignalingClient(&pSampleConfiguration->signalingClientHandle);
-                createSignalingClientSync(&pSampleConfiguration->clientInfo, &pSampleConfiguration->channelInfo,
-                                          &pSampleConfiguration->signalingClientCallbacks, pSampleConfiguration->pCredentialProvider,
-                                          &pSampleConfiguration->signalingClientHandle);
+                CHK_LOG_ERR(resetSignalingClient(pSampleConfiguration));
+            }
+
+            // Nothing else will report that the service is reachable again
+            if (ATOMIC_LOAD_BOOL(&pSampleConfiguration->recreateSignalingClient)) {
+                nextWakeTime = MIN(nextWakeTime, GETTIME() + SAMPLE_SESSION_CLEANUP_WAIT_PERIOD);
             }
         }
 
         // Check the signaling client state and connect if needed
         if (IS_VALID_SIGNALING_CLIENT_HANDLE(pSampleConfiguration->signalingClientHandle)) {
             CHK_STATUS(signalingClientGetCurrentState(pSampleConfiguration->signalingClientHandle, &signalingClientState));
-            if (signalingClientState == SIGNALING_CLIENT_STATE_READY) {
-                UNUSED_PARAM(signalingClientConnectSync(pSampleConfiguration->signalingClientHandle));
+            if (signalingClientState == SIGNALING_CLIENT_STATE_READY &&
+                STATUS_FAILED(signalingClientConnectSync(pSampleConfiguration->signalingClientHandle))) {
+                nextWakeTime = MIN(nextWakeTime, GETTIME() + SAMPLE_SESSION_CLEANUP_WAIT_PERIOD);
             }
         }
 
         // Check if any lingering pending message queues
-        CHK_STATUS(removeExpiredMessageQueues(pSampleConfiguration->pPendingSignalingMessageForRemoteClient));
+        CHK_STATUS(removeExpiredMessageQueues(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, &pendingQueueExpiry));
+        nextWakeTime = MIN(nextWakeTime, pendingQueueExpiry);
 
-        // periodically wake up and clean up terminated streaming session
-        CVAR_WAIT(pSampleConfiguration->cvar, pSampleConfiguration->sampleConfigurationObjLock, SAMPLE_SESSION_CLEANUP_WAIT_PERIOD);
         MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
         locked = FALSE;
+
+        // Sleep until a session terminates, the signaling client needs attention, a pending queue is added or the nearest deadline
+        MUTEX_LOCK(pSampleConfiguration->cleanupEventLock);
+        while (!pSampleConfiguration->cleanupEventPending && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted) &&
+               !ATOMIC_LOAD_BOOL(&pSampleConfiguration->setupHistogramDumpRequested) && (now = GETTIME()) < nextWakeTime) {
+            CVAR_WAIT(pSampleConfiguration->cleanupEventCvar, pSampleConfiguration->cleanupEventLock,
+                      nextWakeTime == INFINITE_TIME_VALUE ? INFINITE_TIME_VALUE : nextWakeTime - now);
+        }
+        pSampleConfiguration->cleanupEventPending = FALSE;
+        MUTEX_UNLOCK(pSampleConfiguration->cleanupEventLock);
     }
 
 CleanUp:
@@ -1229,6 +2578,37 @@ CleanUp:
     return retStatus;
 }
 
+STATUS resetSignalingClient(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    // The endpoint in the cache file may be what failed, so the new client looks it up again
+    if (FREMOVE(SAMPLE_SIGNALING_CACHE_FILE_PATH) == 0) {
+        DLOGI("Removed the cached signaling endpoint");
+    }
+
+    CHK_STATUS(freeSignalingClient(&pSampleConfiguration->signalingClientHandle));
+    CHK_STATUS(createSignalingClientSync(&pSampleConfiguration->clientInfo, &pSampleConfiguration->channelInfo,
+                                         &pSampleConfiguration->signalingClientCallbacks, pSampleConfiguration->pCredentialProvider,
+                                         &pSampleConfiguration->signalingClientHandle));
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+VOID raiseCleanupEvent(PSampleConfiguration pSampleConfiguration)
+{
+    // A leaf lock, so this is safe from any callback and under any other lock
+    MUTEX_LOCK(pSampleConfiguration->cleanupEventLock);
+    pSampleConfiguration->cleanupEventPending = TRUE;
+    CVAR_SIGNAL(pSampleConfiguration->cleanupEventCvar);
+    MUTEX_UNLOCK(pSampleConfiguration->cleanupEventLock);
+}
+
 STATUS submitPendingIceCandidate(PPendingMessageQueue pPendingMessageQueue, PSampleStreamingSession pSampleStreamingSession)
 {
     STATUS retStatus = STATUS_SUCCESS;
@@ -1261,16 +2641,137 @@ CleanUp:
     return retStatus;
 }
 
+/*
+ * Creates the streaming session of an offer and answers it without the config lock held, then makes the session
+ * visible to the capture threads and to the ice candidate messages of the client.
+ */
+static STATUS setupStreamingSession(PSampleConfiguration pSampleConfiguration, PSessionSetupJob pSessionSetupJob)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSignalingMessage pSignalingMessage = &pSessionSetupJob->receivedSignalingMessage.signalingMessage;
+    PSampleStreamingSession pSampleStreamingSession = NULL;
+    PPendingMessageQueue pPendingMessageQueue = NULL;
+    UINT32 statsTimerId = MAX_UINT32;
+    BOOL locked = FALSE, setupDone = FALSE, startStats = FALSE;
+
+    CHK_STATUS(createSampleStreamingSession(pSampleConfiguration, pSignalingMessage->peerClientId, TRUE, &pSampleStreamingSession));
+    pSampleStreamingSession->offerReceiveTime = pSessionSetupJob->offerReceiveTime;
+    recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_PEER_CONNECTION_CREATED);
+    CHK_STATUS(handleOffer(pSampleConfiguration, pSampleStreamingSession, pSignalingMessage));
+
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = TRUE;
+
+    // From here on a new offer of the client is checked against the session instead
+    CHK_STATUS(hashTableRemove(pSampleConfiguration->pSessionSetupForRemoteClient, pSessionSetupJob->hashValue));
+    setupDone = TRUE;
+
+    pSampleConfiguration->sampleStreamingSessionList[pSampleConfiguration->streamingSessionCount++] = pSampleStreamingSession;
+    CHK_STATUS(publishStreamingSessionSnapshot(pSampleConfiguration));
+    // Released capturers start again while ICE and DTLS are still being set up
+    CVAR_BROADCAST(pSampleConfiguration->cvar);
+    CHK_STATUS(hashTablePut(pSampleConfiguration->pRtcPeerConnectionForRemoteClient, pSessionSetupJob->hashValue, (UINT64) pSampleStreamingSession));
+
+    // If there are any ice candidate messages in the queue for this client id, submit them now.
+    CHK_STATUS(getPendingMessageQueueForHash(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, pSessionSetupJob->hashValue, TRUE,
+                                             &pPendingMessageQueue));
+    if (pPendingMessageQueue != NULL) {
+        CHK_STATUS(submitPendingIceCandidate(pPendingMessageQueue, pSampleStreamingSession));
+
+        // NULL the pointer to avoid it being freed in the cleanup
+        pPendingMessageQueue = NULL;
+    }
+
+    // The connection may have failed before sessionCleanupWait could see the session
+    if (ATOMIC_LOAD_BOOL(&pSampleStreamingSession->terminateFlag)) {
+        raiseCleanupEvent(pSampleConfiguration);
+    }
+
+    // Claimed under the lock, a setup finishing at the same time doesn't add a second timer
+    if (pSampleConfiguration->iceCandidatePairStatsTimerId == MAX_UINT32) {
+        pSampleConfiguration->iceCandidatePairStatsTimerId = SAMPLE_STATS_TIMER_ID_PENDING;
+        startStats = TRUE;
+    }
+
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    locked = FALSE;
+
+    if (startStats) {
+        if (STATUS_FAILED(retStatus = timerQueueAddTimer(pSampleConfiguration->timerQueueHandle, SAMPLE_STATS_DURATION, SAMPLE_STATS_DURATION,
+                                                         getIceCandidatePairStatsCallback, (UINT64) pSampleConfiguration, &statsTimerId))) {
+            DLOGW("Failed to add getIceCandidatePairStatsCallback to add to timer queue (code 0x%08x). "
+                  "Cannot pull ice candidate pair metrics periodically",
+                  retStatus);
+            statsTimerId = MAX_UINT32;
+
+            // Reset the returned status
+            retStatus = STATUS_SUCCESS;
+        }
+
+        // Released again on failure, the next session tries to add it
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        pSampleConfiguration->iceCandidatePairStatsTimerId = statsTimerId;
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
+CleanUp:
+
+    if (!setupDone) {
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        hashTableRemove(pSampleConfiguration->pSessionSetupForRemoteClient, pSessionSetupJob->hashValue);
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+
+        // The session was never visible to any other thread
+        if (pSampleStreamingSession != NULL) {
+            freeSampleStreamingSession(&pSampleStreamingSession);
+        }
+    }
+
+    if (pPendingMessageQueue != NULL) {
+        freeMessageQueue(pPendingMessageQueue);
+    }
+
+    if (locked) {
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+PVOID sessionSetupRoutine(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    UINT64 data;
+
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->sessionSetupTerminate)) {
+        if (STATUS_FAILED(stackQueueDequeue(pSampleConfiguration->pSessionSetupQueue, &data))) {
+            CVAR_WAIT(pSampleConfiguration->sessionSetupCvar, pSampleConfiguration->sampleConfigurationObjLock, INFINITE_TIME_VALUE);
+            continue;
+        }
+
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        setupStreamingSession(pSampleConfiguration, (PSessionSetupJob) data);
+        MEMFREE((PSessionSetupJob) data);
+        MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+
+    return NULL;
+}
+
 STATUS signalingMessageReceived(UINT64 customData, PReceivedSignalingMessage pReceivedSignalingMessage)
 {
     STATUS retStatus = STATUS_SUCCESS;
     PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
-    BOOL peerConnectionFound = FALSE, locked = FALSE, startStats = FALSE;
-    UINT32 clientIdHash;
+    BOOL peerConnectionFound = FALSE, sessionSetupFound = FALSE, locked = FALSE;
+    UINT32 clientIdHash, sessionSetupCount;
     UINT64 hashValue = 0;
-    PPendingMessageQueue pPendingMessageQueue = NULL;
+    PPendingMessageQueue pPendingMessageQueue = NULL, pIndexedMessageQueue = NULL;
     PSampleStreamingSession pSampleStreamingSession = NULL;
     PReceivedSignalingMessage pReceivedSignalingMessageCopy = NULL;
+    PSessionSetupJob pSessionSetupJob = NULL;
 
     CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
 
@@ -1288,16 +2789,19 @@ STATUS signalingMessageReceived(UINT64 customData, PReceivedSignalingMessage pRe
     switch (pReceivedSignalingMessage->signalingMessage.messageType) {
         case SIGNALING_MESSAGE_TYPE_OFFER:
             // Check if we already have an ongoing master session with the same peer
-            CHK_ERR(!peerConnectionFound, STATUS_INVALID_OPERATION, "Peer connection %s is in progress",
+            CHK_STATUS(hashTableContains(pSampleConfiguration->pSessionSetupForRemoteClient, clientIdHash, &sessionSetupFound));
+            CHK_ERR(!peerConnectionFound && !sessionSetupFound, STATUS_INVALID_OPERATION, "Peer connection %s is in progress",
                     pReceivedSignalingMessage->signalingMessage.peerClientId);
 
             /*
-             * Create new streaming session for each offer, then insert the client id and streaming session into
-             * pRtcPeerConnectionForRemoteClient for subsequent ice candidate messages. Lastly check if there is
-             * any ice candidate messages queued in pPendingSignalingMessageForRemoteClient. If so then submit
-             * all of them.
+             * Hand the offer to a session setup worker, see setupStreamingSession. Creating the streaming session can
+             * include generating a certificate, so it isn't done on the signaling thread, and the offers of several
+             * viewers are answered in parallel. Until the session is in pRtcPeerConnectionForRemoteClient, the ice
+             * candidate messages of the client are queued in pPendingSignalingMessageForRemoteClient like the ones
+             * received before the offer.
              */
-            if (pSampleConfiguration->streamingSessionCount == ARRAY_SIZE(pSampleConfiguration->sampleStreamingSessionList)) {
+            CHK_STATUS(hashTableGetCount(pSampleConfiguration->pSessionSetupForRemoteClient, &sessionSetupCount));
+            if (pSampleConfiguration->streamingSessionCount + sessionSetupCount >= ARRAY_SIZE(pSampleConfiguration->sampleStreamingSessionList)) {
                 DLOGW("Max simultaneous streaming session count reached.");
 
                 // Need to remove the pending queue if any.
@@ -1308,30 +2812,34 @@ STATUS signalingMessageReceived(UINT64 customData, PReceivedSignalingMessage pRe
 
                 CHK(FALSE, retStatus);
             }
-            CHK_STATUS(createSampleStreamingSession(pSampleConfiguration, pReceivedSignalingMessage->signalingMessage.peerClientId, TRUE,
-                                                    &pSampleStreamingSession));
-            pSampleStreamingSession->offerReceiveTime = GETTIME();
-            MUTEX_LOCK(pSampleConfiguration->streamingSessionListReadLock);
-            pSampleConfiguration->sampleStreamingSessionList[pSampleConfiguration->streamingSessionCount++] = pSampleStreamingSession;
-            MUTEX_UNLOCK(pSampleConfiguration->streamingSessionListReadLock);
-
-            CHK_STATUS(handleOffer(pSampleConfiguration, pSampleStreamingSession, &pReceivedSignalingMessage->signalingMessage));
-            CHK_STATUS(hashTablePut(pSampleConfiguration->pRtcPeerConnectionForRemoteClient, clientIdHash, (UINT64) pSampleStreamingSession));
 
-            // If there are any ice candidate messages in the queue for this client id, submit them now.
-            CHK_STATUS(getPendingMessageQueueForHash(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, clientIdHash, TRUE,
-                                                     &pPendingMessageQueue));
-            if (pPendingMessageQueue != NULL) {
-                CHK_STATUS(submitPendingIceCandidate(pPendingMessageQueue, pSampleStreamingSession));
+            CHK(NULL != (pSessionSetupJob = (PSessionSetupJob) MEMCALLOC(1, SIZEOF(SessionSetupJob))), STATUS_NOT_ENOUGH_MEMORY);
+            pSessionSetupJob->hashValue = clientIdHash;
+            // Taken before the offer is queued, so the offer to answer time includes waiting for a worker and getting a certificate
+            pSessionSetupJob->offerReceiveTime = GETTIME();
+            pSessionSetupJob->receivedSignalingMessage = *pReceivedSignalingMessage;
 
-                // NULL the pointer to avoid it being freed in the cleanup
-                pPendingMessageQueue = NULL;
+            CHK_STATUS(stackQueueEnqueue(pSampleConfiguration->pSessionSetupQueue, (UINT64) pSessionSetupJob));
+            if (STATUS_FAILED(retStatus = hashTablePut(pSampleConfiguration->pSessionSetupForRemoteClient, clientIdHash,
+                                                       (UINT64) pSessionSetupJob))) {
+                stackQueueRemoveItem(pSampleConfiguration->pSessionSetupQueue, (UINT64) pSessionSetupJob);
+                CHK(FALSE, retStatus);
             }
 
-            startStats = pSampleConfiguration->iceCandidatePairStatsTimerId == MAX_UINT32;
+            // The worker owns the job now
+            pSessionSetupJob = NULL;
+            CVAR_SIGNAL(pSampleConfiguration->sessionSetupCvar);
             break;
 
         case SIGNALING_MESSAGE_TYPE_ANSWER:
+            // The master is only answered when it restarted the ICE of a session
+            if (pSampleConfiguration->channelInfo.channelRoleType == SIGNALING_CHANNEL_ROLE_TYPE_MASTER) {
+                CHK_ERR(peerConnectionFound, STATUS_INVALID_OPERATION, "Answer from %s without a session",
+                        pReceivedSignalingMessage->signalingMessage.peerClientId);
+                CHK_STATUS(handleAnswer(pSampleConfiguration, pSampleStreamingSession, &pReceivedSignalingMessage->signalingMessage));
+                break;
+            }
+
             /*
              * for viewer, pSampleStreamingSession should've already been created. insert the client id and
              * streaming session into pRtcPeerConnectionForRemoteClient for subsequent ice candidate messages.
@@ -1359,21 +2867,25 @@ STATUS signalingMessageReceived(UINT64 customData, PReceivedSignalingMessage pRe
              * submit the signaling message into the corresponding streaming session.
              */
             if (!peerConnectionFound) {
+                CHK(NULL != (pReceivedSignalingMessageCopy = (PReceivedSignalingMessage) MEMCALLOC(1, SIZEOF(ReceivedSignalingMessage))),
+                    STATUS_NOT_ENOUGH_MEMORY);
+                *pReceivedSignalingMessageCopy = *pReceivedSignalingMessage;
+
+                // An indexed queue is owned by the pending message queues, only a new queue is freed in the cleanup until it's indexed
                 CHK_STATUS(getPendingMessageQueueForHash(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, clientIdHash, FALSE,
-                                                         &pPendingMessageQueue));
-                if (pPendingMessageQueue == NULL) {
+                                                         &pIndexedMessageQueue));
+                if (pIndexedMessageQueue == NULL) {
                     CHK_STATUS(createMessageQueue(clientIdHash, &pPendingMessageQueue));
-                    CHK_STATUS(stackQueueEnqueue(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, (UINT64) pPendingMessageQueue));
-                }
-
-                pReceivedSignalingMessageCopy = (PReceivedSignalingMessage) MEMCALLOC(1, SIZEOF(ReceivedSignalingMessage));
+                    CHK_STATUS(addPendingMessageQueue(pSampleConfiguration->pPendingSignalingMessageForRemoteClient, pPendingMessageQueue));
+                    pIndexedMessageQueue = pPendingMessageQueue;
+                    pPendingMessageQueue = NULL;
 
-                *pReceivedSignalingMessageCopy = *pReceivedSignalingMessage;
-
-                CHK_STATUS(stackQueueEnqueue(pPendingMessageQueue->messageQueue, (UINT64) pReceivedSignalingMessageCopy));
+                    // sessionCleanupWait has to arm the expiry of the new queue
+                    raiseCleanupEvent(pSampleConfiguration);
+                }
 
-                // NULL the pointers to not free any longer
-                pPendingMessageQueue = NULL;
+                // Only the copied message is freed in the cleanup if it can't be queued
+                CHK_STATUS(stackQueueEnqueue(pIndexedMessageQueue->messageQueue, (UINT64) pReceivedSignalingMessageCopy));
                 pReceivedSignalingMessageCopy = NULL;
             } else {
                 CHK_STATUS(handleRemoteCandidate(pSampleStreamingSession, &pReceivedSignalingMessage->signalingMessage));
@@ -1388,21 +2900,10 @@ STATUS signalingMessageReceived(UINT64 customData, PReceivedSignalingMessage pRe
     MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
     locked = FALSE;
 
-    if (startStats &&
-        STATUS_FAILED(retStatus = timerQueueAddTimer(pSampleConfiguration->timerQueueHandle, SAMPLE_STATS_DURATION, SAMPLE_STATS_DURATION,
-                                                     getIceCandidatePairStatsCallback, (UINT64) pSampleConfiguration,
-                                                     &pSampleConfiguration->iceCandidatePairStatsTimerId))) {
-        DLOGW("Failed to add getIceCandidatePairStatsCallback to add to timer queue (code 0x%08x). "
-              "Cannot pull ice candidate pair metrics periodically",
-              retStatus);
-
-        // Reset the returned status
-        retStatus = STATUS_SUCCESS;
-    }
-
 CleanUp:
 
     SAFE_MEMFREE(pReceivedSignalingMessageCopy);
+    SAFE_MEMFREE(pSessionSetupJob);
     if (pPendingMessageQueue != NULL) {
         freeMessageQueue(pPendingMessageQueue);
     }
@@ -1459,32 +2960,170 @@ CleanUp:
     return retStatus;
 }
 
-STATUS getPendingMessageQueueForHash(PStackQueue pPendingQueue, UINT64 clientHash, BOOL remove, PPendingMessageQueue* ppPendingMessageQueue)
+/*
+ * The expiry heap keeps the oldest queue at index 0. Every queue knows its index in the heap, a queue taken out
+ * by its offer doesn't have to be searched for.
+ */
+static VOID swapPendingMessageQueues(PPendingMessageQueues pPendingMessageQueues, UINT32 i, UINT32 j)
+{
+    PPendingMessageQueue pPendingMessageQueue = pPendingMessageQueues->expiryHeap[i];
+
+    pPendingMessageQueues->expiryHeap[i] = pPendingMessageQueues->expiryHeap[j];
+    pPendingMessageQueues->expiryHeap[i]->heapIndex = i;
+    pPendingMessageQueues->expiryHeap[j] = pPendingMessageQueue;
+    pPendingMessageQueue->heapIndex = j;
+}
+
+static VOID siftUpPendingMessageQueue(PPendingMessageQueues pPendingMessageQueues, UINT32 index)
+{
+    PPendingMessageQueue* pHeap = pPendingMessageQueues->expiryHeap;
+
+    while (index > 0 && pHeap[(index - 1) / 2]->createTime > pHeap[index]->createTime) {
+        swapPendingMessageQueues(pPendingMessageQueues, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+static VOID siftDownPendingMessageQueue(PPendingMessageQueues pPendingMessageQueues, UINT32 index)
+{
+    PPendingMessageQueue* pHeap = pPendingMessageQueues->expiryHeap;
+    UINT32 child, oldest;
+
+    for (;;) {
+        oldest = index;
+        child = 2 * index + 1;
+        if (child < pPendingMessageQueues->count && pHeap[child]->createTime < pHeap[oldest]->createTime) {
+            oldest = child;
+        }
+        child++;
+        if (child < pPendingMessageQueues->count && pHeap[child]->createTime < pHeap[oldest]->createTime) {
+            oldest = child;
+        }
+        if (oldest == index) {
+            break;
+        }
+        swapPendingMessageQueues(pPendingMessageQueues, index, oldest);
+        index = oldest;
+    }
+}
+
+// Takes the queue out of both the table and the heap, the caller owns it afterwards
+static STATUS removePendingMessageQueue(PPendingMessageQueues pPendingMessageQueues, PPendingMessageQueue pPendingMessageQueue)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    UINT32 index = pPendingMessageQueue->heapIndex, last;
+
+    CHK_STATUS(hashTableRemove(pPendingMessageQueues->pQueueTable, pPendingMessageQueue->hashValue));
+
+    last = --pPendingMessageQueues->count;
+    if (index != last) {
+        swapPendingMessageQueues(pPendingMessageQueues, index, last);
+        siftDownPendingMessageQueue(pPendingMessageQueues, index);
+        siftUpPendingMessageQueue(pPendingMessageQueues, index);
+    }
+    pPendingMessageQueues->expiryHeap[last] = NULL;
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS createPendingMessageQueues(PPendingMessageQueues* ppPendingMessageQueues)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PPendingMessageQueues pPendingMessageQueues = NULL;
+
+    CHK(ppPendingMessageQueues != NULL, STATUS_NULL_ARG);
+
+    CHK(NULL != (pPendingMessageQueues = (PPendingMessageQueues) MEMCALLOC(1, SIZEOF(PendingMessageQueues))), STATUS_NOT_ENOUGH_MEMORY);
+    CHK_STATUS(hashTableCreateWithParams(SAMPLE_HASH_TABLE_BUCKET_COUNT, SAMPLE_HASH_TABLE_BUCKET_LENGTH, &pPendingMessageQueues->pQueueTable));
+
+CleanUp:
+
+    if (STATUS_FAILED(retStatus)) {
+        freePendingMessageQueues(&pPendingMessageQueues);
+    }
+
+    if (ppPendingMessageQueues != NULL) {
+        *ppPendingMessageQueues = pPendingMessageQueues;
+    }
+
+    return retStatus;
+}
+
+STATUS freePendingMessageQueues(PPendingMessageQueues* ppPendingMessageQueues)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PPendingMessageQueues pPendingMessageQueues = NULL;
+    UINT32 i;
+
+    CHK(ppPendingMessageQueues != NULL, STATUS_NULL_ARG);
+    pPendingMessageQueues = *ppPendingMessageQueues;
+    CHK(pPendingMessageQueues != NULL, retStatus);
+
+    for (i = 0; i < pPendingMessageQueues->count; i++) {
+        freeMessageQueue(pPendingMessageQueues->expiryHeap[i]);
+    }
+
+    if (pPendingMessageQueues->pQueueTable != NULL) {
+        hashTableClear(pPendingMessageQueues->pQueueTable);
+        hashTableFree(pPendingMessageQueues->pQueueTable);
+    }
+
+    MEMFREE(pPendingMessageQueues);
+    *ppPendingMessageQueues = NULL;
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS addPendingMessageQueue(PPendingMessageQueues pPendingMessageQueues, PPendingMessageQueue pPendingMessageQueue)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PPendingMessageQueue pOldestMessageQueue = NULL;
+
+    CHK(pPendingMessageQueues != NULL && pPendingMessageQueue != NULL, STATUS_NULL_ARG);
+
+    // The oldest queue is the closest to expiring anyway
+    if (pPendingMessageQueues->count == SAMPLE_PENDING_MESSAGE_QUEUE_MAX_COUNT) {
+        pOldestMessageQueue = pPendingMessageQueues->expiryHeap[0];
+        DLOGW("Too many clients with pending ICE candidates, dropping the candidates of client hash %" PRIu64, pOldestMessageQueue->hashValue);
+        CHK_STATUS(removePendingMessageQueue(pPendingMessageQueues, pOldestMessageQueue));
+        CHK_STATUS(freeMessageQueue(pOldestMessageQueue));
+    }
+
+    CHK_STATUS(hashTablePut(pPendingMessageQueues->pQueueTable, pPendingMessageQueue->hashValue, (UINT64) pPendingMessageQueue));
+    pPendingMessageQueue->heapIndex = pPendingMessageQueues->count++;
+    pPendingMessageQueues->expiryHeap[pPendingMessageQueue->heapIndex] = pPendingMessageQueue;
+    siftUpPendingMessageQueue(pPendingMessageQueues, pPendingMessageQueue->heapIndex);
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS getPendingMessageQueueForHash(PPendingMessageQueues pPendingMessageQueues, UINT64 clientHash, BOOL remove,
+                                     PPendingMessageQueue* ppPendingMessageQueue)
 {
     STATUS retStatus = STATUS_SUCCESS;
     PPendingMessageQueue pPendingMessageQueue = NULL;
-    StackQueueIterator iterator;
-    BOOL iterate = TRUE;
     UINT64 data;
 
-    CHK(pPendingQueue != NULL && ppPendingMessageQueue != NULL, STATUS_NULL_ARG);
+    CHK(pPendingMessageQueues != NULL && ppPendingMessageQueue != NULL, STATUS_NULL_ARG);
 
-    CHK_STATUS(stackQueueGetIterator(pPendingQueue, &iterator));
-    while (iterate && IS_VALID_ITERATOR(iterator)) {
-        CHK_STATUS(stackQueueIteratorGetItem(iterator, &data));
-        CHK_STATUS(stackQueueIteratorNext(&iterator));
+    retStatus = hashTableGet(pPendingMessageQueues->pQueueTable, clientHash, &data);
+    CHK(retStatus == STATUS_SUCCESS || retStatus == STATUS_HASH_KEY_NOT_PRESENT, retStatus);
 
+    if (retStatus == STATUS_HASH_KEY_NOT_PRESENT) {
+        retStatus = STATUS_SUCCESS;
+    } else {
         pPendingMessageQueue = (PPendingMessageQueue) data;
+        *ppPendingMessageQueue = pPendingMessageQueue;
 
-        if (clientHash == pPendingMessageQueue->hashValue) {
-            *ppPendingMessageQueue = pPendingMessageQueue;
-            iterate = FALSE;
-
-            // Check if the item needs to be removed
-            if (remove) {
-                // This is OK to do as we are terminating the iterator anyway
-                CHK_STATUS(stackQueueRemoveItem(pPendingQueue, data));
-            }
+        // Check if the item needs to be removed
+        if (remove) {
+            CHK_STATUS(removePendingMessageQueue(pPendingMessageQueues, pPendingMessageQueue));
         }
     }
 
@@ -1493,34 +3132,34 @@ CleanUp:
     return retStatus;
 }
 
-STATUS removeExpiredMessageQueues(PStackQueue pPendingQueue)
+STATUS removeExpiredMessageQueues(PPendingMessageQueues pPendingMessageQueues, PUINT64 pNextExpiry)
 {
     STATUS retStatus = STATUS_SUCCESS;
     PPendingMessageQueue pPendingMessageQueue = NULL;
-    UINT32 i, count;
-    UINT64 data, curTime;
+    UINT64 curTime, nextExpiry = INFINITE_TIME_VALUE;
 
-    CHK(pPendingQueue != NULL, STATUS_NULL_ARG);
+    CHK(pPendingMessageQueues != NULL, STATUS_NULL_ARG);
 
     curTime = GETTIME();
-    CHK_STATUS(stackQueueGetCount(pPendingQueue, &count));
 
-    // Dequeue and enqueue in order to not break the iterator while removing an item
-    for (i = 0; i < count; i++) {
-        CHK_STATUS(stackQueueDequeue(pPendingQueue, &data));
-
-        // Check for expiry
-        pPendingMessageQueue = (PPendingMessageQueue) data;
-        if (pPendingMessageQueue->createTime + SAMPLE_PENDING_MESSAGE_CLEANUP_DURATION < curTime) {
-            // Message queue has expired and needs to be freed
-            CHK_STATUS(freeMessageQueue(pPendingMessageQueue));
-        } else {
-            // Enqueue back again as it's still valued
-            CHK_STATUS(stackQueueEnqueue(pPendingQueue, data));
+    // Only the expired queues and the next one to expire are looked at
+    while (pPendingMessageQueues->count > 0) {
+        pPendingMessageQueue = pPendingMessageQueues->expiryHeap[0];
+        if (pPendingMessageQueue->createTime + SAMPLE_PENDING_MESSAGE_CLEANUP_DURATION > curTime) {
+            nextExpiry = pPendingMessageQueue->createTime + SAMPLE_PENDING_MESSAGE_CLEANUP_DURATION;
+            break;
         }
+
+        // Message queue has expired and needs to be freed
+        CHK_STATUS(removePendingMessageQueue(pPendingMessageQueues, pPendingMessageQueue));
+        CHK_STATUS(freeMessageQueue(pPendingMessageQueue));
     }
 
 CleanUp:
 
+    if (pNextExpiry != NULL) {
+        *pNextExpiry = nextExpiry;
+    }
+
     return retStatus;
 }
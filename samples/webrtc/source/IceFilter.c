@@ -0,0 +1,279 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+#define LOG_CLASS "IceFilter"
+#include "Samples.h"
+
+#include <arpa/inet.h>
+#include <fnmatch.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+/*
+ * Keeps the candidates which can't connect a viewer out of ICE. Every local candidate is paired with every remote
+ * candidate of its family and each pair is checked, so on a gateway with docker bridges, veth pairs and IPv6 most of the
+ * checks are wasted. The SDK only passes the name of an interface to its filter, so the family and link-local policy
+ * leaves out the interfaces without any address it allows. The candidates are filtered again when they are signaled,
+ * and the remote ones before they are given to the SDK, so no pair of a family left out is formed on either side.
+ */
+
+#define SAMPLE_ICE_CANDIDATE_ATTRIBUTE ((PCHAR) "candidate:")
+#define SAMPLE_ICE_SDP_CANDIDATE_LINE  ((PCHAR) "a=candidate:")
+
+static SampleIceFamily getAddressFamily(PCHAR pAddress, PBOOL pLinkLocal)
+{
+    struct in_addr ipv4Address;
+    struct in6_addr ipv6Address;
+
+    *pLinkLocal = FALSE;
+    if (inet_pton(AF_INET, pAddress, &ipv4Address) == 1) {
+        // 169.254.0.0/16
+        *pLinkLocal = (ntohl(ipv4Address.s_addr) & 0xffff0000) == 0xa9fe0000;
+        return SAMPLE_ICE_FAMILY_IPV4;
+    } else if (inet_pton(AF_INET6, pAddress, &ipv6Address) == 1) {
+        *pLinkLocal = IN6_IS_ADDR_LINKLOCAL(&ipv6Address);
+        return SAMPLE_ICE_FAMILY_IPV6;
+    }
+
+    // A hostname, like the mDNS names browsers give to their host candidates
+    return SAMPLE_ICE_FAMILY_COUNT;
+}
+
+static BOOL acceptAddress(PSampleIceFilterPolicy pPolicy, SampleIceFamily family, BOOL linkLocal)
+{
+    return family == SAMPLE_ICE_FAMILY_COUNT || (pPolicy->useFamilies[family] && (pPolicy->useLinkLocal || !linkLocal));
+}
+
+// Returns TRUE when the name matches one of the comma separated patterns, the ones starting with ! are skipped unless negated
+static BOOL matchInterfacePatterns(PCHAR pPatterns, PCHAR pName, BOOL negated)
+{
+    CHAR pattern[SAMPLE_ICE_INTERFACE_PATTERNS_LEN + 1];
+    PCHAR pCurrent = pPatterns, pEnd;
+    UINT32 length;
+
+    while (*pCurrent != '\0') {
+        pEnd = STRCHR(pCurrent, ',');
+        length = pEnd == NULL ? (UINT32) STRLEN(pCurrent) : (UINT32) (pEnd - pCurrent);
+        if ((pCurrent[0] == '!') == negated && length > (negated ? 1 : 0) && length <= SAMPLE_ICE_INTERFACE_PATTERNS_LEN) {
+            length -= negated ? 1 : 0;
+            MEMCPY(pattern, pCurrent + (negated ? 1 : 0), length);
+            pattern[length] = '\0';
+            if (fnmatch(pattern, pName, 0) == 0) {
+                return TRUE;
+            }
+        }
+        if (pEnd == NULL) {
+            break;
+        }
+        pCurrent = pEnd + 1;
+    }
+
+    return FALSE;
+}
+
+static BOOL hasIncludePatterns(PCHAR pPatterns)
+{
+    PCHAR pCurrent = pPatterns;
+
+    while (*pCurrent != '\0') {
+        if (*pCurrent != '!' && *pCurrent != ',') {
+            return TRUE;
+        }
+        pCurrent = STRCHR(pCurrent, ',');
+        if (pCurrent == NULL) {
+            break;
+        }
+        pCurrent++;
+    }
+
+    return FALSE;
+}
+
+// An interface whose addresses are all left out would only bring candidates the signaling drops
+static BOOL hasAcceptedAddress(PSampleIceFilterPolicy pPolicy, PCHAR pName)
+{
+    struct ifaddrs *pInterfaces = NULL, *pInterface;
+    CHAR address[INET6_ADDRSTRLEN];
+    PVOID pAddress;
+    SampleIceFamily family;
+    BOOL linkLocal, accepted = FALSE;
+
+    // Without the list of addresses the interface is given the benefit of the doubt
+    if (getifaddrs(&pInterfaces) != 0) {
+        return TRUE;
+    }
+
+    for (pInterface = pInterfaces; pInterface != NULL && !accepted; pInterface = pInterface->ifa_next) {
+        if (pInterface->ifa_addr == NULL || STRCMP(pInterface->ifa_name, pName) != 0) {
+            continue;
+        }
+
+        if (pInterface->ifa_addr->sa_family == AF_INET) {
+            pAddress = &((struct sockaddr_in*) pInterface->ifa_addr)->sin_addr;
+        } else if (pInterface->ifa_addr->sa_family == AF_INET6) {
+            pAddress = &((struct sockaddr_in6*) pInterface->ifa_addr)->sin6_addr;
+        } else {
+            continue;
+        }
+
+        if (inet_ntop(pInterface->ifa_addr->sa_family, pAddress, address, SIZEOF(address)) != NULL) {
+            family = getAddressFamily(address, &linkLocal);
+            accepted = family != SAMPLE_ICE_FAMILY_COUNT && acceptAddress(pPolicy, family, linkLocal);
+        }
+    }
+
+    freeifaddrs(pInterfaces);
+
+    return accepted;
+}
+
+VOID loadIceFilterPolicy(PSampleIceFilterPolicy pPolicy)
+{
+    PCHAR pValue;
+    UINT32 i;
+
+    MEMSET(pPolicy, 0x00, SIZEOF(SampleIceFilterPolicy));
+    for (i = 0; i < SAMPLE_ICE_FAMILY_COUNT; i++) {
+        pPolicy->useFamilies[i] = TRUE;
+    }
+
+    if (NULL != (pValue = getenv(SAMPLE_ICE_INTERFACES_ENV_VAR))) {
+        if (STRLEN(pValue) > SAMPLE_ICE_INTERFACE_PATTERNS_LEN) {
+            DLOGW("The interface patterns are longer than %u characters, all the interfaces are used", SAMPLE_ICE_INTERFACE_PATTERNS_LEN);
+        } else {
+            STRCPY(pPolicy->interfacePatterns, pValue);
+        }
+    }
+    pPolicy->useVirtualInterfaces = NULL != (pValue = getenv(SAMPLE_ICE_VIRTUAL_INTERFACES_ENV_VAR)) && STRCMP(pValue, "1") == 0;
+    pPolicy->useLinkLocal = NULL != (pValue = getenv(SAMPLE_ICE_LINK_LOCAL_ENV_VAR)) && STRCMP(pValue, "1") == 0;
+    if (NULL != (pValue = getenv(SAMPLE_ICE_ADDRESS_FAMILY_ENV_VAR))) {
+        if (0 == STRCMP(pValue, SAMPLE_ICE_ADDRESS_FAMILY_IPV4)) {
+            pPolicy->useFamilies[SAMPLE_ICE_FAMILY_IPV6] = FALSE;
+        } else if (0 == STRCMP(pValue, SAMPLE_ICE_ADDRESS_FAMILY_IPV6)) {
+            pPolicy->useFamilies[SAMPLE_ICE_FAMILY_IPV4] = FALSE;
+        } else {
+            DLOGW("Unknown address family %s, using both", pValue);
+        }
+    }
+
+    DLOGI("ICE interfaces: %s, virtual interfaces %s, link-local addresses %s, IPv4 %s, IPv6 %s",
+          pPolicy->interfacePatterns[0] == '\0' ? "all" : pPolicy->interfacePatterns, pPolicy->useVirtualInterfaces ? "used" : "skipped",
+          pPolicy->useLinkLocal ? "used" : "skipped", pPolicy->useFamilies[SAMPLE_ICE_FAMILY_IPV4] ? "used" : "skipped",
+          pPolicy->useFamilies[SAMPLE_ICE_FAMILY_IPV6] ? "used" : "skipped");
+}
+
+BOOL sampleFilterNetworkInterfaces(UINT64 customData, PCHAR networkInt)
+{
+    PSampleIceFilterPolicy pPolicy = (PSampleIceFilterPolicy) customData;
+    BOOL useInterface = TRUE;
+
+    if (pPolicy == NULL || networkInt == NULL) {
+        return TRUE;
+    }
+
+    // Exclusions win, then a name has to match one of the include patterns if there is any
+    if (matchInterfacePatterns(pPolicy->interfacePatterns, networkInt, TRUE)) {
+        useInterface = FALSE;
+    } else if (hasIncludePatterns(pPolicy->interfacePatterns)) {
+        useInterface = matchInterfacePatterns(pPolicy->interfacePatterns, networkInt, FALSE);
+    } else if (!pPolicy->useVirtualInterfaces) {
+        useInterface = !matchInterfacePatterns(SAMPLE_ICE_VIRTUAL_INTERFACE_PATTERNS, networkInt, FALSE);
+    }
+
+    if (useInterface) {
+        useInterface = hasAcceptedAddress(pPolicy, networkInt);
+    }
+
+    DLOGD("%s %s", networkInt, (useInterface) ? ("allowed. Candidates to be gathered") : ("blocked. Candidates will not be gathered"));
+    return useInterface;
+}
+
+// The address is the fifth field of a candidate: foundation, component, transport, priority, address
+static BOOL getCandidateAddress(PCHAR pCandidate, PCHAR pAddress, UINT32 addressLen)
+{
+    PCHAR pCurrent = STRSTR(pCandidate, SAMPLE_ICE_CANDIDATE_ATTRIBUTE);
+    UINT32 field, length = 0;
+
+    if (pCurrent == NULL) {
+        return FALSE;
+    }
+
+    pCurrent += STRLEN(SAMPLE_ICE_CANDIDATE_ATTRIBUTE);
+    for (field = 0; field < 4; field++) {
+        while (*pCurrent != '\0' && *pCurrent != ' ' && *pCurrent != '"' && *pCurrent != '\r' && *pCurrent != '\n') {
+            pCurrent++;
+        }
+        if (*pCurrent != ' ') {
+            return FALSE;
+        }
+        pCurrent++;
+    }
+
+    while (pCurrent[length] != '\0' && pCurrent[length] != ' ' && pCurrent[length] != '"' && pCurrent[length] != '\r' && pCurrent[length] != '\n') {
+        length++;
+    }
+    if (length == 0 || length >= addressLen) {
+        return FALSE;
+    }
+
+    MEMCPY(pAddress, pCurrent, length);
+    pAddress[length] = '\0';
+
+    return TRUE;
+}
+
+BOOL sampleFilterIceCandidate(PSampleIceFilterPolicy pPolicy, PCHAR pCandidate, SampleIceFamily* pFamily)
+{
+    CHAR address[INET6_ADDRSTRLEN];
+    BOOL linkLocal = FALSE;
+
+    *pFamily = SAMPLE_ICE_FAMILY_COUNT;
+    if (pPolicy == NULL || pCandidate == NULL || !getCandidateAddress(pCandidate, address, SIZEOF(address))) {
+        return TRUE;
+    }
+
+    *pFamily = getAddressFamily(address, &linkLocal);
+    if (!acceptAddress(pPolicy, *pFamily, linkLocal)) {
+        DLOGD("Candidate %s left out", address);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+UINT32 filterSessionDescriptionCandidates(PSampleIceFilterPolicy pPolicy, PCHAR pSdp, volatile SIZE_T* pCandidateCounts)
+{
+    PCHAR pLine = pSdp, pNext;
+    SampleIceFamily family;
+    UINT32 removed = 0;
+
+    while (pLine != NULL && *pLine != '\0') {
+        pNext = STRCHR(pLine, '\n');
+        pNext = pNext == NULL ? pLine + STRLEN(pLine) : pNext + 1;
+        if (STRNCMP(pLine, SAMPLE_ICE_SDP_CANDIDATE_LINE, STRLEN(SAMPLE_ICE_SDP_CANDIDATE_LINE)) == 0) {
+            if (!sampleFilterIceCandidate(pPolicy, pLine, &family)) {
+                MEMMOVE(pLine, pNext, STRLEN(pNext) + 1);
+                removed++;
+                continue;
+            }
+            if (pCandidateCounts != NULL && family < SAMPLE_ICE_FAMILY_COUNT) {
+                ATOMIC_INCREMENT(&pCandidateCounts[family]);
+            }
+        }
+        pLine = pNext;
+    }
+
+    return removed;
+}
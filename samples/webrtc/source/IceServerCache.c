@@ -0,0 +1,316 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+#define LOG_CLASS "IceServerCache"
+#include "Samples.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+/*
+ * Creating a peer connection otherwise waits for the DNS lookup of the STUN server and, once the TURN credentials have
+ * expired, for the signaling client to request new ones. Both are done here on a thread started from the timer queue
+ * instead, and kept in a file so that the first viewer after a restart doesn't wait for them either.
+ *
+ * The TURN server URLs from KVS carry the address of the server in the host name and the SDK doesn't resolve them, so
+ * only the STUN server needs its address cached.
+ */
+
+static VOID resetIceServerCache(PSampleConfiguration pSampleConfiguration, PIceServerCache pIceServerCache)
+{
+    MEMSET(pIceServerCache, 0x00, SIZEOF(IceServerCache));
+    pIceServerCache->version = SAMPLE_ICE_SERVER_CACHE_VERSION;
+    STRNCPY(pIceServerCache->channelName, pSampleConfiguration->channelInfo.pChannelName, MAX_CHANNEL_NAME_LEN);
+    STRNCPY(pIceServerCache->region, pSampleConfiguration->channelInfo.pRegion, MAX_REGION_NAME_LEN);
+}
+
+static STATUS resolveStunServer(PSampleConfiguration pSampleConfiguration, PCHAR pStunUrl)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    CHAR url[MAX_ICE_CONFIG_URI_LEN + 1], address[INET_ADDRSTRLEN];
+    PCHAR pHostName, pPort;
+    struct addrinfo hints, *pAddressInfo = NULL;
+
+    // Take the host name and the port from the URL the SDK would otherwise resolve itself
+    SNPRINTF(url, SIZEOF(url), KINESIS_VIDEO_STUN_URL, pSampleConfiguration->channelInfo.pRegion);
+    CHK((pHostName = STRCHR(url, ':')) != NULL, STATUS_INVALID_ARG);
+    pHostName++;
+    CHK((pPort = STRCHR(pHostName, ':')) != NULL, STATUS_INVALID_ARG);
+    *pPort++ = '\0';
+
+    MEMSET(&hints, 0x00, SIZEOF(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    CHK_ERR(getaddrinfo(pHostName, NULL, &hints, &pAddressInfo) == 0 && pAddressInfo != NULL, STATUS_RESOLVE_HOSTNAME_FAILED,
+            "Unable to resolve %s", pHostName);
+    CHK(inet_ntop(AF_INET, &((struct sockaddr_in*) pAddressInfo->ai_addr)->sin_addr, address, SIZEOF(address)) != NULL,
+        STATUS_RESOLVE_HOSTNAME_FAILED);
+
+    SNPRINTF(pStunUrl, MAX_ICE_CONFIG_URI_LEN + 1, "stun:%s:%s", address, pPort);
+
+CleanUp:
+
+    if (pAddressInfo != NULL) {
+        freeaddrinfo(pAddressInfo);
+    }
+
+    return retStatus;
+}
+
+STATUS loadIceServerCache(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PIceServerCache pIceServerCache;
+    IceServerCache fileCache;
+    UINT64 fileSize = 0, now;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+
+    pIceServerCache = &pSampleConfiguration->iceServerCache;
+    resetIceServerCache(pSampleConfiguration, pIceServerCache);
+
+    // A missing or foreign cache file only means that the ICE servers are looked up the first time they are needed
+    CHK(STATUS_SUCCEEDED(readFile(SAMPLE_ICE_SERVER_CACHE_FILE_PATH, TRUE, NULL, &fileSize)) && fileSize == SIZEOF(IceServerCache), retStatus);
+    CHK_STATUS(readFile(SAMPLE_ICE_SERVER_CACHE_FILE_PATH, TRUE, (PBYTE) &fileCache, &fileSize));
+    CHK(fileCache.version == SAMPLE_ICE_SERVER_CACHE_VERSION && fileCache.turnServerCount <= SAMPLE_ICE_SERVER_CACHE_MAX_TURN_SERVERS &&
+            STRNCMP(fileCache.channelName, pIceServerCache->channelName, MAX_CHANNEL_NAME_LEN + 1) == 0 &&
+            STRNCMP(fileCache.region, pIceServerCache->region, MAX_REGION_NAME_LEN + 1) == 0,
+        retStatus);
+
+    now = GETTIME();
+    if (fileCache.stunExpiration > now + SAMPLE_ICE_SERVER_CACHE_EXPIRY_MARGIN) {
+        STRNCPY(pIceServerCache->stunUrl, fileCache.stunUrl, MAX_ICE_CONFIG_URI_LEN);
+        pIceServerCache->stunExpiration = fileCache.stunExpiration;
+    }
+
+    if (fileCache.turnExpiration > now + SAMPLE_ICE_SERVER_CACHE_EXPIRY_MARGIN) {
+        MEMCPY(pIceServerCache->turnServers, fileCache.turnServers, SIZEOF(fileCache.turnServers));
+        pIceServerCache->turnServerCount = fileCache.turnServerCount;
+        pIceServerCache->turnExpiration = fileCache.turnExpiration;
+    }
+
+    DLOGI("Cached STUN server %s, %u cached TURN servers", pIceServerCache->stunExpiration != 0 ? pIceServerCache->stunUrl : "(none)",
+          pIceServerCache->turnServerCount);
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS setCachedIceServers(PSampleConfiguration pSampleConfiguration, PRtcConfiguration pConfiguration, UINT32 maxTurnServer,
+                           PUINT32 pTurnUriCount)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PIceServerCache pIceServerCache;
+    PIceConfigInfo pIceConfigInfo;
+    UINT32 i, j, uriCount = 0;
+    UINT64 usableUntil;
+
+    CHK(pSampleConfiguration != NULL && pConfiguration != NULL && pTurnUriCount != NULL, STATUS_NULL_ARG);
+
+    pIceServerCache = &pSampleConfiguration->iceServerCache;
+    usableUntil = GETTIME() + SAMPLE_ICE_SERVER_CACHE_EXPIRY_MARGIN;
+
+    MUTEX_LOCK(pSampleConfiguration->iceServerCacheLock);
+
+    if (pIceServerCache->stunExpiration > usableUntil) {
+        STRNCPY(pConfiguration->iceServers[0].urls, pIceServerCache->stunUrl, MAX_ICE_CONFIG_URI_LEN);
+    }
+
+    // No TURN URIs tells the caller to ask the signaling client
+    if (pSampleConfiguration->useTurn && pIceServerCache->turnExpiration > usableUntil) {
+        for (i = 0; i < MIN(maxTurnServer, pIceServerCache->turnServerCount); i++) {
+            pIceConfigInfo = &pIceServerCache->turnServers[i];
+            for (j = 0; j < pIceConfigInfo->uriCount && uriCount + 1 < MAX_ICE_SERVERS_COUNT; j++) {
+                STRNCPY(pConfiguration->iceServers[uriCount + 1].urls, pIceConfigInfo->uris[j], MAX_ICE_CONFIG_URI_LEN);
+                STRNCPY(pConfiguration->iceServers[uriCount + 1].credential, pIceConfigInfo->password, MAX_ICE_CONFIG_CREDENTIAL_LEN);
+                STRNCPY(pConfiguration->iceServers[uriCount + 1].username, pIceConfigInfo->userName, MAX_ICE_CONFIG_USER_NAME_LEN);
+                uriCount++;
+            }
+        }
+    }
+
+    MUTEX_UNLOCK(pSampleConfiguration->iceServerCacheLock);
+
+    *pTurnUriCount = uriCount;
+
+CleanUp:
+
+    return retStatus;
+}
+
+VOID invalidateIceServerCache(PSampleConfiguration pSampleConfiguration)
+{
+    MUTEX_LOCK(pSampleConfiguration->iceServerCacheLock);
+    resetIceServerCache(pSampleConfiguration, &pSampleConfiguration->iceServerCache);
+    MUTEX_UNLOCK(pSampleConfiguration->iceServerCacheLock);
+}
+
+static STATUS saveIceServerCache(PIceServerCache pIceServerCache)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    CHAR tempFilePath[MAX_PATH_LEN + 1];
+    INT32 fd = -1;
+
+    // Created for the owner only and renamed over the cache file, so the TURN credentials are never readable by others or half written
+    SNPRINTF(tempFilePath, SIZEOF(tempFilePath), "%s.tmp", SAMPLE_ICE_SERVER_CACHE_FILE_PATH);
+    unlink(tempFilePath);
+    CHK_ERR((fd = open(tempFilePath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) >= 0, STATUS_OPEN_FILE_FAILED, "Unable to create %s",
+            tempFilePath);
+    CHK(write(fd, pIceServerCache, SIZEOF(IceServerCache)) == (ssize_t) SIZEOF(IceServerCache) && fsync(fd) == 0, STATUS_WRITE_TO_FILE_FAILED);
+    CHK(close(fd) == 0, STATUS_WRITE_TO_FILE_FAILED);
+    fd = -1;
+    CHK(rename(tempFilePath, SAMPLE_ICE_SERVER_CACHE_FILE_PATH) == 0, STATUS_WRITE_TO_FILE_FAILED);
+
+CleanUp:
+
+    if (fd >= 0) {
+        close(fd);
+        unlink(tempFilePath);
+    }
+
+    return retStatus;
+}
+
+static PVOID refreshIceServerCacheRoutine(PVOID args)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    IceServerCache iceServerCache;
+    PIceConfigInfo pIceConfigInfo;
+    UINT32 i, iceConfigCount;
+    UINT64 now, refreshFrom;
+    BOOL locked = FALSE, stunRefreshed = FALSE, turnRefreshed = FALSE, credentialsChanged = FALSE;
+
+    // Anything that would stop being usable before the next refresh is refreshed now
+    now = GETTIME();
+    refreshFrom = now + SAMPLE_ICE_SERVER_CACHE_EXPIRY_MARGIN + SAMPLE_ICE_SERVER_CACHE_REFRESH_PERIOD;
+
+    MUTEX_LOCK(pSampleConfiguration->iceServerCacheLock);
+    iceServerCache = pSampleConfiguration->iceServerCache;
+    MUTEX_UNLOCK(pSampleConfiguration->iceServerCacheLock);
+
+    // getaddrinfo doesn't tell the TTL of the record, the address is kept for a fixed period instead
+    if (iceServerCache.stunExpiration <= refreshFrom && STATUS_SUCCEEDED(resolveStunServer(pSampleConfiguration, iceServerCache.stunUrl))) {
+        iceServerCache.stunExpiration = now + SAMPLE_STUN_SERVER_ADDRESS_TTL;
+        stunRefreshed = TRUE;
+    }
+
+    // Use MUTEX_TRYLOCK so that this never waits on a thread that is joining it, the credentials are only looked at again next time
+    if (pSampleConfiguration->useTurn && iceServerCache.turnExpiration <= refreshFrom &&
+        MUTEX_TRYLOCK(pSampleConfiguration->sampleConfigurationObjLock)) {
+        locked = TRUE;
+
+        // The signaling client requests new credentials once its own are about to expire, until then it returns the same ones
+        CHK(IS_VALID_SIGNALING_CLIENT_HANDLE(pSampleConfiguration->signalingClientHandle), retStatus);
+        CHK_STATUS(signalingClientGetIceConfigInfoCount(pSampleConfiguration->signalingClientHandle, &iceConfigCount));
+        for (i = 0; i < MIN(iceConfigCount, SAMPLE_ICE_SERVER_CACHE_MAX_TURN_SERVERS); i++) {
+            CHK_STATUS(signalingClientGetIceConfigInfo(pSampleConfiguration->signalingClientHandle, i, &pIceConfigInfo));
+            if (i >= iceServerCache.turnServerCount ||
+                STRNCMP(iceServerCache.turnServers[i].password, pIceConfigInfo->password, MAX_ICE_CONFIG_CREDENTIAL_LEN) != 0) {
+                credentialsChanged = TRUE;
+            }
+            iceServerCache.turnServers[i] = *pIceConfigInfo;
+        }
+
+        // When they were requested isn't known, but the signaling client was asked within the last refresh period
+        if (credentialsChanged) {
+            turnRefreshed = TRUE;
+            iceServerCache.turnServerCount = i;
+            iceServerCache.turnExpiration = MAX_UINT64;
+            for (i = 0; i < iceServerCache.turnServerCount; i++) {
+                iceServerCache.turnExpiration =
+                    MIN(iceServerCache.turnExpiration, now + iceServerCache.turnServers[i].ttl - SAMPLE_ICE_SERVER_CACHE_REFRESH_PERIOD);
+            }
+        }
+
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+        locked = FALSE;
+    }
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    }
+
+    if (stunRefreshed || turnRefreshed) {
+        // Only what was refreshed is written back, the rest may have been invalidated in the meantime
+        MUTEX_LOCK(pSampleConfiguration->iceServerCacheLock);
+        if (stunRefreshed) {
+            STRNCPY(pSampleConfiguration->iceServerCache.stunUrl, iceServerCache.stunUrl, MAX_ICE_CONFIG_URI_LEN);
+            pSampleConfiguration->iceServerCache.stunExpiration = iceServerCache.stunExpiration;
+        }
+        if (turnRefreshed) {
+            MEMCPY(pSampleConfiguration->iceServerCache.turnServers, iceServerCache.turnServers, SIZEOF(iceServerCache.turnServers));
+            pSampleConfiguration->iceServerCache.turnServerCount = iceServerCache.turnServerCount;
+            pSampleConfiguration->iceServerCache.turnExpiration = iceServerCache.turnExpiration;
+        }
+        iceServerCache = pSampleConfiguration->iceServerCache;
+        MUTEX_UNLOCK(pSampleConfiguration->iceServerCacheLock);
+
+        DLOGD("Refreshed the cached%s%s", stunRefreshed ? " STUN server address" : "", turnRefreshed ? " TURN servers" : "");
+        CHK_LOG_ERR(saveIceServerCache(&iceServerCache));
+    }
+
+    ATOMIC_STORE_BOOL(&pSampleConfiguration->iceServerCacheRefreshing, FALSE);
+
+    return (PVOID) (ULONG_PTR) retStatus;
+}
+
+STATUS refreshIceServerCacheTimerCallback(UINT32 timerId, UINT64 currentTime, UINT64 customData)
+{
+    UNUSED_PARAM(timerId);
+    UNUSED_PARAM(currentTime);
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
+
+    CHK_WARN(pSampleConfiguration != NULL, STATUS_NULL_ARG, "[KVS Master] refreshIceServerCacheTimerCallback(): Passed argument is NULL");
+
+    // The DNS lookup blocks, so it doesn't hold up the other timers. A refresh still running from last time is left to finish.
+    CHK(!ATOMIC_EXCHANGE_BOOL(&pSampleConfiguration->iceServerCacheRefreshing, TRUE), retStatus);
+    if (pSampleConfiguration->iceServerCacheRefreshTid != INVALID_TID_VALUE) {
+        THREAD_JOIN(pSampleConfiguration->iceServerCacheRefreshTid, NULL);
+        pSampleConfiguration->iceServerCacheRefreshTid = INVALID_TID_VALUE;
+    }
+
+    if (STATUS_FAILED(retStatus = THREAD_CREATE(&pSampleConfiguration->iceServerCacheRefreshTid, refreshIceServerCacheRoutine,
+                                                (PVOID) pSampleConfiguration))) {
+        pSampleConfiguration->iceServerCacheRefreshTid = INVALID_TID_VALUE;
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->iceServerCacheRefreshing, FALSE);
+    }
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS startIceServerCacheRefresh(PSampleConfiguration pSampleConfiguration)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+
+    CHK(pSampleConfiguration != NULL, STATUS_NULL_ARG);
+    CHK(pSampleConfiguration->iceServerCacheTimerId == MAX_UINT32, retStatus);
+
+    // Started once the signaling client exists, it's where the TURN servers come from
+    CHK_STATUS(timerQueueAddTimer(pSampleConfiguration->timerQueueHandle, 0, SAMPLE_ICE_SERVER_CACHE_REFRESH_PERIOD,
+                                  refreshIceServerCacheTimerCallback, (UINT64) pSampleConfiguration, &pSampleConfiguration->iceServerCacheTimerId));
+
+CleanUp:
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+#define LOG_CLASS "LoopbackSignaling"
+#include "LoopbackSignaling.h"
+
+typedef struct {
+    BOOL toMaster;
+    ReceivedSignalingMessage receivedSignalingMessage;
+} LoopbackMessage, *PLoopbackMessage;
+
+static STATUS enqueueLoopbackMessage(PLoopbackSignaling pLoopbackSignaling, BOOL toMaster, PSignalingMessage pSignalingMessage)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PLoopbackMessage pLoopbackMessage = NULL;
+    BOOL locked = FALSE;
+
+    CHK(pLoopbackSignaling != NULL && pSignalingMessage != NULL, STATUS_NULL_ARG);
+    CHK(NULL != (pLoopbackMessage = (PLoopbackMessage) MEMCALLOC(1, SIZEOF(LoopbackMessage))), STATUS_NOT_ENOUGH_MEMORY);
+    pLoopbackMessage->toMaster = toMaster;
+    pLoopbackMessage->receivedSignalingMessage.signalingMessage = *pSignalingMessage;
+
+    MUTEX_LOCK(pLoopbackSignaling->lock);
+    locked = TRUE;
+    CHK_STATUS(stackQueueEnqueue(pLoopbackSignaling->pMessageQueue, (UINT64) pLoopbackMessage));
+    pLoopbackMessage = NULL;
+    CVAR_SIGNAL(pLoopbackSignaling->cvar);
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pLoopbackSignaling->lock);
+    }
+
+    SAFE_MEMFREE(pLoopbackMessage);
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
+
+// Replaces signalingClientSendMessageSync for the master
+static STATUS loopbackSignalingSendToViewer(UINT64 customData, PSignalingMessage pSignalingMessage)
+{
+    return enqueueLoopbackMessage((PLoopbackSignaling) customData, FALSE, pSignalingMessage);
+}
+
+static STATUS waitForFlag(volatile ATOMIC_BOOL* pFlag, UINT64 timeout)
+{
+    UINT64 deadline = GETTIME() + timeout;
+
+    while (!ATOMIC_LOAD_BOOL(pFlag)) {
+        if (GETTIME() > deadline) {
+            return STATUS_OPERATION_TIMED_OUT;
+        }
+        THREAD_SLEEP(LOOPBACK_POLL_PERIOD);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// The master restarted ICE, the viewer does the same and answers once it has gathered its new candidates
+static STATUS answerIceRestart(PLoopbackSignaling pLoopbackSignaling, PLoopbackViewer pLoopbackViewer, PSignalingMessage pSignalingMessage)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PRtcSessionDescriptionInit pSessionDescriptionInit = NULL;
+    SignalingMessage message;
+    UINT32 buffLen = MAX_SIGNALING_MESSAGE_LEN;
+
+    CHK(NULL != (pSessionDescriptionInit = (PRtcSessionDescriptionInit) MEMCALLOC(1, SIZEOF(RtcSessionDescriptionInit))), STATUS_NOT_ENOUGH_MEMORY);
+    ATOMIC_STORE_BOOL(&pLoopbackViewer->candidateGatheringDone, FALSE);
+    ATOMIC_INCREMENT(&pLoopbackViewer->iceRestartCount);
+    CHK_STATUS(restartIce(pLoopbackViewer->pPeerConnection));
+    CHK_STATUS(deserializeSessionDescriptionInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, pSessionDescriptionInit));
+    CHK_STATUS(setRemoteDescription(pLoopbackViewer->pPeerConnection, pSessionDescriptionInit));
+
+    MEMSET(pSessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
+    CHK_STATUS(setLocalDescription(pLoopbackViewer->pPeerConnection, pSessionDescriptionInit));
+    CHK_STATUS(waitForFlag(&pLoopbackViewer->candidateGatheringDone, LOOPBACK_CONNECT_TIMEOUT));
+    CHK_STATUS(createAnswer(pLoopbackViewer->pPeerConnection, pSessionDescriptionInit));
+
+    CHK_STATUS(serializeSessionDescriptionInit(pSessionDescriptionInit, message.payload, &buffLen));
+    message.version = SIGNALING_MESSAGE_CURRENT_VERSION;
+    message.messageType = SIGNALING_MESSAGE_TYPE_ANSWER;
+    STRNCPY(message.peerClientId, pLoopbackViewer->peerId, MAX_SIGNALING_CLIENT_ID_LEN);
+    message.peerClientId[MAX_SIGNALING_CLIENT_ID_LEN] = '\0';
+    message.payloadLen = (UINT32) STRLEN(message.payload);
+    message.correlationId[0] = '\0';
+    CHK_STATUS(enqueueLoopbackMessage(pLoopbackSignaling, TRUE, &message));
+
+CleanUp:
+
+    SAFE_MEMFREE(pSessionDescriptionInit);
+
+    return retStatus;
+}
+
+static VOID deliverLoopbackMessage(PLoopbackSignaling pLoopbackSignaling, PLoopbackMessage pLoopbackMessage)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSignalingMessage pSignalingMessage = &pLoopbackMessage->receivedSignalingMessage.signalingMessage;
+    PLoopbackViewer pLoopbackViewer = NULL;
+    RtcSessionDescriptionInit sessionDescriptionInit;
+    RtcIceCandidateInit iceCandidate;
+    BOOL locked = FALSE;
+    UINT32 i;
+
+    if (pLoopbackMessage->toMaster) {
+        CHK_STATUS(signalingMessageReceived((UINT64) pLoopbackSignaling->pSampleConfiguration, &pLoopbackMessage->receivedSignalingMessage));
+        CHK(FALSE, retStatus);
+    }
+
+    MUTEX_LOCK(pLoopbackSignaling->viewerLock);
+    locked = TRUE;
+
+    for (i = 0; i < ARRAY_SIZE(pLoopbackSignaling->viewers) && pLoopbackViewer == NULL; i++) {
+        if (pLoopbackSignaling->viewers[i] != NULL && STRCMP(pLoopbackSignaling->viewers[i]->peerId, pSignalingMessage->peerClientId) == 0) {
+            pLoopbackViewer = pLoopbackSignaling->viewers[i];
+        }
+    }
+    CHK_WARN(pLoopbackViewer != NULL, STATUS_NOT_FOUND, "Dropping message for unknown viewer %s", pSignalingMessage->peerClientId);
+
+    switch (pSignalingMessage->messageType) {
+        case SIGNALING_MESSAGE_TYPE_ANSWER:
+            MEMSET(&sessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
+            CHK_STATUS(deserializeSessionDescriptionInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &sessionDescriptionInit));
+            CHK_STATUS(setRemoteDescription(pLoopbackViewer->pPeerConnection, &sessionDescriptionInit));
+            break;
+
+        case SIGNALING_MESSAGE_TYPE_OFFER:
+            CHK_STATUS(answerIceRestart(pLoopbackSignaling, pLoopbackViewer, pSignalingMessage));
+            break;
+
+        case SIGNALING_MESSAGE_TYPE_ICE_CANDIDATE:
+            CHK_STATUS(deserializeRtcIceCandidateInit(pSignalingMessage->payload, pSignalingMessage->payloadLen, &iceCandidate));
+            CHK_STATUS(addIceCandidate(pLoopbackViewer->pPeerConnection, iceCandidate.candidate));
+            break;
+
+        default:
+            DLOGD("Unhandled loopback message type %u", pSignalingMessage->messageType);
+            break;
+    }
+
+CleanUp:
+
+    if (locked) {
+        MUTEX_UNLOCK(pLoopbackSignaling->viewerLock);
+    }
+
+    CHK_LOG_ERR(retStatus);
+}
+
+static PVOID loopbackDeliveryRoutine(PVOID args)
+{
+    PLoopbackSignaling pLoopbackSignaling = (PLoopbackSignaling) args;
+    UINT64 item;
+    BOOL empty;
+
+    MUTEX_LOCK(pLoopbackSignaling->lock);
+    while (!ATOMIC_LOAD_BOOL(&pLoopbackSignaling->terminateFlag)) {
+        if (STATUS_FAILED(stackQueueIsEmpty(pLoopbackSignaling->pMessageQueue, &empty)) || empty) {
+            CVAR_WAIT(pLoopbackSignaling->cvar, pLoopbackSignaling->lock, INFINITE_TIME_VALUE);
+            continue;
+        }
+
+        if (STATUS_SUCCEEDED(stackQueueDequeue(pLoopbackSignaling->pMessageQueue, &item))) {
+            // The master answers from the delivery thread, so the lock can't be held here
+            MUTEX_UNLOCK(pLoopbackSignaling->lock);
+            deliverLoopbackMessage(pLoopbackSignaling, (PLoopbackMessage) item);
+            MEMFREE((PVOID) item);
+            MUTEX_LOCK(pLoopbackSignaling->lock);
+        }
+    }
+    MUTEX_UNLOCK(pLoopbackSignaling->lock);
+
+    return NULL;
+}
+
+STATUS createLoopbackSignaling(PSampleConfiguration pSampleConfiguration, PLoopbackSignaling* ppLoopbackSignaling)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+
+    CHK(pSampleConfiguration != NULL && ppLoopbackSignaling != NULL, STATUS_NULL_ARG);
+
+    CHK(NULL != (pLoopbackSignaling = (PLoopbackSignaling) MEMCALLOC(1, SIZEOF(LoopbackSignaling))), STATUS_NOT_ENOUGH_MEMORY);
+    pLoopbackSignaling->pSampleConfiguration = pSampleConfiguration;
+    pLoopbackSignaling->deliveryTid = INVALID_TID_VALUE;
+    pLoopbackSignaling->lock = MUTEX_CREATE(FALSE);
+    pLoopbackSignaling->viewerLock = MUTEX_CREATE(FALSE);
+    pLoopbackSignaling->cvar = CVAR_CREATE();
+    CHK(IS_VALID_MUTEX_VALUE(pLoopbackSignaling->lock) && IS_VALID_MUTEX_VALUE(pLoopbackSignaling->viewerLock) &&
+            IS_VALID_CVAR_VALUE(pLoopbackSignaling->cvar),
+        STATUS_INVALID_OPERATION);
+    CHK_STATUS(stackQueueCreate(&pLoopbackSignaling->pMessageQueue));
+    ATOMIC_STORE_BOOL(&pLoopbackSignaling->terminateFlag, FALSE);
+    CHK_STATUS(THREAD_CREATE(&pLoopbackSignaling->deliveryTid, loopbackDeliveryRoutine, (PVOID) pLoopbackSignaling));
+
+    // The master's answers and candidates now go to the viewers in this process
+    pSampleConfiguration->signalingMessageSendCustomData = (UINT64) pLoopbackSignaling;
+    pSampleConfiguration->signalingMessageSendFn = loopbackSignalingSendToViewer;
+
+CleanUp:
+
+    if (STATUS_FAILED(retStatus)) {
+        freeLoopbackSignaling(&pLoopbackSignaling);
+    }
+
+    if (ppLoopbackSignaling != NULL) {
+        *ppLoopbackSignaling = pLoopbackSignaling;
+    }
+
+    return retStatus;
+}
+
+STATUS freeLoopbackSignaling(PLoopbackSignaling* ppLoopbackSignaling)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PLoopbackSignaling pLoopbackSignaling;
+    UINT64 item;
+
+    CHK(ppLoopbackSignaling != NULL, STATUS_NULL_ARG);
+    pLoopbackSignaling = *ppLoopbackSignaling;
+    CHK(pLoopbackSignaling != NULL, retStatus);
+
+    if (pLoopbackSignaling->pSampleConfiguration->signalingMessageSendCustomData == (UINT64) pLoopbackSignaling) {
+        pLoopbackSignaling->pSampleConfiguration->signalingMessageSendFn = NULL;
+    }
+
+    if (IS_VALID_TID_VALUE(pLoopbackSignaling->deliveryTid)) {
+        MUTEX_LOCK(pLoopbackSignaling->lock);
+        ATOMIC_STORE_BOOL(&pLoopbackSignaling->terminateFlag, TRUE);
+        CVAR_BROADCAST(pLoopbackSignaling->cvar);
+        MUTEX_UNLOCK(pLoopbackSignaling->lock);
+        THREAD_JOIN(pLoopbackSignaling->deliveryTid, NULL);
+    }
+
+    if (pLoopbackSignaling->pMessageQueue != NULL) {
+        while (STATUS_SUCCEEDED(stackQueueDequeue(pLoopbackSignaling->pMessageQueue, &item))) {
+            MEMFREE((PVOID) item);
+        }
+        stackQueueFree(pLoopbackSignaling->pMessageQueue);
+    }
+
+    if (IS_VALID_CVAR_VALUE(pLoopbackSignaling->cvar)) {
+        CVAR_FREE(pLoopbackSignaling->cvar);
+    }
+
+    if (IS_VALID_MUTEX_VALUE(pLoopbackSignaling->viewerLock)) {
+        MUTEX_FREE(pLoopbackSignaling->viewerLock);
+    }
+
+    if (IS_VALID_MUTEX_VALUE(pLoopbackSignaling->lock)) {
+        MUTEX_FREE(pLoopbackSignaling->lock);
+    }
+
+    SAFE_MEMFREE(*ppLoopbackSignaling);
+
+CleanUp:
+
+    return retStatus;
+}
+
+static VOID viewerIceCandidateHandler(UINT64 customData, PCHAR candidateJson)
+{
+    PLoopbackViewer pLoopbackViewer = (PLoopbackViewer) customData;
+
+    // Candidates are sent in the offer once gathering is done
+    if (candidateJson == NULL) {
+        ATOMIC_STORE_BOOL(&pLoopbackViewer->candidateGatheringDone, TRUE);
+    }
+}
+
+static VOID viewerConnectionStateChange(UINT64 customData, RTC_PEER_CONNECTION_STATE newState)
+{
+    PLoopbackViewer pLoopbackViewer = (PLoopbackViewer) customData;
+
+    ATOMIC_STORE_BOOL(&pLoopbackViewer->connected, newState == RTC_PEER_CONNECTION_STATE_CONNECTED);
+}
+
+static VOID viewerVideoFrameHandler(UINT64 customData, PFrame pFrame)
+{
+    PLoopbackViewer pLoopbackViewer = (PLoopbackViewer) customData;
+
+    ATOMIC_INCREMENT(&pLoopbackViewer->videoFrameCount);
+    if (pLoopbackViewer->videoFrameHandler != NULL) {
+        pLoopbackViewer->videoFrameHandler(pLoopbackViewer->customData, pFrame);
+    }
+}
+
+VOID freeLoopbackViewer(PLoopbackSignaling pLoopbackSignaling, PLoopbackViewer pLoopbackViewer)
+{
+    UINT32 i;
+
+    MUTEX_LOCK(pLoopbackSignaling->viewerLock);
+    for (i = 0; i < ARRAY_SIZE(pLoopbackSignaling->viewers); i++) {
+        if (pLoopbackSignaling->viewers[i] == pLoopbackViewer) {
+            pLoopbackSignaling->viewers[i] = NULL;
+        }
+    }
+    MUTEX_UNLOCK(pLoopbackSignaling->viewerLock);
+
+    if (pLoopbackViewer->pPeerConnection != NULL) {
+        closePeerConnection(pLoopbackViewer->pPeerConnection);
+        freePeerConnection(&pLoopbackViewer->pPeerConnection);
+    }
+}
+
+STATUS connectLoopbackViewer(PLoopbackSignaling pLoopbackSignaling, PLoopbackViewer pLoopbackViewer, UINT32 index, RtcOnFrame videoFrameHandler,
+                             UINT64 customData)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    RtcConfiguration configuration;
+    RtcMediaStreamTrack videoTrack, audioTrack;
+    RtcRtpTransceiverInit rtpTransceiverInit;
+    RtcSessionDescriptionInit sessionDescriptionInit;
+    SignalingMessage message;
+    UINT32 buffLen = MAX_SIGNALING_MESSAGE_LEN;
+
+    CHK(pLoopbackSignaling != NULL && pLoopbackViewer != NULL, STATUS_NULL_ARG);
+    CHK(index < ARRAY_SIZE(pLoopbackSignaling->viewers) && pLoopbackSignaling->viewers[index] == NULL, STATUS_INVALID_ARG);
+
+    MEMSET(pLoopbackViewer, 0x00, SIZEOF(LoopbackViewer));
+    MEMSET(&configuration, 0x00, SIZEOF(RtcConfiguration));
+    MEMSET(&videoTrack, 0x00, SIZEOF(RtcMediaStreamTrack));
+    MEMSET(&audioTrack, 0x00, SIZEOF(RtcMediaStreamTrack));
+    MEMSET(&sessionDescriptionInit, 0x00, SIZEOF(RtcSessionDescriptionInit));
+    SNPRINTF(pLoopbackViewer->peerId, SIZEOF(pLoopbackViewer->peerId), "LoopbackViewer%u", index);
+    pLoopbackViewer->videoFrameHandler = videoFrameHandler;
+    pLoopbackViewer->customData = customData;
+
+    // Host candidates only, everything stays on this machine
+    configuration.iceTransportPolicy = ICE_TRANSPORT_POLICY_ALL;
+    CHK_STATUS(createPeerConnection(&configuration, &pLoopbackViewer->pPeerConnection));
+    CHK_STATUS(peerConnectionOnIceCandidate(pLoopbackViewer->pPeerConnection, (UINT64) pLoopbackViewer, viewerIceCandidateHandler));
+    CHK_STATUS(peerConnectionOnConnectionStateChange(pLoopbackViewer->pPeerConnection, (UINT64) pLoopbackViewer, viewerConnectionStateChange));
+    CHK_STATUS(addSupportedCodec(pLoopbackViewer->pPeerConnection, RTC_CODEC_H264_PROFILE_42E01F_LEVEL_ASYMMETRY_ALLOWED_PACKETIZATION_MODE));
+    CHK_STATUS(addSupportedCodec(pLoopbackViewer->pPeerConnection, RTC_CODEC_ALAW));
+
+    rtpTransceiverInit.direction = RTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY;
+    videoTrack.kind = MEDIA_STREAM_TRACK_KIND_VIDEO;
+    videoTrack.codec = RTC_CODEC_H264_PROFILE_42E01F_LEVEL_ASYMMETRY_ALLOWED_PACKETIZATION_MODE;
+    STRCPY(videoTrack.streamId, SAMPLE_MASTER_STREAM_ID);
+    STRCPY(videoTrack.trackId, SAMPLE_VIDEO_TRACK_ID);
+    CHK_STATUS(addTransceiver(pLoopbackViewer->pPeerConnection, &videoTrack, &rtpTransceiverInit, &pLoopbackViewer->pVideoRtcRtpTransceiver));
+    CHK_STATUS(transceiverOnFrame(pLoopbackViewer->pVideoRtcRtpTransceiver, (UINT64) pLoopbackViewer, viewerVideoFrameHandler));
+
+    audioTrack.kind = MEDIA_STREAM_TRACK_KIND_AUDIO;
+    audioTrack.codec = RTC_CODEC_ALAW;
+    STRCPY(audioTrack.streamId, SAMPLE_MASTER_STREAM_ID);
+    STRCPY(audioTrack.trackId, SAMPLE_AUDIO_TRACK_ID);
+    CHK_STATUS(addTransceiver(pLoopbackViewer->pPeerConnection, &audioTrack, &rtpTransceiverInit, &pLoopbackViewer->pAudioRtcRtpTransceiver));
+
+    // Non-trickle offer, the master may still trickle its candidates back
+    CHK_STATUS(setLocalDescription(pLoopbackViewer->pPeerConnection, &sessionDescriptionInit));
+    CHK_STATUS(waitForFlag(&pLoopbackViewer->candidateGatheringDone, LOOPBACK_CONNECT_TIMEOUT));
+    CHK_STATUS(createOffer(pLoopbackViewer->pPeerConnection, &sessionDescriptionInit));
+
+    MUTEX_LOCK(pLoopbackSignaling->viewerLock);
+    pLoopbackSignaling->viewers[index] = pLoopbackViewer;
+    MUTEX_UNLOCK(pLoopbackSignaling->viewerLock);
+
+    // Goes through signalingMessageReceived like an offer from the signaling channel
+    CHK_STATUS(serializeSessionDescriptionInit(&sessionDescriptionInit, message.payload, &buffLen));
+    message.version = SIGNALING_MESSAGE_CURRENT_VERSION;
+    message.messageType = SIGNALING_MESSAGE_TYPE_OFFER;
+    STRNCPY(message.peerClientId, pLoopbackViewer->peerId, MAX_SIGNALING_CLIENT_ID_LEN);
+    message.peerClientId[MAX_SIGNALING_CLIENT_ID_LEN] = '\0';
+    message.payloadLen = (UINT32) STRLEN(message.payload);
+    message.correlationId[0] = '\0';
+    CHK_STATUS(enqueueLoopbackMessage(pLoopbackSignaling, TRUE, &message));
+
+    CHK_STATUS(waitForFlag(&pLoopbackViewer->connected, LOOPBACK_CONNECT_TIMEOUT));
+
+CleanUp:
+
+    if (STATUS_FAILED(retStatus) && pLoopbackSignaling != NULL && pLoopbackViewer != NULL) {
+        freeLoopbackViewer(pLoopbackSignaling, pLoopbackViewer);
+    }
+
+    CHK_LOG_ERR(retStatus);
+    return retStatus;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Local stand-in for the signaling channel, used by the WebRTC benchmarks to connect viewers running in the same
+ * process to the master over localhost.
+ */
+#ifndef __KINESIS_VIDEO_SAMPLE_LOOPBACK_SIGNALING_INCLUDE__
+#define __KINESIS_VIDEO_SAMPLE_LOOPBACK_SIGNALING_INCLUDE__
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "Samples.h"
+
+#define LOOPBACK_CONNECT_TIMEOUT (15 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define LOOPBACK_POLL_PERIOD     (10 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+
+/* A receive-only viewer peer connection in the benchmark process */
+typedef struct {
+    CHAR peerId[MAX_SIGNALING_CLIENT_ID_LEN + 1];
+    PRtcPeerConnection pPeerConnection;
+    PRtcRtpTransceiver pVideoRtcRtpTransceiver;
+    PRtcRtpTransceiver pAudioRtcRtpTransceiver;
+    volatile ATOMIC_BOOL candidateGatheringDone;
+    volatile ATOMIC_BOOL connected;
+    volatile SIZE_T videoFrameCount;
+    volatile SIZE_T iceRestartCount; // Offers of the master to an existing connection
+    // Optional, called on the viewer's receive thread for every video frame
+    RtcOnFrame videoFrameHandler;
+    UINT64 customData;
+} LoopbackViewer, *PLoopbackViewer;
+
+/*
+ * Messages in both directions go through one queue and are delivered in order by one thread, so like with the real
+ * signaling client no peer is ever called back on the thread that sent the message.
+ */
+typedef struct {
+    PSampleConfiguration pSampleConfiguration;
+    MUTEX lock;
+    CVAR cvar;
+    PStackQueue pMessageQueue;
+    TID deliveryTid;
+    volatile ATOMIC_BOOL terminateFlag;
+    // Held while a message is delivered to a viewer, so the viewer isn't freed under it
+    MUTEX viewerLock;
+    PLoopbackViewer viewers[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+} LoopbackSignaling, *PLoopbackSignaling;
+
+STATUS createLoopbackSignaling(PSampleConfiguration, PLoopbackSignaling*);
+STATUS freeLoopbackSignaling(PLoopbackSignaling*);
+STATUS connectLoopbackViewer(PLoopbackSignaling, PLoopbackViewer, UINT32, RtcOnFrame, UINT64);
+VOID freeLoopbackViewer(PLoopbackSignaling, PLoopbackViewer);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __KINESIS_VIDEO_SAMPLE_LOOPBACK_SIGNALING_INCLUDE__ */
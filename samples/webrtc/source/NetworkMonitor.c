@@ -0,0 +1,247 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+#define LOG_CLASS "NetworkMonitor"
+#include "Samples.h"
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/*
+ * Watches the route netlink socket for the changes which move the ICE candidates of the device: an address added or
+ * removed, or the carrier of an interface going up or down. A Wi-Fi roam or a DHCP renewal comes as a burst of these,
+ * the callback is called once the burst is over. The states of the interfaces are read from a dump at startup, so a
+ * link message which doesn't change the carrier isn't taken for a change.
+ */
+
+typedef struct {
+    INT32 index;
+    UINT32 flags;
+} NetworkInterfaceState, *PNetworkInterfaceState;
+
+struct __NetworkMonitor {
+    INT32 socket;
+    TID monitorTid;
+    volatile ATOMIC_BOOL terminate;
+    NetworkChangeCallback networkChangeCallback;
+    UINT64 customData;
+    // Only used by the monitor thread
+    NetworkInterfaceState interfaces[SAMPLE_NETWORK_MONITOR_MAX_INTERFACES];
+    UINT32 interfaceCount;
+};
+
+// Returns TRUE when the interface went up or down, the other link messages don't change the candidates
+static BOOL updateInterfaceState(PNetworkMonitor pNetworkMonitor, struct ifinfomsg* pInfo, BOOL removed)
+{
+    UINT32 i, flags = removed ? 0 : pInfo->ifi_flags & (IFF_UP | IFF_RUNNING);
+    BOOL changed;
+
+    if ((pInfo->ifi_flags & IFF_LOOPBACK) != 0) {
+        return FALSE;
+    }
+
+    for (i = 0; i < pNetworkMonitor->interfaceCount; i++) {
+        if (pNetworkMonitor->interfaces[i].index == pInfo->ifi_index) {
+            changed = pNetworkMonitor->interfaces[i].flags != flags;
+            pNetworkMonitor->interfaces[i].flags = flags;
+            if (removed) {
+                pNetworkMonitor->interfaces[i] = pNetworkMonitor->interfaces[--pNetworkMonitor->interfaceCount];
+            }
+            return changed;
+        }
+    }
+
+    // Without room to track it, every message of the interface counts as a change
+    if (!removed && pNetworkMonitor->interfaceCount < ARRAY_SIZE(pNetworkMonitor->interfaces)) {
+        pNetworkMonitor->interfaces[pNetworkMonitor->interfaceCount].index = pInfo->ifi_index;
+        pNetworkMonitor->interfaces[pNetworkMonitor->interfaceCount].flags = flags;
+        pNetworkMonitor->interfaceCount++;
+        return (flags & IFF_RUNNING) != 0;
+    }
+
+    return !removed;
+}
+
+// Returns TRUE when one of the notifications in the buffer changes the candidates, the answers to the dump never do
+static BOOL handleNetlinkMessages(PNetworkMonitor pNetworkMonitor, struct nlmsghdr* pHeader, INT32 length)
+{
+    struct ifaddrmsg* pAddress;
+    BOOL changed = FALSE, notification;
+
+    for (; NLMSG_OK(pHeader, (UINT32) length); pHeader = NLMSG_NEXT(pHeader, length)) {
+        notification = pHeader->nlmsg_seq == 0;
+        switch (pHeader->nlmsg_type) {
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+                if (updateInterfaceState(pNetworkMonitor, (struct ifinfomsg*) NLMSG_DATA(pHeader), pHeader->nlmsg_type == RTM_DELLINK) &&
+                    notification) {
+                    changed = TRUE;
+                }
+                break;
+
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                // Loopback addresses are never candidates and a tentative address can't be used until it's confirmed
+                pAddress = (struct ifaddrmsg*) NLMSG_DATA(pHeader);
+                if (notification && pAddress->ifa_scope != RT_SCOPE_HOST &&
+                    (pHeader->nlmsg_type == RTM_DELADDR || (pAddress->ifa_flags & IFA_F_TENTATIVE) == 0)) {
+                    DLOGD("Address %s on interface %u", pHeader->nlmsg_type == RTM_NEWADDR ? "added" : "removed", pAddress->ifa_index);
+                    changed = TRUE;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return changed;
+}
+
+static STATUS requestLinkDump(PNetworkMonitor pNetworkMonitor)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    struct {
+        struct nlmsghdr header;
+        struct ifinfomsg info;
+    } request;
+
+    MEMSET(&request, 0x00, SIZEOF(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(SIZEOF(struct ifinfomsg));
+    request.header.nlmsg_type = RTM_GETLINK;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = 1;
+    request.info.ifi_family = AF_UNSPEC;
+
+    CHK_ERR(send(pNetworkMonitor->socket, &request, request.header.nlmsg_len, 0) >= 0, STATUS_INVALID_OPERATION, "Unable to dump the links: %s",
+            strerror(errno));
+
+CleanUp:
+
+    return retStatus;
+}
+
+static PVOID networkMonitorRoutine(PVOID args)
+{
+    PNetworkMonitor pNetworkMonitor = (PNetworkMonitor) args;
+    // Netlink messages are aligned on 4 bytes
+    UINT32 buffer[2048];
+    struct pollfd pollFd;
+    INT32 length;
+    UINT64 now, lastChangeTime = 0, timeout;
+    BOOL changePending = FALSE;
+
+    pollFd.fd = pNetworkMonitor->socket;
+    pollFd.events = POLLIN;
+
+    while (!ATOMIC_LOAD_BOOL(&pNetworkMonitor->terminate)) {
+        timeout = SAMPLE_NETWORK_MONITOR_POLL_PERIOD;
+        if (changePending) {
+            now = GETTIME();
+            timeout = lastChangeTime + SAMPLE_NETWORK_CHANGE_SETTLE_PERIOD > now ? lastChangeTime + SAMPLE_NETWORK_CHANGE_SETTLE_PERIOD - now : 0;
+        }
+
+        pollFd.revents = 0;
+        if (poll(&pollFd, 1, (INT32) (timeout / HUNDREDS_OF_NANOS_IN_A_MILLISECOND)) > 0 && (pollFd.revents & POLLIN) != 0) {
+            length = (INT32) recv(pNetworkMonitor->socket, buffer, SIZEOF(buffer), 0);
+            if (length > 0 && handleNetlinkMessages(pNetworkMonitor, (struct nlmsghdr*) buffer, length)) {
+                changePending = TRUE;
+                lastChangeTime = GETTIME();
+            } else if (length < 0 && errno == ENOBUFS) {
+                // Notifications were lost, whatever they were the candidates may have changed
+                changePending = TRUE;
+                lastChangeTime = GETTIME();
+            }
+            continue;
+        }
+
+        if (changePending && GETTIME() >= lastChangeTime + SAMPLE_NETWORK_CHANGE_SETTLE_PERIOD) {
+            changePending = FALSE;
+            DLOGI("Network interfaces changed");
+            pNetworkMonitor->networkChangeCallback(pNetworkMonitor->customData);
+        }
+    }
+
+    return NULL;
+}
+
+STATUS createNetworkMonitor(NetworkChangeCallback networkChangeCallback, UINT64 customData, PNetworkMonitor* ppNetworkMonitor)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PNetworkMonitor pNetworkMonitor = NULL;
+    struct sockaddr_nl address;
+
+    CHK(networkChangeCallback != NULL && ppNetworkMonitor != NULL, STATUS_NULL_ARG);
+
+    CHK(NULL != (pNetworkMonitor = (PNetworkMonitor) MEMCALLOC(1, SIZEOF(struct __NetworkMonitor))), STATUS_NOT_ENOUGH_MEMORY);
+    pNetworkMonitor->monitorTid = INVALID_TID_VALUE;
+    pNetworkMonitor->networkChangeCallback = networkChangeCallback;
+    pNetworkMonitor->customData = customData;
+    ATOMIC_STORE_BOOL(&pNetworkMonitor->terminate, FALSE);
+
+    pNetworkMonitor->socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    CHK_ERR(pNetworkMonitor->socket >= 0, STATUS_INVALID_OPERATION, "Unable to create the netlink socket: %s", strerror(errno));
+
+    MEMSET(&address, 0x00, SIZEOF(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    CHK_ERR(bind(pNetworkMonitor->socket, (struct sockaddr*) &address, SIZEOF(address)) == 0, STATUS_INVALID_OPERATION,
+            "Unable to bind the netlink socket: %s", strerror(errno));
+
+    CHK_STATUS(requestLinkDump(pNetworkMonitor));
+    CHK_STATUS(THREAD_CREATE(&pNetworkMonitor->monitorTid, networkMonitorRoutine, (PVOID) pNetworkMonitor));
+
+CleanUp:
+
+    if (STATUS_FAILED(retStatus)) {
+        freeNetworkMonitor(&pNetworkMonitor);
+    }
+
+    if (ppNetworkMonitor != NULL) {
+        *ppNetworkMonitor = pNetworkMonitor;
+    }
+
+    return retStatus;
+}
+
+STATUS freeNetworkMonitor(PNetworkMonitor* ppNetworkMonitor)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PNetworkMonitor pNetworkMonitor;
+
+    CHK(ppNetworkMonitor != NULL, STATUS_NULL_ARG);
+    pNetworkMonitor = *ppNetworkMonitor;
+    CHK(pNetworkMonitor != NULL, retStatus);
+
+    // The thread sees the flag within a poll period
+    ATOMIC_STORE_BOOL(&pNetworkMonitor->terminate, TRUE);
+    if (IS_VALID_TID_VALUE(pNetworkMonitor->monitorTid)) {
+        THREAD_JOIN(pNetworkMonitor->monitorTid, NULL);
+    }
+
+    if (pNetworkMonitor->socket >= 0) {
+        close(pNetworkMonitor->socket);
+    }
+
+    SAFE_MEMFREE(*ppNetworkMonitor);
+
+CleanUp:
+
+    return retStatus;
+}
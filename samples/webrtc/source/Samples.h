@@ -38,14 +38,130 @@ extern "C" {
 #define SAMPLE_AUDIO_TRACK_ID   "myAudioTrack"
 
 #define SAMPLE_STATS_DURATION (60 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+// iceCandidatePairStatsTimerId of a timer that a session setup is adding, so only one of them adds it
+#define SAMPLE_STATS_TIMER_ID_PENDING (MAX_UINT32 - 1)
 
 #define SAMPLE_PRE_GENERATE_CERT        TRUE
 #define SAMPLE_PRE_GENERATE_CERT_PERIOD (1000 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+#define SAMPLE_PRE_GENERATE_CERT_NICE   19
 
+// The unused pre-generated certificates are saved in a file only the owner can read, a restart doesn't start with an empty pool
+#define SAMPLE_CERTIFICATE_POOL_FILE_PATH    ((PCHAR) "./.CertificatePool_v0")
+#define SAMPLE_CERTIFICATE_POOL_VERSION      0
+#define SAMPLE_CERTIFICATE_POOL_MAX_AGE      (7 * 24 * 60 * 60 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_CERTIFICATE_POOL_MAX_DER_SIZE 4096
+// Set to 0 to neither load nor save the pool file, the first viewers after startup then wait for their certificate like before
+#define SAMPLE_CERTIFICATE_POOL_FILE_ENV_VAR ((PCHAR) "AWS_KVS_CERTIFICATE_POOL_FILE")
+
+// Retry period of a failed signaling client re-creation or connect, sessionCleanupWait otherwise sleeps until there is work
 #define SAMPLE_SESSION_CLEANUP_WAIT_PERIOD (5 * HUNDREDS_OF_NANOS_IN_A_SECOND)
 
 #define SAMPLE_PENDING_MESSAGE_CLEANUP_DURATION (20 * HUNDREDS_OF_NANOS_IN_A_SECOND)
 
+// Offers are answered by this many threads, a viewer waiting for a certificate doesn't hold up the others
+#define SAMPLE_SESSION_SETUP_WORKER_COUNT 3
+// The oldest queue is dropped beyond this, a flood of candidates from unknown client ids can't grow the memory without bound
+#define SAMPLE_PENDING_MESSAGE_QUEUE_MAX_COUNT 1024
+
+// The signaling endpoint is cached by the signaling client, the ICE servers and the STUN server address by the sample.
+// Both are used at startup as they are and only looked up again when they expire or the connection with them fails.
+#define SAMPLE_SIGNALING_CACHE_FILE_PATH         ((PCHAR) "./.SignalingCache_v0")
+#define SAMPLE_ICE_SERVER_CACHE_FILE_PATH        ((PCHAR) "./.IceServerCache_v0")
+#define SAMPLE_ICE_SERVER_CACHE_VERSION          0
+#define SAMPLE_ICE_SERVER_CACHE_REFRESH_PERIOD   (30 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_ICE_SERVER_CACHE_EXPIRY_MARGIN    (60 * HUNDREDS_OF_NANOS_IN_A_SECOND) // Not used when it expires sooner than this
+#define SAMPLE_STUN_SERVER_ADDRESS_TTL           (60 * 60 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_ICE_SERVER_CACHE_MAX_TURN_SERVERS 1
+
+#define SAMPLE_SESSION_SEND_QUEUE_LENGTH           16
+#define SAMPLE_SESSION_SNAPSHOT_RETIRE_POLL_PERIOD (1 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+
+// Frames of the current GOP kept for viewers which join mid-GOP, longer GOPs aren't cached
+#define SAMPLE_GOP_CACHE_MAX_FRAMES 64
+
+// Set to start capturing at boot so the first viewer doesn't wait for the sensor and the encoder to start
+#define SAMPLE_WARM_CAPTURE_ENV_VAR ((PCHAR) "AWS_KVS_WARM_CAPTURE")
+// What the capture threads do once the last viewer has left, one of the values below. The audio is released unless it's off.
+#define SAMPLE_IDLE_CAPTURE_ENV_VAR     ((PCHAR) "AWS_KVS_IDLE_CAPTURE")
+#define SAMPLE_IDLE_CAPTURE_KEY_FRAMES  ((PCHAR) "keyframes")
+#define SAMPLE_IDLE_CAPTURE_RELEASE     ((PCHAR) "release")
+#define SAMPLE_IDLE_CAPTURE_OFF         ((PCHAR) "off")
+#define SAMPLE_IDLE_CAPTURE_WAIT_PERIOD (5 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+
+// Bandwidth estimates are smoothed with an EWMA and only act once they cross the current value by the hysteresis margin.
+// A session whose link can't carry the video gets the key frames only, until its estimate has recovered for the hold period.
+#define SAMPLE_BITRATE_SMOOTHING_FACTOR    0.25
+#define SAMPLE_BITRATE_HYSTERESIS          0.15
+#define SAMPLE_BITRATE_UPGRADE_HOLD_PERIOD (5 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_BITRATE_MEASURE_PERIOD      (1 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_BITRATE_POLICY              SAMPLE_BITRATE_POLICY_MINIMUM
+
+// The video of a session leaves through a leaky bucket drained at a multiple of its bandwidth estimate, so a large IDR
+// or the GOP cache replay at join doesn't overrun a shallow link buffer. Bursts up to the bucket size go out unpaced,
+// a bucket size of 0 turns the pacer off. The source bitrate, or else the initial rate, is used before the first estimate.
+#define SAMPLE_PACER_BURST_SIZE_ENV_VAR ((PCHAR) "AWS_KVS_PACER_BURST_SIZE")
+#define SAMPLE_PACER_DEFAULT_BURST_SIZE (32 * 1024)
+#define SAMPLE_PACER_RATE_FACTOR        2.5
+#define SAMPLE_PACER_INITIAL_BITRATE    (1024 * 1024)
+
+// With patches/0002-rtp-optimization-share-packetized-payloads-across-tr.patch, the SDK packetizes a frame once for all
+// the viewers. Set to 0 to have every viewer packetize its own frames again, to measure what it saves.
+#define SAMPLE_SHARED_RTP_PAYLOAD_ENV_VAR ((PCHAR) "AWS_KVS_SHARED_RTP_PAYLOAD")
+
+// Every phase of a session setup goes into a histogram of its time from the offer, in power of two buckets of ms.
+// The last bucket takes everything above 16 s. Send SIGUSR1 to the master to print them.
+#define SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT 16
+
+// Set to a path to sample the transport of every session into a ring each period and serve it on a Unix socket there.
+// Each connection is sent a SampleStatsRingHeader and the records in the ring, oldest first, and is then closed.
+#define SAMPLE_STATS_RING_SOCKET_ENV_VAR ((PCHAR) "AWS_KVS_STATS_SOCKET")
+#define SAMPLE_STATS_RING_LENGTH         512
+#define SAMPLE_STATS_RING_PERIOD         (1 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_STATS_RING_MAGIC          0x4b565352 // "KVSR"
+#define SAMPLE_STATS_RING_VERSION        0
+#define SAMPLE_STATS_RING_SEND_TIMEOUT   (1 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+
+// Set to 1 for the master to restart the ICE of its connected sessions when an address or the carrier of an interface
+// changes, so a viewer only waits for a new candidate pair instead of a new session. The changes of a burst, like the
+// ones of a DHCP renewal, are handled once the interfaces have been quiet for the settle period. A session which isn't
+// connected again within the timeout is terminated, and the viewer sets up a new one.
+#define SAMPLE_ICE_RESTART_ENV_VAR            ((PCHAR) "AWS_KVS_ICE_RESTART")
+#define SAMPLE_ICE_RESTART_TIMEOUT            (15 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define SAMPLE_NETWORK_CHANGE_SETTLE_PERIOD   (100 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+#define SAMPLE_NETWORK_MONITOR_POLL_PERIOD    (500 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+#define SAMPLE_NETWORK_MONITOR_MAX_INTERFACES 32
+
+// The interfaces and addresses ICE gathers on. The interfaces env var takes comma separated name patterns, one starting
+// with ! leaves out the interfaces it matches. Without an include pattern the virtual interfaces are left out too,
+// unless their env var is 1. Link-local addresses are left out unless their env var is 1, and the address family env
+// var restricts ICE to one of the values below. The remote candidates go through the same address policy.
+#define SAMPLE_ICE_INTERFACES_ENV_VAR         ((PCHAR) "AWS_KVS_ICE_INTERFACES")
+#define SAMPLE_ICE_VIRTUAL_INTERFACES_ENV_VAR ((PCHAR) "AWS_KVS_ICE_VIRTUAL_INTERFACES")
+#define SAMPLE_ICE_LINK_LOCAL_ENV_VAR         ((PCHAR) "AWS_KVS_ICE_LINK_LOCAL")
+#define SAMPLE_ICE_ADDRESS_FAMILY_ENV_VAR     ((PCHAR) "AWS_KVS_ICE_ADDRESS_FAMILY")
+#define SAMPLE_ICE_ADDRESS_FAMILY_IPV4        ((PCHAR) "ipv4")
+#define SAMPLE_ICE_ADDRESS_FAMILY_IPV6        ((PCHAR) "ipv6")
+// Docker names its user-defined bridges br- and the first 12 hex digits of the network ID. Other bridges, like the br-lan
+// of OpenWrt, can carry the uplink and are kept.
+#define SAMPLE_ICE_HEX_DIGIT                  "[0-9a-f]"
+#define SAMPLE_ICE_DOCKER_BRIDGE_PATTERN                                                                                                             \
+    "br-" SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT            \
+        SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT SAMPLE_ICE_HEX_DIGIT
+#define SAMPLE_ICE_VIRTUAL_INTERFACE_PATTERNS ((PCHAR) "docker*,veth*," SAMPLE_ICE_DOCKER_BRIDGE_PATTERN ",virbr*,lxcbr*,cni*,flannel*,vmnet*")
+#define SAMPLE_ICE_INTERFACE_PATTERNS_LEN     256
+
+#define SAMPLE_H264_NAL_TYPE_SLICE     1
+#define SAMPLE_H264_NAL_TYPE_IDR_SLICE 5
+#define SAMPLE_H264_NAL_TYPE_SPS       7
+
+// Talkback from the viewers is G.711 A-law at 8 kHz, mixed and played out every period
+#define SAMPLE_AUDIO_MIXER_SAMPLE_RATE         8000
+#define SAMPLE_AUDIO_MIXER_PERIOD              (20 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+#define SAMPLE_AUDIO_MIXER_PERIOD_SAMPLES      (SAMPLE_AUDIO_MIXER_SAMPLE_RATE * 20 / 1000)
+#define SAMPLE_JITTER_BUFFER_MIN_DEPTH_SAMPLES (SAMPLE_AUDIO_MIXER_SAMPLE_RATE * 40 / 1000)
+#define SAMPLE_JITTER_BUFFER_MAX_DEPTH_SAMPLES (SAMPLE_AUDIO_MIXER_SAMPLE_RATE * 200 / 1000)
+#define SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES  (SAMPLE_AUDIO_MIXER_SAMPLE_RATE * 400 / 1000)
+
 #define CA_CERT_PEM_FILE_EXTENSION ".pem"
 
 #define FILE_LOGGING_BUFFER_SIZE (100 * 1024)
@@ -71,9 +187,57 @@ typedef enum {
     SAMPLE_STREAMING_AUDIO_VIDEO,
 } SampleStreamingMediaType;
 
+// How the video bitrate target is chosen from the estimates of the sessions
+typedef enum {
+    SAMPLE_BITRATE_POLICY_MINIMUM, // Every viewer can receive the whole stream
+    SAMPLE_BITRATE_POLICY_MEDIAN,  // The viewers below the median get the key frames only
+} SampleBitratePolicy;
+
+// What the video capture thread does while nobody is watching
+typedef enum {
+    SAMPLE_IDLE_CAPTURE_MODE_KEY_FRAMES, // Keeps capturing but only copies the key frames, a new viewer gets the cached one right away
+    SAMPLE_IDLE_CAPTURE_MODE_RELEASE,    // Releases the capturer until the next viewer, which starts at the first IDR of the encoder
+    SAMPLE_IDLE_CAPTURE_MODE_OFF,        // Nothing is gated, every frame is still copied and cached and the audio captured, to compare with
+} SampleIdleCaptureMode;
+
+// Phases of a session setup, in the order they normally happen after the offer is received
+typedef enum {
+    SAMPLE_SETUP_PHASE_PEER_CONNECTION_CREATED, // Includes waiting for a certificate when the pool is empty
+    SAMPLE_SETUP_PHASE_ANSWER_SENT,
+    SAMPLE_SETUP_PHASE_FIRST_LOCAL_CANDIDATE,
+    SAMPLE_SETUP_PHASE_ICE_GATHERING_DONE,
+    SAMPLE_SETUP_PHASE_ICE_CHECKING,
+    SAMPLE_SETUP_PHASE_CONNECTED, // ICE and DTLS, the SDK reports the connection once the DTLS handshake is done
+    SAMPLE_SETUP_PHASE_FIRST_RTP_SENT,
+    SAMPLE_SETUP_PHASE_FIRST_FRAME_RECEIVED,
+    SAMPLE_SETUP_PHASE_COUNT,
+} SampleSetupPhase;
+
+// ICE only pairs the candidates of the same family
+typedef enum {
+    SAMPLE_ICE_FAMILY_IPV4,
+    SAMPLE_ICE_FAMILY_IPV6,
+    SAMPLE_ICE_FAMILY_COUNT, // Also the family of a candidate whose address is a hostname
+} SampleIceFamily;
+
+// Called with the new video bitrate target in bps, a board with an encoder API applies it there
+typedef VOID (*VideoBitrateTargetCallback)(UINT64, UINT64);
+
 typedef struct __SampleStreamingSession SampleStreamingSession;
 typedef struct __SampleStreamingSession* PSampleStreamingSession;
 
+typedef struct __PendingMessageQueues PendingMessageQueues;
+typedef struct __PendingMessageQueues* PPendingMessageQueues;
+
+typedef struct __StatsRing StatsRing;
+typedef struct __StatsRing* PStatsRing;
+
+typedef struct __NetworkMonitor NetworkMonitor;
+typedef struct __NetworkMonitor* PNetworkMonitor;
+
+// Called on the network monitor thread once a burst of interface changes is over
+typedef VOID (*NetworkChangeCallback)(UINT64);
+
 typedef struct {
     UINT64 prevNumberOfPacketsSent;
     UINT64 prevNumberOfPacketsReceived;
@@ -83,6 +247,159 @@ typedef struct {
     UINT64 prevTs;
 } RtcMetricsHistory, *PRtcMetricsHistory;
 
+/*
+ * Immutable copy of the streaming session list used by the capture threads. Readers take a reference while they fan a
+ * frame out, the writer publishes a new copy and waits for the references to the old one to be dropped.
+ */
+typedef struct {
+    volatile SIZE_T refCount;
+    UINT32 sessionCount;
+    PSampleStreamingSession sessionList[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+} StreamingSessionSnapshot, *PStreamingSessionSnapshot;
+
+/*
+ * A captured frame shared by the send queues of all the sessions. The frame data follows the structure and the frame
+ * is freed when the last session has sent it.
+ */
+typedef struct {
+    volatile SIZE_T refCount;
+    BOOL isVideo;
+    UINT64 createTime;
+    UINT64 videoFrameIndex;
+    UINT32 h264NalTypes; // Bit n is set when the frame has a NAL unit of type n before its first slice
+    Frame frame;
+} SampleSharedFrame, *PSampleSharedFrame;
+
+typedef struct {
+    UINT32 queueDepth;
+    UINT32 maxQueueDepth;
+    UINT64 droppedFrames;
+    UINT64 keyFrameWaitCount; // Number of times the session fell behind and waited for the next key frame
+    UINT64 timeBehind;        // Total time spent waiting for a key frame
+    UINT64 maxQueueDelay;     // Longest time a frame waited in the queue before being sent
+    UINT64 decimatedFrames;   // Video frames skipped because the link can't carry the whole stream
+    UINT64 estimatedBitrate;  // Smoothed bandwidth estimate in bps
+    UINT64 pacedTime;         // Total time the video was held back by the pacer
+} SampleSendQueueStats, *PSampleSendQueueStats;
+
+typedef struct {
+    UINT64 count;
+    UINT64 totalTime; // In ms
+    UINT64 maxTime;   // In ms
+    UINT64 buckets[SAMPLE_SETUP_HISTOGRAM_BUCKET_COUNT];
+} SampleSetupHistogram, *PSampleSetupHistogram;
+
+typedef struct {
+    UINT64 gatheringCount;
+    UINT64 totalGatheringTime; // In ms, from the local description to the end of the gathering
+    UINT64 maxGatheringTime;   // In ms
+    UINT64 connectionCount;
+    UINT64 totalCandidatePairs; // Local by remote candidates of the same family once connected, all of them may be checked
+    UINT64 maxCandidatePairs;
+    UINT64 filteredCandidates; // Local and remote candidates left out by the filter policy
+} SampleIceStats, *PSampleIceStats;
+
+typedef struct {
+    CHAR interfacePatterns[SAMPLE_ICE_INTERFACE_PATTERNS_LEN + 1];
+    BOOL useVirtualInterfaces;
+    BOOL useLinkLocal;
+    BOOL useFamilies[SAMPLE_ICE_FAMILY_COUNT];
+} SampleIceFilterPolicy, *PSampleIceFilterPolicy;
+
+/*
+ * Sent on the stats socket as they are, in the byte order of the device and without padding. A reader checks the
+ * magic, the version and the record size of the header before reading the records.
+ */
+typedef struct {
+    UINT32 magic;
+    UINT16 version;
+    UINT16 recordSize;
+    UINT32 recordCount;
+    UINT32 reserved;
+} SampleStatsRingHeader, *PSampleStatsRingHeader;
+
+typedef struct {
+    UINT64 sequence;                 // Number of records before this one since startup, a gap means the reader fell behind
+    UINT64 timestamp;                // In 100 ns since the epoch
+    UINT32 sessionId;                // CRC32 of the peer id
+    UINT32 roundTripTime;            // Current STUN round trip time of the selected candidate pair in us
+    UINT64 availableOutgoingBitrate; // In bps, as reported for the selected candidate pair
+    UINT64 estimatedBitrate;         // Smoothed bandwidth estimate of the session in bps
+    UINT64 bytesSent;                // On the selected candidate pair
+    UINT64 packetsSent;              // Video RTP packets
+    UINT64 retransmittedPacketsSent; // Video RTP packets
+    INT64 packetsLost;               // Video RTP packets, as reported by the viewer
+    UINT32 nackCount;
+    UINT32 pliCount;
+} SampleStatsRecord, *PSampleStatsRecord;
+
+typedef struct {
+    UINT64 frames;
+    UINT64 underruns;
+    UINT64 discardedSamples; // Dropped to bring the latency back down after a burst
+    UINT32 targetLatency;    // Current adaptive depth in ms
+    UINT32 averageLatency;   // Time the played samples spent in the buffer in ms
+    UINT32 maxLatency;
+} JitterBufferStats, *PJitterBufferStats;
+
+/*
+ * Decoded talkback of one session. The target depth follows the inter-arrival jitter and playout only starts, or
+ * restarts after an underrun, once that much audio is buffered.
+ */
+typedef struct {
+    UINT64 streamId;
+    BOOL active;
+    BOOL buffering;
+    INT16 samples[SAMPLE_JITTER_BUFFER_CAPACITY_SAMPLES];
+    UINT32 head;
+    UINT32 count;
+    UINT32 targetDepth;
+    DOUBLE jitter; // In samples, smoothed as in RFC 3550
+    UINT64 lastArrivalTime;
+    UINT32 lastFrameSamples;
+    UINT64 latencySum;
+    UINT64 latencyCount;
+    JitterBufferStats stats;
+} JitterBuffer, *PJitterBuffer;
+
+typedef VOID (*AudioMixerOutputFunc)(UINT64, PBYTE, UINT32);
+
+/*
+ * A certificate in the pre-generated pool, either created by the SDK or loaded from the pool file. The creation time
+ * is kept with it in the file, so that old certificates aren't loaded again.
+ */
+typedef struct {
+    UINT64 createTime;
+    BOOL loaded;
+    PRtcCertificate pRtcCertificate;
+} PooledCertificate, *PPooledCertificate;
+
+/*
+ * ICE servers persisted in SAMPLE_ICE_SERVER_CACHE_FILE_PATH. The expiration times are absolute, so an entry read at
+ * startup is only used when it's still valid. The STUN URL has the address of the server instead of its host name.
+ */
+typedef struct {
+    UINT32 version;
+    CHAR channelName[MAX_CHANNEL_NAME_LEN + 1];
+    CHAR region[MAX_REGION_NAME_LEN + 1];
+    CHAR stunUrl[MAX_ICE_CONFIG_URI_LEN + 1];
+    UINT64 stunExpiration;
+    IceConfigInfo turnServers[SAMPLE_ICE_SERVER_CACHE_MAX_TURN_SERVERS];
+    UINT32 turnServerCount;
+    UINT64 turnExpiration;
+} IceServerCache, *PIceServerCache;
+
+typedef STATUS (*SignalingMessageSendFunc)(UINT64, PSignalingMessage);
+
+typedef struct {
+    MUTEX lock;
+    volatile ATOMIC_BOOL terminateFlag;
+    TID playbackTid;
+    AudioMixerOutputFunc outputFn;
+    UINT64 customData;
+    JitterBuffer streams[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+} AudioMixer, *PAudioMixer;
+
 typedef struct {
     volatile ATOMIC_BOOL appTerminateFlag;
     volatile ATOMIC_BOOL interrupted;
@@ -107,35 +424,119 @@ typedef struct {
     startRoutine receiveAudioVideoSource;
     RtcOnDataChannel onDataChannel;
 
-    PStackQueue pPendingSignalingMessageForRemoteClient;
+    PPendingMessageQueues pPendingSignalingMessageForRemoteClient;
     PHashTable pRtcPeerConnectionForRemoteClient;
 
     MUTEX sampleConfigurationObjLock;
     CVAR cvar;
+    // Raised when sessionCleanupWait has work to do, it sleeps until then or until its nearest deadline
+    MUTEX cleanupEventLock;
+    CVAR cleanupEventCvar;
+    BOOL cleanupEventPending;
+    // The signal handlers only write to the pipe, signalWatcherTid wakes up the waiting threads
+    INT32 signalPipe[2];
+    TID signalWatcherTid;
     BOOL trickleIce;
     BOOL useTurn;
     BOOL enableFileLogging;
+    BOOL warmCapture;
+    SampleIdleCaptureMode idleCaptureMode;
+    UINT32 pacerBurstSize;
     UINT64 customData;
     PSampleStreamingSession sampleStreamingSessionList[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
     UINT32 streamingSessionCount;
+    // Only guards swapping pStreamingSessionSnapshot, it's never held while sending frames
     MUTEX streamingSessionListReadLock;
+    StreamingSessionSnapshot streamingSessionSnapshots[2];
+    PStreamingSessionSnapshot pStreamingSessionSnapshot;
+    // The latest parameter sets and the frames since the latest IDR, a new session starts with these
+    MUTEX gopCacheLock;
+    PSampleSharedFrame pParameterSetFrame;
+    PSampleSharedFrame gopCache[SAMPLE_GOP_CACHE_MAX_FRAMES];
+    UINT32 gopCacheCount;
+    BOOL gopCacheKeyFramesOnly; // The P-frames after the cached IDR were skipped while idle
+    // Set when the video capturer is released, the frames of the restarted encoder are dropped until its first IDR
+    volatile ATOMIC_BOOL videoWaitForKeyFrame;
+    UINT64 videoFrameIndex;
+    // Bitrate of the captured video, measured by the video capture thread
+    volatile SIZE_T videoSourceBitrate;
+    UINT64 videoBytesInMeasurePeriod;
+    UINT64 videoMeasurePeriodStart;
+    // Target chosen from the bandwidth estimates of all the sessions
+    MUTEX bitrateControllerLock;
+    UINT64 videoBitrateTarget;
+    UINT64 videoBitrateTargetAboveSince;
+    VideoBitrateTargetCallback videoBitrateTargetCallback;
+    // Aggregated over all the sessions since startup
+    MUTEX setupHistogramLock;
+    SampleSetupHistogram setupHistograms[SAMPLE_SETUP_PHASE_COUNT];
+    volatile ATOMIC_BOOL setupHistogramDumpRequested;
+    SampleIceStats iceStats; // Guarded by setupHistogramLock
+    SampleIceFilterPolicy iceFilterPolicy;
+    // Only when SAMPLE_STATS_RING_SOCKET_ENV_VAR is set
+    PStatsRing pStatsRing;
+    UINT32 statsRingTimerId;
+    // Only for the master, when SAMPLE_ICE_RESTART_ENV_VAR is 1
+    PNetworkMonitor pNetworkMonitor;
     UINT32 iceUriCount;
     SignalingClientCallbacks signalingClientCallbacks;
     SignalingClientInfo clientInfo;
     RtcStats rtcIceCandidatePairMetrics;
 
     MUTEX signalingSendMessageLock;
+    // Delivers the messages locally instead of through the signaling client, set by the loopback benchmarks
+    SignalingMessageSendFunc signalingMessageSendFn;
+    UINT64 signalingMessageSendCustomData;
+
+    // Keeps pregeneratedCertificates topped up at a low priority, guarded by sampleConfigurationObjLock
+    TID pregenerateCertTid;
+    volatile ATOMIC_BOOL pregenerateCertTerminate;
+    PStackQueue pregeneratedCertificates; // Max MAX_RTCCONFIGURATION_CERTIFICATES PPooledCertificate
+    BOOL pregeneratedCertificatesChanged; // Since the pool file was last saved
+    BOOL certificatePoolFile;             // Unless SAMPLE_CERTIFICATE_POOL_FILE_ENV_VAR is 0
 
-    UINT32 pregenerateCertTimerId;
-    PStackQueue pregeneratedCertificates; // Max MAX_RTCCONFIGURATION_CERTIFICATES certificates
+    // Loaded from the cache file at startup and kept up to date by refreshIceServerCacheTimerCallback
+    MUTEX iceServerCacheLock;
+    IceServerCache iceServerCache;
+    UINT32 iceServerCacheTimerId;
+    TID iceServerCacheRefreshTid;
+    ATOMIC_BOOL iceServerCacheRefreshing;
+
+    // The offers waiting for a session setup worker, guarded by sampleConfigurationObjLock
+    TID sessionSetupTids[SAMPLE_SESSION_SETUP_WORKER_COUNT];
+    volatile ATOMIC_BOOL sessionSetupTerminate;
+    CVAR sessionSetupCvar;
+    PStackQueue pSessionSetupQueue;          // PSessionSetupJob in the order of the offers
+    PHashTable pSessionSetupForRemoteClient; // Queued and in progress, they count towards the session limit
 } SampleConfiguration, *PSampleConfiguration;
 
+/*
+ * An offer waiting for or going through the creation of its streaming session. The ICE candidates of the client go to
+ * the pending message queues until the session is in pRtcPeerConnectionForRemoteClient.
+ */
+typedef struct {
+    UINT64 hashValue;
+    UINT64 offerReceiveTime;
+    ReceivedSignalingMessage receivedSignalingMessage;
+} SessionSetupJob, *PSessionSetupJob;
+
 typedef struct {
     UINT64 hashValue;
     UINT64 createTime;
     PStackQueue messageQueue;
+    UINT32 heapIndex;
 } PendingMessageQueue, *PPendingMessageQueue;
 
+/*
+ * The ICE candidates received before the offer of their client. The queues are looked up by client id hash and
+ * also kept in a min-heap by creation time, the expired ones are found without going through the others.
+ */
+struct __PendingMessageQueues {
+    PHashTable pQueueTable;
+    PPendingMessageQueue expiryHeap[SAMPLE_PENDING_MESSAGE_QUEUE_MAX_COUNT];
+    UINT32 count;
+};
+
 typedef VOID (*StreamSessionShutdownCallback)(UINT64, PSampleStreamingSession);
 
 struct __SampleStreamingSession {
@@ -146,17 +547,51 @@ struct __SampleStreamingSession {
     PRtcPeerConnection pPeerConnection;
     PRtcRtpTransceiver pVideoRtcRtpTransceiver;
     PRtcRtpTransceiver pAudioRtcRtpTransceiver;
-    RtcSessionDescriptionInit answerSessionDescriptionInit;
+    PRtcSessionDescriptionInit pAnswerSessionDescriptionInit; // Only until the answer is sent
     PSampleConfiguration pSampleConfiguration;
     UINT64 audioTimestamp;
     UINT64 videoTimestamp;
     CHAR peerId[MAX_SIGNALING_CLIENT_ID_LEN + 1];
     TID receiveAudioVideoSenderTid;
     UINT64 offerReceiveTime;
+    UINT64 setupPhaseTimes[SAMPLE_SETUP_PHASE_COUNT]; // Guarded by setupHistogramLock, 0 until the phase is reached
     UINT64 startUpLatency;
     BOOL firstFrame;
     RtcMetricsHistory rtcMetricsHistory;
     BOOL remoteCanTrickleIce;
+    // Only a session which has been connected is restarted
+    volatile ATOMIC_BOOL iceConnected;
+    // From the ICE restart offer until the session is connected again, the disconnection meanwhile is expected
+    volatile ATOMIC_BOOL iceRestarting;
+    UINT64 iceRestartTime;
+    // The video starts again from the GOP cache once the restart is done, the viewer lost frames it references
+    volatile ATOMIC_BOOL videoRestartRequested;
+    // Counted for the ICE stats, an ICE restart starts them over
+    UINT64 iceGatheringStartTime;
+    volatile SIZE_T localCandidateCounts[SAMPLE_ICE_FAMILY_COUNT];
+    volatile SIZE_T remoteCandidateCounts[SAMPLE_ICE_FAMILY_COUNT];
+
+    // Frames queued by the capture threads and sent by frameSenderTid, so a slow peer doesn't hold up the others.
+    // When the queue overflows the queued video is dropped and the session skips video up to the next key frame.
+    MUTEX sendQueueLock;
+    CVAR sendQueueCvar;
+    PSampleSharedFrame sendQueue[SAMPLE_SESSION_SEND_QUEUE_LENGTH];
+    UINT32 sendQueueHead;
+    UINT32 sendQueueCount;
+    BOOL sendQueueWaitForKeyFrame;
+    UINT64 sendQueueBehindStartTime;
+    SampleSendQueueStats sendQueueStats;
+    DOUBLE estimatedBitrate;
+    BOOL videoDecimationRequested;
+    BOOL videoDecimated; // Only changes on a key frame when it's turned off
+    UINT64 estimateAboveSince;
+    TID frameSenderTid;
+    // Only used by frameSenderTid
+    BOOL videoStarted;
+    BOOL skipVideoUntilKeyFrame;
+    UINT64 lastSentVideoFrameIndex;
+    DOUBLE pacerLevel; // Bytes in the bucket as of pacerUpdateTime
+    UINT64 pacerUpdateTime;
 
     // this is called when the SampleStreamingSession is being freed
     StreamSessionShutdownCallback shutdownCallback;
@@ -165,17 +600,19 @@ struct __SampleStreamingSession {
 
 VOID sigintHandler(INT32);
 STATUS readFrameFromDisk(PBYTE, PUINT32, PCHAR);
+PVOID mediaSenderRoutine(PVOID);
 PVOID sendVideoPackets(PVOID);
 PVOID sendAudioPackets(PVOID);
 PVOID sendGstreamerAudioVideo(PVOID);
 PVOID sampleReceiveAudioVideoFrame(PVOID args);
 PVOID getPeriodicIceCandidatePairStats(PVOID);
 STATUS getIceCandidatePairStatsCallback(UINT32, UINT64, UINT64);
-STATUS pregenerateCertTimerCallback(UINT32, UINT64, UINT64);
+STATUS refreshIceServerCacheTimerCallback(UINT32, UINT64, UINT64);
 STATUS createSampleConfiguration(PCHAR, SIGNALING_CHANNEL_ROLE_TYPE, BOOL, BOOL, PSampleConfiguration*);
 STATUS freeSampleConfiguration(PSampleConfiguration*);
 STATUS signalingClientStateChanged(UINT64, SIGNALING_CLIENT_STATE);
 STATUS signalingMessageReceived(UINT64, PReceivedSignalingMessage);
+PVOID sessionSetupRoutine(PVOID);
 STATUS handleAnswer(PSampleConfiguration, PSampleStreamingSession, PSignalingMessage);
 STATUS handleOffer(PSampleConfiguration, PSampleStreamingSession, PSignalingMessage);
 STATUS handleRemoteCandidate(PSampleStreamingSession, PSignalingMessage);
@@ -193,15 +630,67 @@ VOID sampleSenderBandwidthEstimationHandler(UINT64, UINT32, UINT32, UINT32, UINT
 VOID onDataChannel(UINT64, PRtcDataChannel);
 VOID onConnectionStateChange(UINT64, RTC_PEER_CONNECTION_STATE);
 STATUS sessionCleanupWait(PSampleConfiguration);
+VOID raiseCleanupEvent(PSampleConfiguration);
 STATUS logSignalingClientStats(PSignalingClientMetrics);
 STATUS logSelectedIceCandidatesInformation(PSampleStreamingSession);
 STATUS logStartUpLatency(PSampleConfiguration);
+VOID recordSessionSetupPhase(PSampleStreamingSession, SampleSetupPhase);
+VOID recordIceGatheringDone(PSampleStreamingSession);
+VOID recordIceConnected(PSampleStreamingSession);
+VOID recordIceCandidatesFiltered(PSampleConfiguration, UINT32);
+VOID dumpSetupPhaseHistograms(PSampleConfiguration);
+VOID setupHistogramSignalHandler(INT32);
 STATUS createMessageQueue(UINT64, PPendingMessageQueue*);
 STATUS freeMessageQueue(PPendingMessageQueue);
 STATUS submitPendingIceCandidate(PPendingMessageQueue, PSampleStreamingSession);
-STATUS removeExpiredMessageQueues(PStackQueue);
-STATUS getPendingMessageQueueForHash(PStackQueue, UINT64, BOOL, PPendingMessageQueue*);
+STATUS createPendingMessageQueues(PPendingMessageQueues*);
+STATUS freePendingMessageQueues(PPendingMessageQueues*);
+STATUS addPendingMessageQueue(PPendingMessageQueues, PPendingMessageQueue);
+STATUS removeExpiredMessageQueues(PPendingMessageQueues, PUINT64);
+STATUS getPendingMessageQueueForHash(PPendingMessageQueues, UINT64, BOOL, PPendingMessageQueue*);
+STATUS publishStreamingSessionSnapshot(PSampleConfiguration);
+PStreamingSessionSnapshot acquireStreamingSessionSnapshot(PSampleConfiguration);
+VOID releaseStreamingSessionSnapshot(PStreamingSessionSnapshot);
+STATUS createSharedFrame(UINT64, PBYTE, UINT32, BOOL, PSampleSharedFrame*);
+VOID updateGopCache(PSampleConfiguration, PSampleSharedFrame);
+UINT32 acquireGopCache(PSampleConfiguration, PSampleSharedFrame*, PBOOL);
+VOID clearGopCache(PSampleConfiguration);
+VOID releaseSharedFrame(PSampleSharedFrame);
+STATUS enqueueSessionFrame(PSampleStreamingSession, PSampleSharedFrame);
+STATUS getSessionSendQueueStats(PSampleStreamingSession, PSampleSendQueueStats);
+VOID updateSessionBitrateEstimate(PSampleStreamingSession, DOUBLE);
+VOID updateVideoBitrateTarget(PSampleConfiguration);
+PVOID sessionFrameSenderRoutine(PVOID);
+STATUS writeFrameToAllSessions(PSampleConfiguration, UINT64, PBYTE, UINT32, PCHAR);
+BOOL hasStreamingSession(PSampleConfiguration);
+BOOL waitForStreamingSession(PSampleConfiguration);
+VOID videoCaptureReleased(PSampleConfiguration);
 BOOL sampleFilterNetworkInterfaces(UINT64, PCHAR);
+STATUS createAudioMixer(AudioMixerOutputFunc, UINT64, PAudioMixer*);
+STATUS freeAudioMixer(PAudioMixer*);
+STATUS audioMixerPushFrame(PAudioMixer, UINT64, PBYTE, UINT32);
+STATUS audioMixerRemoveStream(PAudioMixer, UINT64, PJitterBufferStats);
+PVOID pregenerateCertRoutine(PVOID);
+STATUS loadPregeneratedCertificates(PSampleConfiguration);
+STATUS savePregeneratedCertificates(PSampleConfiguration);
+VOID freePooledCertificate(PPooledCertificate);
+STATUS loadIceServerCache(PSampleConfiguration);
+STATUS startIceServerCacheRefresh(PSampleConfiguration);
+STATUS setCachedIceServers(PSampleConfiguration, PRtcConfiguration, UINT32, PUINT32);
+VOID invalidateIceServerCache(PSampleConfiguration);
+STATUS resetSignalingClient(PSampleConfiguration);
+STATUS createStatsRing(PCHAR, PStatsRing*);
+STATUS freeStatsRing(PStatsRing*);
+VOID pushStatsRecord(PStatsRing, PSampleStatsRecord);
+UINT32 readStatsRecords(PStatsRing, PSampleStatsRecord, UINT32);
+STATUS sampleStatsRingTimerCallback(UINT32, UINT64, UINT64);
+STATUS createNetworkMonitor(NetworkChangeCallback, UINT64, PNetworkMonitor*);
+STATUS freeNetworkMonitor(PNetworkMonitor*);
+STATUS restartSessionIce(PSampleStreamingSession);
+VOID sampleNetworkChangeHandler(UINT64);
+VOID loadIceFilterPolicy(PSampleIceFilterPolicy);
+BOOL sampleFilterIceCandidate(PSampleIceFilterPolicy, PCHAR, SampleIceFamily*);
+UINT32 filterSessionDescriptionCandidates(PSampleIceFilterPolicy, PCHAR, volatile SIZE_T*);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+#define LOG_CLASS "StatsRing"
+#include "Samples.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The transport stats of the sessions for dashboards, without logging them at debug level. The timer queue thread is
+ * the only writer and the socket thread reads without a lock: every slot carries a sequence which is odd while the
+ * slot is being written, a reader keeps a copy only when the sequence was the expected even value before and after it.
+ */
+
+typedef struct {
+    volatile SIZE_T sequence; // 2 * (position + 1) once written
+    SampleStatsRecord record;
+} StatsRingSlot, *PStatsRingSlot;
+
+struct __StatsRing {
+    volatile SIZE_T writeCount;
+    StatsRingSlot slots[SAMPLE_STATS_RING_LENGTH];
+    // Only used by the socket thread
+    SampleStatsRecord readBuffer[SAMPLE_STATS_RING_LENGTH];
+    INT32 listenSocket;
+    TID serverTid;
+    volatile ATOMIC_BOOL terminate;
+    CHAR socketPath[MAX_PATH_LEN + 1];
+};
+
+VOID pushStatsRecord(PStatsRing pStatsRing, PSampleStatsRecord pRecord)
+{
+    SIZE_T position;
+    PStatsRingSlot pSlot;
+
+    if (pStatsRing == NULL || pRecord == NULL) {
+        return;
+    }
+
+    position = ATOMIC_LOAD(&pStatsRing->writeCount);
+    pSlot = &pStatsRing->slots[position % SAMPLE_STATS_RING_LENGTH];
+
+    ATOMIC_STORE(&pSlot->sequence, 2 * position + 1);
+    // The record must not be written before the readers can see the slot is being written
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pSlot->record = *pRecord;
+    pSlot->record.sequence = position;
+    ATOMIC_STORE(&pSlot->sequence, 2 * position + 2);
+
+    ATOMIC_STORE(&pStatsRing->writeCount, position + 1);
+}
+
+UINT32 readStatsRecords(PStatsRing pStatsRing, PSampleStatsRecord pRecords, UINT32 maxCount)
+{
+    SIZE_T end, position, sequence;
+    PStatsRingSlot pSlot;
+    UINT32 count = 0;
+
+    if (pStatsRing == NULL || pRecords == NULL) {
+        return 0;
+    }
+
+    end = ATOMIC_LOAD(&pStatsRing->writeCount);
+    position = end > MIN(maxCount, SAMPLE_STATS_RING_LENGTH) ? end - MIN(maxCount, SAMPLE_STATS_RING_LENGTH) : 0;
+    for (; position < end; position++) {
+        pSlot = &pStatsRing->slots[position % SAMPLE_STATS_RING_LENGTH];
+        sequence = ATOMIC_LOAD(&pSlot->sequence);
+        if (sequence != 2 * position + 2) {
+            // Already overwritten by the writer
+            continue;
+        }
+
+        pRecords[count] = pSlot->record;
+        // The copy must be done before the sequence is checked again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ATOMIC_LOAD(&pSlot->sequence) == sequence) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static BOOL sendAll(INT32 clientSocket, PBYTE pData, SIZE_T size)
+{
+    ssize_t sent;
+
+    while (size > 0) {
+        if ((sent = send(clientSocket, pData, size, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FALSE;
+        }
+        pData += sent;
+        size -= (SIZE_T) sent;
+    }
+
+    return TRUE;
+}
+
+static PVOID statsRingServerRoutine(PVOID args)
+{
+    PStatsRing pStatsRing = (PStatsRing) args;
+    SampleStatsRingHeader header;
+    struct timeval sendTimeout;
+    INT32 clientSocket;
+
+    sendTimeout.tv_sec = SAMPLE_STATS_RING_SEND_TIMEOUT / HUNDREDS_OF_NANOS_IN_A_SECOND;
+    sendTimeout.tv_usec = 0;
+
+    while (!ATOMIC_LOAD_BOOL(&pStatsRing->terminate)) {
+        if ((clientSocket = accept(pStatsRing->listenSocket, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The listening socket is shut down by freeStatsRing
+            break;
+        }
+
+        // A reader which stops reading doesn't hold up the others for long
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, SIZEOF(sendTimeout));
+
+        MEMSET(&header, 0x00, SIZEOF(SampleStatsRingHeader));
+        header.magic = SAMPLE_STATS_RING_MAGIC;
+        header.version = SAMPLE_STATS_RING_VERSION;
+        header.recordSize = SIZEOF(SampleStatsRecord);
+        header.recordCount = readStatsRecords(pStatsRing, pStatsRing->readBuffer, SAMPLE_STATS_RING_LENGTH);
+        if (sendAll(clientSocket, (PBYTE) &header, SIZEOF(SampleStatsRingHeader))) {
+            sendAll(clientSocket, (PBYTE) pStatsRing->readBuffer, header.recordCount * SIZEOF(SampleStatsRecord));
+        }
+
+        close(clientSocket);
+    }
+
+    return NULL;
+}
+
+STATUS createStatsRing(PCHAR socketPath, PStatsRing* ppStatsRing)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PStatsRing pStatsRing = NULL;
+    struct sockaddr_un address;
+
+    CHK(socketPath != NULL && ppStatsRing != NULL, STATUS_NULL_ARG);
+    CHK(STRLEN(socketPath) < SIZEOF(address.sun_path), STATUS_INVALID_ARG);
+
+    CHK(NULL != (pStatsRing = (PStatsRing) MEMCALLOC(1, SIZEOF(StatsRing))), STATUS_NOT_ENOUGH_MEMORY);
+    pStatsRing->listenSocket = -1;
+    STRNCPY(pStatsRing->socketPath, socketPath, MAX_PATH_LEN);
+
+    MEMSET(&address, 0x00, SIZEOF(address));
+    address.sun_family = AF_UNIX;
+    STRNCPY(address.sun_path, socketPath, SIZEOF(address.sun_path) - 1);
+
+    // A socket left behind by a previous run would fail the bind
+    unlink(socketPath);
+    CHK_ERR((pStatsRing->listenSocket = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0, STATUS_INVALID_OPERATION, "socket() failed with errno %d", errno);
+    CHK_ERR(bind(pStatsRing->listenSocket, (struct sockaddr*) &address, SIZEOF(address)) == 0, STATUS_INVALID_OPERATION,
+            "Unable to bind the stats socket %s, errno %d", socketPath, errno);
+    chmod(socketPath, S_IRUSR | S_IWUSR);
+    CHK_ERR(listen(pStatsRing->listenSocket, 4) == 0, STATUS_INVALID_OPERATION, "listen() failed with errno %d", errno);
+
+    CHK_STATUS(THREAD_CREATE(&pStatsRing->serverTid, statsRingServerRoutine, (PVOID) pStatsRing));
+    DLOGI("Serving the session stats on %s", socketPath);
+
+    *ppStatsRing = pStatsRing;
+    pStatsRing = NULL;
+
+CleanUp:
+
+    freeStatsRing(&pStatsRing);
+
+    return retStatus;
+}
+
+STATUS freeStatsRing(PStatsRing* ppStatsRing)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PStatsRing pStatsRing;
+
+    CHK(ppStatsRing != NULL, STATUS_NULL_ARG);
+    pStatsRing = *ppStatsRing;
+    CHK(pStatsRing != NULL, retStatus);
+
+    ATOMIC_STORE_BOOL(&pStatsRing->terminate, TRUE);
+    if (pStatsRing->listenSocket >= 0) {
+        // Wakes up the accept of the socket thread
+        shutdown(pStatsRing->listenSocket, SHUT_RDWR);
+    }
+    if (IS_VALID_TID_VALUE(pStatsRing->serverTid)) {
+        THREAD_JOIN(pStatsRing->serverTid, NULL);
+    }
+    if (pStatsRing->listenSocket >= 0) {
+        close(pStatsRing->listenSocket);
+        unlink(pStatsRing->socketPath);
+    }
+
+    SAFE_MEMFREE(*ppStatsRing);
+
+CleanUp:
+
+    return retStatus;
+}
+
+STATUS sampleStatsRingTimerCallback(UINT32 timerId, UINT64 currentTime, UINT64 customData)
+{
+    UNUSED_PARAM(timerId);
+    UNUSED_PARAM(currentTime);
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) customData;
+    PStreamingSessionSnapshot pSnapshot = NULL;
+    PSampleStreamingSession pSampleStreamingSession;
+    SampleSendQueueStats sendQueueStats;
+    SampleStatsRecord record;
+    RtcStats rtcStats;
+    UINT32 i;
+
+    CHK(pSampleConfiguration != NULL && pSampleConfiguration->pStatsRing != NULL, STATUS_NULL_ARG);
+
+    // The snapshot keeps the sessions alive without holding the configuration lock over the SDK calls
+    CHK(NULL != (pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration)), retStatus);
+
+    for (i = 0; i < pSnapshot->sessionCount; i++) {
+        pSampleStreamingSession = pSnapshot->sessionList[i];
+        MEMSET(&record, 0x00, SIZEOF(SampleStatsRecord));
+
+        // Nothing to record before a candidate pair is selected
+        rtcStats.requestedTypeOfStats = RTC_STATS_TYPE_CANDIDATE_PAIR;
+        if (STATUS_FAILED(rtcPeerConnectionGetMetrics(pSampleStreamingSession->pPeerConnection, NULL, &rtcStats))) {
+            continue;
+        }
+        record.timestamp = GETTIME();
+        record.sessionId = COMPUTE_CRC32((PBYTE) pSampleStreamingSession->peerId, (UINT32) STRLEN(pSampleStreamingSession->peerId));
+        record.roundTripTime = (UINT32) (rtcStats.rtcStatsObject.iceCandidatePairStats.currentRoundTripTime * 1000000);
+        record.availableOutgoingBitrate = (UINT64) rtcStats.rtcStatsObject.iceCandidatePairStats.availableOutgoingBitrate;
+        record.bytesSent = rtcStats.rtcStatsObject.iceCandidatePairStats.bytesSent;
+
+        rtcStats.requestedTypeOfStats = RTC_STATS_TYPE_OUTBOUND_RTP;
+        if (STATUS_SUCCEEDED(rtcPeerConnectionGetMetrics(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pVideoRtcRtpTransceiver,
+                                                         &rtcStats))) {
+            record.packetsSent = rtcStats.rtcStatsObject.outboundRtpStreamStats.sent.packetsSent;
+            record.retransmittedPacketsSent = rtcStats.rtcStatsObject.outboundRtpStreamStats.retransmittedPacketsSent;
+            record.nackCount = rtcStats.rtcStatsObject.outboundRtpStreamStats.nackCount;
+            record.pliCount = rtcStats.rtcStatsObject.outboundRtpStreamStats.pliCount;
+        }
+
+        rtcStats.requestedTypeOfStats = RTC_STATS_TYPE_REMOTE_INBOUND_RTP;
+        if (STATUS_SUCCEEDED(rtcPeerConnectionGetMetrics(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pVideoRtcRtpTransceiver,
+                                                         &rtcStats))) {
+            record.packetsLost = rtcStats.rtcStatsObject.remoteInboundRtpStreamStats.received.packetsLost;
+        }
+
+        if (STATUS_SUCCEEDED(getSessionSendQueueStats(pSampleStreamingSession, &sendQueueStats))) {
+            record.estimatedBitrate = sendQueueStats.estimatedBitrate;
+        }
+
+        pushStatsRecord(pSampleConfiguration->pStatsRing, &record);
+    }
+
+CleanUp:
+
+    releaseStreamingSessionSnapshot(pSnapshot);
+
+    return retStatus;
+}
@@ -26,12 +26,24 @@
 extern PSampleConfiguration gSampleConfiguration;
 static AudioCapturerHandle audioCapturerHandle = NULL;
 static AudioPlayerHandle audioPlayerHandle = NULL;
+static PAudioMixer pAudioMixer = NULL;
 static VideoCapturerHandle videoCapturerHandle = NULL;
 
 static void sessionOnShutdown(UINT64 customData, PSampleStreamingSession pSampleStreamingSession)
 {
+    JitterBufferStats jitterBufferStats;
+
     printf("Shut down session %s\n", pSampleStreamingSession->peerId);
-    audioPlayerReleaseStream(audioPlayerHandle);
+    if (STATUS_SUCCEEDED(audioMixerRemoveStream(pAudioMixer, (UINT64) pSampleStreamingSession, &jitterBufferStats))) {
+        printf("Talkback of %s: %" PRIu64 " frames, %" PRIu64 " underruns, %" PRIu64 " samples discarded, added latency %u ms average, %u ms max\n",
+               pSampleStreamingSession->peerId, jitterBufferStats.frames, jitterBufferStats.underruns, jitterBufferStats.discardedSamples,
+               jitterBufferStats.averageLatency, jitterBufferStats.maxLatency);
+    }
+}
+
+static VOID playMixedAudio(UINT64 customData, PBYTE pData, UINT32 size)
+{
+    audioPlayerWriteFrame((AudioPlayerHandle) customData, pData, size);
 }
 
 static void remoteAudioFrameHandler(UINT64 customData, PFrame pFrame)
@@ -44,58 +56,20 @@ static void remoteAudioFrameHandler(UINT64 customData, PFrame pFrame)
         pSampleStreamingSession->firstFrame = FALSE;
         pSampleStreamingSession->startUpLatency = (GETTIME() - pSampleStreamingSession->offerReceiveTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
         printf("Start up latency from offer to first frame: %" PRIu64 "ms\n", pSampleStreamingSession->startUpLatency);
+        recordSessionSetupPhase(pSampleStreamingSession, SAMPLE_SETUP_PHASE_FIRST_FRAME_RECEIVED);
 
         streamingSessionOnShutdown(pSampleStreamingSession, NULL, sessionOnShutdown);
-
-        if (audioPlayerAcquireStream(audioPlayerHandle)) {
-            printf("audioPlayerAcquireStream failed");
-        }
     }
 
-    audioPlayerWriteFrame(audioPlayerHandle, pFrame->frameData, pFrame->size);
-}
-
-static void writeFrameToAllSessions(const UINT64 timestamp, PVOID pData, const SIZE_T size, const PCHAR const trackId)
-{
-    STATUS status = STATUS_SUCCESS;
-    BOOL isVideo = TRUE;
-    Frame frame = {
-        .presentationTs = timestamp,
-        .frameData = pData,
-        .size = size,
-    };
-
-    if (!STRNCMP(trackId, SAMPLE_VIDEO_TRACK_ID, STRLEN(SAMPLE_VIDEO_TRACK_ID))) {
-        isVideo = TRUE;
-    } else if (!STRNCMP(trackId, SAMPLE_AUDIO_TRACK_ID, STRLEN(SAMPLE_AUDIO_TRACK_ID))) {
-        isVideo = FALSE;
-    } else {
-        printf("unknown trackId: %s", trackId);
-        return;
-    }
-
-    MUTEX_LOCK(gSampleConfiguration->streamingSessionListReadLock);
-    for (int i = 0; i < gSampleConfiguration->streamingSessionCount; ++i) {
-        if (isVideo) {
-            status = writeFrame(gSampleConfiguration->sampleStreamingSessionList[i]->pVideoRtcRtpTransceiver, &frame);
-        } else {
-            status = writeFrame(gSampleConfiguration->sampleStreamingSessionList[i]->pAudioRtcRtpTransceiver, &frame);
-        }
-        if (status != STATUS_SRTP_NOT_READY_YET) {
-            if (status != STATUS_SUCCESS) {
-#ifdef VERBOSE
-                printf("writeFrame() failed with 0x%08x\n", status);
-#endif
-            }
-        }
-    }
-    MUTEX_UNLOCK(gSampleConfiguration->streamingSessionListReadLock);
+    // Played out by the mixer thread, so a slow player never stalls the receive path of a session
+    audioMixerPushFrame(pAudioMixer, (UINT64) pSampleStreamingSession, pFrame->frameData, pFrame->size);
 }
 
 INT32 main(INT32 argc, CHAR* argv[])
 {
     STATUS retStatus = STATUS_SUCCESS;
     UINT32 frameSize;
+    UINT64 signalingStartTime;
     PSampleConfiguration pSampleConfiguration = NULL;
     SignalingClientMetrics signalingClientMetrics;
     PCHAR pChannelName;
@@ -105,6 +79,7 @@ INT32 main(INT32 argc, CHAR* argv[])
 
 #ifndef _WIN32
     signal(SIGINT, sigintHandler);
+    signal(SIGUSR1, setupHistogramSignalHandler);
 #endif
 
     /* Media Interface Construct */
@@ -135,6 +110,16 @@ INT32 main(INT32 argc, CHAR* argv[])
             DLOGE("Unable to set AudioPlayer format");
             audioPlayerDestory(audioPlayerHandle);
             audioPlayerHandle = NULL;
+        } else if (audioPlayerAcquireStream(audioPlayerHandle)) {
+            // The player is shared by the sessions through the mixer, so it's held as long as the mixer exists
+            DLOGE("audioPlayerAcquireStream failed");
+            audioPlayerDestory(audioPlayerHandle);
+            audioPlayerHandle = NULL;
+        } else if (STATUS_FAILED(createAudioMixer(playMixedAudio, (UINT64) audioPlayerHandle, &pAudioMixer))) {
+            DLOGE("AudioMixer init failed");
+            audioPlayerReleaseStream(audioPlayerHandle);
+            audioPlayerDestory(audioPlayerHandle);
+            audioPlayerHandle = NULL;
         }
     }
     DLOGI("Board AudioPlayer initialized\n");
@@ -192,6 +177,11 @@ INT32 main(INT32 argc, CHAR* argv[])
     pSampleConfiguration->onDataChannel = onDataChannel;
     printf("[KVS Master] Finished setting audio and video handlers\n");
 
+    if (pSampleConfiguration->warmCapture && !ATOMIC_EXCHANGE_BOOL(&pSampleConfiguration->mediaThreadStarted, TRUE)) {
+        THREAD_CREATE(&pSampleConfiguration->mediaSenderTid, mediaSenderRoutine, (PVOID) pSampleConfiguration);
+        printf("[KVS Master] Started capturing before the first viewer\n");
+    }
+
     // Initialize KVS WebRTC. This must be done before anything else, and must only be done once.
     retStatus = initKvsWebRtc();
     if (retStatus != STATUS_SUCCESS) {
@@ -204,6 +194,7 @@ INT32 main(INT32 argc, CHAR* argv[])
 
     strcpy(pSampleConfiguration->clientInfo.clientId, SAMPLE_MASTER_CLIENT_ID);
 
+    signalingStartTime = GETTIME();
     retStatus = createSignalingClientSync(&pSampleConfiguration->clientInfo, &pSampleConfiguration->channelInfo,
                                           &pSampleConfiguration->signalingClientCallbacks, pSampleConfiguration->pCredentialProvider,
                                           &pSampleConfiguration->signalingClientHandle);
@@ -213,19 +204,36 @@ INT32 main(INT32 argc, CHAR* argv[])
     }
     printf("[KVS Master] Signaling client created successfully\n");
 
-    // Enable the processing of the messages
+    // Keep the ICE servers fresh in the background, before they are needed and before they expire
+    startIceServerCacheRefresh(pSampleConfiguration);
+
+    // Enable the processing of the messages. The endpoint comes from the cache file when it has one, look it up again if that fails.
     retStatus = signalingClientFetchSync(pSampleConfiguration->signalingClientHandle);
-    if (retStatus != STATUS_SUCCESS) {
-        printf("[KVS Master] signalingClientFetchSync(): operation returned status code: 0x%08x \n", retStatus);
-        goto CleanUp;
+    if (retStatus == STATUS_SUCCESS) {
+        retStatus = signalingClientConnectSync(pSampleConfiguration->signalingClientHandle);
     }
-
-    retStatus = signalingClientConnectSync(pSampleConfiguration->signalingClientHandle);
     if (retStatus != STATUS_SUCCESS) {
-        printf("[KVS Master] signalingClientConnectSync(): operation returned status code: 0x%08x \n", retStatus);
-        goto CleanUp;
+        printf("[KVS Master] Signaling client setup returned status code: 0x%08x, retrying with a fresh endpoint\n", retStatus);
+        retStatus = resetSignalingClient(pSampleConfiguration);
+        if (retStatus != STATUS_SUCCESS) {
+            printf("[KVS Master] resetSignalingClient(): operation returned status code: 0x%08x \n", retStatus);
+            goto CleanUp;
+        }
+
+        retStatus = signalingClientFetchSync(pSampleConfiguration->signalingClientHandle);
+        if (retStatus != STATUS_SUCCESS) {
+            printf("[KVS Master] signalingClientFetchSync(): operation returned status code: 0x%08x \n", retStatus);
+            goto CleanUp;
+        }
+
+        retStatus = signalingClientConnectSync(pSampleConfiguration->signalingClientHandle);
+        if (retStatus != STATUS_SUCCESS) {
+            printf("[KVS Master] signalingClientConnectSync(): operation returned status code: 0x%08x \n", retStatus);
+            goto CleanUp;
+        }
     }
-    printf("[KVS Master] Signaling client connection to socket established\n");
+    printf("[KVS Master] Signaling client connection to socket established in %" PRIu64 " ms\n",
+           (GETTIME() - signalingStartTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
 
     gSampleConfiguration = pSampleConfiguration;
 
@@ -248,8 +256,9 @@ CleanUp:
 
     printf("[KVS Master] Cleaning up....\n");
     if (pSampleConfiguration != NULL) {
-        // Kick of the termination sequence
+        // Kick of the termination sequence, the capture threads waiting for a viewer are woken up too
         ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
 
         if (IS_VALID_MUTEX_VALUE(pSampleConfiguration->sampleConfigurationObjLock)) {
             MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
@@ -278,6 +287,7 @@ CleanUp:
         } else {
             printf("[KVS Master] signalingClientGetMetrics() operation returned status code: 0x%08x\n", retStatus);
         }
+        dumpSetupPhaseHistograms(pSampleConfiguration);
         retStatus = freeSignalingClient(&pSampleConfiguration->signalingClientHandle);
         if (retStatus != STATUS_SUCCESS) {
             printf("[KVS Master] freeSignalingClient(): operation returned status code: 0x%08x\n", retStatus);
@@ -296,7 +306,10 @@ CleanUp:
         audioCapturerHandle = NULL;
     }
 
+    freeAudioMixer(&pAudioMixer);
+
     if (audioPlayerHandle) {
+        audioPlayerReleaseStream(audioPlayerHandle);
         audioPlayerDestory(audioPlayerHandle);
         audioPlayerHandle = NULL;
     }
@@ -326,6 +339,7 @@ PVOID sendVideoPackets(PVOID args)
     void* pFrameBuffer = NULL;
     UINT64 timestamp = 0;
     SIZE_T frameSize = 0;
+    BOOL streamAcquired = FALSE;
 
     if (pSampleConfiguration == NULL) {
         printf("[KVS Master] sendVideoPackets(): operation returned status code: 0x%08x \n", STATUS_NULL_ARG);
@@ -339,21 +353,39 @@ PVOID sendVideoPackets(PVOID args)
         goto CleanUp;
     }
 
-    if (videoCapturerAcquireStream(videoCapturerHandle)) {
-        goto CleanUp;
-    }
-
     while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        // The sensor and the encoder are turned off while nobody is watching, the next viewer turns them on again
+        if (pSampleConfiguration->idleCaptureMode == SAMPLE_IDLE_CAPTURE_MODE_RELEASE && !hasStreamingSession(pSampleConfiguration)) {
+            if (streamAcquired) {
+                videoCapturerReleaseStream(videoCapturerHandle);
+                streamAcquired = FALSE;
+                videoCaptureReleased(pSampleConfiguration);
+                printf("[KVS Master] Released the video capturer until the next viewer\n");
+            }
+            waitForStreamingSession(pSampleConfiguration);
+            continue;
+        }
+
+        if (!streamAcquired) {
+            if (videoCapturerAcquireStream(videoCapturerHandle)) {
+                goto CleanUp;
+            }
+            streamAcquired = TRUE;
+        }
+
         if (videoCapturerGetFrame(videoCapturerHandle, pFrameBuffer, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize)) {
             printf("videoCapturerGetFrame failed\n");
         } else {
-            writeFrameToAllSessions(timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer, frameSize, SAMPLE_VIDEO_TRACK_ID);
+            writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, (PBYTE) pFrameBuffer, (UINT32) frameSize,
+                                    SAMPLE_VIDEO_TRACK_ID);
         }
     }
 
 CleanUp:
 
-    videoCapturerReleaseStream(videoCapturerHandle);
+    if (streamAcquired) {
+        videoCapturerReleaseStream(videoCapturerHandle);
+    }
 
     CHK_LOG_ERR(retStatus);
 
@@ -370,6 +402,7 @@ PVOID sendAudioPackets(PVOID args)
     void* pFrameBuffer = NULL;
     UINT64 timestamp = 0;
     SIZE_T frameSize = 0;
+    BOOL streamAcquired = FALSE;
 
     if (pSampleConfiguration == NULL) {
         printf("[KVS Master] sendAudioPackets(): operation returned status code: 0x%08x \n", STATUS_NULL_ARG);
@@ -383,21 +416,37 @@ PVOID sendAudioPackets(PVOID args)
         goto CleanUp;
     }
 
-    if (audioCapturerAcquireStream(audioCapturerHandle)) {
-        goto CleanUp;
-    }
-
     while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        // Audio frames are dropped without a session anyway, there's nothing to cache for the next viewer
+        if (pSampleConfiguration->idleCaptureMode != SAMPLE_IDLE_CAPTURE_MODE_OFF && !hasStreamingSession(pSampleConfiguration)) {
+            if (streamAcquired) {
+                audioCapturerReleaseStream(audioCapturerHandle);
+                streamAcquired = FALSE;
+            }
+            waitForStreamingSession(pSampleConfiguration);
+            continue;
+        }
+
+        if (!streamAcquired) {
+            if (audioCapturerAcquireStream(audioCapturerHandle)) {
+                goto CleanUp;
+            }
+            streamAcquired = TRUE;
+        }
+
         if (audioCapturerGetFrame(audioCapturerHandle, pFrameBuffer, AUDIO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize)) {
             printf("audioCapturerGetFrame failed\n");
         } else {
-            writeFrameToAllSessions(timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer, frameSize, SAMPLE_AUDIO_TRACK_ID);
+            writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, (PBYTE) pFrameBuffer, (UINT32) frameSize,
+                                    SAMPLE_AUDIO_TRACK_ID);
         }
     }
 
 CleanUp:
 
-    audioCapturerReleaseStream(audioCapturerHandle);
+    if (streamAcquired) {
+        audioCapturerReleaseStream(audioCapturerHandle);
+    }
 
     CHK_LOG_ERR(retStatus);
 
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Capture jitter benchmark for the master's frame fan-out.
+ *
+ * Viewers are peer connections in the same process, connected to master sessions through the loopback signaling
+ * stand-in. One viewer is added per step and the board's video is fanned out to all of them, while the time the
+ * capture thread spends in writeFrameToAllSessions and the jitter of the capture interval are measured.
+ */
+
+#define LOG_CLASS "FanoutBenchmark"
+#include "BenchmarkCommon.h"
+
+#define BENCH_CHANNEL_NAME          (PCHAR) "FanoutBenchmark"
+#define BENCH_DEFAULT_VIEWER_COUNT  DEFAULT_MAX_CONCURRENT_STREAMING_SESSION
+#define BENCH_DEFAULT_STEP_DURATION (10 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_MAX_SAMPLES           4096
+
+typedef struct {
+    UINT64 fanoutTime[BENCH_MAX_SAMPLES];
+    UINT64 captureInterval[BENCH_MAX_SAMPLES];
+    UINT32 count;
+    UINT64 lastCaptureTime;
+} CaptureSamples, *PCaptureSamples;
+
+extern PSampleConfiguration gSampleConfiguration;
+static LoopbackViewer gLoopbackViewers[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+static MUTEX gSamplesLock = INVALID_MUTEX_VALUE;
+static CaptureSamples gCaptureSamples;
+
+static PVOID benchCaptureRoutine(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    PBYTE pFrameBuffer = NULL;
+    UINT64 timestamp = 0, captureTime, fanoutTime;
+    SIZE_T frameSize = 0;
+
+    if (NULL == (pFrameBuffer = (PBYTE) MEMALLOC(VIDEO_FRAME_BUFFER_SIZE_BYTES))) {
+        printf("[Fanout Benchmark] OOM\n");
+        return NULL;
+    }
+
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        if (videoCapturerGetFrame(gVideoCapturerHandle, pFrameBuffer, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp, &frameSize)) {
+            continue;
+        }
+
+        captureTime = GETTIME();
+        writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer, (UINT32) frameSize,
+                                SAMPLE_VIDEO_TRACK_ID);
+        fanoutTime = GETTIME() - captureTime;
+
+        MUTEX_LOCK(gSamplesLock);
+        if (gCaptureSamples.count < BENCH_MAX_SAMPLES) {
+            gCaptureSamples.fanoutTime[gCaptureSamples.count] = fanoutTime;
+            gCaptureSamples.captureInterval[gCaptureSamples.count] =
+                gCaptureSamples.lastCaptureTime == 0 ? 0 : captureTime - gCaptureSamples.lastCaptureTime;
+            gCaptureSamples.count++;
+        }
+        gCaptureSamples.lastCaptureTime = captureTime;
+        MUTEX_UNLOCK(gSamplesLock);
+    }
+
+    MEMFREE(pFrameBuffer);
+
+    return NULL;
+}
+
+static VOID reportStep(UINT32 viewerCount, UINT64 stepDuration, PCaptureSamples pSamples, PSIZE_T pFramesBefore)
+{
+    UINT32 i, intervalCount = 0;
+    UINT64 meanInterval = 0, jitter = 0, maxJitter = 0, deviation;
+    SIZE_T frames, minFrames = MAX_UINT32, maxFrames = 0;
+
+    // The first interval of a step spans the viewer setup
+    for (i = 1; i < pSamples->count; i++) {
+        meanInterval += pSamples->captureInterval[i];
+        intervalCount++;
+    }
+    meanInterval = intervalCount == 0 ? 0 : meanInterval / intervalCount;
+    for (i = 1; i < pSamples->count; i++) {
+        deviation = pSamples->captureInterval[i] > meanInterval ? pSamples->captureInterval[i] - meanInterval
+                                                                : meanInterval - pSamples->captureInterval[i];
+        jitter += deviation;
+        maxJitter = MAX(maxJitter, deviation);
+    }
+    jitter = intervalCount == 0 ? 0 : jitter / intervalCount;
+
+    for (i = 0; i < viewerCount; i++) {
+        frames = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount) - pFramesBefore[i];
+        minFrames = MIN(minFrames, frames);
+        maxFrames = MAX(maxFrames, frames);
+    }
+
+    qsort(pSamples->fanoutTime, pSamples->count, SIZEOF(UINT64), compareUint64);
+    printf("%7u %8u %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %10" PRIu64 " %10" PRIu64 " %11" PRIu64 " %8.1f %8.1f\n", viewerCount, pSamples->count,
+           percentile(pSamples->fanoutTime, pSamples->count, 50) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(pSamples->fanoutTime, pSamples->count, 99) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(pSamples->fanoutTime, pSamples->count, 100) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           meanInterval / HUNDREDS_OF_NANOS_IN_A_MICROSECOND, jitter / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           maxJitter / HUNDREDS_OF_NANOS_IN_A_MICROSECOND, (DOUBLE) minFrames * HUNDREDS_OF_NANOS_IN_A_SECOND / stepDuration,
+           (DOUBLE) maxFrames * HUNDREDS_OF_NANOS_IN_A_SECOND / stepDuration);
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+    UINT32 maxViewerCount = BENCH_DEFAULT_VIEWER_COUNT, viewerCount = 0, stepSeconds = 0, i;
+    UINT64 stepDuration = BENCH_DEFAULT_STEP_DURATION;
+    SIZE_T framesBefore[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+    PCaptureSamples pSamples = NULL;
+
+#ifndef _WIN32
+    signal(SIGINT, sigintHandler);
+#endif
+
+    if (argc > 1) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[1], NULL, 10, &maxViewerCount)) && maxViewerCount > 0 &&
+                    maxViewerCount <= DEFAULT_MAX_CONCURRENT_STREAMING_SESSION,
+                STATUS_INVALID_ARG, "[Fanout Benchmark] Viewer count must be 1 to %u\n", DEFAULT_MAX_CONCURRENT_STREAMING_SESSION);
+    }
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &stepSeconds)) && stepSeconds > 0, STATUS_INVALID_ARG,
+                "[Fanout Benchmark] Invalid step duration %s\n", argv[2]);
+        stepDuration = stepSeconds * HUNDREDS_OF_NANOS_IN_A_SECOND;
+    }
+
+    CHK(NULL != (pSamples = (PCaptureSamples) MEMCALLOC(1, SIZEOF(CaptureSamples))), STATUS_NOT_ENOUGH_MEMORY);
+    gSamplesLock = MUTEX_CREATE(FALSE);
+
+    gVideoCapturerHandle = videoCapturerCreate();
+    CHK_ERR(gVideoCapturerHandle, STATUS_INVALID_OPERATION, "VideoCapturer init failed");
+    CHK_STATUS_ERR(videoCapturerSetFormat(gVideoCapturerHandle, VID_FMT_H264, VID_RES_1080P), STATUS_INVALID_OPERATION, "Unable to set video format");
+    CHK_ERR(videoCapturerAcquireStream(gVideoCapturerHandle) == 0, STATUS_INVALID_OPERATION, "Unable to acquire video stream");
+
+    // The credentials are never used and TURN isn't needed on localhost
+    CHK_STATUS(createSampleConfiguration(BENCH_CHANNEL_NAME, SIGNALING_CHANNEL_ROLE_TYPE_MASTER, TRUE, FALSE, &pSampleConfiguration));
+    pSampleConfiguration->videoSource = benchCaptureRoutine;
+    pSampleConfiguration->mediaType = SAMPLE_STREAMING_VIDEO_ONLY;
+    CHK_STATUS(initKvsWebRtc());
+    gSampleConfiguration = pSampleConfiguration;
+    CHK_STATUS(createLoopbackSignaling(pSampleConfiguration, &pLoopbackSignaling));
+
+    printf("viewers   frames  fanout50  fanout99 fanoutmax   interval     jitter   maxjitter   minfps   maxfps\n");
+    printf("                      (us)      (us)      (us)       (us)       (us)        (us)\n");
+    for (viewerCount = 0; viewerCount < maxViewerCount && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted);) {
+        CHK_STATUS(connectLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[viewerCount], viewerCount, NULL, 0));
+        viewerCount++;
+
+        for (i = 0; i < viewerCount; i++) {
+            framesBefore[i] = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount);
+        }
+        MUTEX_LOCK(gSamplesLock);
+        gCaptureSamples.count = 0;
+        MUTEX_UNLOCK(gSamplesLock);
+
+        THREAD_SLEEP(stepDuration);
+
+        MUTEX_LOCK(gSamplesLock);
+        MEMCPY(pSamples, &gCaptureSamples, SIZEOF(CaptureSamples));
+        MUTEX_UNLOCK(gSamplesLock);
+        reportStep(viewerCount, stepDuration, pSamples, framesBefore);
+    }
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[Fanout Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    if (pSampleConfiguration != NULL) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        if (pSampleConfiguration->mediaSenderTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->mediaSenderTid, NULL);
+        }
+    }
+
+    for (i = 0; i < viewerCount; i++) {
+        freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[i]);
+    }
+
+    // Must go before the configuration it sends to
+    freeLoopbackSignaling(&pLoopbackSignaling);
+
+    // The master sessions and the media threads are freed with the configuration
+    if (pSampleConfiguration != NULL) {
+        freeSampleConfiguration(&pSampleConfiguration);
+    }
+
+    if (gVideoCapturerHandle) {
+        videoCapturerReleaseStream(gVideoCapturerHandle);
+        videoCapturerDestory(gVideoCapturerHandle);
+        gVideoCapturerHandle = NULL;
+    }
+
+    if (IS_VALID_MUTEX_VALUE(gSamplesLock)) {
+        MUTEX_FREE(gSamplesLock);
+    }
+    SAFE_MEMFREE(pSamples);
+
+    return STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
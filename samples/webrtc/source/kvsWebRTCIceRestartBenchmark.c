@@ -0,0 +1,190 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * ICE restart benchmark for the master.
+ *
+ * A loopback viewer watches while an interface of the device is taken down and brought back up, like a Wi-Fi roam
+ * would. The longest gap between two frames of the viewer is reported as the outage, along with the time from the
+ * link coming back to the next frame and the number of ICE restarts the viewer answered. Changing the flags of an
+ * interface needs CAP_NET_ADMIN. Run it once with AWS_KVS_ICE_RESTART=1 and once without it to compare.
+ */
+
+#define LOG_CLASS "IceRestartBenchmark"
+#include "BenchmarkCommon.h"
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCH_CHANNEL_NAME          (PCHAR) "IceRestartBenchmark"
+#define BENCH_DEFAULT_FLAP_DURATION (500 * HUNDREDS_OF_NANOS_IN_A_MILLISECOND)
+#define BENCH_SETTLE_DURATION       (2 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_RECOVERY_TIMEOUT      (30 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+
+typedef struct {
+    volatile SIZE_T lastFrameTime;
+    volatile SIZE_T longestGap;
+    // Frames before this time don't count in the gaps, the connection setup isn't what is measured
+    volatile SIZE_T measureStartTime;
+} FrameGaps, *PFrameGaps;
+
+extern PSampleConfiguration gSampleConfiguration;
+static LoopbackViewer gLoopbackViewer;
+static FrameGaps gFrameGaps;
+
+static VOID onViewerVideoFrame(UINT64 customData, PFrame pFrame)
+{
+    PFrameGaps pFrameGaps = (PFrameGaps) customData;
+    UINT64 now = GETTIME(), lastFrameTime = ATOMIC_LOAD(&pFrameGaps->lastFrameTime);
+    UNUSED_PARAM(pFrame);
+
+    if (lastFrameTime >= ATOMIC_LOAD(&pFrameGaps->measureStartTime) && now - lastFrameTime > ATOMIC_LOAD(&pFrameGaps->longestGap)) {
+        ATOMIC_STORE(&pFrameGaps->longestGap, (SIZE_T) (now - lastFrameTime));
+    }
+    ATOMIC_STORE(&pFrameGaps->lastFrameTime, (SIZE_T) now);
+}
+
+static STATUS setInterfaceUp(PCHAR pInterfaceName, BOOL up)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    struct ifreq request;
+    INT32 sockfd = -1;
+
+    MEMSET(&request, 0x00, SIZEOF(request));
+    STRNCPY(request.ifr_name, pInterfaceName, IFNAMSIZ - 1);
+
+    CHK_ERR((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0, STATUS_INVALID_OPERATION, "[ICE Restart Benchmark] Unable to open a socket\n");
+    CHK_ERR(ioctl(sockfd, SIOCGIFFLAGS, &request) == 0, STATUS_INVALID_ARG, "[ICE Restart Benchmark] Unknown interface %s\n", pInterfaceName);
+    if (up) {
+        request.ifr_flags |= IFF_UP;
+    } else {
+        request.ifr_flags &= ~IFF_UP;
+    }
+    CHK_ERR(ioctl(sockfd, SIOCSIFFLAGS, &request) == 0, STATUS_INVALID_OPERATION,
+            "[ICE Restart Benchmark] Unable to change the flags of %s, CAP_NET_ADMIN is needed\n", pInterfaceName);
+
+CleanUp:
+
+    if (sockfd >= 0) {
+        close(sockfd);
+    }
+
+    return retStatus;
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+    PCHAR pInterfaceName = NULL;
+    UINT32 milliseconds = 0;
+    UINT64 flapDuration = BENCH_DEFAULT_FLAP_DURATION, linkUpTime, firstFrameTime;
+    BOOL viewerConnected = FALSE, interfaceDown = FALSE;
+
+#ifndef _WIN32
+    signal(SIGINT, sigintHandler);
+#endif
+
+    CHK_ERR(argc > 1, STATUS_INVALID_ARG, "Usage: %s <interface> [flap duration in ms]\n", argv[0]);
+    pInterfaceName = argv[1];
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &milliseconds)) && milliseconds > 0, STATUS_INVALID_ARG,
+                "[ICE Restart Benchmark] Invalid flap duration %s\n", argv[2]);
+        flapDuration = milliseconds * HUNDREDS_OF_NANOS_IN_A_MILLISECOND;
+    }
+
+    gVideoCapturerHandle = videoCapturerCreate();
+    CHK_ERR(gVideoCapturerHandle, STATUS_INVALID_OPERATION, "VideoCapturer init failed");
+    CHK_STATUS_ERR(videoCapturerSetFormat(gVideoCapturerHandle, VID_FMT_H264, VID_RES_1080P), STATUS_INVALID_OPERATION, "Unable to set video format");
+
+    // The credentials are never used and TURN isn't needed on localhost
+    CHK_STATUS(createSampleConfiguration(BENCH_CHANNEL_NAME, SIGNALING_CHANNEL_ROLE_TYPE_MASTER, TRUE, FALSE, &pSampleConfiguration));
+    pSampleConfiguration->videoSource = sendBoardVideoPackets;
+    pSampleConfiguration->mediaType = SAMPLE_STREAMING_VIDEO_ONLY;
+    CHK_STATUS(initKvsWebRtc());
+    gSampleConfiguration = pSampleConfiguration;
+    CHK_STATUS(createLoopbackSignaling(pSampleConfiguration, &pLoopbackSignaling));
+
+    printf("ICE restart: %s\n", pSampleConfiguration->pNetworkMonitor != NULL ? "enabled" : "disabled");
+
+    ATOMIC_STORE(&gFrameGaps.measureStartTime, (SIZE_T) MAX_UINT64);
+    CHK_STATUS(connectLoopbackViewer(pLoopbackSignaling, &gLoopbackViewer, 0, onViewerVideoFrame, (UINT64) &gFrameGaps));
+    viewerConnected = TRUE;
+    THREAD_SLEEP(BENCH_SETTLE_DURATION);
+    CHK_ERR(ATOMIC_LOAD(&gLoopbackViewer.videoFrameCount) > 0, STATUS_OPERATION_TIMED_OUT, "[ICE Restart Benchmark] The viewer got no frame\n");
+
+    ATOMIC_STORE(&gFrameGaps.measureStartTime, (SIZE_T) GETTIME());
+    CHK_STATUS(setInterfaceUp(pInterfaceName, FALSE));
+    interfaceDown = TRUE;
+    THREAD_SLEEP(flapDuration);
+    CHK_STATUS(setInterfaceUp(pInterfaceName, TRUE));
+    interfaceDown = FALSE;
+    linkUpTime = GETTIME();
+
+    while (ATOMIC_LOAD(&gFrameGaps.lastFrameTime) < linkUpTime && GETTIME() - linkUpTime < BENCH_RECOVERY_TIMEOUT &&
+           !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted)) {
+        THREAD_SLEEP(LOOPBACK_POLL_PERIOD);
+    }
+    CHK_ERR(ATOMIC_LOAD(&gFrameGaps.lastFrameTime) >= linkUpTime, STATUS_OPERATION_TIMED_OUT,
+            "[ICE Restart Benchmark] The viewer got no frame after the link came back\n");
+    firstFrameTime = ATOMIC_LOAD(&gFrameGaps.lastFrameTime) - linkUpTime;
+
+    // A late frame after the first one may still be the longest gap
+    THREAD_SLEEP(BENCH_SETTLE_DURATION);
+
+    printf("flap  outage  link up to first frame  ice restarts\n");
+    printf("(ms)    (ms)                    (ms)              \n");
+    printf("%4" PRIu64 " %7" PRIu64 " %23" PRIu64 " %13" PRIu64 "\n", flapDuration / HUNDREDS_OF_NANOS_IN_A_MILLISECOND,
+           (UINT64) ATOMIC_LOAD(&gFrameGaps.longestGap) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND, firstFrameTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND,
+           (UINT64) ATOMIC_LOAD(&gLoopbackViewer.iceRestartCount));
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[ICE Restart Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    if (interfaceDown) {
+        setInterfaceUp(pInterfaceName, TRUE);
+    }
+
+    if (pSampleConfiguration != NULL) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        if (pSampleConfiguration->mediaSenderTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->mediaSenderTid, NULL);
+        }
+    }
+
+    if (viewerConnected) {
+        freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewer);
+    }
+
+    // Must go before the configuration it sends to
+    freeLoopbackSignaling(&pLoopbackSignaling);
+
+    if (pSampleConfiguration != NULL) {
+        freeSampleConfiguration(&pSampleConfiguration);
+    }
+
+    if (gVideoCapturerHandle) {
+        videoCapturerDestory(gVideoCapturerHandle);
+        gVideoCapturerHandle = NULL;
+    }
+
+    return STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Idle capture benchmark for the master.
+ *
+ * One loopback viewer watches for a while and leaves, then the process is left alone with no viewer, then a new
+ * viewer joins. The CPU use is reported for the watched and the idle periods, along with the time the first and the
+ * new viewer waited for their first frame. The capture threads are gated like in kvsWebRTCClientMaster.c, run it once per
+ * AWS_KVS_IDLE_CAPTURE mode to compare them, off being the master without the gating, and with and without
+ * AWS_KVS_WARM_CAPTURE for the first viewer. The audio is captured too when the board has an audio capturer.
+ *
+ * The first viewer also shows what the saved certificate pool saves at startup. Run it once to write the pool file, then
+ * once more as is and once with AWS_KVS_CERTIFICATE_POOL_FILE=0, which makes the viewer wait for a new certificate.
+ */
+
+#define LOG_CLASS "IdleBenchmark"
+#include "BenchmarkCommon.h"
+
+#define BENCH_CHANNEL_NAME          (PCHAR) "IdleBenchmark"
+#define BENCH_DEFAULT_DURATION      (10 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_SETTLE_DURATION       (2 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_SESSION_CLOSE_TIMEOUT (60 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_FIRST_FRAME_TIMEOUT   (15 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+
+extern PSampleConfiguration gSampleConfiguration;
+static LoopbackViewer gLoopbackViewers[2];
+
+// From the offer of the viewer to its first decodable frame, including the start of the capturer if it isn't running
+static STATUS connectAndWaitForFirstFrame(PSampleConfiguration pSampleConfiguration, PLoopbackSignaling pLoopbackSignaling,
+                                          PLoopbackViewer pLoopbackViewer, UINT32 index, PUINT64 pFirstFrameTime)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    UINT64 startTime = GETTIME();
+
+    CHK_STATUS(connectLoopbackViewer(pLoopbackSignaling, pLoopbackViewer, index, NULL, 0));
+    while (ATOMIC_LOAD(&pLoopbackViewer->videoFrameCount) == 0 && GETTIME() - startTime < BENCH_FIRST_FRAME_TIMEOUT &&
+           !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted)) {
+        THREAD_SLEEP(LOOPBACK_POLL_PERIOD);
+    }
+    *pFirstFrameTime = GETTIME() - startTime;
+    CHK_ERR(ATOMIC_LOAD(&pLoopbackViewer->videoFrameCount) > 0, STATUS_OPERATION_TIMED_OUT, "[Idle Benchmark] %s got no frame\n",
+            pLoopbackViewer->peerId);
+
+CleanUp:
+
+    return retStatus;
+}
+
+static PCHAR getIdleCaptureModeName(PSampleConfiguration pSampleConfiguration)
+{
+    switch (pSampleConfiguration->idleCaptureMode) {
+        case SAMPLE_IDLE_CAPTURE_MODE_RELEASE:
+            return SAMPLE_IDLE_CAPTURE_RELEASE;
+        case SAMPLE_IDLE_CAPTURE_MODE_OFF:
+            return SAMPLE_IDLE_CAPTURE_OFF;
+        default:
+            return SAMPLE_IDLE_CAPTURE_KEY_FRAMES;
+    }
+}
+
+static STATUS measureCpuUsage(PSampleConfiguration pSampleConfiguration, UINT64 duration, DOUBLE* pCpu)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    ProcessUsage startUsage, endUsage;
+
+    CHK_STATUS(getProcessUsage(&startUsage));
+    THREAD_SLEEP(duration);
+    CHK(!ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted), STATUS_OPERATION_TIMED_OUT);
+    CHK_STATUS(getProcessUsage(&endUsage));
+    *pCpu = getCpuUsagePercent(&startUsage, &endUsage);
+
+CleanUp:
+
+    return retStatus;
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+    UINT32 seconds = 0, viewerCount = 0, certificateCount = 0, i;
+    UINT64 watchDuration = BENCH_DEFAULT_DURATION, idleDuration = BENCH_DEFAULT_DURATION, startTime, closeTime, firstFrameTime = 0,
+           rejoinFrameTime = 0;
+    DOUBLE watchedCpu = 0, idleCpu = 0;
+
+#ifndef _WIN32
+    signal(SIGINT, sigintHandler);
+#endif
+
+    if (argc > 1) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[1], NULL, 10, &seconds)) && seconds > 0, STATUS_INVALID_ARG,
+                "[Idle Benchmark] Invalid watch duration %s\n", argv[1]);
+        watchDuration = seconds * HUNDREDS_OF_NANOS_IN_A_SECOND;
+    }
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &seconds)) && seconds > 0, STATUS_INVALID_ARG,
+                "[Idle Benchmark] Invalid idle duration %s\n", argv[2]);
+        idleDuration = seconds * HUNDREDS_OF_NANOS_IN_A_SECOND;
+    }
+
+    gVideoCapturerHandle = videoCapturerCreate();
+    CHK_ERR(gVideoCapturerHandle, STATUS_INVALID_OPERATION, "VideoCapturer init failed");
+    CHK_STATUS_ERR(videoCapturerSetFormat(gVideoCapturerHandle, VID_FMT_H264, VID_RES_1080P), STATUS_INVALID_OPERATION, "Unable to set video format");
+
+    // Like the master, the video goes alone when the board has no audio
+    if (NULL != (gAudioCapturerHandle = audioCapturerCreate()) &&
+        audioCapturerSetFormat(gAudioCapturerHandle, AUD_FMT_G711A, AUD_CHN_MONO, AUD_SAM_8K, AUD_BIT_16) != 0) {
+        audioCapturerDestory(gAudioCapturerHandle);
+        gAudioCapturerHandle = NULL;
+    }
+
+    // The credentials are never used and TURN isn't needed on localhost
+    CHK_STATUS(createSampleConfiguration(BENCH_CHANNEL_NAME, SIGNALING_CHANNEL_ROLE_TYPE_MASTER, TRUE, FALSE, &pSampleConfiguration));
+    pSampleConfiguration->videoSource = sendBoardVideoPackets;
+    pSampleConfiguration->mediaType = SAMPLE_STREAMING_VIDEO_ONLY;
+    if (gAudioCapturerHandle != NULL) {
+        pSampleConfiguration->audioSource = sendBoardAudioPackets;
+        pSampleConfiguration->mediaType = SAMPLE_STREAMING_AUDIO_VIDEO;
+    }
+    CHK_STATUS(initKvsWebRtc());
+    gSampleConfiguration = pSampleConfiguration;
+    CHK_STATUS(createLoopbackSignaling(pSampleConfiguration, &pLoopbackSignaling));
+
+    // Generating a certificate takes longer than getting here, so these came from the pool file
+    MUTEX_LOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    retStatus = stackQueueGetCount(pSampleConfiguration->pregeneratedCertificates, &certificateCount);
+    MUTEX_UNLOCK(pSampleConfiguration->sampleConfigurationObjLock);
+    CHK_STATUS(retStatus);
+
+    printf("Idle capture mode: %s, audio: %s, warm capture: %s, saved certificates: %u\n", getIdleCaptureModeName(pSampleConfiguration),
+           gAudioCapturerHandle != NULL ? "on" : "off", pSampleConfiguration->warmCapture ? "on" : "off", certificateCount);
+
+    // Like kvsWebRTCClientMaster.c, the capturer then has settled by the time the first viewer joins
+    if (pSampleConfiguration->warmCapture && !ATOMIC_EXCHANGE_BOOL(&pSampleConfiguration->mediaThreadStarted, TRUE)) {
+        CHK_STATUS(THREAD_CREATE(&pSampleConfiguration->mediaSenderTid, mediaSenderRoutine, (PVOID) pSampleConfiguration));
+        THREAD_SLEEP(BENCH_SETTLE_DURATION);
+    }
+
+    viewerCount = 1;
+    CHK_STATUS(connectAndWaitForFirstFrame(pSampleConfiguration, pLoopbackSignaling, &gLoopbackViewers[0], 0, &firstFrameTime));
+    THREAD_SLEEP(BENCH_SETTLE_DURATION);
+    CHK_STATUS(measureCpuUsage(pSampleConfiguration, watchDuration, &watchedCpu));
+
+    // The master only lets the capturer go once it has cleaned up the session of the viewer
+    startTime = GETTIME();
+    freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[0]);
+    while (hasStreamingSession(pSampleConfiguration) && GETTIME() - startTime < BENCH_SESSION_CLOSE_TIMEOUT &&
+           !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted)) {
+        THREAD_SLEEP(LOOPBACK_POLL_PERIOD);
+    }
+    closeTime = GETTIME() - startTime;
+    CHK_ERR(!hasStreamingSession(pSampleConfiguration), STATUS_OPERATION_TIMED_OUT, "[Idle Benchmark] The session of the viewer was never closed\n");
+
+    THREAD_SLEEP(BENCH_SETTLE_DURATION);
+    CHK_STATUS(measureCpuUsage(pSampleConfiguration, idleDuration, &idleCpu));
+
+    viewerCount = 2;
+    CHK_STATUS(connectAndWaitForFirstFrame(pSampleConfiguration, pLoopbackSignaling, &gLoopbackViewers[1], 1, &rejoinFrameTime));
+
+    printf("join to first frame  watched cpu  idle cpu   close  rejoin to first frame\n");
+    printf("               (ms)          (%%)       (%%)    (ms)                   (ms)\n");
+    printf("%19" PRIu64 " %12.1f %9.1f %7" PRIu64 " %22" PRIu64 "\n", firstFrameTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND, watchedCpu, idleCpu,
+           closeTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND, rejoinFrameTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[Idle Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    if (pSampleConfiguration != NULL) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        if (pSampleConfiguration->mediaSenderTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->mediaSenderTid, NULL);
+        }
+    }
+
+    for (i = 0; i < viewerCount; i++) {
+        freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[i]);
+    }
+
+    // Must go before the configuration it sends to
+    freeLoopbackSignaling(&pLoopbackSignaling);
+
+    if (pSampleConfiguration != NULL) {
+        freeSampleConfiguration(&pSampleConfiguration);
+    }
+
+    if (gAudioCapturerHandle) {
+        audioCapturerDestory(gAudioCapturerHandle);
+        gAudioCapturerHandle = NULL;
+    }
+
+    if (gVideoCapturerHandle) {
+        videoCapturerDestory(gVideoCapturerHandle);
+        gVideoCapturerHandle = NULL;
+    }
+
+    return STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Capture to receive latency benchmark for the master.
+ *
+ * The viewers are peer connections in the same process. Their offers go through signalingMessageReceived and the
+ * master's answers and candidates come back through the loopback signaling stand-in, so sessions are set up and fed by
+ * the same code as in kvsWebRTCClientMaster.c. Every captured frame starts with an SEI NAL unit carrying the capture
+ * time, which the viewers compare with the time the frame is received.
+ *
+ * The frames the viewers never got and the NACKs and retransmissions of the master sessions are reported along with
+ * the latency, run it over a shaped loopback interface to compare the pacer settings. The NACKs and retransmissions
+ * while the viewers join, when the GOP cache replay goes out, are reported on their own since that is where the pacer
+ * matters most.
+ */
+
+#define LOG_CLASS "LatencyBenchmark"
+#include "BenchmarkCommon.h"
+
+#define BENCH_CHANNEL_NAME              (PCHAR) "LatencyBenchmark"
+#define BENCH_DEFAULT_VIEWER_COUNT      1
+#define BENCH_DEFAULT_DURATION          (30 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_WARM_UP_DURATION          (3 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_MAX_SAMPLES               (64 * 1024)
+#define BENCH_TIMESTAMP_LEN             16
+// Start code, NAL type 6, user_data_unregistered, payload size, UUID, the capture time in hex and the RBSP stop bit.
+// Hex digits never form a start code, so no emulation prevention bytes are needed.
+#define BENCH_TIMESTAMP_SEI_UUID_OFFSET 7
+#define BENCH_TIMESTAMP_SEI_SIZE        (BENCH_TIMESTAMP_SEI_UUID_OFFSET + 16 + BENCH_TIMESTAMP_LEN + 1)
+
+typedef struct {
+    volatile ATOMIC_BOOL measuring;
+    MUTEX lock;
+    UINT64 latency[BENCH_MAX_SAMPLES];
+    UINT32 count;
+    UINT32 missingTimestamps;
+    volatile SIZE_T capturedFrames;
+} LatencySamples, *PLatencySamples;
+
+// Summed over the master sessions
+typedef struct {
+    UINT64 packetsSent;
+    UINT64 retransmittedPackets;
+    UINT64 nackCount;
+    UINT64 pacedTime;
+} SenderStats, *PSenderStats;
+
+extern PSampleConfiguration gSampleConfiguration;
+static LoopbackViewer gLoopbackViewers[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+static PLatencySamples gLatencySamples = NULL;
+
+static const BYTE gTimestampSeiHeader[BENCH_TIMESTAMP_SEI_UUID_OFFSET + 16] = {
+    0x00, 0x00, 0x00, 0x01, 0x06, 0x05, 16 + BENCH_TIMESTAMP_LEN,
+    // UUID of the capture time payload
+    0x6b, 0x76, 0x73, 0x2d, 0x6c, 0x61, 0x74, 0x65, 0x6e, 0x63, 0x79, 0x2d, 0x62, 0x65, 0x6e, 0x63};
+
+static VOID writeTimestampSei(PBYTE pBuffer, UINT64 captureTime)
+{
+    CHAR timestamp[BENCH_TIMESTAMP_LEN + 1];
+
+    SNPRINTF(timestamp, SIZEOF(timestamp), "%016" PRIx64, captureTime);
+    MEMCPY(pBuffer, gTimestampSeiHeader, SIZEOF(gTimestampSeiHeader));
+    MEMCPY(pBuffer + SIZEOF(gTimestampSeiHeader), timestamp, BENCH_TIMESTAMP_LEN);
+    pBuffer[BENCH_TIMESTAMP_SEI_SIZE - 1] = 0x80;
+}
+
+static BOOL readTimestampSei(PBYTE pData, UINT32 size, PUINT64 pCaptureTime)
+{
+    CHAR timestamp[BENCH_TIMESTAMP_LEN + 1];
+    UINT32 i;
+
+    // The depacketizer may use a 3 byte start code, so look for the rest of the header
+    for (i = 0; i + BENCH_TIMESTAMP_SEI_SIZE - 1 <= size && i < 64; i++) {
+        if (MEMCMP(pData + i, gTimestampSeiHeader + 1, SIZEOF(gTimestampSeiHeader) - 1) == 0) {
+            MEMCPY(timestamp, pData + i + SIZEOF(gTimestampSeiHeader) - 1, BENCH_TIMESTAMP_LEN);
+            timestamp[BENCH_TIMESTAMP_LEN] = '\0';
+            return STATUS_SUCCEEDED(STRTOUI64(timestamp, NULL, 16, pCaptureTime));
+        }
+    }
+
+    return FALSE;
+}
+
+static VOID latencyFrameHandler(UINT64 customData, PFrame pFrame)
+{
+    UNUSED_PARAM(customData);
+    UINT64 receiveTime = GETTIME(), captureTime;
+
+    if (!ATOMIC_LOAD_BOOL(&gLatencySamples->measuring)) {
+        return;
+    }
+
+    MUTEX_LOCK(gLatencySamples->lock);
+    if (!readTimestampSei(pFrame->frameData, pFrame->size, &captureTime) || captureTime > receiveTime) {
+        gLatencySamples->missingTimestamps++;
+    } else if (gLatencySamples->count < BENCH_MAX_SAMPLES) {
+        gLatencySamples->latency[gLatencySamples->count++] = receiveTime - captureTime;
+    }
+    MUTEX_UNLOCK(gLatencySamples->lock);
+}
+
+// The master's video source with the capture time in front of every frame
+static PVOID sendTimestampedVideoPackets(PVOID args)
+{
+    PSampleConfiguration pSampleConfiguration = (PSampleConfiguration) args;
+    PBYTE pFrameBuffer = NULL;
+    UINT64 timestamp = 0;
+    SIZE_T frameSize = 0;
+
+    if (NULL == (pFrameBuffer = (PBYTE) MEMALLOC(BENCH_TIMESTAMP_SEI_SIZE + VIDEO_FRAME_BUFFER_SIZE_BYTES))) {
+        printf("[Latency Benchmark] OOM\n");
+        return NULL;
+    }
+
+    while (!ATOMIC_LOAD_BOOL(&pSampleConfiguration->appTerminateFlag)) {
+        if (videoCapturerGetFrame(gVideoCapturerHandle, pFrameBuffer + BENCH_TIMESTAMP_SEI_SIZE, VIDEO_FRAME_BUFFER_SIZE_BYTES, &timestamp,
+                                  &frameSize)) {
+            continue;
+        }
+
+        if (ATOMIC_LOAD_BOOL(&gLatencySamples->measuring)) {
+            ATOMIC_INCREMENT(&gLatencySamples->capturedFrames);
+        }
+        writeTimestampSei(pFrameBuffer, GETTIME());
+        writeFrameToAllSessions(pSampleConfiguration, timestamp * HUNDREDS_OF_NANOS_IN_A_MICROSECOND, pFrameBuffer,
+                                (UINT32) (BENCH_TIMESTAMP_SEI_SIZE + frameSize), SAMPLE_VIDEO_TRACK_ID);
+    }
+
+    MEMFREE(pFrameBuffer);
+
+    return NULL;
+}
+
+static VOID getSenderStats(PSampleConfiguration pSampleConfiguration, PSenderStats pSenderStats)
+{
+    PStreamingSessionSnapshot pSnapshot;
+    PSampleStreamingSession pSampleStreamingSession;
+    SampleSendQueueStats sendQueueStats;
+    RtcStats rtcStats;
+    UINT32 i;
+
+    MEMSET(pSenderStats, 0x00, SIZEOF(SenderStats));
+    if (NULL == (pSnapshot = acquireStreamingSessionSnapshot(pSampleConfiguration))) {
+        return;
+    }
+
+    for (i = 0; i < pSnapshot->sessionCount; i++) {
+        pSampleStreamingSession = pSnapshot->sessionList[i];
+        rtcStats.requestedTypeOfStats = RTC_STATS_TYPE_OUTBOUND_RTP;
+        if (STATUS_SUCCEEDED(rtcPeerConnectionGetMetrics(pSampleStreamingSession->pPeerConnection, pSampleStreamingSession->pVideoRtcRtpTransceiver,
+                                                         &rtcStats))) {
+            pSenderStats->packetsSent += rtcStats.rtcStatsObject.outboundRtpStreamStats.sent.packetsSent;
+            pSenderStats->retransmittedPackets += rtcStats.rtcStatsObject.outboundRtpStreamStats.retransmittedPacketsSent;
+            pSenderStats->nackCount += rtcStats.rtcStatsObject.outboundRtpStreamStats.nackCount;
+        }
+        if (STATUS_SUCCEEDED(getSessionSendQueueStats(pSampleStreamingSession, &sendQueueStats))) {
+            pSenderStats->pacedTime += sendQueueStats.pacedTime;
+        }
+    }
+
+    releaseStreamingSessionSnapshot(pSnapshot);
+}
+
+static VOID reportLatency(UINT32 viewerCount, UINT64 duration, PSIZE_T pFramesBefore, PSenderStats pSenderStart, PSenderStats pSenderEnd,
+                          PProcessUsage pIdle, PProcessUsage pStart, PProcessUsage pEnd)
+{
+    UINT32 i, count;
+    UINT64 sum = 0, packetsSent = pSenderEnd->packetsSent - pSenderStart->packetsSent;
+    SIZE_T frames, minFrames = MAX_UINT32, maxFrames = 0, capturedFrames = ATOMIC_LOAD(&gLatencySamples->capturedFrames);
+    DOUBLE cpu = getCpuUsagePercent(pStart, pEnd);
+
+    for (i = 0; i < viewerCount; i++) {
+        frames = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount) - pFramesBefore[i];
+        minFrames = MIN(minFrames, frames);
+        maxFrames = MAX(maxFrames, frames);
+    }
+
+    MUTEX_LOCK(gLatencySamples->lock);
+    count = gLatencySamples->count;
+    qsort(gLatencySamples->latency, count, SIZEOF(UINT64), compareUint64);
+    for (i = 0; i < count; i++) {
+        sum += gLatencySamples->latency[i];
+    }
+
+    printf("Viewers: %u, pacer burst size: %u bytes%s, frames: %u, without a capture time: %u\n", viewerCount,
+           gSampleConfiguration->pacerBurstSize, gSampleConfiguration->pacerBurstSize == 0 ? " (off)" : "", count,
+           gLatencySamples->missingTimestamps);
+    printf("Capture to receive latency(us): mean %" PRIu64 ", p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+           count == 0 ? 0 : sum / count / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(gLatencySamples->latency, count, 50) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(gLatencySamples->latency, count, 90) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(gLatencySamples->latency, count, 99) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND,
+           percentile(gLatencySamples->latency, count, 100) / HUNDREDS_OF_NANOS_IN_A_MICROSECOND);
+    MUTEX_UNLOCK(gLatencySamples->lock);
+
+    printf("Received fps: min %.1f, max %.1f\n", (DOUBLE) minFrames * HUNDREDS_OF_NANOS_IN_A_SECOND / duration,
+           (DOUBLE) maxFrames * HUNDREDS_OF_NANOS_IN_A_SECOND / duration);
+    // A frame with a lost packet which wasn't retransmitted in time never reaches the viewer
+    printf("Frames lost: %.1f%% of %zu captured for the viewer which got the fewest\n",
+           capturedFrames == 0 || minFrames >= capturedFrames ? 0.0 : 100.0 * (capturedFrames - minFrames) / capturedFrames, capturedFrames);
+    // No session existed before the viewers joined, so the stats at the start of the measurement are those of the join
+    printf("Join: %" PRIu64 " packets sent, %" PRIu64 " NACKs, %" PRIu64 " packets retransmitted, video paced for %" PRIu64 " ms\n",
+           pSenderStart->packetsSent, pSenderStart->nackCount, pSenderStart->retransmittedPackets,
+           pSenderStart->pacedTime / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+    printf("Master: %" PRIu64 " packets sent, %" PRIu64 " NACKs, %" PRIu64 " packets (%.2f%%) retransmitted, video paced for %" PRIu64 " ms\n",
+           packetsSent, pSenderEnd->nackCount - pSenderStart->nackCount, pSenderEnd->retransmittedPackets - pSenderStart->retransmittedPackets,
+           packetsSent == 0 ? 0.0 : 100.0 * (pSenderEnd->retransmittedPackets - pSenderStart->retransmittedPackets) / packetsSent,
+           (pSenderEnd->pacedTime - pSenderStart->pacedTime) / HUNDREDS_OF_NANOS_IN_A_MILLISECOND);
+    printf("CPU: %.1f%%, %.1f%% per viewer\n", cpu, cpu / viewerCount);
+    printf("RSS: %zu KB before the first viewer, %zu KB with %u viewers, %zd KB per viewer\n", pIdle->rss / 1024, pEnd->rss / 1024, viewerCount,
+           ((ssize_t) pEnd->rss - (ssize_t) pIdle->rss) / 1024 / (ssize_t) viewerCount);
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+    UINT32 viewerCount = BENCH_DEFAULT_VIEWER_COUNT, connectedCount = 0, seconds = 0, i;
+    UINT64 duration = BENCH_DEFAULT_DURATION;
+    SIZE_T framesBefore[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+    ProcessUsage idleUsage, startUsage, endUsage;
+    SenderStats senderStart, senderEnd;
+
+#ifndef _WIN32
+    signal(SIGINT, sigintHandler);
+#endif
+
+    if (argc > 1) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[1], NULL, 10, &viewerCount)) && viewerCount > 0 &&
+                    viewerCount <= DEFAULT_MAX_CONCURRENT_STREAMING_SESSION,
+                STATUS_INVALID_ARG, "[Latency Benchmark] Viewer count must be 1 to %u\n", DEFAULT_MAX_CONCURRENT_STREAMING_SESSION);
+    }
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &seconds)) && seconds > 0, STATUS_INVALID_ARG,
+                "[Latency Benchmark] Invalid duration %s\n", argv[2]);
+        duration = seconds * HUNDREDS_OF_NANOS_IN_A_SECOND;
+    }
+
+    CHK(NULL != (gLatencySamples = (PLatencySamples) MEMCALLOC(1, SIZEOF(LatencySamples))), STATUS_NOT_ENOUGH_MEMORY);
+    gLatencySamples->lock = MUTEX_CREATE(FALSE);
+
+    gVideoCapturerHandle = videoCapturerCreate();
+    CHK_ERR(gVideoCapturerHandle, STATUS_INVALID_OPERATION, "VideoCapturer init failed");
+    CHK_STATUS_ERR(videoCapturerSetFormat(gVideoCapturerHandle, VID_FMT_H264, VID_RES_1080P), STATUS_INVALID_OPERATION, "Unable to set video format");
+    CHK_ERR(videoCapturerAcquireStream(gVideoCapturerHandle) == 0, STATUS_INVALID_OPERATION, "Unable to acquire video stream");
+
+    // The credentials are never used and TURN isn't needed on localhost
+    CHK_STATUS(createSampleConfiguration(BENCH_CHANNEL_NAME, SIGNALING_CHANNEL_ROLE_TYPE_MASTER, TRUE, FALSE, &pSampleConfiguration));
+    pSampleConfiguration->videoSource = sendTimestampedVideoPackets;
+    pSampleConfiguration->mediaType = SAMPLE_STREAMING_VIDEO_ONLY;
+    CHK_STATUS(initKvsWebRtc());
+    gSampleConfiguration = pSampleConfiguration;
+    CHK_STATUS(createLoopbackSignaling(pSampleConfiguration, &pLoopbackSignaling));
+
+    CHK_STATUS(getProcessUsage(&idleUsage));
+    for (; connectedCount < viewerCount; connectedCount++) {
+        CHK_STATUS(connectLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[connectedCount], connectedCount, latencyFrameHandler, 0));
+    }
+
+    // The first frames of a session come from the GOP cache and carry an old capture time
+    THREAD_SLEEP(BENCH_WARM_UP_DURATION);
+
+    for (i = 0; i < viewerCount; i++) {
+        framesBefore[i] = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount);
+    }
+    getSenderStats(pSampleConfiguration, &senderStart);
+    CHK_STATUS(getProcessUsage(&startUsage));
+    ATOMIC_STORE_BOOL(&gLatencySamples->measuring, TRUE);
+
+    THREAD_SLEEP(duration);
+
+    ATOMIC_STORE_BOOL(&gLatencySamples->measuring, FALSE);
+    CHK_STATUS(getProcessUsage(&endUsage));
+    getSenderStats(pSampleConfiguration, &senderEnd);
+    reportLatency(viewerCount, duration, framesBefore, &senderStart, &senderEnd, &idleUsage, &startUsage, &endUsage);
+    dumpSetupPhaseHistograms(pSampleConfiguration);
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[Latency Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    if (pSampleConfiguration != NULL) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        if (pSampleConfiguration->mediaSenderTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->mediaSenderTid, NULL);
+        }
+    }
+
+    for (i = 0; i < connectedCount; i++) {
+        freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[i]);
+    }
+
+    // Must go before the configuration it sends to
+    freeLoopbackSignaling(&pLoopbackSignaling);
+
+    // The master sessions and the media threads are freed with the configuration
+    if (pSampleConfiguration != NULL) {
+        freeSampleConfiguration(&pSampleConfiguration);
+    }
+
+    if (gVideoCapturerHandle) {
+        videoCapturerReleaseStream(gVideoCapturerHandle);
+        videoCapturerDestory(gVideoCapturerHandle);
+        gVideoCapturerHandle = NULL;
+    }
+
+    if (gLatencySamples != NULL) {
+        if (IS_VALID_MUTEX_VALUE(gLatencySamples->lock)) {
+            MUTEX_FREE(gLatencySamples->lock);
+        }
+        SAFE_MEMFREE(gLatencySamples);
+    }
+
+    return STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Viewer count scaling benchmark for the master.
+ *
+ * One loopback viewer is connected through the local signaling stand-in per step. After each step the RSS, the heap
+ * in use according to the instrumented allocators, the CPU use and the frame rate received by every viewer are
+ * reported, along with what the latest viewer added.
+ */
+
+#define LOG_CLASS "ScalingBenchmark"
+#include "BenchmarkCommon.h"
+
+#define BENCH_CHANNEL_NAME          (PCHAR) "ScalingBenchmark"
+#define BENCH_DEFAULT_VIEWER_COUNT  DEFAULT_MAX_CONCURRENT_STREAMING_SESSION
+#define BENCH_DEFAULT_STEP_DURATION (10 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+#define BENCH_SETTLE_DURATION       (2 * HUNDREDS_OF_NANOS_IN_A_SECOND)
+
+typedef struct {
+    SIZE_T rss;
+    SIZE_T heap;
+} MemoryUsage, *PMemoryUsage;
+
+extern PSampleConfiguration gSampleConfiguration;
+static LoopbackViewer gLoopbackViewers[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+
+static VOID reportStep(FILE* pCsvFile, UINT32 viewerCount, UINT64 stepDuration, PSIZE_T pFramesBefore, PMemoryUsage pPrevious,
+                       PMemoryUsage pCurrent, DOUBLE cpu)
+{
+    UINT32 i;
+    SIZE_T frames, minFrames = MAX_UINT32, totalFrames = 0;
+    DOUBLE minFps, averageFps;
+
+    for (i = 0; i < viewerCount; i++) {
+        frames = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount) - pFramesBefore[i];
+        minFrames = MIN(minFrames, frames);
+        totalFrames += frames;
+    }
+    minFps = (DOUBLE) minFrames * HUNDREDS_OF_NANOS_IN_A_SECOND / stepDuration;
+    averageFps = (DOUBLE) totalFrames / viewerCount * HUNDREDS_OF_NANOS_IN_A_SECOND / stepDuration;
+
+    printf("%7u %9zu %9zd %9zu %9zd %7.1f %8.1f %8.1f\n", viewerCount, pCurrent->rss / 1024,
+           ((ssize_t) pCurrent->rss - (ssize_t) pPrevious->rss) / 1024, pCurrent->heap / 1024,
+           ((ssize_t) pCurrent->heap - (ssize_t) pPrevious->heap) / 1024, cpu, minFps, averageFps);
+    if (pCsvFile != NULL) {
+        fprintf(pCsvFile, "%u,%zu,%zu,%.1f,%.1f,%.1f\n", viewerCount, pCurrent->rss, pCurrent->heap, cpu, minFps, averageFps);
+        fflush(pCsvFile);
+    }
+}
+
+static STATUS runStep(FILE* pCsvFile, UINT32 viewerCount, UINT64 stepDuration, PMemoryUsage pPrevious)
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    SIZE_T framesBefore[DEFAULT_MAX_CONCURRENT_STREAMING_SESSION];
+    ProcessUsage startUsage, endUsage;
+    MemoryUsage current;
+    UINT32 i;
+
+    // Leave the connection setup and the GOP cache replay out of the step
+    THREAD_SLEEP(BENCH_SETTLE_DURATION);
+
+    for (i = 0; i < viewerCount; i++) {
+        framesBefore[i] = ATOMIC_LOAD(&gLoopbackViewers[i].videoFrameCount);
+    }
+    CHK_STATUS(getProcessUsage(&startUsage));
+
+    THREAD_SLEEP(stepDuration);
+
+    CHK_STATUS(getProcessUsage(&endUsage));
+    current.rss = endUsage.rss;
+    current.heap = getInstrumentedTotalAllocationSize();
+    reportStep(pCsvFile, viewerCount, endUsage.time - startUsage.time, framesBefore, pPrevious, &current, getCpuUsagePercent(&startUsage, &endUsage));
+    *pPrevious = current;
+
+CleanUp:
+
+    return retStatus;
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PSampleConfiguration pSampleConfiguration = NULL;
+    PLoopbackSignaling pLoopbackSignaling = NULL;
+    UINT32 maxViewerCount = BENCH_DEFAULT_VIEWER_COUNT, viewerCount = 0, stepSeconds = 0, i;
+    UINT64 stepDuration = BENCH_DEFAULT_STEP_DURATION;
+    ProcessUsage usage;
+    MemoryUsage previousMemory;
+    FILE* pCsvFile = NULL;
+    INT32 exitCode;
+
+    SET_INSTRUMENTED_ALLOCATORS();
+
+#ifndef _WIN32
+    signal(SIGINT, sigintHandler);
+#endif
+
+    if (argc > 1) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[1], NULL, 10, &maxViewerCount)) && maxViewerCount > 0 &&
+                    maxViewerCount <= DEFAULT_MAX_CONCURRENT_STREAMING_SESSION,
+                STATUS_INVALID_ARG, "[Scaling Benchmark] Viewer count must be 1 to %u\n", DEFAULT_MAX_CONCURRENT_STREAMING_SESSION);
+    }
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &stepSeconds)) && stepSeconds > 0, STATUS_INVALID_ARG,
+                "[Scaling Benchmark] Invalid step duration %s\n", argv[2]);
+        stepDuration = stepSeconds * HUNDREDS_OF_NANOS_IN_A_SECOND;
+    }
+    if (argc > 3) {
+        CHK_ERR(NULL != (pCsvFile = fopen(argv[3], "w")), STATUS_INVALID_ARG, "[Scaling Benchmark] Unable to open %s\n", argv[3]);
+        fprintf(pCsvFile, "viewers,rss,heap,cpu,minfps,avgfps\n");
+    }
+
+    gVideoCapturerHandle = videoCapturerCreate();
+    CHK_ERR(gVideoCapturerHandle, STATUS_INVALID_OPERATION, "VideoCapturer init failed");
+    CHK_STATUS_ERR(videoCapturerSetFormat(gVideoCapturerHandle, VID_FMT_H264, VID_RES_1080P), STATUS_INVALID_OPERATION, "Unable to set video format");
+
+    // The credentials are never used and TURN isn't needed on localhost
+    CHK_STATUS(createSampleConfiguration(BENCH_CHANNEL_NAME, SIGNALING_CHANNEL_ROLE_TYPE_MASTER, TRUE, FALSE, &pSampleConfiguration));
+    pSampleConfiguration->videoSource = sendBoardVideoPackets;
+    pSampleConfiguration->mediaType = SAMPLE_STREAMING_VIDEO_ONLY;
+    CHK_STATUS(initKvsWebRtc());
+    gSampleConfiguration = pSampleConfiguration;
+    CHK_STATUS(createLoopbackSignaling(pSampleConfiguration, &pLoopbackSignaling));
+
+    CHK_STATUS(getProcessUsage(&usage));
+    previousMemory.rss = usage.rss;
+    previousMemory.heap = getInstrumentedTotalAllocationSize();
+    printf("Before the first viewer: RSS %zu KB, heap %zu KB\n", previousMemory.rss / 1024, previousMemory.heap / 1024);
+    if (previousMemory.heap == 0) {
+        printf("The heap is only reported when the SDK is built with instrumented allocators\n");
+    }
+#ifdef KVS_WEBRTC_SHARED_RTP_PAYLOAD
+    printf("Shared RTP payloads: %s\n", isSharedRtpPayloadEnabled() ? "on" : "off");
+#else
+    printf("Shared RTP payloads: not in this SDK build\n");
+#endif
+
+    printf("viewers       rss  rssadded      heap heapadded     cpu   minfps   avgfps\n");
+    printf("             (KB)      (KB)      (KB)      (KB)     (%%)\n");
+    for (viewerCount = 0; viewerCount < maxViewerCount && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted);) {
+        CHK_STATUS(connectLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[viewerCount], viewerCount, NULL, 0));
+        viewerCount++;
+        CHK_STATUS(runStep(pCsvFile, viewerCount, stepDuration, &previousMemory));
+    }
+
+#ifdef KVS_WEBRTC_SHARED_RTP_PAYLOAD
+    // The same viewers again, each packetizing its own frames. The difference with the last step is what the shared RTP
+    // payloads save for this many viewers.
+    if (isSharedRtpPayloadEnabled() && viewerCount == maxViewerCount && !ATOMIC_LOAD_BOOL(&pSampleConfiguration->interrupted)) {
+        CHK_STATUS(setSharedRtpPayloadEnabled(FALSE));
+        printf("Without shared RTP payloads:\n");
+        CHK_STATUS(runStep(pCsvFile, viewerCount, stepDuration, &previousMemory));
+    }
+#endif
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[Scaling Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    if (pSampleConfiguration != NULL) {
+        ATOMIC_STORE_BOOL(&pSampleConfiguration->appTerminateFlag, TRUE);
+        CVAR_BROADCAST(pSampleConfiguration->cvar);
+        if (pSampleConfiguration->mediaSenderTid != INVALID_TID_VALUE) {
+            THREAD_JOIN(pSampleConfiguration->mediaSenderTid, NULL);
+        }
+    }
+
+    for (i = 0; i < viewerCount; i++) {
+        freeLoopbackViewer(pLoopbackSignaling, &gLoopbackViewers[i]);
+    }
+
+    // Must go before the configuration it sends to
+    freeLoopbackSignaling(&pLoopbackSignaling);
+
+    // The master sessions and the media threads are freed with the configuration
+    if (pSampleConfiguration != NULL) {
+        freeSampleConfiguration(&pSampleConfiguration);
+    }
+
+    if (gVideoCapturerHandle) {
+        videoCapturerDestory(gVideoCapturerHandle);
+        gVideoCapturerHandle = NULL;
+    }
+
+    if (pCsvFile != NULL) {
+        fclose(pCsvFile);
+    }
+
+    exitCode = STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+    RESET_INSTRUMENTED_ALLOCATORS();
+
+    return exitCode;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ *  http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ */
+
+/*
+ * Pending signaling message benchmark for the master.
+ *
+ * Replays a reconnect storm against the queues holding the ICE candidates received before their offer: every client
+ * sends its candidates interleaved with the others, then its offer takes the queue out. A quarter more clients go
+ * away without an offer and are left to the expiry. The time spent per message is what signalingMessageReceived
+ * adds to the config lock hold time.
+ */
+
+#define LOG_CLASS "SignalingBenchmark"
+#include "Samples.h"
+
+#include <time.h>
+
+#define BENCH_DEFAULT_CLIENT_COUNT    100
+#define BENCH_DEFAULT_CANDIDATE_COUNT 10
+#define BENCH_DEFAULT_ROUND_COUNT     100
+#define BENCH_MESSAGE_SIZE            64
+
+// The clients which never send their offer come on top of the others, all of them fit in the pending queues
+#define BENCH_ABANDONED_CLIENT_COUNT(n) ((n) / 4)
+#define BENCH_MAX_CLIENT_COUNT          (SAMPLE_PENDING_MESSAGE_QUEUE_MAX_COUNT * 4 / 5)
+
+typedef struct {
+    UINT64 count;
+    UINT64 total;
+    UINT64 max;
+} OperationTime, *POperationTime;
+
+// GETTIME is too coarse for a single lookup
+static UINT64 getTimeInNanos()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (UINT64) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static VOID addOperationTime(POperationTime pOperationTime, UINT64 startTime)
+{
+    UINT64 duration = getTimeInNanos() - startTime;
+
+    pOperationTime->count++;
+    pOperationTime->total += duration;
+    pOperationTime->max = MAX(pOperationTime->max, duration);
+}
+
+static VOID reportOperationTime(PCHAR name, POperationTime pOperationTime)
+{
+    printf("%-14s %10" PRIu64 " %10.1f %10.1f\n", name, pOperationTime->count,
+           pOperationTime->count == 0 ? 0.0 : (DOUBLE) pOperationTime->total / pOperationTime->count, (DOUBLE) pOperationTime->max / 1000);
+}
+
+INT32 main(INT32 argc, CHAR* argv[])
+{
+    STATUS retStatus = STATUS_SUCCESS;
+    PPendingMessageQueues pPendingMessageQueues = NULL;
+    PPendingMessageQueue pPendingMessageQueue = NULL;
+    UINT32 clientCount = BENCH_DEFAULT_CLIENT_COUNT, candidateCount = BENCH_DEFAULT_CANDIDATE_COUNT, roundCount = BENCH_DEFAULT_ROUND_COUNT;
+    UINT32 round, candidate, i;
+    UINT64 clientHash, nextExpiry, startTime;
+    PBYTE pMessage = NULL;
+    OperationTime candidateTime, offerTime, expiryTime;
+
+    MEMSET(&candidateTime, 0x00, SIZEOF(OperationTime));
+    MEMSET(&offerTime, 0x00, SIZEOF(OperationTime));
+    MEMSET(&expiryTime, 0x00, SIZEOF(OperationTime));
+
+    if (argc > 1) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[1], NULL, 10, &clientCount)) && clientCount > 0 &&
+                    clientCount <= BENCH_MAX_CLIENT_COUNT,
+                STATUS_INVALID_ARG, "[Signaling Benchmark] Client count must be 1 to %u\n", BENCH_MAX_CLIENT_COUNT);
+    }
+    if (argc > 2) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[2], NULL, 10, &candidateCount)) && candidateCount > 0, STATUS_INVALID_ARG,
+                "[Signaling Benchmark] Invalid candidate count %s\n", argv[2]);
+    }
+    if (argc > 3) {
+        CHK_ERR(STATUS_SUCCEEDED(STRTOUI32(argv[3], NULL, 10, &roundCount)) && roundCount > 0, STATUS_INVALID_ARG,
+                "[Signaling Benchmark] Invalid round count %s\n", argv[3]);
+    }
+
+    CHK_STATUS(createPendingMessageQueues(&pPendingMessageQueues));
+
+    for (round = 0; round < roundCount; round++) {
+        for (candidate = 0; candidate < candidateCount; candidate++) {
+            for (i = 0; i < clientCount + BENCH_ABANDONED_CLIENT_COUNT(clientCount); i++) {
+                // The copy of the message is left out, only the lookup and the queueing are timed
+                CHK(NULL != (pMessage = (PBYTE) MEMCALLOC(1, BENCH_MESSAGE_SIZE)), STATUS_NOT_ENOUGH_MEMORY);
+                clientHash = ((UINT64) round << 32) | i;
+
+                startTime = getTimeInNanos();
+                pPendingMessageQueue = NULL;
+                CHK_STATUS(getPendingMessageQueueForHash(pPendingMessageQueues, clientHash, FALSE, &pPendingMessageQueue));
+                if (pPendingMessageQueue == NULL) {
+                    CHK_STATUS(createMessageQueue(clientHash, &pPendingMessageQueue));
+                    if (i >= clientCount) {
+                        pPendingMessageQueue->createTime -= SAMPLE_PENDING_MESSAGE_CLEANUP_DURATION;
+                    }
+                    retStatus = addPendingMessageQueue(pPendingMessageQueues, pPendingMessageQueue);
+                    if (STATUS_FAILED(retStatus)) {
+                        freeMessageQueue(pPendingMessageQueue);
+                        CHK(FALSE, retStatus);
+                    }
+                }
+                CHK_STATUS(stackQueueEnqueue(pPendingMessageQueue->messageQueue, (UINT64) pMessage));
+                pMessage = NULL;
+                addOperationTime(&candidateTime, startTime);
+            }
+
+            // The cleanup thread wakes up for the abandoned queues while the others are still arriving
+            startTime = getTimeInNanos();
+            CHK_STATUS(removeExpiredMessageQueues(pPendingMessageQueues, &nextExpiry));
+            addOperationTime(&expiryTime, startTime);
+        }
+
+        for (i = 0; i < clientCount; i++) {
+            clientHash = ((UINT64) round << 32) | i;
+
+            // The candidates are handed to the new session and freed there
+            startTime = getTimeInNanos();
+            pPendingMessageQueue = NULL;
+            CHK_STATUS(getPendingMessageQueueForHash(pPendingMessageQueues, clientHash, TRUE, &pPendingMessageQueue));
+            addOperationTime(&offerTime, startTime);
+            CHK_ERR(pPendingMessageQueue != NULL, STATUS_INTERNAL_ERROR, "[Signaling Benchmark] Candidates of client %u lost\n", i);
+            CHK_STATUS(freeMessageQueue(pPendingMessageQueue));
+        }
+    }
+
+    printf("%u clients, %u candidates each, %u rounds\n", clientCount, candidateCount, roundCount);
+    printf("operation           count   mean(ns)    max(us)\n");
+    reportOperationTime("ice candidate", &candidateTime);
+    reportOperationTime("offer", &offerTime);
+    reportOperationTime("expiry scan", &expiryTime);
+
+CleanUp:
+
+    if (retStatus != STATUS_SUCCESS) {
+        printf("[Signaling Benchmark] Terminated with status code 0x%08x\n", retStatus);
+    }
+
+    SAFE_MEMFREE(pMessage);
+    freePendingMessageQueues(&pPendingMessageQueues);
+
+    return STATUS_FAILED(retStatus) ? EXIT_FAILURE : EXIT_SUCCESS;
+}